@@ -0,0 +1 @@
+#define PISA_VERSION ""
@@ -1,29 +1,46 @@
 #include "utils.h"
 #include "htslib/sam.h"
 #include "htslib/kstring.h"
+#include "htslib/khash.h"
 #include "htslib/hts.h"
+#include "htslib/bgzf.h"
 #include "number.h"
+#include "bam_pool.h"
+#include "thread.h"
+#include "stats.h"
 
 static struct args {
     const char *input_fname;
     const char *output_fname;
+    const char *r1_fname;
+    const char *r2_fname;
     htsFile *in;
-    FILE *out;
+    bam_hdr_t *hdr;
+    BGZF *out;
+    BGZF *r1;
+    BGZF *r2;
     int filter;
-    int file_th;
+    int n_thread; // size of global thread pool, and workers
     int fasta;
     int n_tag;
     char **tags;
+    int chunk_size;
 } args = {
     .input_fname = NULL,
     .output_fname = NULL,
+    .r1_fname = NULL,
+    .r2_fname = NULL,
     .in = NULL,
+    .hdr = NULL,
     .out = NULL,
+    .r1 = NULL,
+    .r2 = NULL,
     .filter = 0,
-    .file_th = 5,
+    .n_thread = 5,
     .fasta = 0,
     .n_tag = 0,
     .tags = NULL,
+    .chunk_size = 10000,
 };
 
 char **tag_split(const char *_s, int *n)
@@ -42,10 +59,22 @@ char **tag_split(const char *_s, int *n)
     free(s);
     return tags;
 }
+
+// Open output, compressed on the global pool if name ends with .gz.
+static BGZF *fq_open(const char *fn)
+{
+    int gz = fn && strlen(fn) > 3 && strcmp(fn + strlen(fn) - 3, ".gz") == 0;
+    BGZF *fp = fn ? bgzf_open(fn, gz ? "w" : "wu") : bgzf_dopen(fileno(stdout), "wu");
+    if (fp == NULL) error("%s : %s.", fn ? fn : "-", strerror(errno));
+    if (gz) gpool_attach_bgzf(fp, gpool_high);
+    return fp;
+}
+
 static int parse_args(int argc, char **argv)
 {
     int i;
     const char *file_th = NULL;
+    const char *thread = NULL;
     const char *tags = NULL;
     for (i = 1; i < argc; ) {
         const char *a = argv[i++];
@@ -60,9 +89,12 @@ static int parse_args(int argc, char **argv)
             continue;
         }
         else if (strcmp(a, "-@") == 0) var = &file_th;
+        else if (strcmp(a, "-t") == 0) var = &thread;
         else if (strcmp(a, "-o") == 0) var = &args.output_fname;
+        else if (strcmp(a, "-1") == 0) var = &args.r1_fname;
+        else if (strcmp(a, "-2") == 0) var = &args.r2_fname;
         else if (strcmp(a, "-tag") == 0) var = &tags;
-        
+
         if (var != 0) {
             if (argc == i) error("Miss an argument after %s.",a);
             *var = argv[i++];
@@ -71,7 +103,7 @@ static int parse_args(int argc, char **argv)
 
         if (args.input_fname == NULL) {
             args.input_fname = a;
-            continue;            
+            continue;
         }
 
         error("Unknown argument, %s", a);
@@ -81,7 +113,13 @@ static int parse_args(int argc, char **argv)
 
     if (tags == NULL) error("No tag specified.");
 
-    if (file_th) args.file_th = str2int((char*)file_th);
+    if ((args.r1_fname == NULL) != (args.r2_fname == NULL)) error("-1 and -2 should be set together.");
+
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_th;
+    if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
 
     args.tags = tag_split(tags, &args.n_tag);
 
@@ -92,78 +130,283 @@ static int parse_args(int argc, char **argv)
     if (type.format != bam && type.format != sam)
         error("Unsupported input format, only support BAM/SAM/CRAM format.");
 
-    hts_set_threads(args.in, args.file_th);
+    gpool_attach_hts(args.in, gpool_normal);
+
+    if (args.r1_fname) {
+        args.r1 = fq_open(args.r1_fname);
+        args.r2 = fq_open(args.r2_fname);
+        // unpaired and orphan reads, dropped if not set
+        if (args.output_fname) args.out = fq_open(args.output_fname);
+    }
+    else args.out = fq_open(args.output_fname);
 
-    args.out = args.output_fname == NULL ? stdout : fopen(args.output_fname, "w");
-    if (!args.out) error("%s : %s. ", args.output_fname, strerror(errno));
-    
     return 0;
-                                      
+
 }
 void memory_release()
 {
     hts_close(args.in);
-    fclose(args.out);
+    if (args.out && bgzf_close(args.out)) error("Failed to close %s.", args.output_fname ? args.output_fname : "-");
+    if (args.r1 && bgzf_close(args.r1)) error("Failed to close %s.", args.r1_fname);
+    if (args.r2 && bgzf_close(args.r2)) error("Failed to close %s.", args.r2_fname);
+    int i;
+    for (i = 0; i < args.n_tag; ++i) free(args.tags[i]);
+    free(args.tags);
+}
+
+// Format one read, return 1 if filtered. With restore set, reverse strand
+// reads are turned back to sequenced orientation.
+static int fq_format(bam1_t *b, int restore, kstring_t *str)
+{
+    size_t l = str->l;
+    kputc(args.fasta ? '>' : '@', str);
+    kputs(bam_get_qname(b), str);
+    int i;
+    for (i = 0; i < args.n_tag; ++i) {
+        uint8_t *tag = bam_aux_get(b, args.tags[i]);
+        if (!tag) {
+            if (args.filter) {
+                str->l = l;
+                return 1;
+            }
+            continue;
+        }
+        kputs("|||", str);
+        kputs(args.tags[i], str); kputc(':', str);
+        kputc(*(char*)tag, str);  kputc(':', str);
+        kputs((char*)(tag+1), str);
+    }
+    kputc('\n', str);
+
+    int n = b->core.l_qseq;
+    int rev = restore && (b->core.flag & BAM_FREVERSE);
+    uint8_t *s = bam_get_seq(b);
+    ks_resize(str, str->l + n*2 + 5);
+    if (rev) for (i = n-1; i >= 0; --i) str->s[str->l++] = "=TGKCYSBAWRDMHVN"[bam_seqi(s, i)];
+    else for (i = 0; i < n; ++i) str->s[str->l++] = "=ACMGRSVTWYHKDBN"[bam_seqi(s, i)];
+    str->s[str->l++] = '\n';
+    if (args.fasta == 0) {
+        str->s[str->l++] = '+';
+        str->s[str->l++] = '\n';
+        s = bam_get_qual(b);
+        if (s[0] == 0xff) for (i = 0; i < n; ++i) str->s[str->l++] = 'I';
+        else if (rev) for (i = n-1; i >= 0; --i) str->s[str->l++] = s[i] + 33;
+        else for (i = 0; i < n; ++i) str->s[str->l++] = s[i] + 33;
+        str->s[str->l++] = '\n';
+    }
+    str->s[str->l] = '\0';
+    return 0;
+}
+
+// A mate waiting for its pair. Name and text are offsets into buf of chunk.
+struct fq_mate {
+    int name;
+    int text, len;
+    int read1;
+    int filtered;
+};
+
+// Workers format a chunk; the writer outputs chunks in input order. With
+// -1/-2, mates met in one chunk are paired by the worker, the left ones are
+// paired across chunks by the writer.
+struct fq_chunk {
+    struct bam_pool *p;
+    kstring_t out;        // reads to -o
+    kstring_t out1, out2; // pairs
+    kstring_t buf;
+    int n, m;
+    struct fq_mate *mates;
+    int n_pair;
+    int n_unpair;
+};
+
+KHASH_MAP_INIT_STR(mate, int)
+
+static void *fq_read(void *opts)
+{
+    struct bam_pool *b = bam_pool_create();
+    bam_read_pool(b, args.in, args.hdr, args.chunk_size);
+    if (b->n == 0) {
+        bam_pool_recycle(b);
+        return NULL;
+    }
+    struct fq_chunk *c = malloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->p = b;
+    return c;
+}
+
+static void pair_write(kstring_t *out1, kstring_t *out2, const char *s1, int l1, const char *s2, int l2)
+{
+    kputsn(s1, l1, out1);
+    kputsn(s2, l2, out2);
+}
+
+static void *fq_run(void *data, void *opts)
+{
+    struct fq_chunk *c = data;
+    int i;
+    if (args.r1 == NULL) {
+        for (i = 0; i < c->p->n; ++i) fq_format(&c->p->bam[i], 0, &c->out);
+        bam_pool_recycle(c->p);
+        c->p = NULL;
+        return c;
+    }
+
+    khash_t(mate) *h = kh_init(mate);
+    int *done = calloc(c->p->n, sizeof(int));
+    for (i = 0; i < c->p->n; ++i) {
+        bam1_t *b = &c->p->bam[i];
+        if (b->core.flag & (BAM_FSECONDARY|BAM_FSUPPLEMENTARY)) continue;
+        if (!(b->core.flag & BAM_FPAIRED)) {
+            if (fq_format(b, 1, &c->out) == 0) c->n_unpair++;
+            continue;
+        }
+        if (c->n == c->m) {
+            c->m = c->m == 0 ? 1024 : c->m<<1;
+            c->mates = realloc(c->mates, c->m*sizeof(struct fq_mate));
+        }
+        struct fq_mate *m = &c->mates[c->n];
+        m->name = c->buf.l;
+        kputsn(bam_get_qname(b), b->core.l_qname, &c->buf);
+        m->text = c->buf.l;
+        m->filtered = fq_format(b, 1, &c->buf);
+        m->len = c->buf.l - m->text;
+        m->read1 = (b->core.flag & BAM_FREAD1) != 0;
+
+        int ret;
+        khint_t k = kh_put(mate, h, bam_get_qname(b), &ret);
+        if (ret) {
+            kh_val(h, k) = c->n++;
+            continue;
+        }
+        // pair found
+        struct fq_mate *m0 = &c->mates[kh_val(h, k)];
+        done[kh_val(h, k)] = 1;
+        kh_del(mate, h, k);
+        if (m0->filtered || m->filtered) continue;
+        if (m->read1 && !m0->read1) pair_write(&c->out1, &c->out2, c->buf.s + m->text, m->len, c->buf.s + m0->text, m0->len);
+        else pair_write(&c->out1, &c->out2, c->buf.s + m0->text, m0->len, c->buf.s + m->text, m->len);
+        c->n_pair++;
+    }
+    // keep left mates only
+    int j;
+    for (i = 0, j = 0; i < c->n; ++i) {
+        if (done[i]) continue;
+        c->mates[j++] = c->mates[i];
+    }
+    c->n = j;
+    free(done);
+    kh_destroy(mate, h);
+    bam_pool_recycle(c->p);
+    c->p = NULL;
+    return c;
+}
+
+struct pending {
+    char *text; // NULL if filtered
+    int len;
+    int read1;
+};
+
+KHASH_MAP_INIT_STR(pend, struct pending)
+
+struct fq_stat {
+    khash_t(pend) *pend;
+    uint64_t n_pair;
+    uint64_t n_unpair;
+};
+
+static void fq_write1(BGZF *fp, const char *fn, const char *s, size_t l)
+{
+    if (fp == NULL || l == 0) return;
+    if (bgzf_write(fp, s, l) != l) error("Failed to write %s.", fn ? fn : "-");
+    stats_output(l);
+}
+
+static void fq_write(void *data, void *opts)
+{
+    struct fq_stat *st = opts;
+    struct fq_chunk *c = data;
+    fq_write1(args.out, args.output_fname, c->out.s, c->out.l);
+    fq_write1(args.r1, args.r1_fname, c->out1.s, c->out1.l);
+    fq_write1(args.r2, args.r2_fname, c->out2.s, c->out2.l);
+    st->n_pair += c->n_pair;
+    st->n_unpair += c->n_unpair;
+
+    int i;
+    for (i = 0; i < c->n; ++i) {
+        struct fq_mate *m = &c->mates[i];
+        const char *name = c->buf.s + m->name;
+        const char *text = c->buf.s + m->text;
+        khint_t k = kh_get(pend, st->pend, name);
+        if (k == kh_end(st->pend)) {
+            int ret;
+            k = kh_put(pend, st->pend, strdup(name), &ret);
+            struct pending *p = &kh_val(st->pend, k);
+            p->text = m->filtered ? NULL : strndup(text, m->len);
+            p->len = m->len;
+            p->read1 = m->read1;
+            continue;
+        }
+        struct pending *p = &kh_val(st->pend, k);
+        if (p->text && !m->filtered) {
+            int first = !(m->read1 && !p->read1);
+            fq_write1(args.r1, args.r1_fname, first ? p->text : text, first ? p->len : m->len);
+            fq_write1(args.r2, args.r2_fname, first ? text : p->text, first ? m->len : p->len);
+            st->n_pair++;
+        }
+        free(p->text);
+        free((char*)kh_key(st->pend, k));
+        kh_del(pend, st->pend, k);
+    }
+    if (c->out.m) free(c->out.s);
+    if (c->out1.m) free(c->out1.s);
+    if (c->out2.m) free(c->out2.s);
+    if (c->buf.m) free(c->buf.s);
+    free(c->mates);
+    free(c);
 }
 
 extern int bam2fq_usage();
 int bam2fq(int argc, char **argv)
 {
+    double t_real;
+    t_real = realtime();
+
     if (parse_args(argc, argv)) return bam2fq_usage();
     bam_hdr_t *hdr = sam_hdr_read(args.in);
     if (hdr == NULL) error("Failed to read header.");
-    bam1_t *b = bam_init1();
-    kstring_t str = {0,0,0};
-    kstring_t name = {0,0,0};
-    int ret;
-    while ((ret = sam_read1(args.in, hdr, b)) >= 0) {
-        name.l = 0;
-        str.l = 0;
-        int i;
-        int filter = 0;
-        for (i = 0; i < args.n_tag; ++i) {
-            uint8_t *tag = bam_aux_get(b, args.tags[i]);
-            if (!tag) {
-                if (args.filter) {filter = 1; break;}
-                continue;
-            }
-            else {
-                kputs("|||", &name);
-                kputs(args.tags[i], &name); kputc(':', &name);
-                kputc(*(char*)tag, &name);  kputc(':', &name);
-                kputs((char*)(tag+1), &name);
+    args.hdr = hdr;
+
+    struct fq_stat st = { kh_init(pend), 0, 0 };
+    bam_pool_slab(1);
+    pipeline_run(args.n_thread*2, fq_read, fq_run, fq_write, &st);
+
+    if (args.r1) {
+        // mates never met, output as single reads
+        uint64_t n_orphan = 0;
+        khint_t k;
+        for (k = kh_begin(st.pend); k != kh_end(st.pend); ++k) {
+            if (!kh_exist(st.pend, k)) continue;
+            struct pending *p = &kh_val(st.pend, k);
+            if (p->text) {
+                fq_write1(args.out, args.output_fname, p->text, p->len);
+                n_orphan++;
             }
+            free(p->text);
+            free((char*)kh_key(st.pend, k));
         }
-        
-        if (filter == 1) continue;
-        
-        if (args.fasta) {
-            kputc('>', &str); kputs((char*)b->data, &str); kputs(name.s, &str); kputc('\n', &str);
-            int i;
-            uint8_t *s = bam_get_seq(b);
-            for (i = 0; i < b->core.l_qseq; ++i) kputc("=ACMGRSVTWYHKDBN"[bam_seqi(s, i)], &str);
-            kputc('\n', &str);
-        }
-        else {
-            kputc('@', &str); kputs((char*)b->data, &str); kputs(name.s, &str); kputc('\n', &str);
-            int i;
-            uint8_t *s = bam_get_seq(b);
-            for (i = 0; i < b->core.l_qseq; ++i) kputc("=ACMGRSVTWYHKDBN"[bam_seqi(s, i)], &str);
-            kputc('\n', &str);
-            kputs("+\n", &str);
-            s = bam_get_qual(b);
-            if (s[0] == 0xff) for (i = 0; i < b->core.l_qseq; ++i) kputc('I', &str);
-            else for (i = 0; i < b->core.l_qseq; ++i) kputc(s[i] + 33, &str);
-            kputc('\n', &str);
-        }
-
-        fputs(str.s, args.out);
+        LOG_print("%" PRIu64 " pairs, %" PRIu64 " unpaired reads, %" PRIu64 " orphan reads.", st.n_pair, st.n_unpair, n_orphan);
+        if (args.out == NULL && st.n_unpair + n_orphan > 0) warnings("Unpaired and orphan reads are dropped, set -o to keep them.");
     }
-    if (str.m) free(str.s);
-    if (name.m) free(name.s);
-    bam_destroy1(b);
+    kh_destroy(pend, st.pend);
+
     bam_hdr_destroy(hdr);
     memory_release();
+    gpool_destroy();
+    bam_pool_cache_clear();
 
+    LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
     return 0;
 }
@@ -2,7 +2,7 @@
 #include "utils.h"
 #include "number.h"
 #include "htslib/thread_pool.h"
-#include "thread_pool_internal.h"
+#include "thread.h"
 #include "htslib/khash.h"
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
@@ -12,10 +12,13 @@
 #include "bam_pool.h"
 #include "gtf.h"
 #include "bed.h"
+#include "bam_anno_vcf.h"
 #include "region_index.h"
 #include "read_anno.h"
 #include "dict.h"
+#include "stats.h"
 #include <zlib.h>
+#include <sys/stat.h>
 
 struct read_stat {
 
@@ -31,12 +34,23 @@ struct read_stat {
     uint64_t reads_ambiguous;
 };
 
+// Per thread counters indexed by group id, merged once at the end.
+struct stat_shard {
+    int m;
+    struct read_stat *s;
+    struct stat_shard *next;
+};
+
 static struct args {
     const char *input_fname;
     const char *output_fname;
     const char *bed_fname;
     const char *vcf_fname;
     const char *vtag; // tag name for vcf
+    const char *vcf_outdir; // allele count matrices
+    const char *cb_tag;
+    const char *umi_tag;
+    const char *barcode_fname;
     const char *tag; // attribute in BAM
     const char *gtf_fname;
     const char *report_fname;
@@ -50,6 +64,7 @@ static struct args {
     int ignore_strand;
     int splice_consider;
     int intron_consider;
+    int no_cache;
     int n_thread;
     int chunk_size;
 
@@ -69,12 +84,16 @@ static struct args {
 
     // vcf
     struct bed_spec *V;
+    struct vcf_mtx *M;
     
     uint64_t reads_input;
     uint64_t reads_pass_qc;
     int map_qual;
 
-    struct dict *group_stat;
+    struct dict *group_stat; // group names to dense ids, 0 is __ALL__
+    struct stat_shard *stat_shards;
+    struct anno_cache *caches;
+    pthread_mutex_t local_lock; // guards lists of per thread states
 
     int debug_mode;
 } args = {
@@ -83,6 +102,10 @@ static struct args {
     .bed_fname       = NULL,
     .vcf_fname       = NULL,
     .vtag            = NULL,
+    .vcf_outdir      = NULL,
+    .cb_tag          = NULL,
+    .umi_tag         = NULL,
+    .barcode_fname   = NULL,
     .tag             = NULL,    
     .gtf_fname       = NULL,
     .report_fname    = NULL,
@@ -95,6 +118,7 @@ static struct args {
     .ignore_strand   = 0,
     .splice_consider = 0,
     .intron_consider = 0,
+    .no_cache        = 0,
     .map_qual        = 0,
     .n_thread = 1,
     .chunk_size = 100000,
@@ -107,9 +131,13 @@ static struct args {
     .G               = NULL,    
     .B               = NULL,    
     .V               = NULL,
+    .M               = NULL,
     .reads_input     = 0,
     .reads_pass_qc   = 0,
-    .group_stat      = 0,
+    .group_stat      = NULL,
+    .stat_shards     = NULL,
+    .caches          = NULL,
+    .local_lock      = PTHREAD_MUTEX_INITIALIZER,
     .debug_mode      = 0
 };
 
@@ -165,6 +193,7 @@ static char GX_tag[2] = "GX";
 static char RE_tag[2] = "RE";
 
 extern struct bed_spec *bed_read_vcf(const char *fn);
+extern int sam_realloc_bam_data(bam1_t *b, size_t desired);
 
 static int parse_args(int argc, char **argv)
 {
@@ -202,6 +231,10 @@ static int parse_args(int argc, char **argv)
             args.intron_consider = 1;
             continue;
         }
+        else if (strcmp(a, "-no-cache") == 0) {
+            args.no_cache = 1;
+            continue;
+        }
         
         // group options
         else if (strcmp(a, "-group") == 0) var = &args.group_tag;
@@ -220,6 +253,10 @@ static int parse_args(int argc, char **argv)
 
         else if (strcmp(a, "-vcf") == 0) var = &args.vcf_fname;
         else if (strcmp(a, "-vtag") == 0) var = &args.vtag;
+        else if (strcmp(a, "-vcf-outdir") == 0) var = &args.vcf_outdir;
+        else if (strcmp(a, "-cb") == 0) var = &args.cb_tag;
+        else if (strcmp(a, "-umi") == 0) var = &args.umi_tag;
+        else if (strcmp(a, "-list") == 0) var = &args.barcode_fname;
 
         else if (strcmp(a, "-anno-only") == 0) {
             args.anno_only = 1;
@@ -245,17 +282,19 @@ static int parse_args(int argc, char **argv)
     CHECK_EMPTY(args.output_fname, "-o must be set.");
     CHECK_EMPTY(args.input_fname, "Input bam must be set.");
     
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_thread;
     if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
     if (chunk) args.chunk_size = str2int((char*)chunk);
     if (map_qual) args.map_qual = str2int((char*)map_qual);
     if (args.map_qual < 0) args.map_qual = 0;
     
-    int file_th = 1;
-    if (file_thread)
-        file_th = str2int((char*)file_thread);
+    gpool_init(args.n_thread);
     
     args.fp  = hts_open(args.input_fname, "r");
     CHECK_EMPTY(args.fp, "%s : %s.", args.input_fname, strerror(errno));
+    gpool_attach_hts(args.fp, gpool_normal);
     htsFormat type = *hts_get_format(args.fp);
     if (type.format != bam && type.format != sam)
         error("Unsupported input format, only support BAM/SAM/CRAM format.");
@@ -272,7 +311,16 @@ static int parse_args(int argc, char **argv)
         CHECK_EMPTY(args.vtag, "-vtag must be set with -vcf.");
         args.V = bed_read_vcf(args.vcf_fname);
         if (args.V == NULL || args.V->n == 0) error("VCF is empty.");
+        if (args.vcf_outdir) {
+            CHECK_EMPTY(args.cb_tag, "-cb must be set with -vcf-outdir.");
+            struct stat sb;
+            if (stat(args.vcf_outdir, &sb) != 0) error("Directory %s is not exists.", args.vcf_outdir);
+            if (S_ISDIR(sb.st_mode) == 0)  error("%s does not look like a directory.", args.vcf_outdir);
+            args.M = vcf_mtx_init(args.V, args.hdr, args.barcode_fname, args.umi_tag != NULL);
+        }
     }
+    if (args.M == NULL && (args.cb_tag || args.umi_tag || args.barcode_fname))
+        error("-cb, -umi and -list only work with -vcf and -vcf-outdir.");
     
     if (args.gtf_fname) {
 
@@ -309,20 +357,16 @@ static int parse_args(int argc, char **argv)
 
     args.out = hts_open(args.output_fname, "bw");
     CHECK_EMPTY(args.out, "%s : %s.", args.output_fname, strerror(errno));
+    gpool_attach_hts(args.out, gpool_high);
     if (sam_hdr_write(args.out, args.hdr)) error("Failed to write SAM header.");
 
-    hts_set_threads(args.out, file_th);
-
+    bam_pool_slab(1);
+    
+    // workers intern group names directly, no per chunk merge
     args.group_stat = dict_init();
-    int idx;
-    idx = dict_push(args.group_stat, "__ALL__");
+    if (args.n_thread > 1) dict_set_concurrent(args.group_stat, args.n_thread*4);
+    dict_push(args.group_stat, "__ALL__");
 
-    dict_set_value(args.group_stat);
-    
-    struct read_stat *stat = malloc(sizeof(*stat));
-    memset(stat, 0, sizeof(*stat));
-    dict_assign_value(args.group_stat, idx, stat);
-        
     return 0;
 }
 
@@ -331,27 +375,30 @@ struct pair {
     int end;
 };
 struct isoform {
-    int n;
+    int n, m;
     struct pair *p;
 };
-struct isoform *bend_sam_isoform(bam1_t *b)
+// Reference blocks of alignment, split by N. S is reused across reads.
+static void bend_sam_isoform(bam1_t *b, struct isoform *S)
 {
-    struct isoform *S = malloc(sizeof(*S));
-    memset(S, 0, sizeof(*S));
+    S->n = 0;
     int i;
     int start = b->core.pos;
     int l = 0;
-    for (i = 0; i < b->core.n_cigar; ++i) {
-        int cig = bam_cigar_op(bam_get_cigar(b)[i]);
-        int ncig = bam_cigar_oplen(bam_get_cigar(b)[i]);
+    for (i = 0; i <= b->core.n_cigar; ++i) {
+        int cig = i < b->core.n_cigar ? bam_cigar_op(bam_get_cigar(b)[i]) : -1;
+        int ncig = i < b->core.n_cigar ? bam_cigar_oplen(bam_get_cigar(b)[i]) : 0;
         if (cig == BAM_CMATCH || cig == BAM_CEQUAL || cig == BAM_CDIFF) {
             l += ncig;
         }
         else if (cig == BAM_CDEL) {
             l += ncig;
         }
-        else if (cig == BAM_CREF_SKIP) {
-            S->p = realloc(S->p, (S->n+1)*sizeof(struct pair));
+        else if (cig == BAM_CREF_SKIP || cig == -1) { // last block at the end
+            if (S->n == S->m) {
+                S->m = S->m == 0 ? 4 : S->m<<1;
+                S->p = realloc(S->p, S->m*sizeof(struct pair));
+            }
             S->p[S->n].start = start +1; // 0 based to 1 based
             S->p[S->n].end = start + l;
             // reset block
@@ -359,24 +406,51 @@ struct isoform *bend_sam_isoform(bam1_t *b)
             l = 0;
             S->n++;
         }
-    } 
-    S->p = realloc(S->p, (S->n+1)*sizeof(struct pair));
-    S->p[S->n].start = start +1; // 0 based to 1 based
-    S->p[S->n].end = start + l;
-    S->n++;
-    return S;    
+    }
 }
 
-
 #include "htslib/thread_pool.h"
 
+// Allele of a read at a variant, cell and UMI are resolved by writer.
+struct vcf_read {
+    const uint8_t *cb; // points into record, valid until pool recycled
+    uint64_t umi;
+    struct vcf_call call;
+};
+
 struct ret_dat {
     struct bam_pool *p;
-    struct dict *group_stat;
     uint64_t reads_input;
     uint64_t reads_pass_qc;
+    struct vcf_calls calls; // of current read
+    int n_vr, m_vr;
+    struct vcf_read *vr;
 };
 
+// Keep calls of a read with cell barcode, and UMI if required.
+static void vcf_read_push(struct ret_dat *dat, bam1_t *b)
+{
+    uint8_t *cb = bam_aux_get(b, args.cb_tag);
+    if (cb == NULL || *cb != 'Z') return;
+    uint64_t umi = 0;
+    if (args.umi_tag) {
+        uint8_t *u = bam_aux_get(b, args.umi_tag);
+        if (u == NULL || *u != 'Z') return;
+        umi = vcf_umi_key((char*)(u+1));
+    }
+    int i;
+    for (i = 0; i < dat->calls.n; ++i) {
+        if (dat->n_vr == dat->m_vr) {
+            dat->m_vr = dat->m_vr == 0 ? 1024 : dat->m_vr<<1;
+            dat->vr = realloc(dat->vr, dat->m_vr*sizeof(struct vcf_read));
+        }
+        struct vcf_read *r = &dat->vr[dat->n_vr++];
+        r->cb = cb;
+        r->umi = umi;
+        r->call = dat->calls.a[i];
+    }
+}
+
 static char *RE_tags[] = {
     "U", "E", "N", "C", "A", "S", "V", "I",
 };
@@ -592,63 +666,181 @@ void gtf_anno_push(struct trans_type *a, struct gtf_anno_type *ann, int gene_id,
     g->a[g->n].type = a->type;
     g->n++;
 }
-void gtf_anno_string(bam1_t *b, struct gtf_anno_type *ann, struct gtf_spec const *G)
+// Result of GTF annotation which only depends on alignment geometry. Tags
+// are kept serialised in str, RE first, then GX, GN and TX if any.
+struct anno_hit {
+    uint64_t hash; // 0 for empty slot
+    int tid;
+    int rev;
+    struct isoform S;
+    enum exon_type type;
+    kstring_t str;
+};
+
+// Serialised GX, GN and TX tags of each gene id, gene name and transcript,
+// tag, type and value with NUL, built once after GTF loaded. Payload i of
+// a dict is buf[off[i], off[i+1]).
+static struct {
+    kstring_t buf;
+    int *gx, *gn, *tx;
+} payload = { {0,0,0}, NULL, NULL, NULL };
+
+static int *payload_build(struct dict *D, const char tag[2])
 {
-    // 
+    int i, n = dict_size(D);
+    int *off = malloc((n+1)*sizeof(int));
+    for (i = 0; i < n; ++i) {
+        off[i] = payload.buf.l;
+        kputsn(tag, 2, &payload.buf);
+        kputc('Z', &payload.buf);
+        const char *v = dict_name(D, i);
+        kputsn(v, strlen(v)+1, &payload.buf);
+    }
+    off[n] = payload.buf.l;
+    return off;
+}
+
+static void gtf_payload_init(struct gtf_spec const *G)
+{
+    payload.gx = payload_build(G->gene_id, GX_tag);
+    payload.gn = payload_build(G->gene_name, GN_tag);
+    payload.tx = payload_build(G->transcript_id, TX_tag);
+}
+
+static void gtf_payload_destroy()
+{
+    free(payload.buf.s);
+    free(payload.gx);
+    free(payload.gn);
+    free(payload.tx);
+}
+
+static inline void payload_put(const int *off, int i, kstring_t *str)
+{
+    kputsn(payload.buf.s + off[i], off[i+1] - off[i], str);
+}
+
+static inline void payload_value(const int *off, int i, kstring_t *str)
+{
+    kputsn(payload.buf.s + off[i] + 3, off[i+1] - off[i] - 4, str);
+}
+
+static void gtf_anno_tags(bam1_t *b, struct gtf_anno_type *ann, struct gtf_spec const *G, struct anno_hit *e)
+{
+    kstring_t *str = &e->str;
+    e->type = ann->type;
+    str->l = 0;
+    kputsn(RE_tag, 2, str);
+    kputc('A', str);
+    kputc(RE_tags[ann->type][0], str);
+
     if (ann->type == type_unknown) return;
     else if (ann->type == type_intron && args.intron_consider == 0) return;  // for default, only annotate intron type 
     else if (ann->type == type_exon_intron && args.splice_consider == 0 && args.intron_consider == 0) return; // 
     else if (ann->type == type_ambiguous) return;
 
     // only exon or splice come here
-    kstring_t gene_name = {0,0,0};
-    kstring_t gene_id   = {0,0,0};
-    kstring_t trans_id  = {0,0,0};
-    int i;
+    int i, j, n = 0, k = -1;
     for (i = 0; i < ann->n; ++i) {
         struct gene_type *g = &ann->a[i];
-        if (g->type == ann->type) {
-            char *gene = NULL;
-            char *id = NULL;
-            if (g->gene_name != -1) gene = dict_name(G->gene_name, g->gene_name);
-            if (g->gene_id != -1) id = dict_name(G->gene_id, g->gene_id);
-            
-            if (gene_name.l) {
-                kputc(';', &gene_name);
-                kputc(';', &gene_id);
-                kputc(';', &trans_id);
-            }
+        if (g->type != ann->type) continue;
+        if (g->gene_name == -1 && g->gene_id == -1) error("No gene name or gene id in gtf? %s", (char*)b->data);
+        n++;
+        k = i;
+    }
+    if (n == 0) return;
+
+    size_t l_re = str->l;
+    struct gene_type *g0 = &ann->a[k];
+    if (n == 1 && g0->gene_id != -1 && g0->gene_name != -1 && payload.gn[g0->gene_name+1] - payload.gn[g0->gene_name] > 4) {
+        // common case, copy payloads
+        payload_put(payload.gx, g0->gene_id, str);
+        payload_put(payload.gn, g0->gene_name, str);
+    }
+    else {
+        // gene id and name fall back to each other if missing
+        kputsn(GX_tag, 2, str);
+        kputc('Z', str);
+        for (i = 0, j = 0; i < ann->n; ++i) {
+            struct gene_type *g = &ann->a[i];
+            if (g->type != ann->type) continue;
+            if (j++) kputc(';', str);
+            if (g->gene_id != -1) payload_value(payload.gx, g->gene_id, str);
+            else payload_value(payload.gn, g->gene_name, str);
+        }
+        kputc('\0', str);
+        kputsn(GN_tag, 2, str);
+        kputc('Z', str);
+        size_t l_name = str->l;
+        for (i = 0, j = 0; i < ann->n; ++i) {
+            struct gene_type *g = &ann->a[i];
+            if (g->type != ann->type) continue;
+            if (j++) kputc(';', str);
+            if (g->gene_name != -1) payload_value(payload.gn, g->gene_name, str);
+            else payload_value(payload.gx, g->gene_id, str);
+        }
+        if (str->l == l_name) { // empty gene name, no gene tags
+            str->l = l_re;
+            return;
+        }
+        kputc('\0', str);
+    }
 
-            if (gene == NULL && id == NULL) error("No gene name or gene id in gtf? %s", (char*)b->data);
-            if (gene == NULL) id = gene;
-            if (id == NULL) gene = id;
-            kputs(gene, &gene_name);
-            kputs(id, &gene_id);
-            int j;
-            int n_trans = 0;
-            for (j = 0; j < g->n; ++j) {
-                struct trans_type *t = &g->a[j];
-                if (t->type == g->type) {                    
-                    if (n_trans) kputc(',', &trans_id);
-                    char *trans = dict_name(G->transcript_id, t->trans_id);
-                    kputs(trans, &trans_id);
-                    n_trans++;
+    // transcripts of a gene are split by ',', genes by ';'
+    int n_trans = 0;
+    kputsn(TX_tag, 2, str);
+    kputc('Z', str);
+    for (i = 0, j = 0; i < ann->n; ++i) {
+        struct gene_type *g = &ann->a[i];
+        if (g->type != ann->type) continue;
+        if (j++) kputc(';', str);
+        int n0 = n_trans;
+        for (k = 0; k < g->n; ++k) {
+            struct trans_type *t = &g->a[k];
+            if (t->type != g->type) continue;
+            if (n_trans > n0) kputc(',', str);
+            payload_value(payload.tx, t->trans_id, str);
+            n_trans++;
+        }
+    }
+    kputc('\0', str);
+}
+
+// A spliced read is splice type on a transcript only if its junctions are
+// consecutive junctions of that transcript and the end blocks lie in the
+// outer exons. Candidates come from the first junction, the rest are
+// checked by hash lookups. Return number of such transcripts, 0 if none or
+// more than max, then every isoform is scanned as before.
+static int junc_compatible(struct gtf_spec const *G, const char *name, struct isoform *S, const struct gtf **comp, int max)
+{
+    struct gtf_ctg *ctg = gtf_query_ctg(G, name);
+    if (ctg == NULL || ctg->junc == NULL) return 0;
+    int i, j, k, n, n0, n_comp = 0;
+    for (i = 0; i < S->n; ++i)
+        if (S->p[i].end < S->p[i].start) return 0; // empty block
+    const struct gtf_junc *a = gtf_query_junc(ctg, S->p[0].end, S->p[1].start, &n0);
+    for (k = 0; k < n0; ++k) {
+        if (S->p[0].start < a[k].start) continue;
+        const struct gtf_junc *last = &a[k];
+        for (i = 1; i < S->n-1 && last; ++i) {
+            const struct gtf_junc *hit = gtf_query_junc(ctg, S->p[i].end, S->p[i+1].start, &n);
+            for (j = 0, last = NULL; j < n; ++j) {
+                if (hit[j].tx == a[k].tx && hit[j].exon == a[k].exon + i) {
+                    last = &hit[j];
+                    break;
                 }
             }
         }
+        if (last == NULL || S->p[S->n-1].end > last->end) continue;
+        if (n_comp == max) return 0;
+        comp[n_comp++] = a[k].tx;
     }
-    
-    if (gene_name.l) {
-        bam_aux_append(b, GX_tag, 'Z', gene_id.l+1, (uint8_t*)gene_id.s);
-        bam_aux_append(b, GN_tag, 'Z', gene_name.l+1, (uint8_t*)gene_name.s);
-        bam_aux_append(b, TX_tag, 'Z', trans_id.l+1, (uint8_t*)trans_id.s);
-        free(gene_id.s);
-        free(gene_name.s);
-        free(trans_id.s);
-    }
+    return n_comp;
 }
 
-struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h)
+#define JUNC_MAX_COMP 64
+
+static struct gtf_anno_type *gtf_anno_blocks(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h, struct isoform *S)
 {
     //bam_hdr_t *h = args.hdr;
     bam1_core_t *c;
@@ -677,10 +869,13 @@ struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam
     // exon == splice > intron > antisense
     // https://github.com/shiquan/PISA/wiki/4.-Annotate-alignment-records-with-GTF-or-BED
 
-    struct isoform *S = bend_sam_isoform(b);
-    
+    // other isoforms are never splice type if any is, skip their exon scans
+    const struct gtf *comp[JUNC_MAX_COMP];
+    int n_comp = S->n > 1 && args.debug_mode == 0 ? junc_compatible(G, name, S, comp, JUNC_MAX_COMP) : 0;
+
     int antisense = 0;
     int i;
+  scan_isoforms:
     for (i = 0; i < itr->n; ++i) {
         struct gtf const *g0 = (struct gtf*)itr->rets[i];
         if (g0->start > c->pos+1 || endpos > g0->end) continue; // not fully covered
@@ -704,11 +899,24 @@ struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam
         for (j = 0; j < g0->n_gtf; ++j) {
             struct gtf const *g1 = g0->gtf[j];
             if (g1->type != feature_transcript) continue;
+            if (n_comp) {
+                int k;
+                for (k = 0; k < n_comp && comp[k] != g1; ++k);
+                if (k == n_comp) continue;
+                struct trans_type t = { g1->transcript_id, type_splice };
+                gtf_anno_push(&t, ann, g1->gene_id, g1->gene_name);
+                continue;
+            }
             struct trans_type *a = gtf_anno_core(S, g1);
             gtf_anno_push(a, ann, g1->gene_id, g1->gene_name);
             free(a);
         }
     }
+    if (n_comp && ann->n == 0) { // compatible transcripts all on the other strand
+        n_comp = 0;
+        antisense = 0;
+        goto scan_isoforms;
+    }
     
     // stat type
     gtf_anno_most_likely_type(ann);
@@ -721,12 +929,103 @@ struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam
         fprintf(stderr, "%s   ", b->data);
         gtf_anno_print(ann, G);
     }
-    free(S->p); free(S);
-
     region_itr_destroy(itr);
 
     return ann;
 }
+struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h)
+{
+    struct isoform S = {0,0,0};
+    bend_sam_isoform(b, &S);
+    struct gtf_anno_type *ann = gtf_anno_blocks(b, G, h, &S);
+    free(S.p);
+    return ann;
+}
+
+// Per thread direct mapped cache of annotations. In deep 3' libraries many
+// reads share the same position, strand and splicing, so they reuse one
+// result instead of querying the GTF again. Key is the reference blocks of
+// alignment instead of raw CIGAR, clips and insertions do not matter.
+#define ANNO_CACHE_BITS 14
+
+struct anno_cache {
+    struct isoform S; // blocks of current read
+    struct anno_hit *slots;
+    uint64_t hits, lookups;
+    struct anno_cache *next;
+};
+
+static __thread struct anno_cache *cache_local = NULL;
+
+static struct anno_cache *anno_cache_get()
+{
+    if (cache_local) return cache_local;
+    struct anno_cache *C = malloc(sizeof(*C));
+    memset(C, 0, sizeof(*C));
+    // -no-cache and -debug keep one slot which never hits
+    int n = args.no_cache || args.debug_mode ? 1 : 1<<ANNO_CACHE_BITS;
+    C->slots = calloc(n, sizeof(struct anno_hit));
+    pthread_mutex_lock(&args.local_lock);
+    C->next = args.caches;
+    args.caches = C;
+    pthread_mutex_unlock(&args.local_lock);
+    cache_local = C;
+    return C;
+}
+
+static void anno_cache_destroy(struct anno_cache *C)
+{
+    int i, n = args.no_cache || args.debug_mode ? 1 : 1<<ANNO_CACHE_BITS;
+    for (i = 0; i < n; ++i) {
+        free(C->slots[i].S.p);
+        free(C->slots[i].str.s);
+    }
+    free(C->slots);
+    free(C->S.p);
+    free(C);
+}
+
+// Return slot of read, *hit is set if it holds the annotation already.
+static struct anno_hit *anno_cache_lookup(struct anno_cache *C, bam1_t *b, int *hit)
+{
+    struct isoform *S = &C->S;
+    bend_sam_isoform(b, S);
+    int rev = !!(b->core.flag & BAM_FREVERSE);
+    uint64_t h = (uint64_t)b->core.tid<<1 | rev;
+    int i;
+    for (i = 0; i < S->n; ++i) {
+        h = (h ^ (uint32_t)S->p[i].start) * 0x100000001b3ULL;
+        h = (h ^ (uint32_t)S->p[i].end) * 0x100000001b3ULL;
+    }
+    h ^= h >> 31;
+    h |= 1; // never 0
+    struct anno_hit *e;
+    if (args.no_cache || args.debug_mode) {
+        e = C->slots;
+        *hit = 0;
+    }
+    else {
+        e = &C->slots[(h >> 1) & ((1<<ANNO_CACHE_BITS)-1)];
+        *hit = e->hash == h && e->tid == b->core.tid && e->rev == rev && e->S.n == S->n &&
+            memcmp(e->S.p, S->p, S->n*sizeof(struct pair)) == 0;
+    }
+    C->lookups++;
+    if (*hit) {
+        C->hits++;
+        return e;
+    }
+    e->hash = h;
+    e->tid = b->core.tid;
+    e->rev = rev;
+    if (e->S.m < S->n) {
+        e->S.m = S->m;
+        e->S.p = realloc(e->S.p, e->S.m*sizeof(struct pair));
+    }
+    memcpy(e->S.p, S->p, S->n*sizeof(struct pair));
+    e->S.n = S->n;
+    return e;
+}
+
 int bam_gtf_anno(bam1_t *b, struct gtf_spec const *G, struct read_stat *stat)
 {
     // cleanup all exist tags
@@ -737,24 +1036,31 @@ int bam_gtf_anno(bam1_t *b, struct gtf_spec const *G, struct read_stat *stat)
     if ((data = bam_aux_get(b, GX_tag)) != NULL) bam_aux_del(b, data);
     if ((data = bam_aux_get(b, RE_tag)) != NULL) bam_aux_del(b, data);
 
-    struct gtf_anno_type *ann = bam_gtf_anno_core(b, G, args.hdr);
-
-    bam_aux_append(b, RE_tag, 'A', 1, (uint8_t*)RE_tags[ann->type]);
-
-    gtf_anno_string(b, ann, G);
-
-    if (ann->type == type_exon) stat->reads_in_exon++;
-    else if (ann->type == type_splice) stat->reads_in_exon++; // reads cover two exomes
-    else if (ann->type == type_intron) stat->reads_in_intron++;
-    else if (ann->type == type_exon_intron) stat->reads_in_exonintron++;
-    else if (ann->type == type_ambiguous) stat->reads_ambiguous++; // new transcript
-    else if (ann->type == type_intergenic) stat->reads_in_intergenic++;
-    else if (ann->type == type_antisense) stat->reads_antisense++;
-    else error("Unknown type? %s", exon_type_names[ann->type]);
-
-    gtf_anno_destroy(ann);
+    struct anno_cache *C = anno_cache_get();
+    int hit;
+    struct anno_hit *e = anno_cache_lookup(C, b, &hit);
+    if (hit == 0) {
+        struct gtf_anno_type *ann = gtf_anno_blocks(b, G, args.hdr, &C->S);
+        gtf_anno_tags(b, ann, G, e);
+        gtf_anno_destroy(ann);
+    }
 
-    return ann->type == type_intergenic ? 0 : 1;
+    // all tags in one copy
+    if (b->l_data + e->str.l > b->m_data && sam_realloc_bam_data(b, b->l_data + e->str.l) < 0)
+        error("Failed to allocate memory.");
+    memcpy(b->data + b->l_data, e->str.s, e->str.l);
+    b->l_data += e->str.l;
+
+    if (e->type == type_exon) stat->reads_in_exon++;
+    else if (e->type == type_splice) stat->reads_in_exon++; // reads cover two exomes
+    else if (e->type == type_intron) stat->reads_in_intron++;
+    else if (e->type == type_exon_intron) stat->reads_in_exonintron++;
+    else if (e->type == type_ambiguous) stat->reads_ambiguous++; // new transcript
+    else if (e->type == type_intergenic) stat->reads_in_intergenic++;
+    else if (e->type == type_antisense) stat->reads_antisense++;
+    else error("Unknown type? %s", exon_type_names[e->type]);
+
+    return e->type == type_intergenic ? 0 : 1;
 }
 
 int bam_bed_anno(bam1_t *b, struct bed_spec const *B, struct read_stat *stat)
@@ -835,45 +1141,63 @@ int bam_bed_anno(bam1_t *b, struct bed_spec const *B, struct read_stat *stat)
     return 0;
 }
 
-extern int bam_vcf_anno(bam1_t *b, bam_hdr_t *h, struct bed_spec const *B, const char *vtag);
 
-void *run_it(void *_d)
+static __thread struct stat_shard *stat_local = NULL;
+
+static struct read_stat *stat_get(int idx)
+{
+    struct stat_shard *sh = stat_local;
+    if (sh == NULL) {
+        sh = malloc(sizeof(*sh));
+        memset(sh, 0, sizeof(*sh));
+        pthread_mutex_lock(&args.local_lock);
+        sh->next = args.stat_shards;
+        args.stat_shards = sh;
+        pthread_mutex_unlock(&args.local_lock);
+        stat_local = sh;
+    }
+    if (idx >= sh->m) {
+        int m = sh->m == 0 ? 16 : sh->m;
+        while (m <= idx) m <<= 1;
+        sh->s = realloc(sh->s, m*sizeof(struct read_stat));
+        memset(sh->s + sh->m, 0, (m - sh->m)*sizeof(struct read_stat));
+        sh->m = m;
+    }
+    return &sh->s[idx];
+}
+
+static void *anno_read(void *opts)
+{
+    struct bam_pool *b = bam_pool_create();
+    bam_read_pool(b, args.fp, args.hdr, args.chunk_size);
+    if (b->n == 0) {
+        bam_pool_recycle(b);
+        return NULL;
+    }
+    return b;
+}
+
+static void *anno_run(void *_d, void *opts)
 {
     bam_hdr_t *h = args.hdr;
     struct ret_dat *dat = malloc(sizeof(struct ret_dat));
     memset(dat, 0, sizeof(*dat));
     dat->p = (struct bam_pool*)_d;
-    dat->group_stat = dict_init();
 
-    int idx;
-    idx = dict_push(dat->group_stat, "__ALL__");
-
-    dict_set_value(dat->group_stat);
-    
-    struct read_stat *stat = malloc(sizeof(*stat));
-    memset(stat, 0, sizeof(*stat));
-    dict_assign_value(dat->group_stat, idx, stat);
-    
     int i;
     
     for (i = 0; i < dat->p->n; ++i) {
         int ann = 0;
         bam1_t *b = &dat->p->bam[i];
-    
+        dat->calls.n = 0;
+
+        int idx = 0;
         if (args.group_tag) {
             uint8_t *data;
-            if ((data = bam_aux_get(b, args.group_tag)) != NULL) {
-                char *tag_val = (char*)(data+1);
-                int idx = dict_query(dat->group_stat, tag_val);
-                if (idx == -1) {
-                    idx = dict_push(dat->group_stat, tag_val);
-                    struct read_stat *s = malloc(sizeof(*s));
-                    memset(s, 0, sizeof(*s));
-                    dict_assign_value(dat->group_stat, idx, s);
-                }
-                stat = dict_query_value(dat->group_stat, idx);
-            }
+            if ((data = bam_aux_get(b, args.group_tag)) != NULL && *data == 'Z')
+                idx = dict_push(args.group_stat, (char*)(data+1));
         }
+        struct read_stat *stat = stat_get(idx);
 
         bam1_core_t *c;
         c = &b->core;
@@ -897,7 +1221,7 @@ void *run_it(void *_d)
             if (bam_bed_anno(b, args.B, stat)) ann = 1;
 
         if (args.V)
-            if (bam_vcf_anno(b, args.hdr, args.V, args.vtag)) ann = 1;
+            if (bam_vcf_anno(b, args.hdr, args.V, args.vtag, args.M ? &dat->calls : NULL)) ann = 1;
         
         if (args.chr_binding) {
             char *v = args.chr_binding[b->core.tid];
@@ -911,34 +1235,58 @@ void *run_it(void *_d)
         if (args.anno_only && ann == 0) {
             b->core.flag |= BAM_FQCFAIL;
         }
+        // after all tags appended, so barcode pointers stay valid
+        if (dat->calls.n) vcf_read_push(dat, b);
     }
+    free(dat->calls.a);
     return dat;
 }
 
-static void write_out(void *_d)
+static void anno_write(void *_d, void *opts)
 {
     struct ret_dat *dat = (struct ret_dat *)_d;
+    uint64_t bytes = 0;
     int i;
     for (i = 0; i < dat->p->n; ++i) {
         if (dat->p->bam[i].core.flag & BAM_FQCFAIL) continue; // skip QC failure reads
         if (sam_write1(args.out, args.hdr, &dat->p->bam[i]) == -1)
             error("Failed to write SAM.");
+        bytes += dat->p->bam[i].l_data + 36;
+    }
+    stats_output(bytes);
+
+    if (args.M) {
+        const uint8_t *cb = NULL;
+        int cell = -1;
+        for (i = 0; i < dat->n_vr; ++i) {
+            struct vcf_read *r = &dat->vr[i];
+            // calls of one read share the barcode, look it up once
+            if (r->cb != cb) {
+                cb = r->cb;
+                cell = vcf_mtx_cell(args.M, (char*)(cb+1));
+            }
+            if (cell == -1) continue;
+            vcf_mtx_push(args.M, cell, r->umi, r->call.var, r->call.allele);
+        }
+        bam1_t *last = &dat->p->bam[dat->p->n-1];
+        vcf_mtx_sync(args.M, last->core.tid, last->core.pos);
+        free(dat->vr);
     }
     
     args.reads_input   += dat->reads_input;
     args.reads_pass_qc += dat->reads_pass_qc;
 
-    for (i = 0; i < dict_size(dat->group_stat); ++i) {
-        int idx = dict_query(args.group_stat, dict_name(dat->group_stat, i));
-        if (idx == -1) {
-            idx = dict_push(args.group_stat, dict_name(dat->group_stat, i));
-            struct read_stat *s = malloc(sizeof(*s));
-            memset(s, 0, sizeof(*s));
-            dict_assign_value(args.group_stat, idx, s);
-        }
-
-        struct read_stat *s0 = dict_query_value(args.group_stat, idx);
-        struct read_stat *s1 = dict_query_value(dat->group_stat, i);
+    bam_pool_recycle(dat->p);
+    free(dat);
+}
+// Sum per thread counters of group idx.
+static void stat_merge(int idx, struct read_stat *s0)
+{
+    memset(s0, 0, sizeof(*s0));
+    struct stat_shard *sh;
+    for (sh = args.stat_shards; sh; sh = sh->next) {
+        if (idx >= sh->m) continue;
+        struct read_stat *s1 = &sh->s[idx];
         s0->reads_in_region += s1->reads_in_region;
         s0->reads_in_region_diff_strand += s1->reads_in_region_diff_strand;
         s0->reads_in_intergenic += s1->reads_in_intergenic;
@@ -948,21 +1296,13 @@ static void write_out(void *_d)
         s0->reads_ambiguous += s1->reads_ambiguous;
         s0->reads_in_exonintron += s1->reads_in_exonintron;
     }
-    bam_pool_destory(dat->p);
-
-    // free assign memory manually
-    for (i = 0; i < dict_size(dat->group_stat); ++i) {
-        void *v = dict_query_value(dat->group_stat, i);
-        if (v) free(v);
-    }
-
-    dict_destroy(dat->group_stat);
-    free(dat);
 }
+
 void write_report()
 {
     if (dict_size(args.group_stat) == 1) {
-        struct read_stat *s0 = (struct read_stat*)dict_query_value(args.group_stat, 0);
+        struct read_stat stat0, *s0 = &stat0;
+        stat_merge(0, s0);
         fprintf(args.fp_report, "Reads Mapped to Genome (Map Quality >= %d),%.1f%%\n", args.map_qual, (float)args.reads_pass_qc/args.reads_input*100);
         
         if (args.B) {
@@ -987,16 +1327,28 @@ static void memory_release()
     bam_hdr_destroy(args.hdr);
     sam_close(args.fp);
     sam_close(args.out);
-    int i;
-    for (i = 0; i < dict_size(args.group_stat); ++i) {
-        void *v = dict_query_value(args.group_stat, i);
-        if (v) free(v);
+    while (args.stat_shards) {
+        struct stat_shard *sh = args.stat_shards;
+        args.stat_shards = sh->next;
+        free(sh->s);
+        free(sh);
     }
     dict_destroy(args.group_stat);
+    while (args.caches) {
+        struct anno_cache *C = args.caches;
+        args.caches = C->next;
+        anno_cache_destroy(C);
+    }
     if (args.B) bed_spec_destroy(args.B);
-    if (args.G) gtf_destroy(args.G);
+    if (args.G) {
+        gtf_destroy(args.G);
+        gtf_payload_destroy();
+    }
+    if (args.M) vcf_mtx_destroy(args.M);
     if (args.V) bed_spec_var_destroy(args.V);
     if (args.fp_report != stderr) fclose(args.fp_report);
+    bam_pool_cache_clear();
+    gpool_destroy();
 }
 
 extern int anno_usage();
@@ -1007,55 +1359,21 @@ int bam_anno_attr(int argc, char *argv[])
     t_real = realtime();
 
     if (parse_args(argc, argv)) return anno_usage();
+    if (args.G) gtf_payload_init(args.G);
 
-    if (args.n_thread == 1) {
-        for (;;) {
-            struct bam_pool *b = bam_pool_create();
-            bam_read_pool(b, args.fp, args.hdr, args.chunk_size);
-            if (b == NULL) break;
-            if (b->n == 0) { free(b->bam); free(b); break; }
-            b = run_it(b);
-            write_out(b);
-        }
-    }
-    else {
-        // multi-thread mode
-
-        hts_tpool *p = hts_tpool_init(args.n_thread);
-        hts_tpool_process *q = hts_tpool_process_init(p, args.n_thread*2, 0);
-        hts_tpool_result *r;
-
-        for (;;) {
-            struct bam_pool *b = bam_pool_create();
-            bam_read_pool(b, args.fp, args.hdr, args.chunk_size);
-            
-            if (b == NULL) break;
-            if (b->n == 0) { free(b->bam); free(b); break; }
-            
-            int block;
-            do {
-                block = hts_tpool_dispatch2(p, q, run_it, b, 1);
-                if ((r = hts_tpool_next_result(q))) {
-                    struct bam_pool *d = (struct bam_pool*)hts_tpool_result_data(r);
-                    write_out(d);
-                    hts_tpool_delete_result(r, 0);
-                }
-            }
-            while (block == -1);
-        }
+    pipeline_run(args.n_thread*2, anno_read, anno_run, anno_write, NULL);
 
-        hts_tpool_process_flush(q);
-
-        while ((r = hts_tpool_next_result(q))) {
-            struct bam_pool *d = (struct bam_pool*)hts_tpool_result_data(r);
-            write_out(d);
-            hts_tpool_delete_result(r, 0);
+    write_report();
+    if (args.G && args.no_cache == 0 && args.debug_mode == 0) {
+        uint64_t hits = 0, lookups = 0;
+        struct anno_cache *C;
+        for (C = args.caches; C; C = C->next) {
+            hits += C->hits;
+            lookups += C->lookups;
         }
-        hts_tpool_process_destroy(q);
-        hts_tpool_destroy(p);
+        LOG_print("Annotation cache hits %" PRIu64 " of %" PRIu64 " reads (%.1f%%).", hits, lookups, lookups ? (double)hits/lookups*100 : 0);
     }
-
-    write_report();
+    if (args.M) vcf_mtx_write(args.M, args.vcf_outdir);
     memory_release();    
     LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
     
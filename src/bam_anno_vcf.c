@@ -1,69 +1,72 @@
 #include "utils.h"
 #include "bed.h"
+#include "bam_anno_vcf.h"
+#include "hll.h"
+#include "thread.h"
+#include "pisa_version.h" // mex output
 #include "htslib/vcf.h"
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/khash.h"
 #include "htslib/kstring.h"
 
-// return -1 on out of range
+// Forward only cursor over CIGAR. Variants are visited in ascending position,
+// so the CIGAR of one read is walked once for all of them.
+struct cigar_walk {
+    const uint32_t *cigar;
+    int n, i;
+    int rpos; // reference position of current operator
+    int qpos; // query position of current operator
+};
+
+static void cigar_walk_init(struct cigar_walk *w, const bam1_t *b)
+{
+    w->cigar = bam_get_cigar(b);
+    w->n = b->core.n_cigar;
+    w->i = 0;
+    w->rpos = b->core.pos;
+    w->qpos = 0;
+}
+
+// return query position of pos
+// -1 on out of range
 // -2 on intron region
 // -3 on deletion
-static int bam_seqpos(bam1_t *a, int pos)
+static int cigar_walk_seqpos(struct cigar_walk *w, int pos)
 {
-    int st = 0;
-    int i;
-    const bam1_core_t *c = &a->core;
-    int qpos = c->pos;
-    uint32_t *cigar = bam_get_cigar(a);
-    for (i = 0; i < c->n_cigar; ++i) {
-        int type = cigar[i]&0xf;
-        int len = cigar[i]>>4;
-        if (type == BAM_CMATCH || type == BAM_CEQUAL || type == BAM_CDIFF) {
-            int k;
-            for (k = 0; k < len; ++k) {
-                if (qpos == pos) return st;
-                qpos++;
-                st++;
-            }
-        }
-        else if (type == BAM_CINS) {
-            st+=len;
+    if (pos < w->rpos) return -1;
+    for (; w->i < w->n; w->i++) {
+        int type = bam_cigar_op(w->cigar[w->i]);
+        int len = bam_cigar_oplen(w->cigar[w->i]);
+        int consume = bam_cigar_type(type); // bit 1 query, bit 2 reference
+        if ((consume & 2) && pos < w->rpos + len) {
+            if (type == BAM_CDEL) return -3;
+            if (type == BAM_CREF_SKIP) return -2;
+            return w->qpos + pos - w->rpos;
         }
-        else if (type == BAM_CDEL) {
-            qpos+=len;
-            if (qpos > pos) return -3;
-        }
-        else if (type == BAM_CREF_SKIP) {
-            qpos+=len;
-            if (qpos > pos) return -2;
-        }
-        else {
-            st+=len;
-        }
-        if (qpos > pos) break;
+        if (consume & 1) w->qpos += len;
+        if (consume & 2) w->rpos += len;
     }
-
     return -1;
 }
 
-int reads_match_var(struct bed *bed, bam1_t *b)
+// return -1 on not covered, otherwise enum var_allele
+static int reads_match_var(struct cigar_walk *w, const struct var *v, int pos, const bam1_t *b)
 {
-    int st = bam_seqpos(b, bed->start);
+    int st = cigar_walk_seqpos(w, pos);
     if (st == -1) return -1; // out of range
     if (st == -2) return -1; // intron region
 
-    struct var *v = (struct var*)bed->data;
-    assert(v);
-
     if (st == -3) { // deletion
-        if (v->alt->l < v->ref->l) return 0; // matched
-        return 1; // unmatched
-    } 
-    uint8_t *seq = bam_get_seq(b);
-    bam1_core_t *c = &b->core;
+        if (v->alt->l < v->ref->l) return var_alt; // matched
+        return var_other;
+    }
+    const uint8_t *seq = bam_get_seq(b);
+    const bam1_core_t *c = &b->core;
     int i, j;
     int mis = 0;
     for (i = st, j = 0; i < c->l_qseq && j < v->ref->l; ++i,++j) {
-        if ("=ACMGRSVTWYHKDBN"[bam_seqi(seq, i)] != v->ref->s[j]) {
+        if (seq_nt16_str[bam_seqi(seq, i)] != v->ref->s[j]) {
             mis = 1;
             break;
         }
@@ -71,64 +74,368 @@ int reads_match_var(struct bed *bed, bam1_t *b)
 
     if (mis) {
         for (i = st, j = 0; i < c->l_qseq && j < v->alt->l; ++i,++j) {
-            if ("=ACMGRSVTWYHKDBN"[bam_seqi(seq, i)] != v->alt->s[j])
-                return 1;
+            if (seq_nt16_str[bam_seqi(seq, i)] != v->alt->s[j])
+                return var_other;
         }
-        return 0;
+        return var_alt;
+    }
+
+    return var_ref;
+}
+
+// Tag value is built on stack, heap is only used by reads carry many calls.
+#define VCF_BUF 256
+
+struct vcf_buf {
+    char *s;
+    size_t l, m;
+    char stack[VCF_BUF];
+};
+
+static void vcf_put(struct vcf_buf *b, const char *s, size_t l)
+{
+    if (b->l + l + 1 > b->m) {
+        size_t m = (b->l + l + 1)*2;
+        if (b->s == b->stack) {
+            b->s = malloc(m);
+            memcpy(b->s, b->stack, b->l);
+        }
+        else b->s = realloc(b->s, m);
+        b->m = m;
+    }
+    memcpy(b->s + b->l, s, l);
+    b->l += l;
+    b->s[b->l] = '\0';
+}
+
+// Return 1 if the last call of buf, from start, is one of the calls before,
+// like dict_push did.
+static int vcf_dup(const struct vcf_buf *b, size_t start)
+{
+    const char *s = b->s + start;
+    size_t l = b->l - start;
+    const char *p = b->s, *e = start ? b->s + start - 1 : b->s;
+    while (p < e) {
+        const char *q = memchr(p, ';', e - p);
+        if (q == NULL) q = e;
+        if (q - p == l && memcmp(p, s, l) == 0) return 1;
+        p = q + 1;
     }
-            
-    return 1;       
+    return 0;
 }
-int bam_vcf_anno(bam1_t *b, bam_hdr_t *h, struct bed_spec const *B, const char *vtag)
-{ 
+
+int bam_vcf_anno(bam1_t *b, bam_hdr_t *h, struct bed_spec const *B, const char *vtag, struct vcf_calls *calls)
+{
     bam1_core_t *c;
     c = &b->core;
-    
+
     // cleanup exist tag
     uint8_t *data;
     if ((data = bam_aux_get(b, vtag)) != NULL) bam_aux_del(b, data);
-    
-    char *name = h->target_name[c->tid];
+
+    int id = dict_query(B->seqname, h->target_name[c->tid]);
+    if (id == -1) return 0;
+
     int endpos = bam_endpos(b);
+    int first;
+    int n = bed_sorted_range(B, id, c->pos, endpos, &first);
+    if (n == 0) return 0; // no hit
 
-    struct region_itr *itr = bed_query(B, name, c->pos, endpos);
-    if (itr == NULL) return 0; // query failed
-    if (itr->n == 0) return 0; // no hit
+    struct cigar_walk w;
+    cigar_walk_init(&w, b);
 
-    struct dict *val = dict_init();
+    struct vcf_buf buf;
+    buf.s = buf.stack;
+    buf.l = 0;
+    buf.m = VCF_BUF;
     int i;
-    kstring_t temp = {0,0,0};
-    for (i = 0; i < itr->n; ++i) {
-        struct bed *bed = (struct bed*)itr->rets[i];
+    for (i = first; i < first + n; ++i) {
+        const struct bed *bed = &B->bed[i];
         if (bed->start > endpos || bed->end <= c->pos) continue; // not covered
-        if (reads_match_var(bed, b) != 0) continue; // no variant contained
-        
-        temp.l = 0;
-
-        if (bed->name == -1) ksprintf(&temp, "%s,%d,%s", dict_name(B->seqname, bed->seqname), bed->start+1, ((struct var*)bed->data)->alt->s);
-        else kputs(dict_name(B->name,bed->name), &temp);
-        
-        if (temp.l)
-            dict_push(val, temp.s);
-        
-    }
-    region_itr_destroy(itr);
-
-    if (temp.m) free(temp.s);
-    
-    if (dict_size(val)) {
-        kstring_t str = {0,0,0};
-        int i;
-        for (i = 0; i < dict_size(val); ++i) {
-            if (i) kputc(';', &str);
-            kputs(dict_name(val, i), &str);
+        const struct var *v = bed->data;
+        int allele = reads_match_var(&w, v, bed->start, b);
+        if (allele == -1) continue;
+        if (calls) {
+            if (calls->n == calls->m) {
+                calls->m = calls->m == 0 ? 8 : calls->m<<1;
+                calls->a = realloc(calls->a, calls->m*sizeof(struct vcf_call));
+            }
+            calls->a[calls->n].var = i;
+            calls->a[calls->n].allele = allele;
+            calls->n++;
         }
+        if (allele != var_alt) continue; // no variant contained
 
-        bam_aux_append(b, vtag, 'Z', str.l+1, (uint8_t*)str.s);
-        free(str.s);
-        dict_destroy(val);
-        return 1;
+        size_t l0 = buf.l;
+        if (buf.l) vcf_put(&buf, ";", 1);
+        size_t start = buf.l;
+        if (bed->name == -1) {
+            const char *name = dict_name(B->seqname, bed->seqname);
+            char pos[16];
+            int k = snprintf(pos, sizeof(pos), ",%d,", bed->start+1);
+            vcf_put(&buf, name, strlen(name));
+            vcf_put(&buf, pos, k);
+            if (v->alt->l) vcf_put(&buf, v->alt->s, v->alt->l);
+            else vcf_put(&buf, ".", 1); // no alt allele
+        }
+        else {
+            const char *name = dict_name(B->name, bed->name);
+            vcf_put(&buf, name, strlen(name));
+        }
+        if (buf.l == start || vcf_dup(&buf, start)) {
+            buf.l = l0;
+            buf.s[buf.l] = '\0';
+        }
     }
-    dict_destroy(val);
-    return 0;
+
+    int ret = 0;
+    if (buf.l) {
+        bam_aux_append(b, vtag, 'Z', buf.l+1, (uint8_t*)buf.s);
+        ret = 1;
+    }
+    if (buf.s != buf.stack) free(buf.s);
+    return ret;
+}
+
+struct vcf_count {
+    uint32_t n[3]; // indexed by enum var_allele
+};
+
+// key is cell<<32|var
+KHASH_MAP_INIT_INT64(cv, struct vcf_count)
+
+struct umi_key {
+    uint32_t cell;
+    uint32_t var;
+    uint64_t umi;
+};
+
+static inline khint_t umi_key_hash(struct umi_key k)
+{
+    uint64_t x = ((uint64_t)k.cell<<32 | k.var) * 0x9E3779B97F4A7C15ULL ^ k.umi;
+    return kh_int64_hash_func(x ^ x>>29);
+}
+#define umi_key_equal(a, b) ((a).cell == (b).cell && (a).var == (b).var && (a).umi == (b).umi)
+
+KHASH_INIT(umi, struct umi_key, struct vcf_count, 1, umi_key_hash, umi_key_equal)
+
+struct vcf_mtx {
+    const struct bed_spec *B;
+    struct dict *cells;
+    int fixed; // cells from list
+    khash_t(cv) *cv;
+    khash_t(umi) *umi;
+    int sorted;
+    int *ctg_tid; // bam tid of each contig of B
+    uint32_t collapse_at;
+};
+
+struct vcf_mtx *vcf_mtx_init(const struct bed_spec *B, bam_hdr_t *h, const char *list, int umi)
+{
+    struct vcf_mtx *M = malloc(sizeof(*M));
+    memset(M, 0, sizeof(*M));
+    M->B = B;
+    M->cells = dict_init();
+    if (list) {
+        dict_read(M->cells, list);
+        if (dict_size(M->cells) == 0) error("Barcode list is empty.");
+        M->fixed = 1;
+    }
+    M->cv = kh_init(cv);
+    if (umi) {
+        M->umi = kh_init(umi);
+        kstring_t so = {0,0,0};
+        M->sorted = sam_hdr_find_tag_hd(h, "SO", &so) == 0 && strcmp(so.s, "coordinate") == 0;
+        free(so.s);
+        int n = dict_size(B->seqname), i;
+        M->ctg_tid = malloc(n*sizeof(int));
+        for (i = 0; i < n; ++i) M->ctg_tid[i] = sam_hdr_name2tid(h, dict_name(B->seqname, i));
+        M->collapse_at = 1<<16;
+    }
+    return M;
+}
+
+void vcf_mtx_destroy(struct vcf_mtx *M)
+{
+    dict_destroy(M->cells);
+    kh_destroy(cv, M->cv);
+    if (M->umi) kh_destroy(umi, M->umi);
+    free(M->ctg_tid);
+    free(M);
+}
+
+int vcf_mtx_cell(struct vcf_mtx *M, const char *cb)
+{
+    if (M->fixed) return dict_query(M->cells, cb);
+    return dict_push(M->cells, cb);
+}
+
+uint64_t vcf_umi_key(const char *s)
+{
+    uint64_t x = 1; // leading 1 keeps length
+    int i;
+    for (i = 0; s[i]; ++i) {
+        if (i == 31) break;
+        switch (s[i]) {
+            case 'A': x = x<<2;     continue;
+            case 'C': x = x<<2 | 1; continue;
+            case 'G': x = x<<2 | 2; continue;
+            case 'T': x = x<<2 | 3; continue;
+        }
+        break;
+    }
+    if (s[i] == '\0') return x;
+    return hll_hash(s) | 1ULL<<63; // never equal to a packed key
+}
+
+static void cv_add(struct vcf_mtx *M, int cell, int var, int allele, uint32_t n)
+{
+    int ret;
+    khint_t k = kh_put(cv, M->cv, (uint64_t)cell<<32 | (uint32_t)var, &ret);
+    if (ret) memset(&kh_val(M->cv, k), 0, sizeof(struct vcf_count));
+    kh_val(M->cv, k).n[allele] += n;
+}
+
+void vcf_mtx_push(struct vcf_mtx *M, int cell, uint64_t umi, int var, int allele)
+{
+    if (M->umi == NULL) {
+        cv_add(M, cell, var, allele, 1);
+        return;
+    }
+    struct umi_key key = { cell, var, umi };
+    int ret;
+    khint_t k = kh_put(umi, M->umi, key, &ret);
+    if (ret) memset(&kh_val(M->umi, k), 0, sizeof(struct vcf_count));
+    kh_val(M->umi, k).n[allele]++;
+}
+
+// Count UMIs of variants no read after tid:pos could cover, all if tid < 0.
+static void umi_collapse(struct vcf_mtx *M, int tid, int pos)
+{
+    khint_t k;
+    for (k = kh_begin(M->umi); k != kh_end(M->umi); ++k) {
+        if (!kh_exist(M->umi, k)) continue;
+        struct umi_key key = kh_key(M->umi, k);
+        if (tid >= 0) {
+            const struct bed *bed = &M->B->bed[key.var];
+            int t = M->ctg_tid[bed->seqname];
+            if (t == tid && bed->end > pos) continue;
+            if (t > tid) continue;
+        }
+        const uint32_t *n = kh_val(M->umi, k).n;
+        int allele = var_other;
+        if (n[var_ref] > n[var_alt] && n[var_ref] > n[var_other]) allele = var_ref;
+        else if (n[var_alt] > n[var_ref] && n[var_alt] > n[var_other]) allele = var_alt;
+        cv_add(M, key.cell, key.var, allele, 1);
+        kh_del(umi, M->umi, k);
+    }
+}
+
+void vcf_mtx_sync(struct vcf_mtx *M, int tid, int pos)
+{
+    if (M->umi == NULL || M->sorted == 0 || tid < 0) return;
+    if (kh_size(M->umi) < M->collapse_at) return;
+    umi_collapse(M, tid, pos);
+    // amortize scans over new UMIs
+    M->collapse_at = kh_size(M->umi)*2 > 1<<16 ? kh_size(M->umi)*2 : 1<<16;
+}
+
+// Matrix entry, key is var<<32|cell so entries sort by variant then cell.
+struct mex_ent {
+    uint64_t key;
+    struct vcf_count c;
+};
+
+static int cmp_ent(const void *a, const void *b)
+{
+    uint64_t x = ((const struct mex_ent*)a)->key, y = ((const struct mex_ent*)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+static BGZF *mex_open(const char *outdir, const char *name)
+{
+    kstring_t str = {0,0,0};
+    kputs(outdir, &str);
+    if (outdir[strlen(outdir)-1] != '/') kputc('/', &str);
+    kputs(name, &str);
+    BGZF *fp = bgzf_open(str.s, "w");
+    CHECK_EMPTY(fp, "%s : %s.", str.s, strerror(errno));
+    gpool_attach_bgzf(fp, gpool_high);
+    free(str.s);
+    return fp;
+}
+
+static void mex_flush(BGZF *fp, kstring_t *str, int force)
+{
+    if (str->l < 100000000 && force == 0) return;
+    if (bgzf_write(fp, str->s, str->l) != str->l) error("Failed to write.");
+    str->l = 0;
+}
+
+void vcf_mtx_write(struct vcf_mtx *M, const char *outdir)
+{
+    if (M->umi) umi_collapse(M, -1, 0);
+
+    kstring_t str = {0,0,0};
+    int i;
+    BGZF *fp = mex_open(outdir, "barcodes.tsv.gz");
+    for (i = 0; i < dict_size(M->cells); ++i) {
+        kputs(dict_name(M->cells, i), &str);
+        kputc('\n', &str);
+        mex_flush(fp, &str, 0);
+    }
+    mex_flush(fp, &str, 1);
+    if (bgzf_close(fp)) error("Failed to close barcodes.tsv.gz.");
+
+    const struct bed_spec *B = M->B;
+    fp = mex_open(outdir, "features.tsv.gz");
+    for (i = 0; i < B->n; ++i) {
+        const struct bed *bed = &B->bed[i];
+        const struct var *v = bed->data;
+        ksprintf(&str, "%s,%d,%s,%s\n", dict_name(B->seqname, bed->seqname), bed->start+1, v->ref->s, v->alt->l ? v->alt->s : ".");
+        mex_flush(fp, &str, 0);
+    }
+    mex_flush(fp, &str, 1);
+    if (bgzf_close(fp)) error("Failed to close features.tsv.gz.");
+
+    // sort by variant then cell
+    uint64_t n = kh_size(M->cv), j = 0;
+    struct mex_ent *ent = malloc(n*sizeof(struct mex_ent));
+    khint_t k;
+    for (k = kh_begin(M->cv); k != kh_end(M->cv); ++k) {
+        if (!kh_exist(M->cv, k)) continue;
+        uint64_t x = kh_key(M->cv, k);
+        ent[j].key = x<<32 | x>>32;
+        ent[j++].c = kh_val(M->cv, k);
+    }
+    qsort(ent, n, sizeof(struct mex_ent), cmp_ent);
+
+    static const char *names[] = { "alt.mtx.gz", "ref.mtx.gz", "other.mtx.gz" };
+    int a;
+    for (a = 0; a < 3; ++a) {
+        uint64_t nnz = 0;
+        for (j = 0; j < n; ++j)
+            if (ent[j].c.n[a]) nnz++;
+        fp = mex_open(outdir, names[a]);
+        kputs("%%MatrixMarket matrix coordinate integer general\n", &str);
+        kputs("% Generated by PISA ", &str);
+        kputs(PISA_VERSION, &str);
+        kputc('\n', &str);
+        ksprintf(&str, "%d\t%d\t%" PRIu64 "\n", B->n, dict_size(M->cells), nnz);
+        for (j = 0; j < n; ++j) {
+            uint32_t c = ent[j].c.n[a];
+            if (c == 0) continue;
+            kputuw((uint32_t)(ent[j].key>>32)+1, &str);
+            kputc('\t', &str);
+            kputuw((uint32_t)ent[j].key+1, &str);
+            kputc('\t', &str);
+            kputuw(c, &str);
+            kputc('\n', &str);
+            mex_flush(fp, &str, 0);
+        }
+        mex_flush(fp, &str, 1);
+        if (bgzf_close(fp)) error("Failed to close %s.", names[a]);
+    }
+    free(ent);
+    free(str.s);
 }
@@ -0,0 +1,50 @@
+#ifndef BAM_ANNO_VCF_H
+#define BAM_ANNO_VCF_H
+
+#include "bed.h"
+#include "htslib/sam.h"
+
+// Allele of a read at a variant.
+enum var_allele {
+    var_alt = 0,
+    var_ref,
+    var_other,
+};
+
+struct vcf_call {
+    int var; // index of variant in B->bed
+    int allele;
+};
+
+struct vcf_calls {
+    int n, m;
+    struct vcf_call *a;
+};
+
+// Tag read with alt alleles it carries. If calls is not NULL, every covered
+// variant and its allele are appended. Return 1 if tagged.
+int bam_vcf_anno(bam1_t *b, bam_hdr_t *h, struct bed_spec const *B, const char *vtag, struct vcf_calls *calls);
+
+// Cell x variant ref/alt/other counts. With UMIs, each UMI counts once with
+// its majority allele, ties count as other. On coordinate sorted input, UMIs
+// of variants behind the reads are collapsed on the way, so memory follows
+// active variants instead of the whole file.
+struct vcf_mtx;
+
+// Cells are limited to list if set. Pass umi 1 to dedup UMIs.
+struct vcf_mtx *vcf_mtx_init(const struct bed_spec *B, bam_hdr_t *h, const char *list, int umi);
+void vcf_mtx_destroy(struct vcf_mtx *M);
+
+// Return cell index of barcode, -1 if filtered by list.
+int vcf_mtx_cell(struct vcf_mtx *M, const char *cb);
+// Key of a UMI string, exact for A/C/G/T up to 31 bases.
+uint64_t vcf_umi_key(const char *s);
+void vcf_mtx_push(struct vcf_mtx *M, int cell, uint64_t umi, int var, int allele);
+// Tell all reads before tid:pos are pushed.
+void vcf_mtx_sync(struct vcf_mtx *M, int tid, int pos);
+
+// Write barcodes.tsv.gz, features.tsv.gz, ref.mtx.gz, alt.mtx.gz and
+// other.mtx.gz into outdir.
+void vcf_mtx_write(struct vcf_mtx *M, const char *outdir);
+
+#endif
@@ -6,6 +6,9 @@
 #include "htslib/sam.h"
 #include "htslib/kseq.h"
 #include "dict.h"
+#include "hll.h"
+#include "bam_pool.h"
+#include "thread.h"
 #include <zlib.h>
 
 static struct args {
@@ -20,8 +23,12 @@ static struct args {
     int qual_thres;
     int ignore_header;
     int is_dyn_alloc;
-    int file_th;
+    int n_thread; // size of global thread pool, and workers
     int all_tags;
+    int hll_p; // HyperLogLog precision, 0 for exact counting
+    htsFile *fp;
+    bam_hdr_t *hdr;
+    int chunk_size;
 } args = {
     .input_fname   = NULL,
     .output_fname  = NULL,
@@ -34,8 +41,12 @@ static struct args {
     .qual_thres    = 0,
     .ignore_header = 0,
     .is_dyn_alloc  = 1,
-    .file_th       = 4,
+    .n_thread      = 1,
     .all_tags      = 0,
+    .hll_p         = 0,
+    .fp            = NULL,
+    .hdr           = NULL,
+    .chunk_size    = 100000, // records are streamed, keep chunks small
 };
 
 static int parse_args(int argc, char **argv)
@@ -44,6 +55,8 @@ static int parse_args(int argc, char **argv)
     const char *tag  = NULL;
     const char *qual = NULL;
     const char *file_th = NULL;
+    const char *thread = NULL;
+    const char *hll = NULL;
     for (i = 1; i < argc; ) {
         const char *a = argv[i++];
         const char **var = 0;
@@ -59,6 +72,8 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-list") == 0) var = &args.barcode_fname;
         else if (strcmp(a, "-q") == 0) var = &qual;
         else if (strcmp(a, "-@") == 0) var = &file_th;
+        else if (strcmp(a, "-t") == 0) var = &thread;
+        else if (strcmp(a, "-hll") == 0) var = &hll;
         else if (strcmp(a, "-all-tags") == 0) {
             args.all_tags = 1;
             continue;
@@ -96,101 +111,393 @@ static int parse_args(int argc, char **argv)
     
     if (qual) args.qual_thres = str2int((char*)qual);
     if (args.qual_thres) args.qual_thres = 0;
-    if (file_th) args.file_th = str2int(file_th);
-    assert (args.file_th > 0);
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_th;
+    if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
+    if (hll) {
+        if (args.dedup == 0) error("-hll only works with -dedup.");
+        args.hll_p = str2int((char*)hll);
+        if (args.hll_p < 4 || args.hll_p > 16) error("-hll should be in [4, 16].");
+    }
     return 0;
 }
+// Distinct values of one tag in one cell and group. Values of A/C/G/T up to
+// 31 bases, like UMIs, are packed into integers, others are kept as strings.
+// With -hll, all values are hashed into a HyperLogLog sketch instead.
+KHASH_SET_INIT_INT64(key)
+
+struct attr_set {
+    uint32_t n; // records with this tag
+    khash_t(key) *keys;
+    struct dict *vals;
+    struct hll *hll;
+};
+
+static void attr_set_destroy(struct attr_set *a)
+{
+    if (a->keys) kh_destroy(key, a->keys);
+    if (a->vals) dict_destroy(a->vals);
+    if (a->hll) hll_destroy(a->hll);
+    free(a);
+}
+
+static uint32_t attr_set_count(const struct attr_set *a)
+{
+    if (args.dedup == 0) return a->n;
+    if (a->hll) return (uint32_t)(hll_estimate(a->hll) + 0.5);
+    return (a->keys ? kh_size(a->keys) : 0) + (a->vals ? dict_size(a->vals) : 0);
+}
+
+// Return 0 if not a packable DNA value.
+static uint64_t pack_dna(const char *s)
+{
+    uint64_t x = 1; // leading 1 keeps length
+    int i;
+    for (i = 0; s[i]; ++i) {
+        if (i == 31) return 0;
+        switch (s[i]) {
+            case 'A': x = x<<2;     break;
+            case 'C': x = x<<2 | 1; break;
+            case 'G': x = x<<2 | 2; break;
+            case 'T': x = x<<2 | 3; break;
+            default: return 0;
+        }
+    }
+    return x;
+}
+
+static void attr_set_merge(struct attr_set *a, const struct attr_set *o)
+{
+    a->n += o->n;
+    if (o->hll) {
+        if (a->hll == NULL) a->hll = hll_init(args.hll_p);
+        hll_merge(a->hll, o->hll);
+    }
+    if (o->keys) {
+        if (a->keys == NULL) a->keys = kh_init(key);
+        khint_t k;
+        int ret;
+        for (k = kh_begin(o->keys); k != kh_end(o->keys); ++k)
+            if (kh_exist(o->keys, k)) kh_put(key, a->keys, kh_key(o->keys, k), &ret);
+    }
+    if (o->vals) {
+        if (a->vals == NULL) a->vals = dict_init();
+        int i;
+        for (i = 0; i < dict_size(o->vals); ++i) dict_push(a->vals, dict_name(o->vals, i));
+    }
+}
+
 struct counts_per_bcode {
     int n, m; // init equal n_tag, if set group, m == n_tag*n_group
-    struct dict **counts; 
+    struct attr_set **counts;
 };
 
+// Each pool thread counts its chunks into a counts of its own, they are merged
+// into one after the pipeline. Barcodes and groups keep the position of their
+// first record, chunk serial<<32 | index, so merged ones are ordered as if
+// counted serially. With -list, barcodes are indexed by the shared list.
 struct counts {
     struct dict *bc_dict;
     struct dict *group_dict;
     int n, m;
     struct counts_per_bcode *counts;    // n_barcodes
+    uint32_t *raw;                      // records per barcode
+    uint64_t *bc_first;
+    uint64_t *grp_first;
+    int m_grp;
+    struct counts *next;
 };
+static struct {
+    pthread_mutex_t lock;
+    struct counts *head;
+    struct dict *list; // -list
+} locals = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+
 void counts_destroy(struct counts *cnt)
 {
     int i;
-    for (i = 0; i < dict_size(cnt->bc_dict); ++i) {
+    for (i = 0; i < cnt->n; ++i) {
         struct counts_per_bcode *c = &cnt->counts[i];
         int j;
         for (j = 0; j < c->n; ++j)
-            if (c->counts[j]) dict_destroy(c->counts[j]);
+            if (c->counts[j]) attr_set_destroy(c->counts[j]);
         free(c->counts);
     }
     free(cnt->counts);
-    dict_destroy(cnt->bc_dict);
+    free(cnt->raw);
+    free(cnt->bc_first);
+    free(cnt->grp_first);
+    if (cnt->bc_dict != locals.list) dict_destroy(cnt->bc_dict);
     if (cnt->group_dict) dict_destroy(cnt->group_dict);
 }
-int counts_push(struct counts *cnt, bam1_t *b)
+
+static __thread struct counts *cnt_local = NULL;
+
+// Make room for barcode id of c.
+static void counts_resize(struct counts *c, int id)
 {
-    int i;
-    if (args.all_tags == 1) { // check if all tags existed
-        for (i = 0; i < args.n_tag; ++i) {
-            uint8_t *va = bam_aux_get(b, args.tags[i]);
-            if (!va) return 0;
-        }
+    if (id < c->m) return;
+    int m = c->m == 0 ? 1024 : c->m;
+    while (m <= id) m <<= 1;
+    c->counts = realloc(c->counts, m*sizeof(struct counts_per_bcode));
+    memset(c->counts + c->m, 0, (m - c->m)*sizeof(struct counts_per_bcode));
+    c->raw = realloc(c->raw, m*sizeof(uint32_t));
+    memset(c->raw + c->m, 0, (m - c->m)*sizeof(uint32_t));
+    c->bc_first = realloc(c->bc_first, m*sizeof(uint64_t));
+    c->m = m;
+    c->n = m;
+}
+
+static struct counts *counts_get()
+{
+    struct counts *c = cnt_local;
+    if (c) return c;
+    c = malloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->bc_dict = args.is_dyn_alloc ? dict_init() : locals.list;
+    if (args.group_tag) c->group_dict = dict_init();
+    if (args.is_dyn_alloc == 0) counts_resize(c, dict_size(locals.list));
+    pthread_mutex_lock(&locals.lock);
+    c->next = locals.head;
+    locals.head = c;
+    pthread_mutex_unlock(&locals.lock);
+    cnt_local = c;
+    return c;
+}
+
+// Tag value as string, a character tag is copied to buf.
+static const char *aux_str(const uint8_t *t, char *buf)
+{
+    if (*t == 'A') {
+        buf[0] = t[1];
+        buf[1] = '\0';
+        return buf;
     }
-    
+    return (const char*)(t+1);
+}
 
-    uint8_t *tag = bam_aux_get(b, args.cb_tag);
-    if (!tag) return 1; // skip records without cell Barcodes
+struct attr_chunk {
+    struct bam_pool *p;
+    uint64_t serial;
+};
 
-    char *name = (char*)(tag+1);
-    int id = -1; // individual index
-    
-    if (args.is_dyn_alloc == 0) {
-        id = dict_query(cnt->bc_dict, name);
-        if (id == -1) return 1;
-        dict_push(cnt->bc_dict, name); // increase count
+static void *attr_read(void *opts)
+{
+    static uint64_t serial = 0; // reader only
+    struct bam_pool *b = bam_pool_create();
+    bam_read_pool(b, args.fp, args.hdr, args.chunk_size);
+    if (b->n == 0) {
+        bam_pool_recycle(b);
+        return NULL;
+    }
+    struct attr_chunk *c = malloc(sizeof(*c));
+    c->p = b;
+    c->serial = serial++;
+    return c;
+}
+
+static void attr_push(struct attr_set *a, const uint8_t *va)
+{
+    a->n++;
+    if (args.dedup == 0) return;
+    char buf[2];
+    const char *v = aux_str(va, buf);
+    if (args.hll_p) {
+        if (a->hll == NULL) a->hll = hll_init(args.hll_p);
+        hll_add(a->hll, hll_hash(v));
+        return;
+    }
+    uint64_t x = pack_dna(v);
+    if (x == 0) {
+        if (a->vals == NULL) a->vals = dict_init();
+        dict_push(a->vals, v);
     }
     else {
-        id = dict_push(cnt->bc_dict, name);
-        if (dict_size(cnt->bc_dict) >= cnt->m) {
-            cnt->m = cnt->m == 0 ? 1024 : cnt->m<<1;
-            cnt->counts = realloc(cnt->counts, cnt->m*sizeof(struct counts_per_bcode));
-            // init new allocated records
-            int i;
-            for (i = cnt->n; i < cnt->m; ++i) {
-                struct counts_per_bcode *bc = &cnt->counts[i];
-                memset(bc, 0, sizeof(*bc));
+        if (a->keys == NULL) a->keys = kh_init(key);
+        int ret;
+        kh_put(key, a->keys, x, &ret);
+    }
+}
+
+static void *attr_run(void *data, void *opts)
+{
+    struct attr_chunk *c = data;
+    struct counts *cnt = counts_get();
+    char buf[2];
+    int i, j;
+    for (i = 0; i < c->p->n; ++i) {
+        bam1_t *b = &c->p->bam[i];
+        if (b->core.flag & BAM_FSECONDARY) continue; // filter secondary alignments
+
+        /* For raw reads per barcode, unmapped reads also included. */
+        //if (b->core.tid < 0) continue;
+
+        // if set qual threshold, only keep confidently mapped reads
+        if (b->core.qual < args.qual_thres) continue;
+
+        if (args.all_tags == 1) { // check if all tags existed
+            for (j = 0; j < args.n_tag; ++j)
+                if (bam_aux_get(b, args.tags[j]) == NULL) break;
+            if (j < args.n_tag) continue;
+        }
+
+        uint8_t *tag = bam_aux_get(b, args.cb_tag);
+        if (!tag) continue; // skip records without cell Barcodes
+
+        uint64_t pos = c->serial<<32 | i;
+        const char *name = aux_str(tag, buf);
+        int id = -1; // individual index
+        if (args.is_dyn_alloc == 0) {
+            id = dict_query(cnt->bc_dict, name);
+            if (id == -1) continue;
+        }
+        else {
+            int n = dict_size(cnt->bc_dict);
+            id = dict_push1(cnt->bc_dict, name);
+            counts_resize(cnt, id);
+            if (id == n) cnt->bc_first[id] = pos;
+        }
+        cnt->raw[id]++;
+
+        int grp_id = 0; // group index
+        if (args.group_tag) {
+            uint8_t *g = bam_aux_get(b, args.group_tag);
+            if (!g) continue; // record counted, tags not
+            int n = dict_size(cnt->group_dict);
+            grp_id = dict_push(cnt->group_dict, aux_str(g, buf));
+            if (grp_id == n) {
+                if (n == cnt->m_grp) {
+                    cnt->m_grp = cnt->m_grp == 0 ? 64 : cnt->m_grp<<1;
+                    cnt->grp_first = realloc(cnt->grp_first, cnt->m_grp*sizeof(uint64_t));
+                }
+                cnt->grp_first[n] = pos;
             }
-            cnt->n = cnt->m;
+        }
+        struct counts_per_bcode *bc = &cnt->counts[id];
+        int alloc_group = grp_id+1;
+        if (bc->m < alloc_group*args.n_tag) {
+            bc->m = alloc_group*args.n_tag;
+            bc->counts = realloc(bc->counts, bc->m*sizeof(void*));
+            int k;
+            for (k = bc->n; k < bc->m; ++k) bc->counts[k] = NULL;
+            bc->n = bc->m;
+        }
+        for (j = 0; j < args.n_tag; ++j) {
+            uint8_t *va = bam_aux_get(b, args.tags[j]);
+            if (!va) continue;
+            int idx = grp_id*args.n_tag+j;
+            if (bc->counts[idx] == NULL) bc->counts[idx] = calloc(1, sizeof(struct attr_set));
+            attr_push(bc->counts[idx], va);
         }
     }
-    struct counts_per_bcode *bc = &cnt->counts[id];
-    
-    // dynamic allocate group tag
-    int grp_id = 0; // group index
-    
-    if (args.group_tag) {
-        uint8_t *tag = bam_aux_get(b, args.group_tag);
-        if (!tag) return 1;
-        grp_id = dict_push(cnt->group_dict, (char*)(tag+1));
-    }
-    int alloc_group = grp_id+1;
+    bam_pool_recycle(c->p);
+    free(c);
+    return NULL;
+}
 
-    if (bc->m < alloc_group*args.n_tag) {
-        bc->m = alloc_group*args.n_tag;
-        bc->counts = realloc(bc->counts, bc->m*sizeof(void*));
-        int i;
-        for (i = bc->n; i < bc->m; ++i) bc->counts[i] = NULL;
-        bc->n = bc->m;
+struct first_name {
+    const char *name;
+    uint64_t first;
+};
+static int first_cmp(const void *a, const void *b)
+{
+    const struct first_name *x = a, *y = b;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+// Index names of all threads in order of first record into D. Return map of
+// thread local index to merged one, per thread in list order.
+static int **merge_names(struct dict *D, int group)
+{
+    struct dict *all = dict_init();
+    struct first_name *a = NULL;
+    int n = 0, m = 0, n_local = 0;
+    struct counts *c;
+    for (c = locals.head; c; c = c->next) n_local++;
+    int **map = calloc(n_local, sizeof(int*));
+    int t, i;
+    for (c = locals.head, t = 0; c; c = c->next, ++t) {
+        struct dict *L = group ? c->group_dict : c->bc_dict;
+        const uint64_t *first = group ? c->grp_first : c->bc_first;
+        map[t] = malloc((dict_size(L) > 0 ? dict_size(L) : 1)*sizeof(int));
+        for (i = 0; i < dict_size(L); ++i) {
+            int idx = dict_push(all, dict_name(L, i));
+            if (idx == n) {
+                if (n == m) {
+                    m = m == 0 ? 1024 : m<<1;
+                    a = realloc(a, m*sizeof(struct first_name));
+                }
+                a[n].name = dict_name(all, idx);
+                a[n++].first = first[i];
+            }
+            else if (first[i] < a[idx].first) a[idx].first = first[i];
+            map[t][i] = idx;
+        }
     }
-    for (i = 0; i < args.n_tag; ++i) {
-        uint8_t *va = bam_aux_get(b, args.tags[i]);
-        if (!va) continue;
-        int idx = grp_id*args.n_tag+i;
-        struct dict *d = bc->counts[idx];
-        if (d == NULL) d = dict_init();
-        dict_push(d, (char*)(va+1));
-        bc->counts[idx] = d;
+    qsort(a, n, sizeof(struct first_name), first_cmp);
+    for (i = 0; i < n; ++i) dict_push1(D, a[i].name);
+    int *order = malloc((n > 0 ? n : 1)*sizeof(int));
+    for (i = 0; i < n; ++i) order[i] = dict_query(D, dict_name(all, i));
+    for (t = 0, c = locals.head; c; c = c->next, ++t) {
+        struct dict *L = group ? c->group_dict : c->bc_dict;
+        for (i = 0; i < dict_size(L); ++i) map[t][i] = order[map[t][i]];
     }
-    
-    return 0;
+    free(order);
+    free(a);
+    dict_destroy(all);
+    return map;
+}
+
+// Merge counts of all threads into cnt.
+static void counts_merge(struct counts *cnt)
+{
+    int **bc_map = args.is_dyn_alloc ? merge_names(cnt->bc_dict, 0) : NULL;
+    int **grp_map = args.group_tag ? merge_names(cnt->group_dict, 1) : NULL;
+    counts_resize(cnt, dict_size(cnt->bc_dict) > 0 ? dict_size(cnt->bc_dict)-1 : 0);
+    int t = 0;
+    while (locals.head) {
+        struct counts *c = locals.head;
+        int i, j;
+        for (i = 0; i < dict_size(c->bc_dict); ++i) {
+            int id = bc_map ? bc_map[t][i] : i;
+            struct counts_per_bcode *b0 = &c->counts[i];
+            struct counts_per_bcode *b1 = &cnt->counts[id];
+            cnt->raw[id] += c->raw[i];
+            for (j = 0; j < b0->n; ++j) {
+                if (b0->counts[j] == NULL) continue;
+                int idx = grp_map ? grp_map[t][j/args.n_tag]*args.n_tag + j%args.n_tag : j;
+                if (b1->m <= idx) {
+                    int m = (idx/args.n_tag+1)*args.n_tag;
+                    b1->counts = realloc(b1->counts, m*sizeof(void*));
+                    int k;
+                    for (k = b1->m; k < m; ++k) b1->counts[k] = NULL;
+                    b1->m = b1->n = m;
+                }
+                // the first thread holding a set hands it over
+                if (b1->counts[idx] == NULL) {
+                    b1->counts[idx] = b0->counts[j];
+                    b0->counts[j] = NULL;
+                }
+                else {
+                    attr_set_merge(b1->counts[idx], b0->counts[j]);
+                    attr_set_destroy(b0->counts[j]);
+                }
+            }
+            free(b0->counts);
+            b0->counts = NULL;
+            b0->n = b0->m = 0;
+        }
+        if (bc_map) free(bc_map[t]);
+        if (grp_map) free(grp_map[t]);
+        // free each thread once merged, keeps peak memory low
+        locals.head = c->next;
+        counts_destroy(c);
+        free(c);
+        t++;
+    }
+    free(bc_map);
+    free(grp_map);
 }
 
 int generat_outputs(struct counts *cnt)
@@ -231,14 +538,13 @@ int generat_outputs(struct counts *cnt)
     
     for (i = 0; i < dict_size(cnt->bc_dict); ++i) {
         struct counts_per_bcode *bcode = &cnt->counts[i];
-        fprintf(out, "%s\t%u", dict_name(cnt->bc_dict, i), dict_count(cnt->bc_dict, i) );
+        fprintf(out, "%s\t%u", dict_name(cnt->bc_dict, i), cnt->raw[i]);
 
         int j;
         for (j = 0; j < w; ++j) {
             if ( j >= bcode->n) fputs("\t0", out);
             else {
-                fprintf(out, "\t%u", bcode->counts[j] == NULL ? 0:
-                        args.dedup == 1 ? dict_size(bcode->counts[j]) : dict_count_sum(bcode->counts[j]));
+                fprintf(out, "\t%u", bcode->counts[j] == NULL ? 0 : attr_set_count(bcode->counts[j]));
             }
         }
         fputc('\n', out);
@@ -265,55 +571,37 @@ int bam_count_attr(int argc, char *argv[])
     bam_hdr_t *hdr = sam_hdr_read(fp);
     CHECK_EMPTY(hdr, "Failed to open header.");
 
-    hts_set_threads(fp, args.file_th);
+    gpool_attach_hts(fp, gpool_normal);
+    args.fp = fp;
+    args.hdr = hdr;
     
     struct counts *cnt = malloc(sizeof(*cnt));
     memset(cnt, 0, sizeof(*cnt));
-    cnt->bc_dict = dict_init();
     if (args.group_tag) cnt->group_dict = dict_init();
     
     if (args.barcode_fname) {
-        dict_read(cnt->bc_dict, args.barcode_fname);
-        cnt->m = dict_size(cnt->bc_dict);
-        cnt->n = cnt->m;
-        cnt->counts = malloc( cnt->m *sizeof(struct counts_per_bcode));
-        int i;
-        for (i = 0; i < cnt->n; ++i) {
-            struct counts_per_bcode *bcode = &cnt->counts[i];
-            memset(bcode, 0, sizeof(struct counts_per_bcode));
-        }
+        locals.list = dict_init();
+        dict_read(locals.list, args.barcode_fname);
+        cnt->bc_dict = locals.list;
         args.is_dyn_alloc = 0;
     }
-    
-    bam1_t *b;
-    int ret;
-    b = bam_init1();
-
-    while ((ret = sam_read1(fp, hdr, b)) >= 0) {
-        if (b->core.flag & BAM_FSECONDARY) continue; // filter secondary alignments
-
-        /* For raw reads per barcode, unmapped reads also included. */
-        //if (b->core.tid < 0) continue;
+    else cnt->bc_dict = dict_init();
 
-        // if set qual threshold, only keep confidently mapped reads
-        if (b->core.qual < args.qual_thres) continue;
-        
-        counts_push(cnt, b);
-    }
+    bam_pool_slab(1);
+    pipeline_run(args.n_thread*2, attr_read, attr_run, NULL, NULL);
+    counts_merge(cnt);
 
-    bam_destroy1(b);
     bam_hdr_destroy(hdr);
     sam_close(fp);
-
-    if (ret != -1) warnings("Truncated file?");
+    gpool_destroy();
+    bam_pool_cache_clear();
 
     generat_outputs(cnt);
     
     counts_destroy(cnt);
+    if (locals.list) dict_destroy(locals.list);
+    free(cnt);
 
     LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
     return 0;    
 }
-
-
-        
@@ -6,6 +6,9 @@
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "htslib/bgzf.h"
+#include "stats.h"
+#include "thread.h"
+#include "bam_pool.h"
 #include <sys/stat.h>
 #include "pisa_version.h" // mex output
 
@@ -25,7 +28,8 @@ static struct args {
     int mapq_thres;
     int use_dup;
     int enable_corr_umi;
-    int n_thread;
+    int n_thread; // size of global thread pool
+    int chunk_size; // records per pipeline chunk
     int one_hit;
     
     htsFile *fp_in;
@@ -49,6 +53,7 @@ static struct args {
     .enable_corr_umi = 0,
     .one_hit         = 0,
     .n_thread        = 5,
+    .chunk_size      = 100000,
     .fp_in           = NULL,
     .hdr             = NULL,
     .n_record        = 0
@@ -63,6 +68,20 @@ struct feature_counts {
     struct dict *features;
 };
 
+// Tags of one counted record, point into the records of its chunk.
+struct count_hit {
+    int cell_id; // -1 if no whitelist, barcode is pushed by writer
+    const char *cell;
+    const char *anno;
+    const char *umi;
+};
+
+struct count_chunk {
+    struct bam_pool *p;
+    int n;
+    struct count_hit *hits;
+};
+
 
 static void memory_release()
 {
@@ -94,6 +113,7 @@ static int parse_args(int argc, char **argv)
     int i;
     const char *mapq = NULL;
     const char *n_thread = NULL;
+    const char *file_th = NULL;
     for (i = 1; i < argc;) {
         const char *a = argv[i++];
         const char **var = 0;
@@ -105,7 +125,8 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-o") == 0) var = &args.output_fname;
         else if (strcmp(a, "-outdir") == 0) var = &args.outdir;
         else if (strcmp(a, "-q") == 0) var = &mapq;
-        else if (strcmp(a, "-@") == 0) var = &n_thread;
+        else if (strcmp(a, "-t") == 0) var = &n_thread;
+        else if (strcmp(a, "-@") == 0) var = &file_th;
         else if (strcmp(a, "-dup") == 0) {
             args.use_dup = 1;
             continue;
@@ -138,7 +159,11 @@ static int parse_args(int argc, char **argv)
     if (args.tag == 0) error("No cell barcode specified.");
     if (args.anno_tag == 0) error("No anno tag specified.");
 
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (n_thread == NULL) n_thread = file_th;
     if (n_thread) args.n_thread = str2int((char*)n_thread);
+    if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
 
     if (args.outdir) {
          struct stat sb;
@@ -152,7 +177,7 @@ static int parse_args(int argc, char **argv)
     if (type.format != bam && type.format != sam)
         error("Unsupported input format, only support BAM/SAM/CRAM format.");
 
-    hts_set_threads(args.fp_in, args.n_thread);
+    gpool_attach_hts(args.fp_in, gpool_normal);
     
     args.hdr = sam_hdr_read(args.fp_in);
     CHECK_EMPTY(args.hdr, "Failed to open header.");
@@ -207,43 +232,53 @@ int *str_split(kstring_t *str, int *_n)
     *_n = n;
     return s;
 }
-int count_matrix_core(bam1_t *b)
+// Filter record and pick its tags, return 1 if record is skipped. Barcode
+// dicts are not changed here, so it is safe to call from workers.
+static int count_hit_parse(bam1_t *b, struct count_hit *h)
 {
+    bam1_core_t *c = &b->core;
+    if (c->tid <= -1 || c->tid > args.hdr->n_targets || (c->flag & BAM_FUNMAP)) return 1;
+    if (c->qual < args.mapq_thres) return 1;
+    if (args.use_dup == 0 && c->flag & BAM_FDUP) return 1;
+
     uint8_t *tag = bam_aux_get(b, args.tag);
     if (!tag) return 1;
-        
     uint8_t *anno_tag = bam_aux_get(b, args.anno_tag);
     if (!anno_tag) return 1;
-
-            
+    h->umi = NULL;
     if (args.umi_tag) {
         uint8_t *umi_tag = bam_aux_get(b, args.umi_tag);
         if (!umi_tag) return 1;
+        h->umi = (char*)(umi_tag+1);
     }
+    h->cell = (char*)(tag+1);
+    h->anno = (char*)(anno_tag+1);
 
-    int cell_id;
+    h->cell_id = -1;
     if (args.whitelist_fname) {
-        cell_id = dict_query(args.barcodes, (char*)(tag+1));
-        if (cell_id == -1) return 1;
-    }
-    else {
-        cell_id = dict_push(args.barcodes, (char*)(tag+1));
+        h->cell_id = dict_query(args.barcodes, h->cell);
+        if (h->cell_id == -1) return 1;
     }
 
+    // Sometime two or more genes or functional regions can overlapped with each other, if default PISA counts the reads for both of these regions.
+    // But if -one-hit set, these reads will be filtered.
+    if (args.one_hit == 1 && strpbrk(h->anno, ",;")) return 1;
+
+    return 0;
+}
+// Count one record, called in input order so ids of barcodes, features and
+// UMIs are the same as a single thread run.
+static void count_hit_push(struct count_hit *h)
+{
+    int cell_id = h->cell_id;
+    if (cell_id == -1) cell_id = dict_push(args.barcodes, h->cell);
+
     // for each feature
     kstring_t str = {0,0,0};
-    kputs((char*)(anno_tag+1), &str);
+    kputs(h->anno, &str);
     int n_gene;
     int *s = str_split(&str, &n_gene); // seperator ; or ,
 
-    // Sometime two or more genes or functional regions can overlapped with each other, if default PISA counts the reads for both of these regions.
-    // But if -one-hit set, these reads will be filtered.
-    if (args.one_hit == 1 && n_gene >1) {
-        free(str.s);
-        free(s);
-        return 1;
-    }
-    
     int i;
     for (i = 0; i < n_gene; ++i) {
         // Features (Gene or Region)
@@ -277,12 +312,9 @@ int count_matrix_core(bam1_t *b)
             dict_assign_value(v->features, idx0, vv);
         }
         
-        if (args.umi_tag) {
-            uint8_t *umi_tag = bam_aux_get(b, args.umi_tag);
-            assert(umi_tag);
-            char *val = (char*)(umi_tag+1);
+        if (h->umi) {
             if (vv->umi == NULL) vv->umi = dict_init();
-            dict_push(vv->umi, val);
+            dict_push(vv->umi, (char*)h->umi);
         }
         else {
             vv->count++;
@@ -290,7 +322,39 @@ int count_matrix_core(bam1_t *b)
     }
     free(str.s);
     free(s);
-    return 0;
+}
+
+static void *count_read(void *opts)
+{
+    struct bam_pool *p = bam_pool_create();
+    bam_read_pool(p, args.fp_in, args.hdr, args.chunk_size);
+    if (p->n == 0) {
+        bam_pool_recycle(p);
+        return NULL;
+    }
+    struct count_chunk *c = malloc(sizeof(*c));
+    c->p = p;
+    c->n = 0;
+    c->hits = NULL;
+    return c;
+}
+static void *count_run(void *data, void *opts)
+{
+    struct count_chunk *c = data;
+    c->hits = malloc(c->p->n*sizeof(struct count_hit));
+    int i;
+    for (i = 0; i < c->p->n; ++i)
+        if (count_hit_parse(&c->p->bam[i], &c->hits[c->n]) == 0) c->n++;
+    return c;
+}
+static void count_write(void *data, void *opts)
+{
+    struct count_chunk *c = data;
+    int i;
+    for (i = 0; i < c->n; ++i) count_hit_push(&c->hits[i]);
+    free(c->hits);
+    bam_pool_recycle(c->p);
+    free(c);
 }
 
 static void update_counts()
@@ -372,8 +436,8 @@ static void write_outs()
         kputs("matrix.mtx.gz", &mex_str);
         
         BGZF *barcode_fp = bgzf_open(barcode_str.s, "w");
-        bgzf_mt(barcode_fp, args.n_thread, 256);
         CHECK_EMPTY(barcode_fp, "%s : %s.", barcode_str.s, strerror(errno));
+        gpool_attach_bgzf(barcode_fp, gpool_high);
         
         int i;
 
@@ -389,8 +453,8 @@ static void write_outs()
 
         str.l = 0;
         BGZF *feature_fp = bgzf_open(feature_str.s, "w");
-        bgzf_mt(feature_fp, args.n_thread, 256);
         CHECK_EMPTY(feature_fp, "%s : %s.", feature_str.s, strerror(errno));
+        gpool_attach_bgzf(feature_fp, gpool_high);
         for (i = 0; i < n_feature; ++i) {
             kputs(dict_name(args.features,i), &str);
             kputc('\n', &str);
@@ -405,7 +469,7 @@ static void write_outs()
         BGZF *mex_fp = bgzf_open(mex_str.s, "w");
         CHECK_EMPTY(mex_fp, "%s : %s.", mex_str.s, strerror(errno));
         
-        bgzf_mt(mex_fp, args.n_thread, 256);
+        gpool_attach_bgzf(mex_fp, gpool_high);
         kputs("%%MatrixMarket matrix coordinate integer general\n", &str);
         kputs("% Generated by PISA ", &str);
         kputs(PISA_VERSION, &str);
@@ -480,33 +544,16 @@ int count_matrix(int argc, char **argv)
     t_real = realtime();
     if (parse_args(argc, argv)) return bam_count_usage();
         
-    bam1_t *b;
-
-    int ret;
-    b = bam_init1();
-    
-    for (;;) {
-        ret = sam_read1(args.fp_in, args.hdr, b);
-        if (ret < 0) break;
-                
-        bam1_core_t *c;
-        c = &b->core;
-
-        if (c->tid <= -1 || c->tid > args.hdr->n_targets || (c->flag & BAM_FUNMAP)) continue;
-        if (c->qual < args.mapq_thres) continue;
-        if (args.use_dup == 0 && c->flag & BAM_FDUP) continue;
-        count_matrix_core(b);
-    }
-    
-    bam_destroy1(b);
-    
-    if (ret != -1) warnings("Truncated file?");   
+    // workers filter records and pick tags, counts are updated in input order
+    pipeline_run(args.n_thread*2, count_read, count_run, count_write, NULL);
 
     update_counts();
 
     write_outs();
     
     memory_release();
+    bam_pool_cache_clear();
+    gpool_destroy();
     
     LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
     return 0;
@@ -1,23 +1,64 @@
 #include "utils.h"
 #include "htslib/hts.h"
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
 #include "htslib/kstring.h"
 #include "number.h"
+#include "dict.h"
+#include "bam_pool.h"
+#include "thread.h"
+#include "stats.h"
+
+// Columnar binary output of -bin, little-endian, offsets 8-byte aligned so
+// every column can be mapped as a numpy array:
+//   header   magic, number of columns and rows
+//   columns  one xt_column per tag
+//   codes    n_row codes of each column, width 1, 2 or 4 bytes
+//   dicts    values of each column, NUL-terminated, in code order
+//
+// Code 0 is a missing tag and its value is the empty string, other values are
+// coded from 1 in order of first appearance.
+#define XT_MAGIC    "PISAXT\1"
+#define XT_VERSION  1
+
+struct xt_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_col;
+    uint64_t n_row;
+};
+
+struct xt_column {
+    char tag[4];
+    uint32_t width;    // bytes per code
+    uint64_t n_val;    // dictionary entries, include missing
+    uint64_t codes;    // offsets from beginning of file
+    uint64_t dict;
+    uint64_t dict_len; // bytes
+};
 
 static struct args {
     const char *input_fname;
     const char *output_fname;
-    int file_th;
+    const char *bin_fname;
+    int n_thread; // size of global thread pool, and workers
     int n_tag;
     int print_rname;
-    char **tags;    
+    char **tags;
+    htsFile *fp;
+    bam_hdr_t *hdr;
+    int chunk_size;
 } args = {
     .input_fname = NULL,
     .output_fname = NULL,
-    .file_th = 4,
+    .bin_fname = NULL,
+    .n_thread = 4,
     .n_tag = 0,
     .print_rname = 0,
     .tags = NULL,
+    .fp = NULL,
+    .hdr = NULL,
+    .chunk_size = 10000, // records are streamed, keep chunks small
 };
 
 extern int bam_extract_usage();
@@ -26,14 +67,17 @@ static int parse_args(int argc, char **argv)
 {
     int i;
     const char *file_thread = NULL;
+    const char *thread = NULL;
     const char *tags = NULL;
     for (i = 1; i < argc;) {
         const char *a = argv[i++];
         const char **var = 0;
         if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) return 1;
-        if (strcmp(a, "-tags") == 0) var = &tags;        
+        if (strcmp(a, "-tags") == 0) var = &tags;
         else if (strcmp(a, "-o") == 0) var = &args.output_fname;
+        else if (strcmp(a, "-bin") == 0) var = &args.bin_fname;
         else if (strcmp(a, "-@") == 0) var = &file_thread;
+        else if (strcmp(a, "-t") == 0) var = &thread;
         else if (strcmp(a, "-n") == 0) {
             args.print_rname = 1;
             continue;
@@ -53,7 +97,12 @@ static int parse_args(int argc, char **argv)
     if (args.input_fname == 0) error("No input bam.");
     // if (args.output_fname == 0) error("No output file specified.");
     if (tags == 0) error("No tags specified.");
-    if (file_thread) args.file_th = str2int((char*)file_thread);
+    if (args.bin_fname && args.output_fname) error("-o and -bin cannot be used together.");
+    if (args.bin_fname && args.print_rname) error("-n is not supported with -bin.");
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_thread;
+    if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
 
     kstring_t str = {0,0,0};
     kputs(tags, &str);
@@ -67,12 +116,265 @@ static int parse_args(int argc, char **argv)
     }
     free(str.s);
     free(s);
-    
+
     return 0;
 }
 
+// Format value of a tag, numbers are printed like samtools.
+static void aux_format(const uint8_t *tag, kstring_t *str)
+{
+    switch (*tag) {
+        case 'A':
+            kputc(tag[1], str);
+            break;
+        case 'Z': case 'H':
+            kputs((char*)(tag+1), str);
+            break;
+        case 'c': case 'C': case 's': case 'S': case 'i': case 'I':
+            kputll(bam_aux2i(tag), str);
+            break;
+        case 'f': case 'd':
+            ksprintf(str, "%g", bam_aux2f(tag));
+            break;
+        case 'B': {
+            uint32_t i, n = bam_auxB_len(tag);
+            kputc(tag[1], str);
+            for (i = 0; i < n; ++i) {
+                kputc(',', str);
+                if (tag[1] == 'f') ksprintf(str, "%g", bam_auxB2f(tag, i));
+                else kputll(bam_auxB2i(tag, i), str);
+            }
+            break;
+        }
+        default:
+            error("Unknown tag type %c.", *tag);
+    }
+}
+
+// Workers format a chunk of records, the writer outputs chunks in input
+// order. For TSV, str holds the lines; for -bin, str holds NUL-terminated
+// values and off their offsets, -1 if missing.
+struct extract_chunk {
+    struct bam_pool *p;
+    kstring_t str;
+    int n; // records kept
+    int *off;
+};
+
+static void *extract_read(void *opts)
+{
+    struct bam_pool *b = bam_pool_create();
+    bam_read_pool(b, args.fp, args.hdr, args.chunk_size);
+    if (b->n == 0) {
+        bam_pool_recycle(b);
+        return NULL;
+    }
+    struct extract_chunk *c = malloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->p = b;
+    return c;
+}
+
+static void *extract_run(void *data, void *opts)
+{
+    struct extract_chunk *c = data;
+    kstring_t *str = &c->str;
+    if (args.bin_fname) c->off = malloc(c->p->n*args.n_tag*sizeof(int));
+    int i, j;
+    for (i = 0; i < c->p->n; ++i) {
+        bam1_t *b = &c->p->bam[i];
+        size_t l = str->l;
+        int is_empty = 1;
+        if (args.bin_fname) {
+            int *off = c->off + c->n*args.n_tag;
+            for (j = 0; j < args.n_tag; ++j) {
+                uint8_t *tag = bam_aux_get(b, args.tags[j]);
+                if (!tag) {
+                    off[j] = -1;
+                    continue;
+                }
+                is_empty = 0;
+                off[j] = str->l;
+                aux_format(tag, str);
+                kputc('\0', str);
+            }
+        }
+        else {
+            if (args.print_rname) {
+                kputs(bam_get_qname(b), str);
+                kputc('\t', str);
+            }
+            for (j = 0; j < args.n_tag; ++j) {
+                if (j) kputc('\t', str);
+                uint8_t *tag = bam_aux_get(b, args.tags[j]);
+                if (!tag) kputc('.', str);
+                else {
+                    is_empty = 0;
+                    aux_format(tag, str);
+                }
+            }
+            kputc('\n', str);
+        }
+        if (is_empty) str->l = l; // skip records without any tag
+        else c->n++;
+    }
+    bam_pool_recycle(c->p);
+    c->p = NULL;
+    return c;
+}
+
+// Codes of each column are spooled to a temporary file next to the output,
+// and copied into place once dictionaries are complete.
+struct bin_writer {
+    uint64_t n_row;
+    struct dict **vals;
+    FILE **tmp;
+    uint32_t *buf;
+};
+
+struct extract_out {
+    BGZF *fp;
+    struct bin_writer *bin;
+};
+
+static char *tmp_name(int col)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.%s.tmp", args.bin_fname, args.tags[col]);
+    return str.s;
+}
+
+static struct bin_writer *bin_init()
+{
+    struct bin_writer *w = malloc(sizeof(*w));
+    w->n_row = 0;
+    w->vals = malloc(args.n_tag*sizeof(struct dict*));
+    w->tmp = malloc(args.n_tag*sizeof(FILE*));
+    w->buf = malloc(args.chunk_size*sizeof(uint32_t));
+    int i;
+    for (i = 0; i < args.n_tag; ++i) {
+        w->vals[i] = dict_init();
+        char *fn = tmp_name(i);
+        w->tmp[i] = fopen(fn, "w+b");
+        CHECK_EMPTY(w->tmp[i], "%s : %s.", fn, strerror(errno));
+        unlink(fn); // removed on close
+        free(fn);
+    }
+    return w;
+}
+
+static void bin_push(struct bin_writer *w, struct extract_chunk *c)
+{
+    int i, j;
+    for (j = 0; j < args.n_tag; ++j) {
+        for (i = 0; i < c->n; ++i) {
+            int off = c->off[i*args.n_tag+j];
+            w->buf[i] = off == -1 ? 0 : dict_push(w->vals[j], c->str.s + off) + 1;
+        }
+        if (fwrite(w->buf, sizeof(uint32_t), c->n, w->tmp[j]) != c->n) error("Failed to write temporary file.");
+    }
+    w->n_row += c->n;
+}
+
+static size_t align8(size_t l)
+{
+    return (l + 7) & ~(size_t)7;
+}
+
+static void bin_close(struct bin_writer *w)
+{
+    struct xt_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, XT_MAGIC, 8);
+    h.version = XT_VERSION;
+    h.n_col = args.n_tag;
+    h.n_row = w->n_row;
+
+    struct xt_column *cols = calloc(args.n_tag, sizeof(struct xt_column));
+    uint64_t off = align8(sizeof(h) + args.n_tag*sizeof(struct xt_column));
+    int i, j;
+    for (j = 0; j < args.n_tag; ++j) {
+        struct xt_column *c = &cols[j];
+        memcpy(c->tag, args.tags[j], 2);
+        c->n_val = dict_size(w->vals[j]) + 1;
+        c->width = c->n_val <= UINT8_MAX+1 ? 1 : c->n_val <= UINT16_MAX+1 ? 2 : 4;
+        c->codes = off;
+        off += align8(h.n_row*c->width);
+    }
+    for (j = 0; j < args.n_tag; ++j) {
+        struct xt_column *c = &cols[j];
+        c->dict = off;
+        c->dict_len = 1;
+        for (i = 0; i < dict_size(w->vals[j]); ++i) c->dict_len += strlen(dict_name(w->vals[j], i)) + 1;
+        off += align8(c->dict_len);
+    }
+
+    FILE *fo = fopen(args.bin_fname, "wb");
+    CHECK_EMPTY(fo, "%s : %s.", args.bin_fname, strerror(errno));
+    static const char pad[8] = {0};
+    if (fwrite(&h, sizeof(h), 1, fo) != 1 ||
+        fwrite(cols, sizeof(struct xt_column), args.n_tag, fo) != args.n_tag ||
+        fwrite(pad, 1, cols[0].codes - sizeof(h) - args.n_tag*sizeof(struct xt_column), fo) != cols[0].codes - sizeof(h) - args.n_tag*sizeof(struct xt_column))
+        error("Failed to write %s.", args.bin_fname);
+
+    // narrow spooled codes to column width
+    uint8_t *out = malloc(args.chunk_size*sizeof(uint32_t));
+    for (j = 0; j < args.n_tag; ++j) {
+        struct xt_column *c = &cols[j];
+        rewind(w->tmp[j]);
+        size_t n;
+        while ((n = fread(w->buf, sizeof(uint32_t), args.chunk_size, w->tmp[j])) > 0) {
+            size_t k;
+            if (c->width == 1) for (k = 0; k < n; ++k) out[k] = w->buf[k];
+            else if (c->width == 2) for (k = 0; k < n; ++k) ((uint16_t*)out)[k] = w->buf[k];
+            else memcpy(out, w->buf, n*sizeof(uint32_t));
+            if (fwrite(out, c->width, n, fo) != n) error("Failed to write %s.", args.bin_fname);
+        }
+        if (ferror(w->tmp[j])) error("Failed to read temporary file.");
+        fclose(w->tmp[j]);
+        size_t l = align8(h.n_row*c->width) - h.n_row*c->width;
+        if (fwrite(pad, 1, l, fo) != l) error("Failed to write %s.", args.bin_fname);
+    }
+    free(out);
+
+    for (j = 0; j < args.n_tag; ++j) {
+        struct xt_column *c = &cols[j];
+        if (fputc('\0', fo) == EOF) error("Failed to write %s.", args.bin_fname);
+        for (i = 0; i < dict_size(w->vals[j]); ++i) {
+            char *s = dict_name(w->vals[j], i);
+            if (fwrite(s, 1, strlen(s)+1, fo) != strlen(s)+1) error("Failed to write %s.", args.bin_fname);
+        }
+        size_t l = align8(c->dict_len) - c->dict_len;
+        if (fwrite(pad, 1, l, fo) != l) error("Failed to write %s.", args.bin_fname);
+        dict_destroy(w->vals[j]);
+    }
+    if (fclose(fo)) error("%s : %s.", args.bin_fname, strerror(errno));
+
+    free(cols);
+    free(w->vals);
+    free(w->tmp);
+    free(w->buf);
+    free(w);
+}
+
+static void extract_write(void *data, void *opts)
+{
+    struct extract_out *o = opts;
+    struct extract_chunk *c = data;
+    if (o->bin) bin_push(o->bin, c);
+    else if (c->str.l && bgzf_write(o->fp, c->str.s, c->str.l) != c->str.l)
+        error("Failed to write %s.", args.output_fname ? args.output_fname : "-");
+    stats_output(c->str.l);
+    if (c->str.m) free(c->str.s);
+    free(c->off);
+    free(c);
+}
+
 int bam_extract_tags(int argc, char **argv)
 {
+    double t_real;
+    t_real = realtime();
+
     if (parse_args(argc, argv)) return bam_extract_usage();
     htsFile *in  = hts_open(args.input_fname, "r");
     CHECK_EMPTY(in, "%s : %s.", args.input_fname, strerror(errno));
@@ -82,46 +384,36 @@ int bam_extract_tags(int argc, char **argv)
 
     bam_hdr_t *hdr = sam_hdr_read(in);
     CHECK_EMPTY(hdr, "Failed to open header.");
-    hts_set_threads(in, args.file_th);
 
-    FILE *out = args.output_fname == NULL ? stdout : fopen(args.output_fname, "w");
-    if (out == NULL) error("%s : %s.", args.output_fname, strerror(errno));
+    gpool_init(args.n_thread);
+    gpool_attach_hts(in, gpool_normal);
+    args.fp = in;
+    args.hdr = hdr;
 
-    int ret;
-    bam1_t *b;
-    b = bam_init1();
-    kstring_t str = {0,0,0};
-    int is_empty;
-    while ((ret = sam_read1(in, hdr, b)) >= 0) {
-        int i;
-        is_empty = 1;
-        str.l = 0;
-        if (args.print_rname) {
-            kputs((char*)b->data, &str);
-            kputc('\t', &str);
-        }
-        for (i = 0; i < args.n_tag; ++i) {
-            if (i) kputc('\t', &str);
-            uint8_t *tag = bam_aux_get(b, args.tags[i]);
-            if (!tag) kputc('.', &str);
-            else {
-                is_empty = 0;
-                if (*tag == 'A') kputc(tag[1], &str);
-                else kputs((char*)(tag+1), &str);
-            }
-        }
-        kputc('\n', &str);
-        if (is_empty==0) fputs(str.s, out);
+    struct extract_out o = { NULL, NULL };
+    if (args.bin_fname) o.bin = bin_init();
+    else {
+        // compress if output ends with .gz
+        const char *fn = args.output_fname;
+        int gz = fn && strlen(fn) > 3 && strcmp(fn + strlen(fn) - 3, ".gz") == 0;
+        o.fp = fn ? bgzf_open(fn, gz ? "w" : "wu") : bgzf_dopen(fileno(stdout), "wu");
+        if (o.fp == NULL) error("%s : %s.", fn ? fn : "-", strerror(errno));
+        if (gz) gpool_attach_bgzf(o.fp, gpool_high);
     }
-    if (str.m) free(str.s);
-    bam_destroy1(b);
-    
-    fclose(out);
+
+    bam_pool_slab(1);
+    pipeline_run(args.n_thread*2, extract_read, extract_run, extract_write, &o);
+
+    if (o.bin) bin_close(o.bin);
+    else if (bgzf_close(o.fp)) error("Failed to close %s.", args.output_fname ? args.output_fname : "-");
     bam_hdr_destroy(hdr);
     sam_close(in);
+    gpool_destroy();
+    bam_pool_cache_clear();
 
     int i;
     for (i = 0; i < args.n_tag; ++i) free(args.tags[i]);
     free(args.tags);
+    LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
     return 0;
 }
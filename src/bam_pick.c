@@ -1,24 +1,40 @@
 // pick alignment reads by cell barcodes
 #include "utils.h"
 #include "number.h"
-//#include "htslib/thread_pool.h"
 #include "barcode_list.h"
 #include "htslib/khash.h"
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
 #include "htslib/khash_str2int.h"
 #include "htslib/kseq.h"
+#include "hfile_internal.h"
 #include "bam_pool.h"
+#include "thread.h"
+#include "dict.h"
+#include "stats.h"
+#include <zlib.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+KSTREAM_INIT(gzFile, gzread, 8193)
 
 static struct args {
     const char *input_fname;
     const char *output_fname;
     const char *barcode_fname;
     const char *tag;
-    int file_th;
-    //int n_thread;
+    const char *split_dir;
+    const char *map_fname;
+    int n_thread; // size of global thread pool, and workers
     struct barcode_list *barcode;
 
+    // split mode
+    struct dict *map;   // barcode to group, from -map
+    int *map_group;     // group index of map barcodes
+    struct dict *groups;
+    int max_open;
+    int64_t mem;
+
     htsFile *in;
     htsFile *out;
     bam_hdr_t *hdr;
@@ -29,22 +45,67 @@ static struct args {
     .output_fname = NULL,
     .barcode_fname = NULL,
     .tag = NULL,
-    .file_th = 4,
-    //.n_thread = 1,
+    .split_dir = NULL,
+    .map_fname = NULL,
+    .n_thread = 1,
     .barcode = NULL,
 
+    .map = NULL,
+    .map_group = NULL,
+    .groups = NULL,
+    .max_open = 256,
+    .mem = 1000000000, // 1G
+
     .in = NULL,
     .out = NULL,
     .hdr = NULL,
-    .chunk_size = 1000000, // 1M
+    .chunk_size = 100000,
 };
 
 extern int pick_usage();
 
+// Two columns per line, barcode and group name.
+static void map_load(const char *fname)
+{
+    gzFile fp = gzopen(fname, "r");
+    CHECK_EMPTY(fp, "%s : %s.", fname, strerror(errno));
+    kstream_t *ks = ks_init(fp);
+    kstring_t str = {0,0,0};
+    int ret, m = 0;
+    args.map = dict_init();
+    while (ks_getuntil(ks, 2, &str, &ret) >= 0) {
+        if (str.l == 0 || str.s[0] == '#') continue;
+        char *p = str.s, *e = str.s + str.l;
+        while (p < e && !isspace(*p)) p++;
+        if (p == e) error("No group for barcode %s.", str.s);
+        *p++ = '\0';
+        while (p < e && isspace(*p)) p++;
+        char *g = p;
+        while (p < e && !isspace(*p)) p++;
+        *p = '\0';
+        if (*g == '\0') error("No group for barcode %s.", str.s);
+        if (strchr(g, '/')) error("Group name should not contain '/'. %s", g);
+        if (dict_query(args.map, str.s) != -1) error("Duplicated barcode %s in %s.", str.s, fname);
+        int idx = dict_push(args.map, str.s);
+        if (idx >= m) {
+            m = m == 0 ? 1024 : m<<1;
+            args.map_group = realloc(args.map_group, m*sizeof(int));
+        }
+        args.map_group[idx] = dict_query(args.groups, g);
+        if (args.map_group[idx] == -1) args.map_group[idx] = dict_push(args.groups, g);
+    }
+    free(str.s);
+    ks_destroy(ks);
+    gzclose(fp);
+    if (dict_size(args.map) == 0) error("Empty map file %s.", fname);
+}
+
 static int parse_args(int argc, char **argv)
 {
     const char *file_th = NULL;
-    //const char *thread = NULL;
+    const char *thread = NULL;
+    const char *max_open = NULL;
+    const char *memory = NULL;
     int i;
     for (i = 1; i < argc; ) {
         const char *a = argv[i++];
@@ -54,8 +115,12 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-tag") == 0) var = &args.tag;
         else if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) return 1;
         else if (strcmp(a, "-@") == 0) var = &file_th;
-        // else if (strcmp(a, "-t") == 0) var = &thread;
-        
+        else if (strcmp(a, "-t") == 0) var = &thread;
+        else if (strcmp(a, "-split") == 0) var = &args.split_dir;
+        else if (strcmp(a, "-map") == 0) var = &args.map_fname;
+        else if (strcmp(a, "-max-open") == 0) var = &max_open;
+        else if (strcmp(a, "-m") == 0) var = &memory;
+
         if (var != 0) {
             if (i == argc) error("Miss an argument after %s.", a);
             *var = argv[i++];
@@ -72,119 +137,393 @@ static int parse_args(int argc, char **argv)
 
     // CHECK_EMPTY(args.barcode_fname, "-list Cell barcode list must be set.");
     CHECK_EMPTY(args.input_fname, "Input BAM file must be set.");
-    CHECK_EMPTY(args.output_fname, "Output BAM file must be set.");
+    CHECK_EMPTY(args.tag, "-tag must be set.");
+    if (args.split_dir) {
+        if (args.output_fname) error("-o and -split are conflicted.");
+    }
+    else {
+        CHECK_EMPTY(args.output_fname, "Output BAM file must be set.");
+        if (args.map_fname) error("-map only works with -split.");
+    }
+
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_th;
+    if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
+    if (max_open) args.max_open = str2int((char*)max_open);
+    if (args.max_open < 1) error("-max-open should be positive.");
+    if (memory) args.mem = human2int(memory);
 
-    if (file_th) args.file_th = str2int((char*)file_th);
-    //if (thread) args.n_thread = str2int((char*)thread);
-    
     if (args.barcode_fname) {
         args.barcode = barcode_init();
         if (barcode_read(args.barcode, args.barcode_fname)) error("Empty barcode");
     }
+    if (args.split_dir) {
+        args.groups = dict_init();
+        if (args.map_fname) map_load(args.map_fname);
+        if (mkdir(args.split_dir, 0755) && errno != EEXIST) error("%s : %s.", args.split_dir, strerror(errno));
+    }
 
     args.in = hts_open(args.input_fname, "r");
     CHECK_EMPTY(args.in, "%s : %s.", args.input_fname, strerror(errno));
     htsFormat type = *hts_get_format(args.in);
     if (type.format != bam && type.format != sam)
         error("Unsupported input format, only support BAM/SAM/CRAM format.");
-
-    args.out = hts_open(args.output_fname, "bw");
-    CHECK_EMPTY(args.out, "%s : %s.", args.output_fname, strerror(errno));
-
-    hts_set_threads(args.in, args.file_th);
-    //hts_set_threads(args.out, args.file_th);
+    gpool_attach_hts(args.in, gpool_normal);
 
     args.hdr = sam_hdr_read(args.in);
     CHECK_EMPTY(args.hdr, "Failed to open header.");
 
-    if (sam_hdr_write(args.out, args.hdr)) error("Failed to write SAM header.");
+    if (args.output_fname) {
+        args.out = hts_open(args.output_fname, "bw");
+        CHECK_EMPTY(args.out, "%s : %s.", args.output_fname, strerror(errno));
+        gpool_attach_hts(args.out, gpool_high);
+        if (sam_hdr_write(args.out, args.hdr)) error("Failed to write SAM header.");
+    }
+    bam_pool_slab(1);
     return 0;
 }
 static void memory_release()
 {
     if (args.barcode)
         barcode_destory(args.barcode);
+    if (args.map) dict_destroy(args.map);
+    free(args.map_group);
+    if (args.groups) dict_destroy(args.groups);
     bam_hdr_destroy(args.hdr);
     sam_close(args.in);
-    sam_close(args.out);
+    if (args.out) sam_close(args.out);
+    gpool_destroy();
+    bam_pool_cache_clear();
+}
+
+// Split output. Workers encode records of each group in a chunk into BGZF
+// blocks; BGZF allows any block boundary, so blocks of later chunks are simply
+// appended. The writer keeps compressed blocks in memory, and appends them to
+// files when buffered over -m. At most -max-open files are open, the least
+// recently used one is closed for a new one. BGZF EOF marker is only written
+// at the end, so files are never closed by htslib.
+static const uint8_t bgzf_eof[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0";
+
+// Records are encoded by bam_write1 into a BGZF writer over an hFILE that
+// appends to a kstring, so long CIGARs move to the CG tag as in normal
+// output. Blocks go to the kstring of the current group; flushed bytes are
+// dropped if none is set, like EOF marker at close.
+struct kstr_hfile {
+    hFILE base;
+    kstring_t *s;
+};
+
+static ssize_t kstr_write(hFILE *fp, const void *buf, size_t n)
+{
+    kstring_t *s = ((struct kstr_hfile*)fp)->s;
+    if (s) kputsn(buf, n, s);
+    return n;
 }
-static void write_out(struct bam_pool *p)
+static int kstr_close(hFILE *fp)
+{
+    return 0;
+}
+static const struct hFILE_backend kstr_backend = { NULL, kstr_write, NULL, NULL, kstr_close };
+
+static BGZF *kstr_open()
+{
+    struct kstr_hfile *fp = (struct kstr_hfile*)hfile_init(sizeof(*fp), "w", 0);
+    if (fp == NULL) error("Failed to init buffer.");
+    fp->base.backend = &kstr_backend;
+    fp->s = NULL;
+    BGZF *z = bgzf_hopen(&fp->base, "w");
+    if (z == NULL) error("Failed to init buffer.");
+    return z;
+}
+// End current block, later writes go to s.
+static void kstr_switch(BGZF *z, kstring_t *s)
+{
+    if (bgzf_flush(z) || hflush(z->fp)) error("Failed to compress.");
+    ((struct kstr_hfile*)z->fp)->s = s;
+}
+static void kstr_close_bgzf(BGZF *z)
+{
+    kstr_switch(z, NULL);
+    if (bgzf_close(z)) error("Failed to compress.");
+}
+
+struct split_file {
+    kstring_t z;    // compressed blocks not written yet
+    FILE *fp;
+    uint64_t used;  // tick of last write
+    int created;
+};
+
+static struct split {
+    kstring_t hdr;  // compressed header
+    struct split_file *f;
+    int n, m;
+    int *open;      // groups of open files
+    int n_open;
+    uint64_t tick;
+    int64_t pending;
+    uint64_t n_reopen;
+} split = {
+    .hdr = {0,0,0},
+    .f = NULL,
+    .n = 0,
+    .m = 0,
+    .open = NULL,
+    .n_open = 0,
+    .tick = 0,
+    .pending = 0,
+    .n_reopen = 0,
+};
+
+static void split_fname(int gid, kstring_t *str)
+{
+    str->l = 0;
+    ksprintf(str, "%s/%s.bam", args.split_dir, dict_name(args.groups, gid));
+}
+
+static FILE *split_open(int gid)
+{
+    struct split_file *f = &split.f[gid];
+    f->used = ++split.tick;
+    if (f->fp) return f->fp;
+
+    int slot = split.n_open;
+    if (split.n_open == args.max_open) {
+        int i;
+        slot = 0;
+        for (i = 1; i < split.n_open; ++i)
+            if (split.f[split.open[i]].used < split.f[split.open[slot]].used) slot = i;
+        struct split_file *old = &split.f[split.open[slot]];
+        if (fclose(old->fp)) error("Failed to close file : %s.", strerror(errno));
+        old->fp = NULL;
+    }
+    else split.n_open++;
+
+    kstring_t str = {0,0,0};
+    split_fname(gid, &str);
+    f->fp = fopen(str.s, f->created ? "ab" : "wb");
+    CHECK_EMPTY(f->fp, "%s : %s.", str.s, strerror(errno));
+    if (f->created) split.n_reopen++;
+    else {
+        if (fwrite(split.hdr.s, 1, split.hdr.l, f->fp) != split.hdr.l) error("Failed to write %s.", str.s);
+        f->created = 1;
+    }
+    free(str.s);
+    split.open[slot] = gid;
+    return f->fp;
+}
+
+static void split_flush1(int gid)
+{
+    struct split_file *f = &split.f[gid];
+    if (f->z.l == 0) return;
+    FILE *fp = split_open(gid);
+    if (fwrite(f->z.s, 1, f->z.l, fp) != f->z.l) error("Failed to write : %s.", strerror(errno));
+    split.pending -= f->z.l;
+    f->z.l = 0;
+}
+
+static int pending_cmp(const void *a, const void *b)
+{
+    size_t x = split.f[*(const int*)a].z.l, y = split.f[*(const int*)b].z.l;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Largest buffers first, until half of the budget is free.
+static void split_flush()
+{
+    int *ids = malloc(split.n*sizeof(int));
+    int i, n = 0;
+    for (i = 0; i < split.n; ++i)
+        if (split.f[i].z.l) ids[n++] = i;
+    qsort(ids, n, sizeof(int), pending_cmp);
+    for (i = 0; i < n && split.pending > args.mem/2; ++i) split_flush1(ids[i]);
+    free(ids);
+}
+
+static void split_init()
+{
+    BGZF *z = kstr_open();
+    kstr_switch(z, &split.hdr);
+    if (bam_hdr_write(z, args.hdr)) error("Failed to encode header.");
+    kstr_close_bgzf(z);
+    split.open = malloc(args.max_open*sizeof(int));
+}
+
+static void split_push(int gid, const kstring_t *z)
+{
+    if (gid >= split.m) {
+        int m = split.m;
+        split.m = gid < 1024 ? 1024 : (gid+1)*2;
+        split.f = realloc(split.f, split.m*sizeof(struct split_file));
+        memset(split.f + m, 0, (split.m - m)*sizeof(struct split_file));
+    }
+    if (gid >= split.n) split.n = gid+1;
+    kputsn(z->s, z->l, &split.f[gid].z);
+    split.pending += z->l;
+    if (split.pending > args.mem) split_flush();
+}
+
+static void split_close()
 {
     int i;
-    for (i = 0; i < p->n; ++i) {
-        bam1_t *b = &p->bam[i];
-        if (b->core.flag & BAM_FQCFAIL) continue;
-        if (sam_write1(args.out, args.hdr, b) == -1) error("Failed to write SAM.");
+    for (i = 0; i < split.n; ++i) {
+        struct split_file *f = &split.f[i];
+        if (f->created == 0 && f->z.l == 0) continue;
+        split_flush1(i);
+        FILE *fp = split_open(i);
+        if (fwrite(bgzf_eof, 1, 28, fp) != 28) error("Failed to write : %s.", strerror(errno));
+        if (fclose(fp)) error("Failed to close file : %s.", strerror(errno));
+        f->fp = NULL;
+        free(f->z.s);
+        // closed file keeps its slot, take it over
+        int j;
+        for (j = 0; j < split.n_open; ++j)
+            if (split.open[j] == i) split.open[j] = split.open[--split.n_open];
+    }
+    LOG_print("Split into %d files, %" PRIu64 " reopened.", split.n, split.n_reopen);
+    free(split.f);
+    free(split.open);
+    free(split.hdr.s);
+}
+
+struct pick_chunk {
+    struct bam_pool *p;
+    // split mode, compressed blocks of each group in chunk
+    struct dict *names;
+    kstring_t *z;
+};
+
+static void *pick_read(void *opts)
+{
+    struct bam_pool *b = bam_pool_create();
+    bam_read_pool(b, args.in, args.hdr, args.chunk_size);
+    if (b->n == 0) {
+        bam_pool_recycle(b);
+        return NULL;
     }
-    bam_pool_destory(p);
+    struct pick_chunk *c = malloc(sizeof(*c));
+    c->p = b;
+    c->names = NULL;
+    c->z = NULL;
+    return c;
+}
+
+// Return barcode of kept record, or NULL.
+static char *pick_barcode(bam1_t *b)
+{
+    uint8_t *tag = bam_aux_get(b, args.tag);
+    if (!tag) return NULL;
+    if (args.barcode && barcode_select(args.barcode, (char*)(tag+1)) == -1) return NULL;
+    return (char*)(tag+1);
 }
-static void *run_it(void *data)
+
+static void *pick_run(void *data, void *opts)
 {
-    struct bam_pool *p = (struct bam_pool*)data;    
+    struct pick_chunk *c = data;
+    struct bam_pool *p = c->p;
     int i;
+    if (args.split_dir == NULL) {
+        for (i = 0; i < p->n; ++i) {
+            bam1_t *b = &p->bam[i];
+            if (pick_barcode(b) == NULL) b->core.flag = BAM_FQCFAIL; // destroy this bam
+        }
+        return c;
+    }
+
+    // QC failed records are dropped as normal mode
+    c->names = dict_init();
+    int *gid = malloc(p->n*sizeof(int));
     for (i = 0; i < p->n; ++i) {
         bam1_t *b = &p->bam[i];
-        uint8_t *tag = bam_aux_get(b, args.tag);
-        if (!tag) {
-            b->core.flag = BAM_FQCFAIL;
-            continue;
+        gid[i] = -1;
+        if (b->core.flag & BAM_FQCFAIL) continue;
+        char *name = pick_barcode(b);
+        if (name == NULL) continue;
+        if (args.map) {
+            int idx = dict_query(args.map, name);
+            if (idx == -1) continue;
+            name = dict_name(args.groups, args.map_group[idx]);
+        }
+        gid[i] = dict_push(c->names, name);
+    }
+    // order records by group, keep input order within group
+    int n = dict_size(c->names);
+    int *start = calloc(n+1, sizeof(int));
+    for (i = 0; i < p->n; ++i)
+        if (gid[i] != -1) start[gid[i]+1]++;
+    int k;
+    for (k = 0; k < n; ++k) start[k+1] += start[k];
+    int *order = malloc((start[n] > 0 ? start[n] : 1)*sizeof(int));
+    for (i = 0; i < p->n; ++i)
+        if (gid[i] != -1) order[start[gid[i]]++] = i;
+
+    c->z = calloc(n > 0 ? n : 1, sizeof(kstring_t));
+    BGZF *z = kstr_open();
+    uint64_t bytes = 0;
+    for (k = 0, i = 0; k < n; ++k) {
+        kstr_switch(z, &c->z[k]);
+        for (; i < start[k]; ++i) { // start[k] is end of group k now
+            int l = bam_write1(z, &p->bam[order[i]]);
+            if (l < 0) error("Failed to encode %s.", bam_get_qname(&p->bam[order[i]]));
+            bytes += l;
         }
+    }
+    kstr_close_bgzf(z);
+    stats_output(bytes);
+    free(order);
+    free(start);
+    free(gid);
+    return c;
+}
 
-        if (args.barcode) {
-            int id;
-            id = barcode_select(args.barcode, (char*)(tag+1));
-            if (id == -1)
-                b->core.flag = BAM_FQCFAIL; // destroy this bam
+static void pick_write(void *data, void *opts)
+{
+    struct pick_chunk *c = data;
+    struct bam_pool *p = c->p;
+    int i;
+    if (args.split_dir == NULL) {
+        uint64_t bytes = 0;
+        for (i = 0; i < p->n; ++i) {
+            bam1_t *b = &p->bam[i];
+            if (b->core.flag & BAM_FQCFAIL) continue;
+            int l = sam_write1(args.out, args.hdr, b);
+            if (l == -1) error("Failed to write SAM.");
+            bytes += l;
+        }
+        stats_output(bytes);
+    }
+    else {
+        for (i = 0; i < dict_size(c->names); ++i) {
+            char *name = dict_name(c->names, i);
+            int gid = dict_query(args.groups, name);
+            if (gid == -1) {
+                if (strchr(name, '/')) error("Barcode should not contain '/'. %s", name);
+                gid = dict_push(args.groups, name);
+            }
+            split_push(gid, &c->z[i]);
+            free(c->z[i].s);
         }
+        free(c->z);
+        dict_destroy(c->names);
     }
-    return p;
+    bam_pool_recycle(p);
+    free(c);
 }
-    
+
 int bam_pick(int argc, char **argv)
 {
     double t_real;
     t_real = realtime();
     if (parse_args(argc, argv)) return pick_usage();
-        
-    //hts_tpool *p = hts_tpool_init(args.n_thread);
-    //hts_tpool_process *q = hts_tpool_process_init(p, args.n_thread*2, 0);
-    //hts_tpool_result *r;
-
-    for (;;) {
-        struct bam_pool *b = bam_pool_create();
-        bam_read_pool(b, args.in, args.hdr, args.chunk_size);
-            
-        if (b == NULL) break;
-        if (b->n == 0) { free(b->bam); free(b); break; }
-
-        struct bam_pool *d = run_it(b);
-        write_out(d);
-        
-        /*
-        int block;
-        do {
-            block = hts_tpool_dispatch2(p, q, run_it, b, 1);
-            if ((r = hts_tpool_next_result(q))) {
-                struct bam_pool *d = (struct bam_pool*)hts_tpool_result_data(r);
-                write_out(d);
-                hts_tpool_delete_result(r, 0);
-            }
-        }
-        while (block == -1);
-        */
-    }
 
-    /*
-    hts_tpool_process_flush(q);
+    if (args.split_dir) split_init();
 
-    while ((r = hts_tpool_next_result(q))) {
-        struct bam_pool *d = (struct bam_pool*)hts_tpool_result_data(r);
-        write_out(d);
-        hts_tpool_delete_result(r, 0);
-    }
-    hts_tpool_process_destroy(q);
-    hts_tpool_destroy(p);
-    */
+    pipeline_run(args.n_thread*2, pick_read, pick_run, pick_write, &args);
+
+    if (args.split_dir) split_close();
     memory_release();
     LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
 
@@ -1,11 +1,30 @@
 #include "utils.h"
 #include "bam_pool.h"
+#include "stats.h"
+#include <pthread.h>
+
+static struct {
+    pthread_mutex_t lock;
+    struct bam_pool *head;
+    int slab;
+} cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
 
 struct bam_pool *bam_pool_create()
 {
-    struct bam_pool *p = malloc(sizeof(*p));
-    p->n = p->m =0;
-    p->bam = NULL;
+    pthread_mutex_lock(&cache.lock);
+    struct bam_pool *p = cache.head;
+    if (p) cache.head = p->next;
+    pthread_mutex_unlock(&cache.lock);
+    if (p) {
+        p->n = 0;
+        p->next = NULL;
+        stats_reuse(1);
+        return p;
+    }
+
+    stats_alloc(1);
+    p = malloc(sizeof(*p));
+    memset(p, 0, sizeof(*p));
     return p;
 }
 void bam_read_pool(struct bam_pool *p, htsFile *fp, bam_hdr_t *h, int chunk_size)
@@ -15,6 +34,7 @@ void bam_read_pool(struct bam_pool *p, htsFile *fp, bam_hdr_t *h, int chunk_size
     do {
         if (p->n >= chunk_size) break;
         if (p->n == p->m) {
+            if (p->slab) error("Chunk size changed in a slab pool.");
             p->m = chunk_size;
             p->bam = realloc(p->bam, p->m*sizeof(bam1_t));
             int i;
@@ -26,14 +46,68 @@ void bam_read_pool(struct bam_pool *p, htsFile *fp, bam_hdr_t *h, int chunk_size
         p->n++;
     } while(1);
 
-    if (ret < -1) warnings("Truncated file?");    
+    if (ret < -1) warnings("Truncated file?");
+
+    stats_records(p->n);
+    stats_input_hts(fp);
+}
+// Move records into one slab sized by average record length of this chunk.
+// Records growing over the stride are reallocated by htslib, which clears
+// BAM_USER_OWNS_DATA, and keep their own buffers afterwards. Only a full chunk
+// is measured, a short last chunk of a few long reads would size all m slots
+// by them.
+static void bam_pool_build_slab(struct bam_pool *p)
+{
+    if (p->n == 0 || p->n < p->m) return;
+    uint64_t l = 0;
+    int i;
+    for (i = 0; i < p->n; ++i) l += p->bam[i].l_data;
+    size_t stride = l/p->n;
+    stride = (stride + (stride>>2) + 63) & ~(size_t)63;
+    p->slab = malloc(stride*p->m);
+    CHECK_EMPTY(p->slab, "Failed to allocate memory.");
+    stats_alloc(1);
+    for (i = 0; i < p->m; ++i) {
+        bam1_t *b = &p->bam[i];
+        if (b->l_data > stride) continue;
+        if (b->data && (bam_get_mempolicy(b) & BAM_USER_OWNS_DATA) == 0) free(b->data);
+        b->data = p->slab + stride*i;
+        b->m_data = stride;
+        b->l_data = 0;
+        bam_set_mempolicy(b, bam_get_mempolicy(b) | BAM_USER_OWNS_DATA);
+    }
+}
+void bam_pool_recycle(struct bam_pool *p)
+{
+    if (cache.slab && p->slab == NULL) bam_pool_build_slab(p);
+    p->n = 0;
+    pthread_mutex_lock(&cache.lock);
+    p->next = cache.head;
+    cache.head = p;
+    pthread_mutex_unlock(&cache.lock);
 }
 void bam_pool_destory(struct bam_pool *p)
 {
     int i;
-    for (i = 0; i <p->n; ++i) 
-        free(p->bam[i].data);
+    for (i = 0; i < p->m; ++i) 
+        if ((bam_get_mempolicy(&p->bam[i]) & BAM_USER_OWNS_DATA) == 0) free(p->bam[i].data);
     free(p->bam);
+    if (p->slab) free(p->slab);
     free(p);
 }
-
+void bam_pool_slab(int enable)
+{
+    cache.slab = enable;
+}
+void bam_pool_cache_clear()
+{
+    pthread_mutex_lock(&cache.lock);
+    struct bam_pool *p = cache.head;
+    cache.head = NULL;
+    pthread_mutex_unlock(&cache.lock);
+    while (p) {
+        struct bam_pool *next = p->next;
+        bam_pool_destory(p);
+        p = next;
+    }
+}
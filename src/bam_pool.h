@@ -7,10 +7,21 @@
 struct bam_pool {
     int n, m;
     bam1_t *bam;
+    uint8_t *slab; // contiguous data buffer of records, NULL if not enabled
+    struct bam_pool *next; // link of free list
 };
 
+// Pools are recycled through a process-wide free list. A recycled pool keeps
+// its record array and the data buffer of each record, so reading chunks in
+// steady state does not malloc at all.
 extern struct bam_pool *bam_pool_create();
 extern void bam_read_pool(struct bam_pool *p, htsFile *fp, bam_hdr_t *h, int chunk_size);
+// Put pool back to free list.
+extern void bam_pool_recycle(struct bam_pool *p);
 extern void bam_pool_destory(struct bam_pool *p);
+// Back recycled records with one contiguous slab per pool.
+extern void bam_pool_slab(int enable);
+// Free all cached pools, call at exit.
+extern void bam_pool_cache_clear();
 
 #endif
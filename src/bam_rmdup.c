@@ -5,13 +5,15 @@
 #include "htslib/bgzf.h"
 #include "htslib/kstring.h"
 #include "number.h"
+#include "stats.h"
+#include "thread.h"
 
 static struct args {
     const char *input_fname;
     const char *output_fname;
     const char *report_fname;
     
-    int file_thread;
+    int n_thread; // size of global thread pool
     int keep_dup;
 
     int n_tag;
@@ -21,11 +23,12 @@ static struct args {
     FILE *fp_report;
     bam_hdr_t *hdr;
     int as_SE;
+    uint64_t bytes_out;
 } args = {
     .input_fname  = NULL,
     .output_fname = NULL,
     .report_fname = NULL,
-    .file_thread  = 1,
+    .n_thread     = 1,
     .keep_dup     = 0,
     .n_tag        = 0,
     .tags         = NULL,    
@@ -34,6 +37,7 @@ static struct args {
     .fp_report    = NULL,
     .hdr          = NULL,
     .as_SE        = 0,
+    .bytes_out    = 0,
 };
 static int parse_args(int argc, char **argv)
 {
@@ -41,6 +45,7 @@ static int parse_args(int argc, char **argv)
     
     const char *tag_str  = NULL;
     const char *file_thread = NULL;
+    const char *thread = NULL;
     
     for (i = 1; i < argc; ) {
         const char *a = argv[i++];
@@ -50,6 +55,7 @@ static int parse_args(int argc, char **argv)
         if (strcmp(a, "-o") == 0) var = &args.output_fname;
         else if (strcmp(a, "-report") == 0) var = &args.report_fname;
         else if (strcmp(a, "-tag") == 0) var = &tag_str;
+        else if (strcmp(a, "-t") == 0) var = &thread;
         else if (strcmp(a, "-@") == 0) var = &file_thread;
         else if (strcmp(a, "-k") == 0) {
             args.keep_dup = 1;
@@ -78,7 +84,11 @@ static int parse_args(int argc, char **argv)
     if (args.output_fname == NULL) error("No output BAM specified.");
     if (tag_str == NULL) error("No tag specified.");
 
-    if (file_thread) args.file_thread = str2int((char*)file_thread);
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_thread;
+    if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
     
     kstring_t str = {0,0,0};
     kputs(tag_str, &str);
@@ -101,8 +111,7 @@ static int parse_args(int argc, char **argv)
     args.hdr = sam_hdr_read(args.fp);
     CHECK_EMPTY(args.hdr, "Failed to open header.");
 
-    if (args.file_thread > 1)
-        hts_set_threads(args.fp, args.file_thread);
+    gpool_attach_hts(args.fp, gpool_normal);
 
     if (args.report_fname) {
         args.fp_report = fopen(args.report_fname, "w");
@@ -110,6 +119,7 @@ static int parse_args(int argc, char **argv)
     }
     args.out = bgzf_open(args.output_fname, "w");
     CHECK_EMPTY(args.out, "%s : %s.", args.output_fname, strerror(errno));
+    gpool_attach_bgzf(args.out, gpool_high);
     if (bam_hdr_write(args.out, args.hdr) == -1) error("Failed to write SAM header.");
     
     return 0;
@@ -118,6 +128,7 @@ static void memory_release()
 {
     hts_close(args.fp);
     bgzf_close(args.out);
+    gpool_destroy();
     bam_hdr_destroy(args.hdr);
     int i;
     for (i = 0; i < args.n_tag; ++i) free(args.tags[i]);
@@ -201,12 +212,19 @@ struct rq_groups {
     struct read_qual *q;
 };
 
+static void write_bam(bam1_t *b)
+{
+    int l = bam_write1(args.out, b);
+    if (l == -1) error("Failed to write.");
+    args.bytes_out += l;
+}
+
 static void dump_best()
 {
     if (buf.n == 0) return;
     
     if (buf.n == 1) {
-        if (bam_write1(args.out, buf.b[0]) == -1) error("Failed to write.");
+        write_bam(buf.b[0]);
         clean_buffer();
 
         bam1_core_t *c = &buf.b[0]->core;
@@ -307,7 +325,7 @@ static void dump_best()
         bam1_t *b = buf.b[i];
         bam1_core_t *c = &b->core;
         if (c->flag & BAM_FQCFAIL || c->flag & BAM_FSECONDARY || c->flag & BAM_FSUPPLEMENTARY) {
-            if (bam_write1(args.out, b) == -1) error("Failed to write.");
+            write_bam(b);
             continue;
         }
 
@@ -320,7 +338,7 @@ static void dump_best()
             duplicate++;
         }             
         if (args.keep_dup == 0 && idx >= 0) continue;
-        if (bam_write1(args.out, b) == -1) error("Failed to write.");
+        write_bam(b);
     }
 
     // free
@@ -339,8 +357,7 @@ static void dump_best()
 static void print_unmapped(bam1_t *b)
 {
     dump_best();
-    if (bam_write1(args.out, b) == -1)
-        error("Failed to write.");
+    write_bam(b);
 }
 static void summary_report()
 {
@@ -367,10 +384,12 @@ int bam_rmdup(int argc, char **argv)
     int ret;
     int last_tid = -2;
     int last_pos = -1;
+    int n_rec = 0;
 
     for (;;) {
         ret = sam_read1(args.fp, args.hdr, b);
         if (ret < 0) break; // end of file
+        stats_read_hts(args.fp, &n_rec, 0);
 
         // assume inputs are sorted
         if (c->tid == -1) {
@@ -403,6 +422,8 @@ int bam_rmdup(int argc, char **argv)
     }
     dump_best();
     destroy_buffer();
+    stats_read_hts(args.fp, &n_rec, 1);
+    stats_output(args.bytes_out);
     
     summary_report();
     
@@ -6,6 +6,7 @@
 #include "number.h"
 #include "htslib/thread_pool.h"
 #include "thread.h"
+#include "stats.h"
 #include "dict.h"
 #include "htslib/khash.h"
 
@@ -106,8 +107,7 @@ static struct args {
 
     bam_hdr_t   * hdr;
     
-    int           n_thread;
-    int           file_th;
+    int           n_thread; // size of global thread pool
     
     int           chunk_size;
     struct dict * Cindex;
@@ -125,7 +125,6 @@ static struct args {
     .out          = NULL,
     .hdr          = NULL,
     .n_thread     = 5,
-    .file_th      = 4,
 
     .chunk_size   = 1000000, //1M
     .Cindex       = NULL,
@@ -141,6 +140,8 @@ static void memory_release()
     for (i = 0; i < args.n_block; ++i) free(args.blocks[i]);
     free(args.blocks);
     bc_corr_destroy(args.Cindex);
+    bam_pool_cache_clear();
+    gpool_destroy();
 }
 static void umi_idx_refresh(kh_bc_t *val, int old_idx, int new_idx)
 {
@@ -280,11 +281,23 @@ void filter_umi_gene(struct bc_corr *bc)
         }
     }
 }
-void build_index1(struct bc_corr *bc)
+void *build_index1(void *data, void *opts)
 {
+    struct bc_corr *bc = data;
     build_index_core(bc->val, bc->umi_val);
     if (args.cr_method)
         filter_umi_gene(bc);
+    return bc;
+}
+struct cell_itr {
+    struct dict *cell_bc;
+    int i;
+};
+static void *cell_next(void *opts)
+{
+    struct cell_itr *itr = opts;
+    if (itr->i >= dict_size(itr->cell_bc)) return NULL;
+    return dict_query_value(itr->cell_bc, itr->i++);
 }
 
 kh_bc_t *select_umi_hash(struct dict *Cindex, int n, const char **tags)
@@ -379,10 +392,9 @@ struct dict *build_index(const char *fn, int cr_method, int n_tag, const char **
     htsFormat type = *hts_get_format(fp);
     if (type.format != bam && type.format != sam) error("Unsupported input format, only support BAM/SAM/CRAM format.");
     
+    gpool_attach_hts(fp, gpool_normal);
     bam_hdr_t *hdr = sam_hdr_read(fp);
-    hts_set_threads(fp, args.file_th);
     bam1_t *b = bam_init1();
-    int i;
     for (;;) {
         if (sam_read1(fp, hdr, b) < 0) break;
         bam1_core_t *c = &b->core;
@@ -397,14 +409,9 @@ struct dict *build_index(const char *fn, int cr_method, int n_tag, const char **
     bam_hdr_destroy(hdr);
     sam_close(fp);
 
-    //struct tpool *tp = tpool_init(args.n_thread, args.n_thread*2, 1);
-
-    for (i = 0; i < dict_size(cell_bc); ++i) {
-        struct bc_corr *bc0 = dict_query_value(cell_bc, i);
-        build_index1(bc0);
-        //tpool_add_work(tp, build_index1, bc0);
-    }
-    //tpool_destroy(tp);
+    // cells are independent, correct them in parallel
+    struct cell_itr itr = { cell_bc, 0 };
+    pipeline_run(args.n_thread*2, cell_next, build_index1, NULL, &itr);
     LOG_print("Build time : %.3f sec", realtime() - t_real);
     return cell_bc;
 }
@@ -466,8 +473,11 @@ static int parse_args(int argc, char **argv)
     free(s);
     free(str.s);
 
-    if (file_th) args.file_th = str2int((char*)file_th);
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_th;
     if (thread) args.n_thread = str2int((char*)thread);
+    if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
     if (distance) args.e_distance = str2int((char*)distance);
     if (args.e_distance < 1) error("Hamming distance of similar barcodes greater than 0 is required.");
     
@@ -518,7 +528,17 @@ int update_new_tag(struct dict *Cindex, int n_block, const char **blocks, const
     return 1;
 }
 
-static void *run_it(void *data)
+static void *corr_read(void *opts)
+{
+    struct bam_pool *b = bam_pool_create();
+    bam_read_pool(b, args.in, args.hdr, args.chunk_size);
+    if (b->n == 0) {
+        bam_pool_recycle(b);
+        return NULL;
+    }
+    return b;
+}
+static void *run_it(void *data, void *opts)
 {
     struct bam_pool *p = (struct bam_pool*)data;
     int i;
@@ -530,12 +550,18 @@ static void *run_it(void *data)
     
     return p;
 }
-static void write_out(struct bam_pool *p)
+static void write_out(void *data, void *opts)
 {
+    struct bam_pool *p = (struct bam_pool*)data;
     int i;
-    for (i = 0; i < p->n; ++i)        
-        if (sam_write1(args.out, args.hdr, &p->bam[i]) == -1) error("Failed to write SAM.");
-    bam_pool_destory(p);
+    uint64_t bytes = 0;
+    for (i = 0; i < p->n; ++i) {
+        int l = sam_write1(args.out, args.hdr, &p->bam[i]);
+        if (l == -1) error("Failed to write SAM.");
+        bytes += l;
+    }
+    stats_output(bytes);
+    bam_pool_recycle(p);
 }
 
 extern int bam_corr_usage();
@@ -548,49 +574,21 @@ int bam_corr_umi(int argc, char **argv)
     if (parse_args(argc, argv)) return bam_corr_usage();
 
     args.in  = hts_open(args.input_fname, "r");
+    CHECK_EMPTY(args.in, "%s : %s.", args.input_fname, strerror(errno));
+    gpool_attach_hts(args.in, gpool_normal);
     args.hdr = sam_hdr_read(args.in);
     CHECK_EMPTY(args.hdr, "Failed to open header.");
     
     args.out = hts_open(args.output_fname, "bw");
     CHECK_EMPTY(args.out, "%s : %s.", args.output_fname, strerror(errno));
+    gpool_attach_hts(args.out, gpool_high); // write file in multi-threads
     
     if (sam_hdr_write(args.out, args.hdr)) error("Failed to write SAM header.");
-    
-    hts_set_threads(args.out, args.file_th); // write file in multi-threads
-
-    hts_tpool *p = hts_tpool_init(args.n_thread);
-    hts_tpool_process *q = hts_tpool_process_init(p, args.n_thread*2, 0);
-    hts_tpool_result *r;
 
-    for (;;) {
-        struct bam_pool *b = bam_pool_create();
-        bam_read_pool(b, args.in, args.hdr, args.chunk_size);
-            
-        if (b == NULL) break;
-        if (b->n == 0) { free(b->bam); free(b); break; }
-        
-        int block;
-        do {
-            block = hts_tpool_dispatch2(p, q, run_it, b, 1);
-            if ((r = hts_tpool_next_result(q))) {
-                struct bam_pool *d = (struct bam_pool*)hts_tpool_result_data(r);
-                write_out(d);   
-                hts_tpool_delete_result(r, 0);
-            }
-        }
-        while (block == -1);        
-    }
+    bam_pool_slab(1);
     
-    hts_tpool_process_flush(q);
+    pipeline_run(args.n_thread*2, corr_read, run_it, write_out, NULL);
 
-    while ((r = hts_tpool_next_result(q))) {
-        struct bam_pool *d = (struct bam_pool*)hts_tpool_result_data(r);
-        write_out(d);
-        hts_tpool_delete_result(r, 0);
-    }
-    hts_tpool_process_destroy(q);
-    hts_tpool_destroy(p);
-    
     memory_release();    
     LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
     //LOG_print("%d records updated.", args.update_count);
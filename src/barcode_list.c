@@ -3,6 +3,7 @@
 #include "htslib/kstring.h"
 #include "htslib/kseq.h"
 #include "barcode_list.h"
+#include "wlidx.h"
 #include <zlib.h>
 KSTREAM_INIT(gzFile, gzread, 8193);
 KHASH_MAP_INIT_STR(tag, int)
@@ -61,10 +62,15 @@ void barcode_destory(struct barcode_list *b)
         free(b->b[i].s);
     free(b->b);
     kh_destroy(tag, (taghash_t*)b->hash);
+    if (b->wl) wlidx_destroy(b->wl);
     free(b);
 }
 int barcode_read(struct barcode_list *lb, const char *fname)
 {
+    if (lb->n == 0 && lb->wl == NULL && wlidx_check(fname)) {
+        lb->wl = wlidx_load(fname);
+        return wlidx_size(lb->wl) == 0;
+    }
     lb->b = init_barcode_list(fname, &lb->n, &lb->m);
     if (lb->n == 0) return 1;
     khint_t k;
@@ -82,10 +88,16 @@ int barcode_read(struct barcode_list *lb, const char *fname)
 }
 int barcode_select(struct barcode_list *lb, char *s)
 {
+    int n_wl = 0;
+    if (lb->wl) {
+        int idx = wlidx_query(lb->wl, s);
+        if (idx != -1) return idx;
+        n_wl = wlidx_size(lb->wl);
+    }
     taghash_t *hash = (taghash_t*)lb->hash;
     khiter_t k = kh_get(tag, hash, s);
     if (k == kh_end(hash)) return -1;
-    return kh_val(hash, k);
+    return kh_val(hash, k) + n_wl;
 }
 // for barcode already existed, reture the index
 int barcode_push(struct barcode_list *lb, char *s)
@@ -103,5 +115,5 @@ int barcode_push(struct barcode_list *lb, char *s)
     k = kh_put(tag, (taghash_t*)lb->hash, b->s, &ret);
     kh_val((taghash_t*)lb->hash, k) = lb->n;
     lb->n++;
-    return lb->n-1;
+    return lb->n-1 + (lb->wl ? wlidx_size(lb->wl) : 0);
 }
@@ -11,6 +11,8 @@ struct barcode_list {
     struct barcode *b;
     int n, m;
     void *hash;
+    // mapped binary whitelist, indexed before b[] if set
+    struct wlidx *wl;
 };
 
 extern struct barcode_list *barcode_init();
@@ -14,6 +14,7 @@ KSTREAM_INIT(gzFile, gzread, 8193)
 struct _ctg_idx {
     int offset;
     int idx;
+    int max_len; // longest bed of this contig
 };
 
 struct bed_idx {
@@ -75,6 +76,7 @@ static void bed_build_index(struct bed_spec *B)
         struct bed *bed = &B->bed[i];
         B->ctg[bed->seqname].offset++;
         if (B->ctg[bed->seqname].idx == 0) B->ctg[bed->seqname].idx = i+1;
+        if (bed->end - bed->start > B->ctg[bed->seqname].max_len) B->ctg[bed->seqname].max_len = bed->end - bed->start;
         index_bin_push(B->idx[bed->seqname].idx, bed->start, bed->end, bed);
     }
 }
@@ -244,7 +246,7 @@ struct region_itr *bed_query(const struct bed_spec *B, char *name, int start, in
     for (i = 0; i < itr->n;) {
         struct bed *bed = itr->rets[i];
         if (bed->start > end || bed->end < start) {
-            memmove(itr->rets+i, itr->rets+i+1, itr->n-i-1);
+            memmove(itr->rets+i, itr->rets+i+1, (itr->n-i-1)*sizeof(void*));
             itr->n--;
         }
         else i++;
@@ -265,3 +267,27 @@ int bed_check_overlap(const struct bed_spec *B, char *name, int start, int end)
     region_itr_destroy(itr);
     return 1;
 }
+// Binary search candidates of [start, end] in sorted beds of contig id.
+int bed_sorted_range(const struct bed_spec *B, int id, int start, int end, int *first)
+{
+    const struct _ctg_idx *ctg = &B->ctg[id];
+    if (ctg->idx == 0) return 0;
+    const struct bed *a = B->bed + ctg->idx-1;
+    // beds start before start-max_len never reach start
+    int64_t from = (int64_t)start - ctg->max_len;
+    int lo = 0, hi = ctg->offset;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (a[mid].start < from) lo = mid + 1;
+        else hi = mid;
+    }
+    int l = lo;
+    hi = ctg->offset;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (a[mid].start <= end) lo = mid + 1;
+        else hi = mid;
+    }
+    *first = ctg->idx-1 + l;
+    return lo - l;
+}
@@ -38,6 +38,10 @@ void bed_spec_destroy(struct bed_spec *B);
 struct bed_spec *bed_read(const char *fname);
 struct region_itr *bed_query(const struct bed_spec *B, char *name, int start, int end);
 int bed_check_overlap(const struct bed_spec *B, char *name, int start, int end);
+// Beds of contig id which may overlap [start, end], as B->bed[*first] onwards,
+// sorted by start. Candidates starting at or before end are returned, the
+// caller checks their ends. Return number of candidates, no allocation.
+int bed_sorted_range(const struct bed_spec *B, int id, int start, int end, int *first);
 
 
 struct bed_spec *bed_read_vcf(const char *fn);
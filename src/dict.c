@@ -1,180 +1,344 @@
 #include "dict.h"
-#include "htslib/khash.h"
+#include "wlidx.h"
 #include "htslib/kseq.h"
 #include <zlib.h>
+#include <pthread.h>
 
-KHASH_MAP_INIT_STR(name, int)
-    
 KSTREAM_INIT(gzFile, gzread, 8193);
 
+// Entries are kept in segments of growing size, segment k holds 2^(k+4)
+// entries, so pushing never moves an existing entry and small dicts stay small.
+#define DICT_FIRST_BITS   4
+#define DICT_MAX_SEG      28
+
+// Keys are copied into per-shard string arenas instead of strdup'd one by one.
+#define ARENA_MIN_BLOCK   256
+#define ARENA_MAX_BLOCK   (1<<20)
+
+enum dict_key_type {
+    key_unset = 0,
+    key_string,
+    key_int,
+};
+
+struct dict_entry {
+    char *name;      // point to arena, NULL for integer key
+    int key;         // integer key
+    uint32_t hash;   // cached hash, used to skip strcmp and rehash
+    uint32_t count;
+    void *value;
+};
+
+struct arena_block {
+    struct arena_block *next;
+    size_t l, m;
+    char s[];
+};
+
+struct dict_shard {
+    pthread_mutex_t lock;
+    uint32_t *slots; // entry index + 1, 0 for empty slot
+    uint32_t n_slot, m_slot;
+    struct arena_block *arena;
+};
+
 struct dict {
-    int n, m;
-    char **name;
-    kh_name_t *dict;
-    uint32_t *count;
+    int n;
+    int key_type;
     int assign_value_flag;
-    void **value;
+    int concurrent;
+    int n_shard;
+    int shard_shift;
+    struct dict_entry *seg[DICT_MAX_SEG];
+    struct dict_shard *shards;
+
+    // Read-only whitelist mapped by dict_read, takes indexes [0, n_wl), keys
+    // pushed later are indexed after it.
+    struct wlidx *wl;
+    int n_wl;
+    uint32_t *wl_count;
+    void **wl_value;
 };
 
+static inline uint32_t hash_string(const char *s)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    for (; *s; ++s) {
+        h ^= (uint8_t)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+static inline uint32_t hash_int(int key)
+{
+    uint32_t h = (uint32_t)key; // murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+static inline struct dict_entry *dict_entry(const struct dict *D, int idx)
+{
+    uint32_t v = (uint32_t)idx + (1u<<DICT_FIRST_BITS);
+    int k = 31 - __builtin_clz(v) - DICT_FIRST_BITS;
+    return &D->seg[k][v - (1u<<(k+DICT_FIRST_BITS))];
+}
+static struct dict_entry *dict_entry_new(struct dict *D, int idx)
+{
+    uint32_t v = (uint32_t)idx + (1u<<DICT_FIRST_BITS);
+    int k = 31 - __builtin_clz(v) - DICT_FIRST_BITS;
+    if (k >= DICT_MAX_SEG) error("Too many keys in a dict.");
+    if (__atomic_load_n(&D->seg[k], __ATOMIC_ACQUIRE) == NULL) {
+        struct dict_entry *seg = calloc(1u<<(k+DICT_FIRST_BITS), sizeof(struct dict_entry));
+        CHECK_EMPTY(seg, "Failed to allocate memory.");
+        struct dict_entry *empty = NULL;
+        if (!__atomic_compare_exchange_n(&D->seg[k], &empty, seg, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            free(seg); // allocated by another thread
+    }
+    return dict_entry(D, idx);
+}
+static char *arena_strdup(struct arena_block **head, const char *s)
+{
+    size_t l = strlen(s) + 1;
+    struct arena_block *b = *head;
+    if (b == NULL || b->m - b->l < l) {
+        size_t m = b == NULL ? ARENA_MIN_BLOCK : b->m<<1;
+        if (m > ARENA_MAX_BLOCK) m = ARENA_MAX_BLOCK;
+        if (m < l) m = l;
+        struct arena_block *nb = malloc(sizeof(*nb) + m);
+        CHECK_EMPTY(nb, "Failed to allocate memory.");
+        nb->next = b;
+        nb->l = 0;
+        nb->m = m;
+        *head = b = nb;
+    }
+    char *r = b->s + b->l;
+    memcpy(r, s, l);
+    b->l += l;
+    return r;
+}
+static uint32_t *shard_find(const struct dict *D, const struct dict_shard *s, const char *key, int ikey, uint32_t hash)
+{
+    uint32_t mask = s->m_slot - 1;
+    uint32_t i = hash & mask;
+    for (;;) {
+        uint32_t *slot = &s->slots[i];
+        if (*slot == 0) return slot;
+        struct dict_entry *e = dict_entry(D, *slot - 1);
+        if (e->hash == hash && (key ? strcmp(e->name, key) == 0 : e->key == ikey)) return slot;
+        i = (i + 1) & mask;
+    }
+}
+static void shard_resize(const struct dict *D, struct dict_shard *s)
+{
+    uint32_t m = s->m_slot == 0 ? 16 : s->m_slot<<1;
+    uint32_t *slots = calloc(m, sizeof(uint32_t));
+    CHECK_EMPTY(slots, "Failed to allocate memory.");
+    uint32_t i;
+    for (i = 0; i < s->m_slot; ++i) {
+        if (s->slots[i] == 0) continue;
+        uint32_t j = dict_entry(D, s->slots[i]-1)->hash & (m-1);
+        while (slots[j]) j = (j+1) & (m-1);
+        slots[j] = s->slots[i];
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->m_slot = m;
+}
+static inline struct dict_shard *dict_shard(const struct dict *D, uint32_t hash)
+{
+    return D->n_shard == 1 ? D->shards : &D->shards[hash >> D->shard_shift];
+}
+static void dict_check_key_type(struct dict *D, int type)
+{
+    if (D->key_type == type) return;
+    if (D->key_type == key_unset) {
+        if (D->concurrent) {
+            int unset = key_unset;
+            if (__atomic_compare_exchange_n(&D->key_type, &unset, type, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || unset == type) return;
+        }
+        else {
+            D->key_type = type;
+            return;
+        }
+    }
+    error("Mixed string and integer keys in one dict.");
+}
+// inc_new, inc_hit : increase count for new and present key
+static int dict_put(struct dict *D, const char *key, int ikey, int inc_new, int inc_hit)
+{
+    dict_check_key_type(D, key ? key_string : key_int);
+    if (D->wl) {
+        int idx = wlidx_query(D->wl, key);
+        if (idx != -1) {
+            if (D->concurrent) __atomic_add_fetch(&D->wl_count[idx], inc_hit, __ATOMIC_RELAXED);
+            else D->wl_count[idx] += inc_hit;
+            return idx;
+        }
+    }
+    uint32_t hash = key ? hash_string(key) : hash_int(ikey);
+    struct dict_shard *s = dict_shard(D, hash);
+    if (D->concurrent) pthread_mutex_lock(&s->lock);
+    if (s->n_slot*4 >= s->m_slot*3) shard_resize(D, s);
+    uint32_t *slot = shard_find(D, s, key, ikey, hash);
+    int idx;
+    if (*slot) {
+        idx = *slot - 1;
+        dict_entry(D, idx)->count += inc_hit;
+    }
+    else {
+        idx = D->concurrent ? __atomic_fetch_add(&D->n, 1, __ATOMIC_ACQ_REL) : D->n++;
+        struct dict_entry *e = dict_entry_new(D, idx);
+        e->name = key ? arena_strdup(&s->arena, key) : NULL;
+        e->key = ikey;
+        e->hash = hash;
+        e->count = inc_new;
+        e->value = NULL;
+        *slot = idx + 1;
+        s->n_slot++;
+    }
+    if (D->concurrent) pthread_mutex_unlock(&s->lock);
+    return idx + D->n_wl;
+}
+static int dict_get(const struct dict *D, const char *key, int ikey)
+{
+    if (D->wl) {
+        int idx = wlidx_query(D->wl, key);
+        if (idx != -1) return idx;
+    }
+    uint32_t hash = key ? hash_string(key) : hash_int(ikey);
+    struct dict_shard *s = dict_shard(D, hash);
+    if (D->concurrent) pthread_mutex_lock(&s->lock);
+    int idx = -1;
+    if (s->n_slot > 0) {
+        uint32_t *slot = shard_find(D, s, key, ikey, hash);
+        idx = (int)*slot - 1;
+    }
+    if (D->concurrent) pthread_mutex_unlock(&s->lock);
+    return idx == -1 ? -1 : idx + D->n_wl;
+}
+
 struct dict *dict_init()
 {
     struct dict *D = malloc(sizeof(*D));
     memset(D, 0, sizeof(*D));
-    D->dict = kh_init(name);
+    D->n_shard = 1;
+    D->shards = calloc(1, sizeof(struct dict_shard));
     return D;
 }
+void dict_set_concurrent(struct dict *D, int n_shard)
+{
+    if (dict_size(D) > 0) error("Set concurrent mode to a non-empty dict.");
+    int bits = 0;
+    while ((1<<bits) < n_shard) bits++;
+    if (bits > 16) bits = 16;
+    free(D->shards);
+    D->n_shard = 1<<bits;
+    D->shard_shift = 32 - bits;
+    D->shards = calloc(D->n_shard, sizeof(struct dict_shard));
+    int i;
+    for (i = 0; i < D->n_shard; ++i) pthread_mutex_init(&D->shards[i].lock, NULL);
+    D->concurrent = 1;
+}
 void dict_set_value(struct dict *D)
 {
     if (D->assign_value_flag == 1) error("Double assign value to a dict.");
     D->assign_value_flag = 1;
-    if (D->m > 0) {
-        D->value = malloc(D->m*sizeof(void*));
-        int i;
-        for (i = 0; i < D->m; ++i) D->value[i] = NULL;
-    }
 }
 void *dict_query_value(struct dict *D, int idx)
 {
-    if (idx < 0 || idx >= D->n) return NULL;
-    if (D->value == NULL) return NULL;
-    
-    return D->value[idx];
+    if (idx < 0 || idx >= dict_size(D)) return NULL;
+    if (D->assign_value_flag == 0) return NULL;
+    if (idx < D->n_wl) return D->wl_value[idx];
+    return dict_entry(D, idx - D->n_wl)->value;
 }
 
 void *dict_query_value2(struct dict *D, const char *key)
 {
-    int idx = dict_query(D, key);
-    if (idx == -1) return NULL; // failed to query
-    return D->value[idx];
+    return dict_query_value(D, dict_query(D, key));
 }
 
-static char bit32[5];
-
 void *dict_query_valueInt(struct dict *D, int key)
 {
-    int idx = dict_queryInt(D, key);
-    if (idx == -1) return NULL;
-    return D->value[idx];
+    return dict_query_value(D, dict_queryInt(D, key));
 }
 
 int dict_assign_value(struct dict *D, int idx, void *val)
 {
-    if (idx < 0 || idx > D->n) return 1;
-    D->value[idx] = val;
+    if (idx < 0 || idx >= dict_size(D)) return 1;
+    if (idx < D->n_wl) D->wl_value[idx] = val;
+    else dict_entry(D, idx - D->n_wl)->value = val;
     return 0;
 }
 
 char *dict_name(const struct dict *D, int idx)
 {
-    assert(idx >= 0 && idx < D->n);
-    return D->name[idx];
-}
-static void encodeInt(int key)
-{
-    bit32[0] = key & 0x7F;
-    bit32[1] = (key >> 7) & 0x7F;
-    bit32[2] = (key >> 14) & 0x7F;
-    bit32[3] = (key >> 21) & 0x7F;
-    bit32[4] = (key >> 28) & 0x7F;
-    bit32[0] |= 0x80;
-    bit32[1] |= 0x80;
-    bit32[2] |= 0x80;
-    bit32[3] |= 0x80;
-    bit32[4] |= 0x80;
-}
-static int decodeInt(const char *name)
-{
-    int x = 0;
-    x = x | (name[4] & 0x7F);
-    x = x << 7;
-    x = x | (name[3] & 0x7F);
-    x = x << 7;
-    x = x | (name[2] & 0x7F);
-    x = x << 7;
-    x = x | (name[1] & 0x7F);
-    x = x << 7;
-    x = x | (name[0] & 0x7F);
-    return x;
+    assert(idx >= 0 && idx < dict_size(D));
+    if (idx < D->n_wl) return wlidx_name(D->wl, idx);
+    return dict_entry(D, idx - D->n_wl)->name;
 }
 int dict_nameInt(const struct dict *D, int idx)
 {
-    assert(idx >= 0 && idx < D->n);
-    char *name= D->name[idx];
-    return decodeInt(name);
+    assert(idx >= 0 && idx < dict_size(D));
+    return dict_entry(D, idx)->key;
 }
 
 int dict_size(const struct dict *D)
 {
-    return D->n;    
+    return (D->concurrent ? __atomic_load_n(&D->n, __ATOMIC_ACQUIRE) : D->n) + D->n_wl;
 }
 uint32_t dict_count(const struct dict *D, int idx)
 {
-    return D->count[idx];
+    if (idx < D->n_wl) return D->wl_count[idx];
+    return dict_entry(D, idx - D->n_wl)->count;
 }
 uint32_t dict_count_sum(const struct dict *D)
 {
     uint32_t sum = 0;
     int i;
-    for (i = 0; i < D->n; ++i) sum+=D->count[i];
+    for (i = 0; i < D->n_wl; ++i) sum += D->wl_count[i];
+    for (i = 0; i < D->n; ++i) sum += dict_entry(D, i)->count;
     return sum;
 }
 void dict_destroy(struct dict *D)
 {
-    int i;
-    for (i = 0; i < D->n; ++i) free(D->name[i]);
     // values are actually points, need free pointed values manually
-    if (D->assign_value_flag && D->value) free(D->value); 
-    free(D->name);
-    free(D->count);
-    kh_destroy(name,D->dict);
+    int i;
+    for (i = 0; i < DICT_MAX_SEG; ++i)
+        if (D->seg[i]) free(D->seg[i]);
+    for (i = 0; i < D->n_shard; ++i) {
+        struct dict_shard *s = &D->shards[i];
+        struct arena_block *b = s->arena;
+        while (b) {
+            struct arena_block *next = b->next;
+            free(b);
+            b = next;
+        }
+        free(s->slots);
+        if (D->concurrent) pthread_mutex_destroy(&s->lock);
+    }
+    free(D->shards);
+    if (D->wl) {
+        wlidx_destroy(D->wl);
+        free(D->wl_count);
+        free(D->wl_value);
+    }
     free(D);
 }
 
 int dict_query(const struct dict *D, char const *key)
 {
     if (key == NULL) error("Trying to query an empty key.");
-    khint_t k;
-    k = kh_get(name, D->dict, key);
-    if (k == kh_end(D->dict)) return -1;
-    return kh_val(D->dict, k);
+    if (D->key_type == key_int) error("Query a string key in an integer dict.");
+    return dict_get(D, key, 0);
 }
 
 int dict_queryInt(const struct dict *D, int key)
 {
-    encodeInt(key);
-    khint_t k;
-    k = kh_get(name, D->dict, bit32);
-    if (k == kh_end(D->dict)) return -1;
-    return kh_val(D->dict, k);
-}
-
-int dict_push0(struct dict *D, char const *key)
-{
-    if (key == NULL) error("Trying to push an empty key.");
-    int ret;
-    ret = dict_query(D, key);
-    if (ret != -1) {
-        D->count[ret]++;
-        return ret;
-    }
-    if (D->n == D->m) {
-        D->m = D->m == 0 ? 1024 : D->m<<1;
-        D->count = realloc(D->count, sizeof(uint32_t)*D->m);
-        assert(D->count);
-        int i;
-        for (i = D->n; i < D->m; ++i) D->count[i] = 0;
-        D->name = realloc(D->name, sizeof(char*)*D->m);
-        if (D->assign_value_flag) {
-            D->value = realloc(D->value, sizeof(void *)*D->m);
-            int j;
-            for (j = D->n; j < D->m; ++j) D->value[j] = NULL; // reset  
-        }
-    }
-    D->name[D->n] = strdup(key);
-    khint_t k;
-    k = kh_put(name, D->dict, D->name[D->n], &ret);
-    kh_val(D->dict, k) = D->n;
-    return -1;
+    if (D->key_type == key_string) error("Query an integer key in a string dict.");
+    return dict_get(D, NULL, key);
 }
 
 int dict_push(struct dict *D, char const *key)
@@ -183,34 +347,47 @@ int dict_push(struct dict *D, char const *key)
         warnings("Try to push empty key! Skip ..");
         return -1;
     }
-    int ret;
-    ret = dict_push0(D, key);
-    if (ret != -1) return ret; // already present
-    D->count[D->n]++;
-    return D->n++;
+    return dict_put(D, key, 0, 1, 1);
 }
 // push new key without increase count
 int dict_push1(struct dict *D, char const *key)
 {
-    int ret;
-    ret = dict_push0(D, key);
-    if (ret != -1) return ret;
-    return D->n++;
+    if (key == NULL) error("Trying to push an empty key.");
+    return dict_put(D, key, 0, 0, 1);
 }
 
 int dict_pushInt(struct dict *D, int key)
 {
-    encodeInt(key);
-    return dict_push(D, bit32);
+    return dict_put(D, NULL, key, 1, 1);
 }
 int dict_pushInt1(struct dict *D, int key)
 {
-    encodeInt(key);
-    return dict_push1(D, bit32);
+    return dict_put(D, NULL, key, 0, 1);
 }
 
+// Map a binary whitelist as the first keys of an empty dict, counts and
+// values are kept in side arrays so the mapped pages are never copied.
+static int dict_attach_wlidx(struct dict *D, struct wlidx *W)
+{
+    dict_check_key_type(D, key_string);
+    D->wl = W;
+    D->n_wl = wlidx_size(W);
+    // calloc'ed pages stay untouched until a barcode is counted
+    D->wl_count = calloc(D->n_wl, sizeof(uint32_t));
+    D->wl_value = calloc(D->n_wl, sizeof(void*));
+    CHECK_EMPTY(D->wl_value, "Failed to allocate memory.");
+    return 0;
+}
 int dict_read(struct dict *D, const char *fname)
 {
+    if (wlidx_check(fname)) {
+        struct wlidx *W = wlidx_load(fname);
+        if (dict_size(D) == 0 && D->wl == NULL) return dict_attach_wlidx(D, W);
+        int i;
+        for (i = 0; i < wlidx_size(W); ++i) dict_push1(D, wlidx_name(W, i));
+        wlidx_destroy(W);
+        return 0;
+    }
     gzFile fp;
     fp = gzopen(fname, "r");
     CHECK_EMPTY(fp, "%s : %s.", fname, strerror(errno));
@@ -236,10 +413,6 @@ int dict_read(struct dict *D, const char *fname)
     return 0;
 }
 
-char **dict_names(struct dict *D)
-{
-    return D->name;
-}
 // hamming distance
 static int check_similar(char *a, char *b, int mis)
 {
@@ -262,22 +435,24 @@ char *dict_most_likely_key(struct dict *D)
     uint32_t count = 0;
     char *key = NULL;
     int i;
-    for (i = 0; i < D->n; ++i) {
+    for (i = 0; i < dict_size(D); ++i) {
+        char *name = dict_name(D, i);
+        uint32_t c = dict_count(D, i);
         if (key == NULL) {
-            key = D->name[i];
-            count = D->count[i];            
+            key = name;
+            count = c;
         }
         else {
-            if (check_similar(key, D->name[i], 1) == 0) {
-                if (count < D->count[i]) {
-                    count = D->count[i];
-                    key = D->name[i];
+            if (check_similar(key, name, 1) == 0) {
+                if (count < c) {
+                    count = c;
+                    key = name;
                 }
             }
             else {
                 return NULL;
             }
-        }            
+        }
     }
 
     return key;
@@ -3,17 +3,28 @@
 
 #include "utils.h"
 
+// String or integer keyed dictionary, keys are indexed from 0 in push order.
+// Keys live in string arenas with cached hashes, and entries never move, so
+// names and indexes returned are stable until dict_destroy.
 struct dict;
 
 struct dict *dict_init();
 
+// Shard the hash table so worker threads can push and query concurrently,
+// must be set before first push. Iterate by index only after pushing done.
+void dict_set_concurrent(struct dict *D, int n_shard);
+
 void dict_destroy(struct dict *D);
 
 int dict_query(const struct dict *D, char const *key);
 int dict_queryInt(const struct dict *D, int key);
 
 int dict_push(struct dict *D, char const *key);
+// push new key without increase count
+int dict_push1(struct dict *D, char const *key);
 
+// Read a barcode list, one per line. A binary index built by `PISA wlidx` is
+// mapped instead of copied if the dict is empty.
 int dict_read(struct dict *D, const char *fname);
 
 char *dict_name(const struct dict *D, int idx);
@@ -25,8 +36,6 @@ uint32_t dict_count_sum(const struct dict *D);
 
 uint32_t dict_count(const struct dict *D, int idx);
 
-char **dict_names(struct dict *D);
-
 char *dict_most_likely_key(struct dict *D);
 
 void dict_set_value(struct dict *D);
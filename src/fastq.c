@@ -1,8 +1,10 @@
 #include "fastq.h"
 #include "number.h"
+#include "stats.h"
 #include "htslib/kseq.h"
 #include "htslib/kstring.h"
 #include <zlib.h>
+#include <pthread.h>
 
 KSEQ_INIT(gzFile, gzread)
 
@@ -234,11 +236,7 @@ static char **split_multi_files(const char *fname, int *n)
     kstring_t str = {0,0,0};
     kputs(fname, &str);
     int *s = ksplit(&str, ',', n);
-    if (*n == 1 || s == 0) {
-        free(str.s);
-        if (s) free(s);
-        return NULL;
-    }
+    if (s == 0) error("Empty file name.");
     
     char **paths = malloc(*n*sizeof(char*));
     int i;
@@ -264,51 +262,338 @@ struct fastq_handler *fastq_handler_init(const char *r1, const char *r2, int sma
     h->smart_pair = smart;
     h->chunk_size = chunk_size;
 
-    if (n1 == 1) {
-        h->r1 = strcmp(r1, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(r1, "r");
-        if (h->r1 == NULL) error("Failed to open %s : %s.", r1, strerror(errno));
-        h->k1 = kseq_init(h->r1);
-        if (h->k1 == NULL) error("Failed to init stream. %s", r1);
+    h->r1 = strcmp(h->read_1[0], "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(h->read_1[0], "r");
+    if (h->r1 == NULL) error("Failed to open %s : %s.", h->read_1[0], strerror(errno));
+    h->k1 = kseq_init(h->r1);
+    if (h->k1 == NULL) error("Failed to init stream. %s", h->read_1[0]);
         
-        if (r2) {
-            h->r2 = gzopen(r2, "r");    
-            if (h->r2 == NULL) error("Failed to open %s: %s.", r2, strerror(errno));
-            h->k2 = kseq_init(h->r2);
+    if (r2) {
+        h->r2 = gzopen(h->read_2[0], "r");    
+        if (h->r2 == NULL) error("Failed to open %s: %s.", h->read_2[0], strerror(errno));
+        h->k2 = kseq_init(h->r2);
+    }
+    
+    return h;
+}
+
+// Threaded read ahead. Every input file of an active lane is decompressed by
+// its own thread into a bounded queue of blocks, R1 and R2 blocks hold the
+// same number of records and are zipped together by the consumer. All active
+// lanes are consumed concurrently, the consumer takes the block of the lowest
+// lane which is ready, and later lanes may run at most `ahead` blocks ahead of
+// the writer. Blocks are put back in lane order by fastq_write_lanes(). All
+// streams of a handler share one lock and condition, so the consumer can wait
+// for any lane.
+struct fq_stream {
+    const char *fname;
+    gzFile fp;
+    kseq_t *ks;
+    int smart_pair;
+    int chunk_size;
+    pthread_t tid;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+    struct bseq_pool **q;
+    int head, n, m;
+    int eof;
+    int quit;
+};
+
+struct fq_lane {
+    struct fq_stream *s1;
+    struct fq_stream *s2; // NULL for single end
+};
+
+// Blocks of a later lane finished before the lanes in front of it.
+struct fq_held {
+    int n, m;
+    struct bseq_pool **a;
+    int issued; // blocks read while lane was ahead of writer
+};
+
+static struct bseq_pool *fq_stream_block(struct fq_stream *s)
+{
+    struct bseq_pool *p = bseq_pool_init();
+    kseq_t *ks = s->ks;
+    while (p->n < s->chunk_size) {
+        if (kseq_read(ks) < 0) break;
+        if (p->n == p->m) {
+            p->m = p->m ? p->m<<1 : 256;
+            p->s = realloc(p->s, p->m*sizeof(struct bseq));
         }
+        struct bseq *b = &p->s[p->n];
+        bseq_init(b);
+        trim_read_tail(ks->name.s, ks->name.l);
+        kstr_copy(&b->n0, &ks->name);
+        kstr_copy(&b->s0, &ks->seq);
+        kstr_copy(&b->q0, &ks->qual);
+        if (s->smart_pair) {
+            if (kseq_read(ks) < 0) error("Truncated input. %s", s->fname);
+            trim_read_tail(ks->name.s, ks->name.l);
+            if (check_name(b->n0.s, ks->name.s)) error("Inconsistance paired read names. %s vs %s.", b->n0.s, ks->name.s);
+            kstr_copy(&b->s1, &ks->seq);
+            kstr_copy(&b->q1, &ks->qual);
+        }
+        p->n++;
     }
-    else {
-        h->r1 = gzopen(h->read_1[0], "r");
-        h->k1 = kseq_init(h->r1);
-        if (r2) {
-            h->r2 = gzopen(h->read_2[0], "r");
-            h->k2 = kseq_init(h->r2);
+    stats_input(s->fname, gzoffset(s->fp));
+    if (p->n == 0) {
+        bseq_pool_destroy(p);
+        return NULL;
+    }
+    return p;
+}
+static void *fq_stream_run(void *_s)
+{
+    struct fq_stream *s = _s;
+    for (;;) {
+        struct bseq_pool *p = fq_stream_block(s);
+        pthread_mutex_lock(s->lock);
+        while (s->n == s->m && !s->quit)
+            pthread_cond_wait(s->cond, s->lock);
+        if (s->quit) {
+            pthread_mutex_unlock(s->lock);
+            if (p) bseq_pool_destroy(p);
+            break;
         }
+        if (p) s->q[(s->head + s->n++) % s->m] = p;
+        else s->eof = 1;
+        pthread_cond_broadcast(s->cond);
+        pthread_mutex_unlock(s->lock);
+        if (p == NULL) break;
     }
-    
-    return h;
+    return NULL;
+}
+// Should hold the lock.
+static struct bseq_pool *fq_stream_pop(struct fq_stream *s)
+{
+    struct bseq_pool *p = s->q[s->head];
+    s->head = (s->head + 1) % s->m;
+    s->n--;
+    pthread_cond_broadcast(s->cond);
+    return p;
+}
+static struct fq_stream *fq_stream_start(struct fastq_handler *h, const char *fname, gzFile fp, kseq_t *ks, int smart_pair)
+{
+    struct fq_stream *s = malloc(sizeof(*s));
+    memset(s, 0, sizeof(*s));
+    s->fname = fname;
+    if (fp == NULL) {
+        fp = strcmp(fname, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(fname, "r");
+        if (fp == NULL) error("Failed to open %s : %s.", fname, strerror(errno));
+        ks = kseq_init(fp);
+    }
+    s->fp = fp;
+    s->ks = ks;
+    s->smart_pair = smart_pair;
+    s->chunk_size = h->chunk_size;
+    s->m = h->depth;
+    s->q = malloc(s->m*sizeof(void*));
+    s->lock = &h->lock;
+    s->cond = &h->cond;
+    if (pthread_create(&s->tid, NULL, fq_stream_run, s)) error("Failed to create thread.");
+    return s;
+}
+static void fq_stream_stop(struct fq_stream *s)
+{
+    pthread_mutex_lock(s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(s->cond);
+    pthread_mutex_unlock(s->lock);
+    pthread_join(s->tid, NULL);
+    int i;
+    for (i = 0; i < s->n; ++i) bseq_pool_destroy(s->q[(s->head+i) % s->m]);
+    free(s->q);
+    kseq_destroy(s->ks);
+    gzclose(s->fp);
+    free(s);
+}
+static void fq_lane_start(struct fastq_handler *h, int i)
+{
+    struct fq_lane *l = malloc(sizeof(*l));
+    gzFile r1 = NULL, r2 = NULL;
+    kseq_t *k1 = NULL, *k2 = NULL;
+    if (i == 0) { // first lane opened by fastq_handler_init
+        r1 = h->r1; k1 = h->k1;
+        r2 = h->r2; k2 = h->k2;
+        h->r1 = h->r2 = NULL;
+        h->k1 = h->k2 = NULL;
+    }
+    l->s1 = fq_stream_start(h, h->read_1[i], r1, k1, h->smart_pair);
+    l->s2 = h->read_2 ? fq_stream_start(h, h->read_2[i], r2, k2, 0) : NULL;
+    h->lanes[i] = l;
+}
+static void fq_lane_stop(struct fastq_handler *h, int i)
+{
+    struct fq_lane *l = h->lanes[i];
+    if (l == NULL) return;
+    fq_stream_stop(l->s1);
+    if (l->s2) fq_stream_stop(l->s2);
+    free(l);
+    h->lanes[i] = NULL;
 }
+// Return 1 if next block of lane is ready, -1 at end of lane, 0 if not yet.
+// Should hold the lock.
+static int fq_lane_ready(struct fq_lane *l)
+{
+    struct fq_stream *s1 = l->s1, *s2 = l->s2 ? l->s2 : l->s1;
+    if (s1->n && s2->n) return 1;
+    int e1 = s1->n == 0 && s1->eof;
+    int e2 = s2->n == 0 && s2->eof;
+    if (e1 && e2) return -1;
+    if ((e1 && s2->n) || (e2 && s1->n)) error("Inconsistant input fastq records. %s", s1->fname);
+    return 0;
+}
+void fastq_handler_threads(struct fastq_handler *h, int n_lane, int depth, int ahead)
+{
+    if (n_lane < 1) n_lane = 1;
+    if (n_lane > h->n_file) n_lane = h->n_file;
+    h->n_lane = n_lane;
+    h->depth = depth < 1 ? 1 : depth;
+    h->ahead = ahead < 1 ? 1 : ahead;
+    h->lanes = calloc(h->n_file, sizeof(struct fq_lane*));
+    h->held = calloc(h->n_file, sizeof(struct fq_held));
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->cond, NULL);
+    h->curr = 0;
+    h->w_lane = 0;
+    int i;
+    for (i = 0; i < n_lane; ++i) fq_lane_start(h, i);
+    h->next_lane = n_lane;
+}
+static struct bseq_pool *fastq_read_threads(struct fastq_handler *h)
+{
+    int i, ret = 0;
+    pthread_mutex_lock(&h->lock);
+    for (;;) {
+        if (h->curr == h->n_file) break;
+        for (i = h->curr; i < h->next_lane; ++i) {
+            if (h->lanes[i] == NULL) continue; // finished
+            // the lowest lane always goes, so the writer can move on
+            if (i > h->curr && h->n_ahead >= h->ahead) break;
+            if ((ret = fq_lane_ready(h->lanes[i])) != 0) break;
+        }
+        if (ret) break;
+        pthread_cond_wait(&h->cond, &h->lock);
+    }
+    if (ret == 0) { // all lanes finished
+        pthread_mutex_unlock(&h->lock);
+        return NULL;
+    }
+    struct fq_lane *l = h->lanes[i];
+    struct bseq_pool *p = NULL, *p2 = NULL;
+    if (ret == 1) {
+        p = fq_stream_pop(l->s1);
+        if (l->s2) p2 = fq_stream_pop(l->s2);
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    if (ret == -1) {
+        // lane finished, start next one; an empty block marks the end
+        fq_lane_stop(h, i);
+        if (h->next_lane < h->n_file) fq_lane_start(h, h->next_lane++);
+        while (h->curr < h->next_lane && h->lanes[h->curr] == NULL) h->curr++;
+        p = bseq_pool_init();
+        p->lane = i;
+        return p;
+    }
+    if (p2) {
+        if (p->n != p2->n) error("Inconsistant input fastq records. %s", h->read_1[i]);
+        int k;
+        for (k = 0; k < p->n; ++k) {
+            struct bseq *a = &p->s[k];
+            struct bseq *b = &p2->s[k];
+            if (check_name(a->n0.s, b->n0.s)) error("Inconsistance paired read names. %s vs %s.", a->n0.s, b->n0.s);
+            // move R2 sequence and quality
+            a->s1 = b->s0;
+            a->q1 = b->q0;
+            memset(&b->s0, 0, sizeof(kstring_t));
+            memset(&b->q0, 0, sizeof(kstring_t));
+        }
+        bseq_pool_destroy(p2);
+    }
+    p->lane = i;
+    if (i > h->w_lane) {
+        h->held[i].issued++;
+        h->n_ahead++;
+    }
+    return p;
+}
+void fastq_write_lanes(struct fastq_handler *h, struct bseq_pool *p, void (*write)(void *data))
+{
+    if (h->lanes == NULL) {
+        write(p);
+        return;
+    }
+    if (p->lane != h->w_lane) {
+        struct fq_held *d = &h->held[p->lane];
+        if (d->n == d->m) {
+            d->m = d->m ? d->m<<1 : 8;
+            d->a = realloc(d->a, d->m*sizeof(void*));
+        }
+        d->a[d->n++] = p;
+        return;
+    }
+    for (;;) {
+        if (p->n) {
+            write(p);
+            return;
+        }
+        // end of lane, write blocks held for the next one
+        bseq_pool_destroy(p);
+        if (++h->w_lane == h->n_file) return;
+        struct fq_held *d = &h->held[h->w_lane];
+        h->n_ahead -= d->issued;
+        p = NULL;
+        int i;
+        for (i = 0; i < d->n; ++i) {
+            if (d->a[i]->n == 0) { // lane ended too, always the last one
+                p = d->a[i];
+                break;
+            }
+            write(d->a[i]);
+        }
+        free(d->a);
+        memset(d, 0, sizeof(*d));
+        if (p == NULL) return;
+    }
+}
+
 void fastq_handler_destory(struct fastq_handler *h)
 {
-    kseq_destroy(h->k1);
-    gzclose(h->r1);
+    if (h->lanes) {
+        int i, j;
+        for (i = 0; i < h->n_file; ++i) {
+            fq_lane_stop(h, i);
+            for (j = 0; j < h->held[i].n; ++j) bseq_pool_destroy(h->held[i].a[j]);
+            free(h->held[i].a);
+        }
+        free(h->lanes);
+        free(h->held);
+        pthread_mutex_destroy(&h->lock);
+        pthread_cond_destroy(&h->cond);
+    }
+    if (h->k1) {
+        kseq_destroy(h->k1);
+        gzclose(h->r1);
+    }
     if ( h->k2 ) {
         kseq_destroy(h->k2);
         gzclose(h->r2);
     }
-    if (h->n_file > 1) {
-        int i;
-        for (i = 0; i < h->n_file;++i) {
-            free(h->read_1[i]);
-            if (h->read_2) free(h->read_2[i]);
-        }
-        free(h->read_1);
-        if (h->read_2) free(h->read_2);
+    int i;
+    for (i = 0; i < h->n_file;++i) {
+        free(h->read_1[i]);
+        if (h->read_2) free(h->read_2[i]);
     }
+    free(h->read_1);
+    if (h->read_2) free(h->read_2);
     free(h);
 }
 int fastq_handler_state(struct fastq_handler *h)
 {
     if ( h == NULL ) return FH_NOT_ALLOC;
+    if ( h->lanes ) return FH_THREADS;
     if ( h->k1 == NULL ) return FH_NOT_INIT;
     if ( h->smart_pair ) return FH_SMART_PAIR;
     if ( h->k2 == NULL ) return FH_SE;
@@ -335,6 +620,10 @@ void *fastq_read(void *_h, void *opts)
             b = fastq_read_smart(h, h->chunk_size);
             break;
 
+        case FH_THREADS:
+            b = fastq_read_threads(h);
+            break;
+
         case FH_NOT_ALLOC:
             error("The fastq handler is NOT allocated.");
             break;
@@ -347,7 +636,14 @@ void *fastq_read(void *_h, void *opts)
             error("Unknown state");
     }
     
-    if (b) b->opts = opts;
+    if (b) {
+        b->opts = opts;
+        stats_records(b->n);
+    }
+    if (state != FH_THREADS && stats_on) { // lanes report by fq_stream_block
+        stats_input(h->read_1[h->curr-1], gzoffset(h->r1));
+        if (h->r2) stats_input(h->read_2[h->curr-1], gzoffset(h->r2));
+    }
     return b;
 }
 
@@ -401,6 +697,34 @@ size_t hamming_n(const char *a, const size_t length, const char *b, const size_t
     if (i < bLength) dist += bLength-i;
     return dist;
 }
+// Hyyro's formulation of Myers' algorithm, one column of the DP matrix per
+// text symbol. score tracks the last row, D[m][j]; it changes by at most one
+// per column, so D[m][n] >= score - (n-j) bounds the result from below.
+int levenshtein_bp(const uint64_t *peq, int m, const uint8_t *text, int n, int max)
+{
+    if (m == 0) return n;
+    if (m - n > max || n - m > max) return max + 1;
+    uint64_t pv = ~(uint64_t)0, mv = 0;
+    uint64_t last = (uint64_t)1 << (m-1);
+    int score = m;
+    int j;
+    for (j = 0; j < n; ++j) {
+        uint64_t eq = peq[text[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & last) score++;
+        else if (mh & last) score--;
+        if (score - (n - j - 1) > max) return max + 1;
+        ph = ph << 1 | 1; // top row is j, grows by one per column
+        mh = mh << 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    return score;
+}
+
 // credit to https://github.com/wooorm/levenshtein.c
 size_t levenshtein_n(const char *a, const size_t length, const char *b, const size_t bLength) {
   // Shortcut optimizations / degenerate cases.
@@ -416,6 +740,16 @@ size_t levenshtein_n(const char *a, const size_t length, const char *b, const si
     return length;
   }
 
+  // short pattern fits one word, no DP matrix
+  if (length <= 64) {
+      uint64_t peq[256];
+      size_t i;
+      for (i = 0; i < bLength; ++i) peq[(uint8_t)b[i]] = 0;
+      for (i = 0; i < length; ++i) peq[(uint8_t)a[i]] = 0;
+      for (i = 0; i < length; ++i) peq[(uint8_t)a[i]] |= (uint64_t)1 << i;
+      return levenshtein_bp(peq, length, (const uint8_t*)b, bLength, length + bLength);
+  }
+
   size_t *cache = calloc(length, sizeof(size_t));
   size_t index = 0;
   size_t bIndex = 0;
@@ -4,6 +4,7 @@
 #include "utils.h"
 #include "dict.h"
 #include<zlib.h>
+#include<pthread.h>
 #include "htslib/kstring.h"
 
 struct qc_report {
@@ -31,6 +32,7 @@ struct bseq_pool {
     int n, m;
     struct bseq *s;
     void *opts; // used to point thread safe structure
+    int lane; // input lane in threaded mode, see fastq_handler_threads()
 };
 
 struct fastq_handler {
@@ -44,6 +46,19 @@ struct fastq_handler {
     void *k2;
     int smart_pair;
     int chunk_size;
+
+    // threaded read ahead, see fastq_handler_threads()
+    int n_lane;  // lanes decompressed concurrently
+    int depth;   // blocks buffered per input file
+    int ahead;   // blocks of later lanes read before the writer reaches them
+    int next_lane;
+    struct fq_lane **lanes;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // writer side, see fastq_write_lanes()
+    int w_lane;
+    int n_ahead;
+    struct fq_held *held;
 };
 
 #define FH_SE 1
@@ -51,6 +66,7 @@ struct fastq_handler {
 #define FH_SMART_PAIR 3
 #define FH_NOT_ALLOC 4
 #define FH_NOT_INIT 5
+#define FH_THREADS 6
 
 extern int check_name(char *s1, char *s2);
 
@@ -65,6 +81,20 @@ void *fastq_read(void *h, void *opts);
 
 extern struct fastq_handler *fastq_handler_init(const char *r1, const char *r2, int smart, int chunk_size);
 
+// Decompress each input file on its own thread, R1 and R2 separately, n_lane
+// lanes at a time, with at most depth blocks buffered per file. Active lanes
+// are read concurrently, so fastq_read returns blocks of different lanes
+// interleaved, and an empty block marks the end of a lane. Pass every block
+// to fastq_write_lanes to restore lane order. Call right after
+// fastq_handler_init.
+extern void fastq_handler_threads(struct fastq_handler *h, int n_lane, int depth, int ahead);
+
+// Call write on blocks in lane order then read order, blocks of later lanes
+// are held until the lanes in front of them end. Empty blocks are freed here.
+// Must be called from the thread calling fastq_read, blocks of one lane in
+// the order they were read. Without threads, call write directly.
+extern void fastq_write_lanes(struct fastq_handler *h, struct bseq_pool *p, void (*write)(void *data));
+
 extern int fastq_handler_state(struct fastq_handler*);
 
 extern void fastq_handler_destory(struct fastq_handler *h);
@@ -73,4 +103,9 @@ extern void bseq_pool_push(struct bseq *b, struct bseq_pool *p);
 extern int bseq_pool_dedup(struct bseq_pool *p);
 extern size_t hamming_n(const char *a, const size_t length, const char *b, const size_t bLength);
 extern size_t levenshtein_n(const char *a, const size_t length, const char *b, const size_t bLength);
+// Myers' bit-parallel edit distance. Pattern of m <= 64 symbols is given as
+// match masks, peq[c] has bit i set if symbol i of pattern is c. Text is a
+// string of symbols indexing peq. Return max+1 as soon as the distance cannot
+// drop to max any more.
+extern int levenshtein_bp(const uint64_t *peq, int m, const uint8_t *text, int n, int max);
 #endif
@@ -0,0 +1,254 @@
+#include "utils.h"
+#include "fastq_bucket.h"
+#include "thread.h"
+#include "fqi.h"
+#include "stats.h"
+#include "htslib/kstring.h"
+#include "htslib/bgzf.h"
+
+// Records in buffer and spilled runs are key '\0' record '\0'.
+struct bucket {
+    int id;
+    kstring_t buf;
+    uint64_t *offs;
+    int n, m;
+    int n_run;
+    uint64_t n_rec;
+};
+
+struct fq_bucket {
+    char *prefix;
+    int n;
+    int64_t cap; // buffered bytes per bucket
+    struct bucket *b;
+    int next;    // next bucket to close
+};
+
+struct fq_bucket *fq_bucket_init(const char *prefix, int n, int64_t mem)
+{
+    if (n < 1) error("Number of buckets should be positive.");
+    if (n > 9999) error("Too many buckets, 9999 at max.");
+    struct fq_bucket *B = malloc(sizeof(*B));
+    B->prefix = strdup(prefix);
+    B->n = n;
+    // buffers of all buckets together stay within mem
+    B->cap = mem/n;
+    if (B->cap < 65536) error("Memory of %d buckets should be %dK at least, increase -m.", n, n*64);
+    B->b = calloc(n, sizeof(struct bucket));
+    B->next = 0;
+    int i;
+    for (i = 0; i < n; ++i) B->b[i].id = i;
+    return B;
+}
+
+// Same key order as fsort, ties kept in push order. Pointers of one buffer
+// grow with push order.
+static int rec_cmp(const void *a, const void *b)
+{
+    const char *x = *(const char **)a, *y = *(const char **)b;
+    int r = strcmp(x, y);
+    if (r) return r;
+    return x < y ? -1 : x > y;
+}
+
+static const char **bucket_sort(struct bucket *b)
+{
+    const char **p = malloc((b->n > 0 ? b->n : 1)*sizeof(char*));
+    int i;
+    for (i = 0; i < b->n; ++i) p[i] = b->buf.s + b->offs[i];
+    qsort(p, b->n, sizeof(char*), rec_cmp);
+    return p;
+}
+
+static void run_fname(const struct fq_bucket *B, int id, int run, kstring_t *str)
+{
+    str->l = 0;
+    ksprintf(str, "%s.%04d.%d.tmp", B->prefix, id, run);
+}
+
+static void bucket_spill(struct fq_bucket *B, struct bucket *b)
+{
+    kstring_t str = {0,0,0};
+    run_fname(B, b->id, b->n_run, &str);
+    FILE *fp = fopen(str.s, "w");
+    CHECK_EMPTY(fp, "%s : %s.", str.s, strerror(errno));
+    const char **p = bucket_sort(b);
+    int i;
+    for (i = 0; i < b->n; ++i) {
+        const char *rec = p[i] + strlen(p[i]) + 1;
+        size_t l = rec + strlen(rec) + 1 - p[i];
+        if (fwrite(p[i], 1, l, fp) != l) error("Failed to write %s.", str.s);
+    }
+    if (fclose(fp)) error("%s : %s.", str.s, strerror(errno));
+    free(p);
+    free(str.s);
+    b->n_run++;
+    b->n = 0;
+    b->buf.l = 0;
+}
+
+void fq_bucket_push(struct fq_bucket *B, const char *key, int l_key, const char *rec, int l_rec)
+{
+    // X31 hash of key, stable across runs and platforms
+    uint32_t h = 0;
+    int i;
+    for (i = 0; i < l_key; ++i) h = (h << 5) - h + (uint8_t)key[i];
+    struct bucket *b = &B->b[h % B->n];
+    if (b->n == b->m) {
+        b->m = b->m == 0 ? 1024 : b->m<<1;
+        b->offs = realloc(b->offs, b->m*sizeof(uint64_t));
+    }
+    b->offs[b->n++] = b->buf.l;
+    kputsn(key, l_key, &b->buf);
+    kputc('\0', &b->buf);
+    kputsn(rec, l_rec, &b->buf);
+    kputc('\0', &b->buf);
+    b->n_rec++;
+    if (b->buf.l + b->n*sizeof(uint64_t) >= B->cap) bucket_spill(B, b);
+}
+
+// Read records of a spilled run one by one, end is set at end of file.
+struct run {
+    FILE *fp;
+    char *key, *rec;
+    size_t m_key, m_rec;
+    int end;
+};
+static void run_next(struct run *r)
+{
+    if (getdelim(&r->key, &r->m_key, '\0', r->fp) < 0) {
+        r->end = 1;
+        return;
+    }
+    if (getdelim(&r->rec, &r->m_rec, '\0', r->fp) < 0) error("Truncated temp file.");
+}
+
+// Bucket output, records of one key are indexed as a group.
+struct bucket_out {
+    BGZF *fp;
+    const char *fn;
+    struct fqi_writer *w;
+    kstring_t key;
+    int64_t bytes;
+    int n;
+};
+
+static void out_flush(struct bucket_out *o)
+{
+    if (o->n) fqi_writer_push(o->w, o->key.s, o->bytes, o->n);
+    stats_output(o->bytes);
+    o->bytes = 0;
+    o->n = 0;
+}
+
+static void out_rec(struct bucket_out *o, const char *key, const char *rec)
+{
+    if (o->n == 0 || strcmp(o->key.s, key) != 0) {
+        out_flush(o);
+        o->key.l = 0;
+        kputs(key, &o->key);
+    }
+    size_t l = strlen(rec);
+    if (bgzf_write(o->fp, rec, l) != l) error("Failed to write %s.", o->fn);
+    o->bytes += l;
+    o->n++;
+}
+
+// Runs hold earlier records than buffer, and earlier runs earlier ones, so
+// ties are taken from the lowest source to keep push order.
+static void bucket_merge(struct fq_bucket *B, struct bucket *b, struct bucket_out *o)
+{
+    kstring_t str = {0,0,0};
+    const char **p = bucket_sort(b);
+    struct run *r = calloc(b->n_run, sizeof(struct run));
+    int i, k = 0;
+    for (i = 0; i < b->n_run; ++i) {
+        run_fname(B, b->id, i, &str);
+        r[i].fp = fopen(str.s, "r");
+        CHECK_EMPTY(r[i].fp, "%s : %s.", str.s, strerror(errno));
+        run_next(&r[i]);
+    }
+    for (;;) {
+        const char *min = NULL;
+        int best = -1;
+        for (i = 0; i < b->n_run; ++i) {
+            if (r[i].end) continue;
+            if (min == NULL || strcmp(r[i].key, min) < 0) {
+                min = r[i].key;
+                best = i;
+            }
+        }
+        if (k < b->n && (min == NULL || strcmp(p[k], min) < 0)) {
+            out_rec(o, p[k], p[k] + strlen(p[k]) + 1);
+            k++;
+            continue;
+        }
+        if (best == -1) break;
+        out_rec(o, r[best].key, r[best].rec);
+        run_next(&r[best]);
+    }
+    for (i = 0; i < b->n_run; ++i) {
+        fclose(r[i].fp);
+        free(r[i].key);
+        free(r[i].rec);
+        run_fname(B, b->id, i, &str);
+        unlink(str.s);
+    }
+    free(r);
+    free(p);
+    free(str.s);
+}
+
+static void *bucket_read(void *opts)
+{
+    struct fq_bucket *B = opts;
+    if (B->next == B->n) return NULL;
+    return &B->b[B->next++];
+}
+
+static void *bucket_write(void *data, void *opts)
+{
+    struct fq_bucket *B = opts;
+    struct bucket *b = data;
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.%04d.fq.gz", B->prefix, b->id);
+    struct bucket_out o = {0};
+    o.fn = str.s;
+    o.fp = bgzf_open(str.s, "w");
+    if (o.fp == NULL) error("%s : %s.", str.s, strerror(errno));
+    o.w = fqi_writer_init(o.fp);
+    if (b->n_run) bucket_merge(B, b, &o);
+    else {
+        const char **p = bucket_sort(b);
+        int i;
+        for (i = 0; i < b->n; ++i) out_rec(&o, p[i], p[i] + strlen(p[i]) + 1);
+        free(p);
+    }
+    out_flush(&o);
+    fqi_writer_close(o.w, o.fp, str.s);
+    if (bgzf_close(o.fp)) error("Failed to close %s.", str.s);
+    if (o.key.m) free(o.key.s);
+    free(str.s);
+    if (b->buf.m) free(b->buf.s);
+    free(b->offs);
+    memset(&b->buf, 0, sizeof(kstring_t));
+    b->offs = NULL;
+    return b;
+}
+
+uint64_t fq_bucket_close(struct fq_bucket *B, int n_thread)
+{
+    // one bucket per task, buckets are independent
+    pipeline_run(n_thread*2, bucket_read, bucket_write, NULL, B);
+    uint64_t n = 0;
+    int i, n_spill = 0;
+    for (i = 0; i < B->n; ++i) {
+        n += B->b[i].n_rec;
+        n_spill += B->b[i].n_run;
+    }
+    if (n_spill) LOG_print("Merge %d spilled runs.", n_spill);
+    free(B->b);
+    free(B->prefix);
+    free(B);
+    return n;
+}
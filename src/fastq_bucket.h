@@ -0,0 +1,28 @@
+#ifndef FASTQ_BUCKET_H
+#define FASTQ_BUCKET_H
+
+#include <stdint.h>
+
+// Records hash-partitioned by key into n bgzipped bucket files, each bucket
+// grouped by key in the same order as `PISA fsort`: keys sorted by strcmp,
+// records of one key kept in push order. So every key lives in exactly one
+// bucket, and buckets can be processed independently.
+//
+// Each bucket buffers at most mem/n bytes. A full buffer is sorted and spilled
+// to PREFIX.NNNN.RUN.tmp, the runs are merged when closing. Buckets small
+// enough to stay in memory are sorted once and written directly.
+struct fq_bucket;
+
+// Outputs are PREFIX.NNNN.fq.gz, NNNN from 0 to n-1, each indexed by key in
+// PREFIX.NNNN.fq.gz.fqi, see fqi.h.
+struct fq_bucket *fq_bucket_init(const char *prefix, int n, int64_t mem);
+
+// Push one record, may be several reads of a fragment. Not thread safe, call
+// from one writer.
+void fq_bucket_push(struct fq_bucket *B, const char *key, int l_key, const char *rec, int l_rec);
+
+// Sort, merge and compress buckets with n_thread threads, then free B.
+// Return records written.
+uint64_t fq_bucket_close(struct fq_bucket *B, int n_thread);
+
+#endif
@@ -9,6 +9,17 @@
 #include "htslib/khash.h"
 #include "htslib/kseq.h"
 #include "sim_search.h"
+#include "dict.h"
+#include "thread.h"
+#include "read_qc.h"
+#include "fastq_bucket.h"
+#include "stats.h"
+#include "htslib/bgzf.h"
+#include <limits.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+KSTREAM_INIT(gzFile, gzread, 8193)
 
 KHASH_MAP_INIT_STR(str, int)
 typedef kh_str_t strhash_t;
@@ -23,39 +34,42 @@ struct bcode_reg {
     int start;
     int end;
     int dist;
+    enum ss_metric metric; // hamming by default
     ss_t *wl;
     char **white_list; // temp allocated, will be free after initization
+    char *white_list_fname; // barcode list or binary index, instead of inline list
     int len;
     int n_wl;
+    // variable offset, segment moves with the linker found near its expected location
+    char *anchor;
+    int anchor_rd;
+    int anchor_start;
+    int anchor_end;
+    int anchor_shift;
+    int anchor_dist;
 };
 void bcode_reg_clean(struct bcode_reg *br)
 {
     if (br->wl) ss_destroy(br->wl);
+    if (br->anchor) free(br->anchor);
 }
 void bcode_reg_destory(struct bcode_reg *br)
 {
     bcode_reg_clean(br);
     free(br);
 }
-struct BRstat {
-    int q30_bases;
-    int bases;
-    int exact_match;
-    int filter;
-};
-struct BRstat *BRstat_alloc()
-{
-    struct BRstat *b = malloc(sizeof(*b));
-    memset(b, 0, sizeof(*b));
-    return b;
-}
 struct name_count_pair {
     char *name;
     uint32_t count;
 };
 
+// Allocated per chunk. Barcode string is kept in read name as offset.
 struct fq_data {
-    char *bc_str;
+    int bc_off;
+    int bc_len;   // run code not included
+    int64_t bc_id; // dense index of white list hit, -1 for others
+    int sample;    // index in sample sheet, -1 for unassigned
+    int sample_exact;
     int q30_bases_cell_barcode;
     int q30_bases_sample_barcode;
     int q30_bases_umi;
@@ -85,10 +99,16 @@ static struct args {
     const char *cbdis_fname;
     const char *report_fname;
     const char *dis_fname; // barcode segment distribution
+    const char *sheet_fname; // sample sheet for demultiplexing
+    const char *outdir;      // per sample outputs
+    const char *bucket_prefix; // barcode partitioned outputs
+    int n_bucket;
+    int64_t bucket_mem;
+    struct fq_bucket *buckets;
 
     int qual_thres;
     
-    // int n_thread;
+    int n_thread;
     int chunk_size;
     int cell_number;
 
@@ -97,17 +117,6 @@ static struct args {
 
     int dropN;
     
-    // Cell barcodes found in white list, if no white list all barcodes treat as background
-    struct name_count_pair *names;
-    int n_name;
-    int m_name;    
-    strhash_t *cbhash;
-
-    // Background
-    struct name_count_pair *bgnames;
-    int n_bg, m_bg;
-    strhash_t *bghash;
-
     // file handler
     // inputs could be gzipped fastq or unzipped
     gzFile r1_fp;
@@ -151,17 +160,19 @@ static struct args {
     .cbdis_fname = NULL,
     .report_fname = NULL,
     .dis_fname = NULL,
+    .sheet_fname = NULL,
+    .outdir = NULL,
+    .bucket_prefix = NULL,
+    .n_bucket = 0,
+    .bucket_mem = 1000000000, // 1G
+    .buckets = NULL,
     .qual_thres = 0,
-    //.n_thread = 4,
+    .n_thread = 1,
     .chunk_size = 10000,
     .cell_number = 10000,
     .smart_pair = 0,
     .bgiseq_filter = 0,
     .dropN = 0,
-    .names = NULL,
-    .n_name = 0,
-    .m_name = 0,
-    .cbhash = NULL,
 
     .r1_fp = NULL,
     .r2_fp = NULL,
@@ -242,7 +253,9 @@ void config_destory()
         bcode_reg_clean(br);
     }
     free(config.cell_barcodes);
-    if (config.sample_barcodes) bcode_reg_destory(config.sample_barcodes);
+    for (i = 0; i < config.n_sample_barcode; ++i)
+        bcode_reg_clean(&config.sample_barcodes[i]);
+    free(config.sample_barcodes);
     if (config.UMI) bcode_reg_destory(config.UMI);
     if (config.read_1) bcode_reg_destory(config.read_1);
     if (config.read_2) bcode_reg_destory(config.read_2);
@@ -252,6 +265,256 @@ void config_destory()
     if (config.umi_qual_tag) free(config.umi_qual_tag);
                             
 }
+// Location format R1:1-2, 1-based and inclusive.
+static void parse_location(const char *p, int *rd, int *start, int *end)
+{
+    if (strlen(p) < 6) error("Unknown location format, should be like \"R1:1-2\"");
+    if (p[0] == 'R' && p[2] == ':') {
+        if (p[1] == '1') *rd = 1;
+        else if (p[1] == '2') *rd = 2;
+        else  error("Unknown location format, should be like \"R[12]:1-2\"");
+    }
+    else {
+        error("Unknown location format, should be like \"R1:1-2\"");
+    }
+    p = p + 3;
+    const char *s = p;
+    int c = 0;
+    for (; check_char_num(*s); s++,c++);
+    *start = str2int_l(p, c);
+    if (*s != '-') error("Unknown location format, should be like \"R1:1-2\"");
+    p = ++s;
+    c = 0;
+    for (; check_char_num(*s); s++,c++);
+    *end = str2int_l(p, c);
+    if (*start < 1 || *end < *start) error("Bad location range, %d-%d.", *start, *end);
+}
+
+static void parse_segment(const kson_node_t *node, struct bcode_reg *br)
+{
+    memset(br, 0, sizeof(struct bcode_reg));
+    br->anchor_shift = 2;
+    br->anchor_dist = 1;
+    int k;
+    for (k = 0; k < node->n; ++k) {
+        const kson_node_t *n2 = kson_by_index(node, k);
+        if (n2 == NULL) error("Segment record is empty.");
+        if (strcmp(n2->key, "location") == 0) {
+            parse_location(n2->v.str, &br->rd, &br->start, &br->end);
+            br->len = br->end - br->start +1;
+        }
+        else if (strcmp(n2->key, "distance") == 0) {
+            br->dist = str2int(n2->v.str);
+        }
+        else if (strcmp(n2->key, "correction") == 0) {
+            if (strcmp(n2->v.str, "hamming") == 0) br->metric = ss_hamming;
+            else if (strcmp(n2->v.str, "levenshtein") == 0) br->metric = ss_levenshtein;
+            else error("Unknown correction \"%s\", should be hamming or levenshtein.", n2->v.str);
+        }
+        else if (strcmp(n2->key, "white list") == 0 && (n2->type == KSON_TYPE_DBL_QUOTE || n2->type == KSON_TYPE_SGL_QUOTE)) {
+            // "white list":"barcodes.txt" or a binary index built by `PISA wlidx`
+            br->white_list_fname = strdup(n2->v.str);
+        }
+        else if (strcmp(n2->key, "white list") == 0) {
+            if (n2->type != KSON_TYPE_BRACKET) error("Format error. \"white list\":[]");
+            br->n_wl = n2->n;
+            br->white_list = malloc(n2->n*sizeof(char*));
+            int l;
+            for (l = 0; l < n2->n; ++l) {
+                const kson_node_t *n3 = kson_by_index(n2, l);
+                br->white_list[l] = strdup(n3->v.str);
+            }
+        }
+        else if (strcmp(n2->key, "anchor") == 0) {
+            br->anchor = strdup(n2->v.str);
+        }
+        else if (strcmp(n2->key, "anchor location") == 0) {
+            parse_location(n2->v.str, &br->anchor_rd, &br->anchor_start, &br->anchor_end);
+        }
+        else if (strcmp(n2->key, "anchor shift") == 0) {
+            br->anchor_shift = str2int(n2->v.str);
+        }
+        else if (strcmp(n2->key, "anchor distance") == 0) {
+            br->anchor_dist = str2int(n2->v.str);
+        }
+        else error("Unknown key : \"%s\"", n2->key);
+    }
+    if (br->anchor) {
+        if (br->anchor_rd == 0) error("No \"anchor location\" set for anchor %s.", br->anchor);
+        if (br->anchor_end - br->anchor_start + 1 != strlen(br->anchor))
+            error("Inconsistance anchor length. %s vs %d-%d", br->anchor, br->anchor_start, br->anchor_end);
+        if (br->anchor_rd != br->rd) error("Anchor should be located at the same read with segment.");
+        if (br->anchor_shift < 0 || br->anchor_dist < 0) error("Anchor shift and distance should be positive.");
+    }
+}
+
+static void load_white_list(struct bcode_reg *br)
+{
+    if (br->white_list_fname) {
+        struct dict *D = dict_init();
+        dict_read(D, br->white_list_fname);
+        br->n_wl = dict_size(D);
+        if (br->n_wl == 0) error("White list is empty. %s", br->white_list_fname);
+        if (br->dist>3) error("Set too much distance for cell barcode, allow 3 distance at max.");
+        if (br->dist > br->len/2) error("Allow distance greater than half of barcode! Try to reduce distance.");
+        br->wl = ss_init();
+        ss_set_metric(br->wl, br->metric);
+        int j;
+        for (j = 0; j < br->n_wl; ++j) {
+            char *name = dict_name(D, j);
+            if (strlen(name) != br->len) error("Inconsistance white list length. %d vs %d, %s", br->len, (int)strlen(name), name);
+            ss_push(br->wl, name);
+        }
+        dict_destroy(D);
+        free(br->white_list_fname);
+        br->white_list_fname = NULL;
+        return;
+    }
+    if (br->n_wl == 0) return;
+    br->wl = ss_init();
+    ss_set_metric(br->wl, br->metric);
+    int j;
+    for (j = 0; j < br->n_wl; j++) {
+        int len = strlen(br->white_list[j]);
+        if (len != br->len) error("Inconsistance white list length. %d vs %d, %s", br->len, len, br->white_list[j]);
+        if (br->dist>3) error("Set too much distance for cell barcode, allow 3 distance at max.");
+        if (br->dist > len/2) error("Allow distance greater than half of barcode! Try to reduce distance.");
+        ss_push(br->wl, br->white_list[j]);
+        free(br->white_list[j]);
+    }
+    free(br->white_list);
+    br->white_list = NULL;
+}
+
+// Read structure compiled from config, offsets are 0-based and read index
+// is 0 or 1. Run once for each record, no config lookup in the loop.
+#define PLAN_MAX_SEG    16
+#define PLAN_MAX_ANCHOR 8
+
+struct plan_anchor {
+    int rd;
+    int start;
+    int len;
+    int shift;
+    int dist;
+    const char *seq;
+};
+
+struct plan_seg {
+    int rd;
+    int start;
+    int len;
+    int anchor; // -1 for fixed offset
+    int dist;
+    ss_t *wl;   // correction engine, NULL for no white list
+};
+
+enum plan_kind {
+    plan_sample,
+    plan_umi,
+    plan_cell,
+    plan_reads,
+};
+
+struct plan_group {
+    enum plan_kind kind;
+    int n;
+    struct plan_seg segs[PLAN_MAX_SEG];
+    const char *tag;
+    const char *raw_tag;
+    const char *qual_tag;
+    const char *run_code;
+};
+
+static struct plan {
+    int n_group;
+    struct plan_group groups[4];
+    int n_anchor;
+    struct plan_anchor anchors[PLAN_MAX_ANCHOR];
+} plan;
+
+// Segments behind the same linker share one anchor search.
+static int plan_anchor(const struct bcode_reg *br)
+{
+    if (br->anchor == NULL) return -1;
+    int i;
+    for (i = 0; i < plan.n_anchor; ++i) {
+        struct plan_anchor *a = &plan.anchors[i];
+        if (a->rd == br->anchor_rd-1 && a->start == br->anchor_start-1 && strcmp(a->seq, br->anchor) == 0) {
+            if (a->shift != br->anchor_shift || a->dist != br->anchor_dist)
+                error("Anchor %s is set with different shift or distance.", br->anchor);
+            return i;
+        }
+    }
+    if (plan.n_anchor == PLAN_MAX_ANCHOR) error("Too many anchors, %d at max.", PLAN_MAX_ANCHOR);
+    struct plan_anchor *a = &plan.anchors[plan.n_anchor];
+    a->rd = br->anchor_rd - 1;
+    a->start = br->anchor_start - 1;
+    a->len = br->anchor_end - br->anchor_start + 1;
+    a->shift = br->anchor_shift;
+    a->dist = br->anchor_dist;
+    a->seq = br->anchor;
+    return plan.n_anchor++;
+}
+
+static void plan_add(enum plan_kind kind, int n, struct bcode_reg *r, const char *tag, const char *raw_tag, const char *qual_tag, const char *run_code)
+{
+    struct plan_group *g = &plan.groups[plan.n_group++];
+    memset(g, 0, sizeof(*g));
+    g->kind = kind;
+    g->tag = tag;
+    g->raw_tag = raw_tag;
+    g->qual_tag = qual_tag;
+    g->run_code = run_code;
+    int i;
+    for (i = 0; i < n; ++i) {
+        struct bcode_reg *br = &r[i];
+        if (br->len == 0) continue; // empty record
+        if (g->n == PLAN_MAX_SEG) error("Too many segments, %d at max.", PLAN_MAX_SEG);
+        struct plan_seg *sg = &g->segs[g->n++];
+        sg->rd = br->rd - 1;
+        sg->start = br->start - 1;
+        sg->len = br->len;
+        sg->dist = br->dist;
+        sg->wl = br->wl;
+        sg->anchor = plan_anchor(br);
+    }
+}
+
+static void plan_compile(const char *run_code)
+{
+    memset(&plan, 0, sizeof(plan));
+    if (config.sample_barcodes) {
+        if (config.sample_barcode_tag == NULL && config.raw_sample_barcode_tag == NULL)
+            error("No sample barcode tag set.");
+        plan_add(plan_sample, config.n_sample_barcode, config.sample_barcodes, config.sample_barcode_tag,
+                 config.raw_sample_barcode_tag, config.raw_sample_barcode_qual_tag, NULL);
+    }
+    if (config.UMI) {
+        if (config.umi_tag == NULL) error("No UMI tag set.");
+        plan_add(plan_umi, 1, config.UMI, config.umi_tag, NULL, config.umi_qual_tag, NULL);
+    }
+    if (config.cell_barcodes) {
+        if (config.cell_barcode_tag == NULL) error("No cell barcode tag set.");
+        plan_add(plan_cell, config.n_cell_barcode, config.cell_barcodes, config.cell_barcode_tag,
+                 config.raw_cell_barcode_tag, config.raw_cell_barcode_qual_tag, run_code);
+    }
+    if (config.read_1) {
+        struct bcode_reg r[2];
+        r[0] = *config.read_1;
+        if (config.read_2) r[1] = *config.read_2;
+        plan_add(plan_reads, config.read_2 ? 2 : 1, r, NULL, NULL, NULL, NULL);
+    }
+    int i, j;
+    for (i = 0; i < plan.n_group; ++i) {
+        struct plan_group *g = &plan.groups[i];
+        for (j = 0; j < g->n; ++j) {
+            if (g->segs[j].wl && g->segs[j].len >= 32)
+                error("Barcode with white list should be shorter than 32.");
+        }
+    }
+}
+
 static void config_init(const char *fn)
 {
     char *config_str = json_config_open(fn);
@@ -294,123 +557,51 @@ static void config_init(const char *fn)
                 const kson_node_t *n1 = kson_by_index(node, j);                
                 if (n1 == NULL) error("cell barcode is empty.");
                 if (n1->type != KSON_TYPE_BRACE) error("Format error. \"cell barcode\":[{},{}]");
-                if (n1->n == 0) continue; // empty record
-                struct bcode_reg *br = &config.cell_barcodes[j];
-                memset(br, 0, sizeof(struct bcode_reg));
-                int k;
-                for (k = 0; k < n1->n; ++k) {
-                    const kson_node_t *n2 = kson_by_index(n1, k);
-                    if (n2 == NULL) error("cell barcode record is empty.");
-                    if (strcmp(n2->key, "location") == 0) {
-                        // assume format R1:1-2
-                        char *p = n2->v.str;
-                        if (strlen(p) < 6) error("Unknown location format, should be like \"R1:1-2\"");
-                        if (p[0] == 'R' && p[2] == ':') {
-                            if (p[1] == '1') br->rd = 1;
-                            else if (p[1] == '2') br->rd = 2;                            
-                            else  error("Unknown location format, should be like \"R[12]:1-2\"");
-                        }
-                        else {
-                            error("Unknown location format, should be like \"R1:1-2\"");
-                        }
-                        p = p + 3;
-                        char *s = p;
-                        int c = 0;
-                        for (; check_char_num(*s); s++,c++);
-                        br->start = str2int_l(p, c);
-                        if (*s != '-') error("Unknown location format, should be like \"R1:1-2\"");
-                        p = ++s;
-                        c = 0;
-                        for (; check_char_num(*s); s++,c++);
-                        br->end = str2int_l(p, c);
-                        br->len = br->end - br->start +1;
-                    }
-                    else if (strcmp(n2->key, "distance") == 0) {
-                        br->dist = str2int(n2->v.str);
-                    }
-                    else if (strcmp(n2->key, "white list") == 0) {
-                        if (n2->type != KSON_TYPE_BRACKET) error("Format error. \"white list\":[]");
-                        br->n_wl = n2->n;
-                        br->white_list = malloc(n2->n*sizeof(char*));
-                        int l;
-                        for (l = 0; l < n2->n; ++l) {
-                            const kson_node_t *n3 = kson_by_index(n2, l);
-                            br->white_list[l] = strdup(n3->v.str);                            
-                        }                                        
-                    }
-                    else error("Unknown key : \"%s\"", n2->key);
-                }
+                parse_segment(n1, &config.cell_barcodes[j]);
             }
         }
         else if (strcmp(node->key, "sample barcode tag") == 0) {
             if (node->v.str) config.sample_barcode_tag = strdup(node->v.str);
         }
+        else if (strcmp(node->key, "sample barcode raw tag") == 0) {
+            if (node->v.str) config.raw_sample_barcode_tag = strdup(node->v.str);
+        }
+        else if (strcmp(node->key, "sample barcode raw qual tag") == 0) {
+            if (node->v.str) config.raw_sample_barcode_qual_tag = strdup(node->v.str);
+        }
         else if (strcmp(node->key, "sample barcode") == 0) {
-            
+            // one segment {}, or dual index [{},{}]
+            if (node->type == KSON_TYPE_BRACE) {
+                config.n_sample_barcode = 1;
+                config.sample_barcodes = calloc(1, sizeof(struct bcode_reg));
+                parse_segment(node, config.sample_barcodes);
+            }
+            else if (node->type == KSON_TYPE_BRACKET) {
+                config.n_sample_barcode = node->n;
+                config.sample_barcodes = calloc(node->n, sizeof(struct bcode_reg));
+                int j;
+                for (j = 0; j < node->n; ++j) {
+                    const kson_node_t *n1 = kson_by_index(node, j);
+                    if (n1 == NULL || n1->type != KSON_TYPE_BRACE) error("Format error. \"sample barcode\":[{},{}]");
+                    parse_segment(n1, &config.sample_barcodes[j]);
+                }
+            }
+            else error("Format error. \"sample barcode\":[{},{}]");
+            int j;
+            for (j = 0; j < config.n_sample_barcode; ++j)
+                if (config.sample_barcodes[j].len == 0) error("sample barcode location at config is empty.");
         }
         else if (strcmp(node->key, "read 1") == 0) {
             if (node->type != KSON_TYPE_BRACE) error("Format error. \"read 1\":{}");
             config.read_1 = malloc(sizeof(struct bcode_reg));
-            struct bcode_reg *br = config.read_1;
-            memset(br, 0, sizeof(struct bcode_reg));
-            const kson_node_t *n1 = kson_by_index(node, 0);
-            if (n1 == NULL) error("read 1 location at config is empty.");
-            if (strcmp(n1->key, "location") == 0) {
-                // assume format R1:1-2
-                char *p = n1->v.str;
-                if (strlen(p) < 6) error("Unknown location format, should be like \"R1:1-2\"");
-                if (p[0] == 'R' && p[2] == ':') {
-                    if (p[1] == '1') br->rd = 1;
-                    else if (p[1] == '2') br->rd = 2;                            
-                    else  error("Unknown location format, should be like \"R[12]:1-2\"");
-                }
-                else {
-                    error("Unknown location format, should be like \"R1:1-2\"");
-                }
-                p = p + 3;
-                char *s = p;
-                int c = 0;
-                for (; check_char_num(*s); s++,c++);
-                br->start = str2int_l(p, c);
-                if (*s != '-') error("Unknown location format, should be like \"R1:1-2\"");
-                p = ++s;
-                c = 0;
-                for (; check_char_num(*s); s++,c++);
-                br->end = str2int_l(p, c);
-                br->len = br->end - br->start +1;
-            }
+            parse_segment(node, config.read_1);
+            if (config.read_1->len == 0) error("read 1 location at config is empty.");
         }
         else if (strcmp(node->key, "read 2") == 0) {
-            if (node->type != KSON_TYPE_BRACE) error("Format error. \"read 1\":{}");
+            if (node->type != KSON_TYPE_BRACE) error("Format error. \"read 2\":{}");
             config.read_2 = malloc(sizeof(struct bcode_reg));
-            struct bcode_reg *br = config.read_2;
-            memset(br, 0, sizeof(struct bcode_reg));
-            const kson_node_t *n1 = kson_by_index(node, 0);
-            if (n1 == NULL) error("read 2 location at config is empty.");
-            if (strcmp(n1->key, "location") == 0) {
-                // assume format R1:1-2
-                char *p = n1->v.str;
-                if (strlen(p) < 6) error("Unknown location format, should be like \"R1:1-2\"");
-                if (p[0] == 'R' && p[2] == ':') {
-                    if (p[1] == '1') br->rd = 1;
-                    else if (p[1] == '2') br->rd = 2;                            
-                    else  error("Unknown location format, should be like \"R[12]:1-2\"");
-                }
-                else {
-                    error("Unknown location format, should be like \"R1:1-2\"");
-                }
-                p = p + 3;
-                char *s = p;
-                int c = 0;
-                for (; check_char_num(*s); s++,c++);
-                br->start = str2int_l(p, c);
-                if (*s != '-') error("Unknown location format, should be like \"R1:1-2\"");
-                p = ++s;
-                c = 0;
-                for (; check_char_num(*s); s++,c++);
-                br->end = str2int_l(p, c);
-                br->len = br->end - br->start +1;
-            }
+            parse_segment(node, config.read_2);
+            if (config.read_2->len == 0) error("read 2 location at config is empty.");
         }
         else if (strcmp(node->key, "UMI tag") == 0) {
             if (node->v.str) config.umi_tag = strdup(node->v.str);
@@ -421,34 +612,8 @@ static void config_init(const char *fn)
         else if (strcmp(node->key, "UMI") == 0) {
             if (node->type != KSON_TYPE_BRACE) error("Format error. \"UMI\":{}");
             config.UMI = malloc(sizeof(struct bcode_reg));
-            struct bcode_reg *br = config.UMI;
-            memset(br, 0, sizeof(*br));
-            const kson_node_t *n1 = kson_by_index(node, 0);
-            if (n1 == NULL) error("UMI location at config is empty.");
-            if (strcmp(n1->key, "location") == 0) {
-                // assume format R1:1-2
-                char *p = n1->v.str;
-                if (strlen(p) < 6) error("Unknown location format, should be like \"R1:1-2\"");
-                if (p[0] == 'R' && p[2] == ':') {
-                    if (p[1] == '1') br->rd = 1;
-                    else if (p[1] == '2') br->rd = 2;                            
-                    else  error("Unknown location format, should be like \"R[12]:1-2\"");
-                }
-                else {
-                    error("Unknown location format, should be like \"R1:1-2\"");
-                }
-                p = p + 3;
-                char *s = p;
-                int c = 0;
-                for (; check_char_num(*s); s++,c++);
-                br->start = str2int_l(p, c);
-                if (*s != '-') error("Unknown location format, should be like \"R1:1-2\"");
-                p = ++s;
-                c = 0;
-                for (; check_char_num(*s); s++,c++);
-                br->end = str2int_l(p, c);
-                br->len = br->end - br->start +1;
-            }
+            parse_segment(node, config.UMI);
+            if (config.UMI->len == 0) error("UMI location at config is empty.");
         }
         else {
             error("Unknown key \"%s.\"", node->key);
@@ -456,380 +621,697 @@ static void config_init(const char *fn)
     }
 
     // init white list hash
-    for (i = 0; i < config.n_cell_barcode; ++i) {
-        struct bcode_reg *br = &config.cell_barcodes[i];
-        if (br->n_wl == 0) continue;
-        br->wl = ss_init();
-        int j;
-        for (j = 0; j < br->n_wl; j++) {
-            int len = strlen(br->white_list[j]);
-            if (len != br->len) error("Inconsistance white list length. %d vs %d, %s", br->len, len, br->white_list[j]);
-            if (br->dist>3) error("Set too much distance for cell barcode, allow 3 distance at max.");
-            if (br->dist > len/2) error("Allow distance greater than half of barcode! Try to reduce distance.");
-            ss_push(br->wl, br->white_list[j]);
-            free(br->white_list[j]);
+    for (i = 0; i < config.n_cell_barcode; ++i)
+        load_white_list(&config.cell_barcodes[i]);
+    for (i = 0; i < config.n_sample_barcode; ++i)
+        load_white_list(&config.sample_barcodes[i]);
+
+    kson_destroy(json);
+}
+
+#define ANCHOR_UNSET INT_MIN
+#define ANCHOR_MISS  (INT_MIN+1)
+
+// Best hit around expected location, fewer mismatches first, then nearer.
+static int anchor_find(const struct plan_anchor *a, const struct bseq *b)
+{
+    const kstring_t *s = a->rd == 0 ? &b->s0 : &b->s1;
+    int best = ANCHOR_MISS, best_mis = a->dist + 1;
+    int i, j;
+    for (i = 0; i <= 2*a->shift; ++i) {
+        int d = (i & 1) ? -(i+1)/2 : i/2; // 0, -1, 1, -2, 2 ...
+        int start = a->start + d;
+        if (start < 0 || start + a->len > s->l) continue;
+        int mis = 0;
+        for (j = 0; j < a->len && mis < best_mis; ++j)
+            if (s->s[start+j] != a->seq[j]) mis++;
+        if (mis < best_mis) {
+            best = d;
+            best_mis = mis;
+            if (mis == 0) break;
         }
-        free(br->white_list);
     }
-    kson_destroy(json);
+    return best;
 }
 
-struct seqlite {
-    kstring_t *seq;
-    kstring_t *qual;
+struct seg_view {
+    const char *s;
+    const char *q; // NULL if no quality
+    int l;
+    int start;
 };
 
-extern kstring_t *kstr_init();
-
-void kstr_destory(kstring_t *str)
+// Return 0 on success, 1 if anchor is not found or shifted out of read.
+static int seg_locate(const struct bseq *b, const struct plan_seg *sg, int *delta, struct seg_view *v)
 {
-    if (str == NULL) return;
-    if (str->m) free(str->s);
-    free(str);
+    const kstring_t *s = sg->rd == 0 ? &b->s0 : &b->s1;
+    const kstring_t *q = sg->rd == 0 ? &b->q0 : &b->q1;
+    int start = sg->start;
+    if (sg->anchor >= 0) {
+        int *d = &delta[sg->anchor];
+        if (*d == ANCHOR_UNSET) *d = anchor_find(&plan.anchors[sg->anchor], b);
+        if (*d == ANCHOR_MISS) return 1;
+        start += *d;
+        if (start < 0 || start + sg->len > s->l) return 1;
+    }
+    else if (start + sg->len > s->l)
+        error("Try to select sequence out of range. [Read length: %zu, Barcode range: %d-%d. Read name: %s]", s->l, sg->start+1, sg->start+sg->len, b->n0.s);
+    v->s = s->s + start;
+    v->q = q->l ? q->s + start : NULL;
+    v->l = sg->len;
+    v->start = start;
+    return 0;
 }
-void seqlite_destory(struct seqlite *s)
+
+static void name_tag(kstring_t *n, const char *tag)
 {
-    kstr_destory(s->seq);
-    kstr_destory(s->qual);
-    free(s);
+    kputs("|||", n);
+    kputs(tag, n);
+    kputs(":Z:", n);
 }
 
-struct seqlite *extract_tag(struct bseq *b, const struct bcode_reg *r, struct BRstat *stat, int *n)
+// Sample and cell barcodes. Return 1 if any segment fails the white list,
+// read name is untouched then.
+// ids and exact are set for each segment, -1 for segments without white list.
+static int plan_barcode(const struct plan_group *g, struct bseq *b, int *delta, int *q30, int *bases, int *ids, int *exact)
 {
-    if (b == NULL || r == NULL) return NULL;
-    
-    struct seqlite *p = malloc(sizeof(*p));
-    p->seq = kstr_init();
-    p->qual = kstr_init();
-    
-    *n = 0;
-    char *s = NULL;
-    char *q = NULL;
-    if (r->rd == 1) {
-        if (r->end > b->s0.l) error("Try to select sequence out of range. [Read length: %zu, Barcode range: %d-%d. Read name: %s]", b->s0.l, r->start, r->end, b->n0.s);
-        s = b->s0.s + r->start -1;
-        q = b->q0.l ? b->q0.s + r->start -1 : NULL;
+    struct seg_view v[PLAN_MAX_SEG];
+    struct read_qc qc;
+    char buf[32];
+    int i, n_q30 = 0;
+    for (i = 0; i < g->n; ++i) {
+        const struct plan_seg *sg = &g->segs[i];
+        ids[i] = -1;
+        exact[i] = 0;
+        if (seg_locate(b, sg, delta, &v[i])) return 1;
+        read_qc(v[i].s, v[i].q, v[i].l, &qc);
+        n_q30 += qc.q30;
+        if (sg->wl == NULL) continue;
+        memcpy(buf, v[i].s, v[i].l);
+        buf[v[i].l] = '\0';
+        ids[i] = ss_query_idx(sg->wl, buf, sg->dist, &exact[i]);
+        if (ids[i] == -1) return 1;
     }
-    else {
-        if (r->end > b->s1.l) error("Try to select sequence out of range. [Read length: %zu, Barcode range: %d-%d. Read name: %s]", b->s1.l, r->start, r->end, b->n0.s);
-        s = b->s1.s + r->start -1;
-        q = b->q1.l ? b->q1.s + r->start -1 : NULL;
+
+    struct fq_data *data = b->data;
+    if (g->tag) {
+        name_tag(&b->n0, g->tag);
+        data->bc_off = b->n0.l;
+        for (i = 0; i < g->n; ++i) {
+            if (ids[i] >= 0) kputs(ss_name(g->segs[i].wl, ids[i], buf), &b->n0);
+            else kputsn(v[i].s, v[i].l, &b->n0);
+        }
+        data->bc_len = b->n0.l - data->bc_off;
+        if (g->run_code) {
+            kputc('-', &b->n0);
+            kputs(g->run_code, &b->n0);
+        }
     }
-    int l = r->end - r->start + 1;
-    kputsn(s, l, p->seq);
-    kputs("", p->seq);
-    if (q){
-        kputsn(q, l, p->qual);
-        kputs("", p->qual);
+    if (g->raw_tag) {
+        name_tag(&b->n0, g->raw_tag);
+        for (i = 0; i < g->n; ++i) kputsn(v[i].s, v[i].l, &b->n0);
     }
-    int i;
-    for (i = 0; i < l; ++i) {
-        if (p->qual->s[i]-33 >= 30) stat->q30_bases++;
-        if (p->seq->s[i] == 'N') *n = 1;
+    if (g->qual_tag) {
+        name_tag(&b->n0, g->qual_tag);
+        for (i = 0; i < g->n; ++i)
+            if (v[i].q) kputsn(v[i].q, v[i].l, &b->n0);
     }
-    stat->bases += l;
-    return p;
+    for (i = 0; i < g->n; ++i) *bases += v[i].l;
+    *q30 += n_q30;
+    return 0;
 }
 
-// NULL on unfound, else on sequence
-char *check_whitelist(char *s, const struct bcode_reg *r, int *exact_match)
+static void seg_cut(kstring_t *s, int start, int len)
 {
-    if (r->n_wl == 0) return 0;
-    int len = strlen(s);
-    if (len != r->len) error("Trying to check inconsistance length sequence.");
-    set_hamming();
-    return ss_query(r->wl, s, r->dist, exact_match);
+    if (s->l == 0) return;
+    memmove(s->s, s->s + start, len);
+    s->l = len;
+    s->s[len] = '\0';
 }
-static void update_rname(struct bseq *b, const char *tag, char *s){
-    kstring_t str = {0,0,0};
-    kputs(b->n0.s, &str);
-    kputs("|||", &str);
-    kputs(tag, &str);
-    kputs(":Z:", &str);
-    kputs(s, &str);
-    kstr_copy(&b->n0, &str);
-    free(str.s);
+static void seg_copy(kstring_t *dst, const kstring_t *src, int start, int len)
+{
+    dst->l = 0;
+    if (src->l == 0) return;
+    kputsn(src->s + start, len, dst);
 }
-
-struct BRstat *extract_barcodes(struct bseq *b,
-                                int n,
-                                const struct bcode_reg *r,
-                                const char *tag,
-                                const char *raw_tag,
-                                const char *raw_qual_tag,                                
-                                const char *run_code
-    )
+static void kstr_swap(kstring_t *a, kstring_t *b)
 {
-    if (tag == NULL && raw_tag == NULL) return NULL;
-    
-    kstring_t str = {0,0,0};
-    kstring_t qual = {0,0,0};
-    kstring_t tag_str = {0,0,0};
+    kstring_t t = *a;
+    *a = *b;
+    *b = t;
+}
 
-    struct BRstat *stat = malloc(sizeof(struct BRstat));
-    memset(stat, 0, sizeof(struct BRstat));
-    stat->exact_match = 1;
-    
-    int dropN;
-    // barcodes construct from multi segments, only all segments matched with whitelist will be export
+// Cut read 1 and read 2 in place, no copy unless both come from one raw read.
+static int plan_cut_reads(const struct plan_group *g, struct bseq *b, int *delta, struct read_qc *qc)
+{
+    struct seg_view v[2];
     int i;
-    for (i = 0; i < n; ++i) { 
-        const struct bcode_reg *br = &r[i];
-        struct seqlite *s = extract_tag(b, br, stat, &dropN);
-        if (s == NULL) goto failed_check_barcode;
-        char *wl = NULL;
-        int exact_match = 0;
-        if (br->n_wl) {
-            wl = check_whitelist(s->seq->s, br, &exact_match);
-            if (wl == NULL) {                
-                stat->exact_match = 0;
-                stat->filter = 1;
-                seqlite_destory(s);
-                goto failed_check_barcode;
-            }
-            if (exact_match == 0)  stat->exact_match = 0;
+    memset(qc, 0, 2*sizeof(struct read_qc));
+    for (i = 0; i < g->n; ++i) {
+        if (seg_locate(b, &g->segs[i], delta, &v[i])) return 1;
+        read_qc(v[i].s, v[i].q, v[i].l, &qc[i]);
+    }
+    const struct plan_seg *r1 = &g->segs[0];
+    const struct plan_seg *r2 = g->n > 1 ? &g->segs[1] : NULL;
+    if (r2 && r1->rd == r2->rd) {
+        if (r1->rd == 0) {
+            seg_copy(&b->s1, &b->s0, v[1].start, v[1].l);
+            seg_copy(&b->q1, &b->q0, v[1].start, v[1].l);
+            seg_cut(&b->s0, v[0].start, v[0].l);
+            seg_cut(&b->q0, v[0].start, v[0].l);
         }
-        else stat->exact_match = 0;
-        
-        if (raw_tag) kputs(s->seq->s, &str);
-        if (raw_qual_tag && s->qual->l) kputs(s->qual->s, &qual);
-        
-        if (tag) {            
-            kputs(wl == NULL ? s->seq->s : wl, &tag_str);
+        else {
+            seg_copy(&b->s0, &b->s1, v[0].start, v[0].l);
+            seg_copy(&b->q0, &b->q1, v[0].start, v[0].l);
+            seg_cut(&b->s1, v[1].start, v[1].l);
+            seg_cut(&b->q1, v[1].start, v[1].l);
         }
-        seqlite_destory(s);
-
-        if (wl) free(wl);
+        return 0;
+    }
+    if (r1->rd == 1) {
+        kstr_swap(&b->s0, &b->s1);
+        kstr_swap(&b->q0, &b->q1);
     }
+    seg_cut(&b->s0, v[0].start, v[0].l);
+    seg_cut(&b->q0, v[0].start, v[0].l);
+    if (r2) {
+        seg_cut(&b->s1, v[1].start, v[1].l);
+        seg_cut(&b->q1, v[1].start, v[1].l);
+    }
+    else {
+        b->s1.l = 0;
+        b->q1.l = 0;
+    }
+    return 0;
+}
 
-    if (stat->filter == 1) goto failed_check_barcode;
-    
-    if (run_code) {
-        kputc('-', &tag_str);
-        kputs(run_code, &tag_str);
+// Barcode counters for -cbdis and -dis. White list hits are counted in a dense
+// array indexed by white list ids of all segments, the others in hashes of
+// 2-bit packed barcodes, one shard per worker thread, merged at the end.
+#define BC_DENSE_MAX (1<<26)
+
+KHASH_MAP_INIT_INT64(bc64, uint32_t)
+
+struct bc_shard {
+    kh_bc64_t *packed;   // ACGT barcodes not longer than 31, leading 1 marks the length
+    strhash_t *str;      // others, keys are allocated
+    struct bc_shard *next;
+};
+
+static struct {
+    int on;
+    int group;            // counted group in plan, cell barcode, or sample barcode if no cell barcode
+    int dense;
+    uint64_t n_dense;
+    uint64_t stride[PLAN_MAX_SEG];
+    uint32_t *counts;
+    int dis;              // per segment matched and corrected reads of cell barcode
+    uint64_t *matched[PLAN_MAX_SEG];
+    uint64_t *corrected[PLAN_MAX_SEG];
+    pthread_mutex_t lock;
+    struct bc_shard *shards;
+} bc = {
+    .on = 0,
+    .group = -1,
+    .dis = 0,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .shards = NULL,
+};
+
+static __thread struct bc_shard *bc_local = NULL;
+
+static void bc_init(int cbdis, int dis)
+{
+    int i, j;
+    for (i = 0; i < plan.n_group; ++i) {
+        if (plan.groups[i].kind == plan_cell) bc.group = i;
+        else if (plan.groups[i].kind == plan_sample && bc.group == -1) bc.group = i;
     }
+    if (bc.group == -1) return;
+    struct plan_group *g = &plan.groups[bc.group];
+    if (cbdis) {
+        bc.on = 1;
+        bc.dense = 1;
+        bc.n_dense = 1;
+        for (i = g->n-1; i >= 0; --i) {
+            if (g->segs[i].wl == NULL || bc.n_dense*ss_size(g->segs[i].wl) > BC_DENSE_MAX) {
+                bc.dense = 0;
+                break;
+            }
+            bc.stride[i] = bc.n_dense;
+            bc.n_dense *= ss_size(g->segs[i].wl);
+        }
+        if (bc.dense) bc.counts = calloc(bc.n_dense, sizeof(uint32_t));
+    }
+    if (dis && g->kind == plan_cell) {
+        bc.dis = 1;
+        for (j = 0; j < g->n; ++j) {
+            if (g->segs[j].wl == NULL) continue;
+            bc.matched[j] = calloc(ss_size(g->segs[j].wl), sizeof(uint64_t));
+            bc.corrected[j] = calloc(ss_size(g->segs[j].wl), sizeof(uint64_t));
+        }
+    }
+}
 
-    struct fq_data *data = (struct fq_data*)b->data;
-    data->bc_str = strdup(tag_str.s);
-    
-    if (tag) update_rname(b, tag, tag_str.s);
-    if (raw_tag) update_rname(b, raw_tag, str.s);
-    if (raw_qual_tag) update_rname(b, raw_qual_tag, qual.s);
+static struct bc_shard *bc_shard_get()
+{
+    if (bc_local) return bc_local;
+    struct bc_shard *sh = malloc(sizeof(*sh));
+    sh->packed = kh_init(bc64);
+    sh->str = kh_init(str);
+    pthread_mutex_lock(&bc.lock);
+    sh->next = bc.shards;
+    bc.shards = sh;
+    pthread_mutex_unlock(&bc.lock);
+    bc_local = sh;
+    return sh;
+}
 
-    if (str.m) free(str.s);
-    if (qual.m) free(qual.s);
-    if (tag_str.m) free(tag_str.s);
-    return stat;
-    
-  failed_check_barcode:
-    if (str.m) free(str.s);
-    if (qual.m) free(qual.s);
-    if (tag_str.m) free(tag_str.s);
-    free(stat);
-    return NULL;
+// Return 0 if s cannot be packed.
+static uint64_t bc_pack(const char *s, int l)
+{
+    if (l > 31) return 0;
+    uint64_t x = 1;
+    int i;
+    for (i = 0; i < l; ++i) {
+        switch (s[i]) {
+            case 'A': x = x<<2; break;
+            case 'C': x = x<<2|1; break;
+            case 'G': x = x<<2|2; break;
+            case 'T': x = x<<2|3; break;
+            default: return 0;
+        }
+    }
+    return x;
+}
+static void bc_unpack(uint64_t x, kstring_t *str)
+{
+    int l = 0, i;
+    for (; x>>(2*l+2); ++l);
+    str->l = 0;
+    for (i = l-1; i >= 0; --i) kputc("ACGT"[x>>(2*i) & 0x3], str);
 }
 
-struct BRstat *extract_sample_barcode_reads(struct bseq *b,
-                                 int n,
-                                 const struct bcode_reg *r,
-                                 const char *tag,
-                                 const char *raw_tag,
-                                 const char *raw_qual_tag)
+// Count a read of the counted group, called by workers after the plan passed.
+static void bc_count(const struct bseq *b, const struct fq_data *data)
 {
-    return extract_barcodes(b, n, r, tag, raw_tag, raw_qual_tag, NULL);
+    if (data->bc_id >= 0) {
+        __atomic_add_fetch(&bc.counts[data->bc_id], 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (data->bc_len == 0) return;
+    struct bc_shard *sh = bc_shard_get();
+    const char *s = b->n0.s + data->bc_off;
+    uint64_t key = bc_pack(s, data->bc_len);
+    int ret;
+    khint_t k;
+    if (key) {
+        k = kh_put(bc64, sh->packed, key, &ret);
+        if (ret) kh_val(sh->packed, k) = 0;
+        kh_val(sh->packed, k)++;
+        return;
+    }
+    char *name = strndup(s, data->bc_len);
+    k = kh_put(str, sh->str, name, &ret);
+    if (ret) kh_val(sh->str, k) = 0;
+    else free(name);
+    kh_val(sh->str, k)++;
 }
-struct BRstat *extract_cell_barcode_reads(struct bseq *b,
-                                          int n,
-                                          const struct bcode_reg *r,
-                                          const char *tag,
-                                          const char *raw_tag,
-                                          const char *raw_qual_tag,                               
-                                          const char *run_code)
+
+// Matched and corrected reads per white list barcode, for -dis.
+static void bc_seg_hits(const struct plan_group *g, const int *ids, const int *exact)
 {
-    return extract_barcodes(b, n, r, tag, raw_tag, raw_qual_tag, run_code);
+    int i;
+    for (i = 0; i < g->n; ++i) {
+        if (ids[i] < 0) continue;
+        if (exact[i]) __atomic_add_fetch(&bc.matched[i][ids[i]], 1, __ATOMIC_RELAXED);
+        else __atomic_add_fetch(&bc.corrected[i][ids[i]], 1, __ATOMIC_RELAXED);
+    }
 }
 
-struct BRstat *extract_umi(struct bseq *b, const struct bcode_reg *r, const char *tag, const char *qual_tag)
+// Dense index over all segments, -1 if any segment is not a white list hit.
+static int64_t bc_dense_id(const struct plan_group *g, const int *ids)
 {
-    if (tag == NULL) return NULL;
-    struct BRstat *stat = malloc(sizeof(*stat));
-    memset(stat, 0, sizeof(*stat));
+    if (bc.dense == 0) return -1;
+    int64_t id = 0;
+    int i;
+    for (i = 0; i < g->n; ++i) {
+        if (ids[i] < 0) return -1;
+        id += ids[i]*bc.stride[i];
+    }
+    return id;
+}
 
-    int dropN;
-    struct seqlite *s = extract_tag(b, r, stat, &dropN);
+// Sample demultiplexing, -sheet and -outdir. Sample barcodes are corrected
+// per segment by white lists built from the sheet, then the combination of
+// segment hits is looked up in a dense table. Reads of each sample go to their
+// own bgzipped files, compressed by the shared thread pool.
+#define DEMUX_MAX (1<<24)
+
+struct sample_stat {
+    uint64_t raw;
+    uint64_t pass;
+    uint64_t exact;
+    uint64_t failed_barcode;
+    uint64_t lowqual;
+    uint64_t q30_bases_reads;
+    uint64_t bases_reads;
+};
 
-    if (args.dropN && dropN== 1) b->flag= FQ_FLAG_READ_QUAL;
-    
-    if (tag && s->seq->l) update_rname(b, tag, s->seq->s);
-    if (qual_tag && s->qual->l) update_rname(b, qual_tag, s->qual->s);
+static struct {
+    int n;                   // samples
+    struct dict *names;
+    int group;               // sample group in plan
+    uint64_t n_map;
+    uint64_t stride[PLAN_MAX_SEG];
+    int *map;                // segment hits -> sample, -1 if not in sheet
+    BGZF **fp;               // read 1 and read 2 of each sample
+    kstring_t str;
+    struct sample_stat *stats;
+} demux = {
+    .n = 0,
+    .names = NULL,
+    .group = -1,
+    .map = NULL,
+    .fp = NULL,
+    .stats = NULL,
+};
 
-    seqlite_destory(s);
-    return stat;
+// Sheet format, one barcode per line, a sample may have several barcodes:
+//   sample_name  ACGTACGT[+ACGTACGT]
+// Segments of dual index are separated by '+', or just concatenated.
+static void sheet_load(const char *fname)
+{
+    if (config.n_sample_barcode == 0) error("No \"sample barcode\" set in configure file.");
+    if (config.n_sample_barcode > PLAN_MAX_SEG) error("Too many segments, %d at max.", PLAN_MAX_SEG);
+    int i, j;
+    for (i = 0; i < config.n_sample_barcode; ++i) {
+        struct bcode_reg *br = &config.sample_barcodes[i];
+        if (br->wl) error("White list of sample barcode is set by -sheet, remove it from configure file.");
+        if (br->len >= 22) error("Sample barcode should be shorter than 22.");
+        if (br->dist > 3) error("Set too much distance for sample barcode, allow 3 distance at max.");
+        if (br->dist > br->len/2) error("Allow distance greater than half of barcode! Try to reduce distance.");
+        br->wl = ss_init();
+        ss_set_metric(br->wl, br->metric);
+    }
+
+    gzFile fp = gzopen(fname, "r");
+    CHECK_EMPTY(fp, "%s : %s.", fname, strerror(errno));
+    kstream_t *ks = ks_init(fp);
+    kstring_t str = {0,0,0};
+    kstring_t bc = {0,0,0};
+    int ret, n = 0, m = 0;
+    int *rows = NULL; // sample index and segment hits of each barcode
+    int w = config.n_sample_barcode + 1;
+    demux.names = dict_init();
+    while (ks_getuntil(ks, 2, &str, &ret) >= 0) {
+        if (str.l == 0 || str.s[0] == '#') continue;
+        char *p = str.s, *e = str.s + str.l;
+        while (p < e && !isspace(*p)) p++;
+        if (p == e) error("No barcode for sample %s.", str.s);
+        *p++ = '\0';
+        while (p < e && isspace(*p)) p++;
+        if (strchr(str.s, '/')) error("Sample name should not contain '/'. %s", str.s);
+        bc.l = 0;
+        for (; p < e && !isspace(*p); ++p)
+            if (*p != '+') kputc(*p, &bc);
+        if (bc.l == 0) error("No barcode for sample %s.", str.s);
+        int idx = dict_query(demux.names, str.s);
+        if (idx == -1) idx = dict_push(demux.names, str.s);
+
+        if (n == m) {
+            m = m == 0 ? 96 : m<<1;
+            rows = realloc(rows, m*w*sizeof(int));
+        }
+        rows[n*w] = idx;
+        int off = 0;
+        for (i = 0; i < config.n_sample_barcode; ++i) {
+            struct bcode_reg *br = &config.sample_barcodes[i];
+            char buf[32];
+            if (off + br->len > bc.l) break;
+            memcpy(buf, bc.s + off, br->len);
+            buf[br->len] = '\0';
+            off += br->len;
+            for (j = 0; j < br->len; ++j)
+                if (buf[j] != 'A' && buf[j] != 'C' && buf[j] != 'G' && buf[j] != 'T')
+                    error("Only A/C/G/T allowed in sample barcodes. %s", bc.s);
+            int exact;
+            ss_push(br->wl, buf);
+            rows[n*w+i+1] = ss_query_idx(br->wl, buf, 0, &exact);
+        }
+        if (i < config.n_sample_barcode || off != bc.l)
+            error("Inconsistance sample barcode length. %s vs sample barcode segments in configure.", bc.s);
+        n++;
+    }
+    if (str.m) free(str.s);
+    if (bc.m) free(bc.s);
+    ks_destroy(ks);
+    gzclose(fp);
+    if (n == 0) error("Sample sheet is empty. %s", fname);
+
+    demux.n = dict_size(demux.names);
+    demux.n_map = 1;
+    for (i = config.n_sample_barcode-1; i >= 0; --i) {
+        demux.stride[i] = demux.n_map;
+        demux.n_map *= ss_size(config.sample_barcodes[i].wl);
+        if (demux.n_map > DEMUX_MAX) error("Too many sample barcode combinations.");
+    }
+    demux.map = malloc(demux.n_map*sizeof(int));
+    for (i = 0; i < demux.n_map; ++i) demux.map[i] = -1;
+    for (i = 0; i < n; ++i) {
+        uint64_t id = 0;
+        for (j = 0; j < config.n_sample_barcode; ++j) id += rows[i*w+j+1]*demux.stride[j];
+        if (demux.map[id] >= 0 && demux.map[id] != rows[i*w])
+            error("Sample barcode is assigned to both %s and %s.", dict_name(demux.names, demux.map[id]), dict_name(demux.names, rows[i*w]));
+        demux.map[id] = rows[i*w];
+    }
+    free(rows);
+    demux.stats = calloc(demux.n, sizeof(struct sample_stat));
+    LOG_print("Load %d barcodes of %d samples.", n, demux.n);
 }
 
-struct BRstat *extract_reads(struct bseq *b, const struct bcode_reg *r1, const struct bcode_reg *r2)
+// Open outputs of all samples, so empty samples still get their files.
+static void demux_open(const char *dir, int paired)
 {
-    assert(r1);
-    struct BRstat *stat = malloc(sizeof(struct BRstat));
-    memset(stat, 0, sizeof(struct BRstat));
-    int dropN;
-    struct seqlite *s1 = extract_tag(b, r1, stat, &dropN);
-    if (args.dropN && dropN== 1) b->flag= FQ_FLAG_READ_QUAL;
+    if (mkdir(dir, 0755) && errno != EEXIST) error("%s : %s.", dir, strerror(errno));
+    kstring_t str = {0,0,0};
+    int i;
+    demux.fp = calloc(demux.n*2, sizeof(BGZF*));
+    for (i = 0; i < demux.n*2; ++i) {
+        if (i & 1 && paired == 0) continue;
+        str.l = 0;
+        ksprintf(&str, "%s/%s_%d.fq.gz", dir, dict_name(demux.names, i/2), (i&1)+1);
+        demux.fp[i] = bgzf_open(str.s, "w");
+        if (demux.fp[i] == NULL) error("%s : %s.", str.s, strerror(errno));
+        gpool_attach_bgzf(demux.fp[i], gpool_high);
+    }
+    free(str.s);
+}
 
-    struct seqlite *s2 = extract_tag(b, r2, stat, &dropN);
-    if (args.dropN && dropN== 1) b->flag= FQ_FLAG_READ_QUAL;
+// Return sample of segment hits, -1 if the combination is not in sheet.
+static int demux_sample(const struct plan_group *g, const int *ids)
+{
+    uint64_t id = 0;
+    int i;
+    for (i = 0; i < g->n; ++i) id += ids[i]*demux.stride[i];
+    return demux.map[id];
+}
 
-    b->s0.l = 0;
-    b->q0.l = 0;
-    kstr_copy(&b->s0, s1->seq);
-    kstr_copy(&b->q0, s1->qual);
+// Called by writer only. BGZF holds one block per file and hands full blocks
+// to the pool, which bounds the buffered data of each sample.
+// Return bytes written.
+static int demux_write(const struct bseq *b, int sample)
+{
+    kstring_t *str = &demux.str;
+    BGZF *fp1 = demux.fp[sample*2];
+    BGZF *fp2 = demux.fp[sample*2+1] ? demux.fp[sample*2+1] : fp1;
+    str->l = 0;
+    ksprintf(str, "%c%s\n%s\n", b->q0.l ? '@' : '>', b->n0.s, b->s0.s);
+    if (b->q0.l) ksprintf(str, "+\n%s\n", b->q0.s);
+    if (fp2 == fp1 && b->s1.l > 0) {
+        ksprintf(str, "%c%s\n%s\n", b->q1.l ? '@' : '>', b->n0.s, b->s1.s);
+        if (b->q1.l) ksprintf(str, "+\n%s\n", b->q1.s);
+    }
+    if (bgzf_write(fp1, str->s, str->l) != str->l) error("Failed to write sample %s.", dict_name(demux.names, sample));
+    int l = str->l;
+    if (fp2 == fp1 || b->s1.l == 0) return l;
+    str->l = 0;
+    ksprintf(str, "%c%s\n%s\n", b->q1.l ? '@' : '>', b->n0.s, b->s1.s);
+    if (b->q1.l) ksprintf(str, "+\n%s\n", b->q1.s);
+    if (bgzf_write(fp2, str->s, str->l) != str->l) error("Failed to write sample %s.", dict_name(demux.names, sample));
+    return l + str->l;
+}
 
-    b->s1.l = 0;
-    b->q1.l = 0;
-    if (s2 && s2->seq->l) kstr_copy(&b->s1, s2->seq);
-    if (s2 && s2->qual->l) kstr_copy(&b->q1, s2->qual);
+static void demux_close()
+{
+    if (demux.fp == NULL) return;
+    int i;
+    for (i = 0; i < demux.n*2; ++i) {
+        if (demux.fp[i] && bgzf_close(demux.fp[i])) error("Failed to close output of sample %s.", dict_name(demux.names, i/2));
+    }
+    free(demux.fp);
+    demux.fp = NULL;
+    if (demux.str.m) free(demux.str.s);
+}
 
-    seqlite_destory(s1);
-    if (s2) seqlite_destory(s2);
-    
-    return stat;
+// Per sample summary, same items as -report.
+static void demux_report(const char *dir)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/sample_report.csv", dir);
+    FILE *fp = fopen(str.s, "w");
+    CHECK_EMPTY(fp, "%s : %s.", str.s, strerror(errno));
+    free(str.s);
+    fprintf(fp, "Sample,Number of Fragments,Fragments pass QC,Fragments with Exactly Matched Sample Barcodes,"
+            "Fragments with Failed Barcodes,Fragments Filtered on Low Quality,Q30 bases in Reads\n");
+    int i;
+    for (i = 0; i < demux.n; ++i) {
+        struct sample_stat *st = &demux.stats[i];
+        fprintf(fp, "%s,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%.1f%%\n", dict_name(demux.names, i),
+                st->raw, st->pass, st->exact, st->failed_barcode, st->lowqual,
+                (float)st->q30_bases_reads/(st->bases_reads+1)*100);
+    }
+    fclose(fp);
 }
 
-static void *run_it(void *_p, int idx)
+static void demux_destroy()
 {
-    struct bseq_pool *p = (struct bseq_pool*)_p;
-    struct args *opts = p->opts;
+    if (demux.names == NULL) return;
+    dict_destroy(demux.names);
+    free(demux.map);
+    free(demux.stats);
+}
 
-    int i;
-    for (i = 0; i < p->n; ++i) {
-        struct bseq *b = &p->s[i];
-        b->flag = FQ_FLAG_PASS;
-        struct fq_data *data = malloc(sizeof(struct fq_data));
-        memset(data, 0, sizeof(struct fq_data));
-        b->data = data;
-
-        if (config.sample_barcodes) {
-            // sample barcode
-            struct BRstat *sample_stat = extract_sample_barcode_reads(
-                b,
-                config.n_sample_barcode,
-                config.sample_barcodes,
-                config.sample_barcode_tag,
-                config.raw_sample_barcode_tag,
-                config.raw_sample_barcode_qual_tag);
-            
-            if (sample_stat == NULL) {
+// Return 1 if the read is filtered and the rest of plan is skipped.
+static int plan_run(const struct plan_group *g, struct bseq *b, int *delta, struct args *opts)
+{
+    struct fq_data *data = b->data;
+    struct seg_view v;
+    struct read_qc qc[2];
+    int ids[PLAN_MAX_SEG], exact[PLAN_MAX_SEG];
+    int i, all_exact;
+    switch (g->kind) {
+        case plan_sample:
+            if (plan_barcode(g, b, delta, &data->q30_bases_sample_barcode, &data->bases_sample_barcode, ids, exact)) {
                 b->flag = FQ_FLAG_SAMPLE_FAIL;
-                continue;
+                return 1;
             }
-        
-            data->q30_bases_sample_barcode = sample_stat->q30_bases;
-            data->bases_sample_barcode = sample_stat->bases;
-            free(sample_stat);
-        }
+            if (bc.on && g == &plan.groups[bc.group]) data->bc_id = bc_dense_id(g, ids);
+            if (demux.map) {
+                data->sample = demux_sample(g, ids);
+                if (data->sample == -1) {
+                    b->flag = FQ_FLAG_SAMPLE_FAIL;
+                    return 1;
+                }
+                for (i = 0, all_exact = 1; i < g->n; ++i)
+                    if (exact[i] == 0) all_exact = 0;
+                data->sample_exact = all_exact;
+            }
+            return 0;
 
-        // UMI
-        if (config.UMI) {
-            struct BRstat *umi_stat = extract_umi(
-                b,
-                config.UMI,
-                config.umi_tag,
-                config.umi_qual_tag);
-
-            if (umi_stat == NULL) error("Failed to extract UMIs.");
-            
-            data->q30_bases_umi = umi_stat->q30_bases;
-            data->bases_umi = umi_stat->bases;
-            free(umi_stat);
-        }
-        
-        if (config.cell_barcodes) {
-            // cell barcode
-            struct BRstat* cell_stat = extract_cell_barcode_reads(
-                b,
-                config.n_cell_barcode,
-                config.cell_barcodes,
-                config.cell_barcode_tag,
-                config.raw_cell_barcode_tag,
-                config.raw_cell_barcode_qual_tag,
-                opts->run_code
-                );
-            
-            if (cell_stat == NULL) {
+        case plan_umi:
+            if (seg_locate(b, &g->segs[0], delta, &v)) {
                 b->flag = FQ_FLAG_BC_FAILURE;
-                continue;
+                return 1;
+            }
+            read_qc(v.s, v.q, v.l, &qc[0]);
+            if (opts->dropN && qc[0].n) b->flag = FQ_FLAG_READ_QUAL;
+            name_tag(&b->n0, g->tag);
+            kputsn(v.s, v.l, &b->n0);
+            if (g->qual_tag && v.q) {
+                name_tag(&b->n0, g->qual_tag);
+                kputsn(v.q, v.l, &b->n0);
             }
+            data->q30_bases_umi = qc[0].q30;
+            data->bases_umi = v.l;
+            return 0;
 
-            if (cell_stat->filter == 1) {
-                free(cell_stat);
+        case plan_cell:
+            if (plan_barcode(g, b, delta, &data->q30_bases_cell_barcode, &data->bases_cell_barcode, ids, exact)) {
                 b->flag = FQ_FLAG_BC_FAILURE;
-                continue;
+                return 1;
             }
-            data->q30_bases_cell_barcode = cell_stat->q30_bases;
-            data->bases_cell_barcode = cell_stat->bases;
-            data->cr_exact_match = cell_stat->exact_match;
-            if (cell_stat->exact_match) {
-                b->flag = FQ_FLAG_BC_EXACTMATCH;
+            if (bc.on) data->bc_id = bc_dense_id(g, ids);
+            if (bc.dis) bc_seg_hits(g, ids, exact);
+            for (i = 0, all_exact = 1; i < g->n; ++i)
+                if (exact[i] == 0) all_exact = 0;
+            data->cr_exact_match = all_exact;
+            if (all_exact) b->flag = FQ_FLAG_BC_EXACTMATCH;
+            return 0;
+
+        case plan_reads:
+            if (plan_cut_reads(g, b, delta, qc)) {
+                b->flag = FQ_FLAG_BC_FAILURE;
+                return 1;
             }
-            free(cell_stat);
-        }
+            data->q30_bases_reads = qc[0].q30 + qc[1].q30;
+            data->bases_reads = b->s0.l + b->s1.l;
+            if (opts->dropN && (qc[0].n || qc[1].n)) b->flag = FQ_FLAG_READ_QUAL;
+            if (b->flag != FQ_FLAG_PASS) return 1;
 
-        if (config.read_1) {
-            // clean sequence
-            struct BRstat *read_stat = extract_reads(b, config.read_1, config.read_2);
-            data->q30_bases_reads = read_stat->q30_bases;
-            data->bases_reads = read_stat->bases;
-            free(read_stat);
-            if (b->flag != FQ_FLAG_PASS) continue;
-            
-            if (opts->bgiseq_filter) {
-                if (b->q0.l) {
-                    int k;
-                    int bad_bases = 0;
-                    for (k = 0; k < 15 && k <b->q0.l; ++k) {
-                        if (b->q0.s[k]-33<10) bad_bases++;
-                    }
-                    if (bad_bases >2) {
-                        b->flag = FQ_FLAG_READ_QUAL;
-                        continue;
-                    }
-                    else {
-                        if (b->q1.l) {
-                            for (k = 0; k < 15 && k <b->q1.l; ++k) {
-                                if (b->q1.s[k]-33<10) bad_bases++;
-                            }
-                            if (bad_bases >2) {
-                                b->flag = FQ_FLAG_READ_QUAL;
-                                continue;
-                            }
-                        }
-                    }                
+            if (opts->bgiseq_filter && b->q0.l) {
+                if (qc[0].low > 2 || (b->q1.l && qc[0].low + qc[1].low > 2)) {
+                    b->flag = FQ_FLAG_READ_QUAL;
+                    return 1;
                 }
             }
 
-            if (opts->qual_thres > 0 && b->q0.l) { 
-                int k;
-                int ave = 0;
-                
-                for (k = 0; k < b->q0.l; k++) ave+=b->q0.s[k]-33;
-                if (ave/k < opts->qual_thres) {
+            if (opts->qual_thres > 0 && b->q0.l) {
+                if (qc[0].qsum/(int)b->q0.l < opts->qual_thres ||
+                    (b->q1.l > 0 && qc[1].qsum/(int)b->q1.l < opts->qual_thres)) {
                     b->flag = FQ_FLAG_READ_QUAL;
-                    continue;
-                }
-
-                if (b->q1.l > 0) {
-                    ave = 0;
-                    for (k = 0; k < b->q1.l; k++) ave+=b->q1.s[k]-33;
-                    if (ave/k < opts->qual_thres) {
-                        b->flag = FQ_FLAG_READ_QUAL;
-                        continue;
-                    }
+                    return 1;
                 }
             }
-        }
+            return 0;
+    }
+    return 0;
+}
+
+static void *run_it(void *_p, int idx)
+{
+    struct bseq_pool *p = (struct bseq_pool*)_p;
+    struct args *opts = p->opts;
+    if (p->n == 0) return p; // end of lane
+    // freed by write_out with the chunk
+    struct fq_data *data = calloc(p->n, sizeof(struct fq_data));
+
+    int i, j;
+    int delta[PLAN_MAX_ANCHOR];
+    for (i = 0; i < p->n; ++i) {
+        struct bseq *b = &p->s[i];
+        b->flag = FQ_FLAG_PASS;
+        b->data = &data[i];
+        data[i].bc_id = -1;
+        data[i].sample = -1;
+        b->n0.l = strlen(b->n0.s); // "/1" may be cut by trim_read_tail, tags are appended after
+        for (j = 0; j < plan.n_anchor; ++j) delta[j] = ANCHOR_UNSET;
+        for (j = 0; j < plan.n_group; ++j)
+            if (plan_run(&plan.groups[j], b, delta, opts)) break;
+        if (bc.on && (b->flag == FQ_FLAG_PASS || b->flag == FQ_FLAG_BC_EXACTMATCH))
+            bc_count(b, &data[i]);
     }    
     return p;
 }
+// Fragment is grouped by cell barcode tag value, run code included, the same
+// key fsort -tag CB sorts on.
+static void bucket_write(struct fq_bucket *B, const struct bseq *b)
+{
+    static kstring_t str = {0,0,0}; // writer only
+    const struct fq_data *data = b->data;
+    const char *key = b->n0.s + data->bc_off;
+    int l_key = 0;
+    for (; key[l_key] && key[l_key] != '|'; ++l_key);
+    str.l = 0;
+    ksprintf(&str, "%c%s\n%s\n", b->q0.l ? '@' : '>', b->n0.s, b->s0.s);
+    if (b->q0.l) ksprintf(&str, "+\n%s\n", b->q0.s);
+    if (b->s1.l > 0) {
+        ksprintf(&str, "%c%s\n%s\n", b->q1.l ? '@' : '>', b->n0.s, b->s1.s);
+        if (b->q1.l) ksprintf(&str, "+\n%s\n", b->q1.s);
+    }
+    fq_bucket_push(B, key, l_key, str.s, str.l);
+}
+
 static void write_out(void *_data)
 {
     struct bseq_pool *p = (struct bseq_pool*)_data;
@@ -837,14 +1319,20 @@ static void write_out(void *_data)
 
     FILE *fp1 = opts->out1_fp == NULL ? stdout : opts->out1_fp;
     FILE *fp2 = opts->out2_fp == NULL ? fp1 : opts->out2_fp;
+    uint64_t bytes = 0;
     int i;
-    int ret;
     // because the output queue is order, we do not consider the thread-safe of summary report
+    // barcodes are counted by workers, see bc_count()
     for (i = 0; i < p->n; ++i) {
         struct bseq *b = &p->s[i];
         struct fq_data *data = (struct fq_data*)b->data;
-        
+        struct sample_stat *st = data->sample >= 0 ? &demux.stats[data->sample] : NULL;
+
         opts->raw_reads++;
+        if (st) {
+            st->raw++;
+            if (data->sample_exact) st->exact++;
+        }
         if (b->flag == FQ_FLAG_SAMPLE_FAIL) {
             opts->filtered_by_sample++;
             goto background_reads;
@@ -852,11 +1340,13 @@ static void write_out(void *_data)
         
         if (b->flag == FQ_FLAG_BC_FAILURE) {
             opts->filtered_by_barcode++;
+            if (st) st->failed_barcode++;
             goto background_reads;
         }
 
         if (b->flag == FQ_FLAG_READ_QUAL) {
             opts->filtered_by_lowqual++;
+            if (st) st->lowqual++;
             continue; // just skip ALL low quality reads
         }
 
@@ -870,61 +1360,22 @@ static void write_out(void *_data)
         if (0) {
           flag_pass:
             opts->reads_pass_qc++;
-            fprintf(fp1, "%c%s\n%s\n", b->q0.l ? '@' : '>', b->n0.s, b->s0.s);
-            if (b->q0.l) fprintf(fp1, "+\n%s\n", b->q0.s);
-            if (b->s1.l > 0) {
-                fprintf(fp2, "%c%s\n%s\n", b->q1.l ? '@' : '>', b->n0.s, b->s1.s);
-                if (b->q1.l) fprintf(fp2, "+\n%s\n", b->q1.s);
+            if (demux.fp) {
+                st->pass++;
+                bytes += demux_write(b, data->sample);
             }
-
-            if (data->bc_str && opts->cbhash) {
-                khint_t k;
-                k = kh_get(str, opts->cbhash, (char*)data->bc_str);
-                if (k == kh_end(opts->cbhash)) {
-                    if (opts->n_name == opts->m_name) {
-                        opts->m_name += 10000;
-                        opts->names = realloc(opts->names,opts->m_name *sizeof(struct name_count_pair));                        
-                    }
-                    struct name_count_pair *pair = &opts->names[opts->n_name];
-                    pair->name = strdup(data->bc_str);
-                    pair->count = 1;
-                    k = kh_put(str,opts->cbhash, pair->name, &ret);
-                    kh_val(opts->cbhash, k) = opts->n_name;
-                    opts->n_name++;
-                }
-                else {
-                    int id = kh_val(opts->cbhash, k);
-                    struct name_count_pair *pair = &opts->names[id];
-                    pair->count++;
+            else if (opts->buckets) bucket_write(opts->buckets, b); // counted when buckets are written
+            else {
+                bytes += fprintf(fp1, "%c%s\n%s\n", b->q0.l ? '@' : '>', b->n0.s, b->s0.s);
+                if (b->q0.l) bytes += fprintf(fp1, "+\n%s\n", b->q0.s);
+                if (b->s1.l > 0) {
+                    bytes += fprintf(fp2, "%c%s\n%s\n", b->q1.l ? '@' : '>', b->n0.s, b->s1.s);
+                    if (b->q1.l) bytes += fprintf(fp2, "+\n%s\n", b->q1.s);
                 }
             }
         }
 
-        if (0) {
-          background_reads:                        
-            if (data->bc_str && opts->bghash) {
-                khint_t k;
-                k = kh_get(str, opts->bghash, (char*)data->bc_str);
-                if (k == kh_end(opts->bghash)) {
-                    if (opts->n_bg == opts->m_bg) {
-                        opts->m_bg += 10000;
-                        opts->bgnames = realloc(opts->bgnames,opts->m_bg *sizeof(struct name_count_pair));                        
-                    }
-                    struct name_count_pair *pair = &opts->bgnames[opts->n_bg];
-                    pair->name = strdup(data->bc_str);
-                    pair->count = 1;
-                    k = kh_put(str,opts->bghash, pair->name, &ret);
-                    kh_val(opts->bghash, k) = opts->n_bg;
-                    opts->n_bg++;
-                }
-                else {
-                    int id = kh_val(opts->bghash, k);
-                    struct name_count_pair *pair = &opts->bgnames[id];
-                    pair->count++;
-                }
-            }
-            
-        }
+      background_reads:
         opts->q30_bases_cell_barcode += (uint64_t)data->q30_bases_cell_barcode;
         opts->q30_bases_sample_barcode += (uint64_t)data->q30_bases_sample_barcode;
         opts->q30_bases_umi += (uint64_t)data->q30_bases_umi;
@@ -933,31 +1384,106 @@ static void write_out(void *_data)
         opts->bases_sample_barcode += (uint64_t)data->bases_sample_barcode;
         opts->bases_umi += (uint64_t)data->bases_umi;
         opts->bases_reads += (uint64_t)data->bases_reads;
+        if (st) {
+            st->q30_bases_reads += (uint64_t)data->q30_bases_reads;
+            st->bases_reads += (uint64_t)data->bases_reads;
+        }
         // opts->barcode_exactly_matched += data->cr_exact_match;
-        if (data->bc_str) free(data->bc_str);
-        free(data);
     }
+    stats_output(bytes);
+    if (p->n) free(p->s[0].data);
     bseq_pool_destroy(p);
     fflush(fp1);
     if (fp2 != fp1) fflush(fp2);
 }
+
 static int cmpfunc (const void *a, const void *b)
-{    
-    return ( ((struct name_count_pair*)b)->count - ((struct name_count_pair*)a)->count );
+{
+    const struct name_count_pair *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+static void bc_push_pair(struct name_count_pair **a, int *n, int *m, kstring_t *name, uint32_t count)
+{
+    if (*n == *m) {
+        *m = *m == 0 ? 10000 : *m<<1;
+        *a = realloc(*a, *m*sizeof(struct name_count_pair));
+    }
+    if (args.run_code) {
+        kputc('-', name);
+        kputs(args.run_code, name);
+    }
+    (*a)[*n].name = strdup(name->s);
+    (*a)[*n].count = count;
+    (*n)++;
 }
 void cell_barcode_count_pair_write()
 {
-    if (args.cbdis_fp && args.n_name && args.cbhash) {
-        qsort(args.names, args.n_name, sizeof(struct name_count_pair), cmpfunc);
-        int i;
-        for (i = 0; i < args.n_name; ++i) {
-            fprintf(args.cbdis_fp, "%s\t%d\n", args.names[i].name, args.names[i].count);
-            free(args.names[i].name);
+    if (bc.on == 0) return;
+    struct name_count_pair *a = NULL;
+    int n = 0, m = 0;
+    kstring_t str = {0,0,0};
+    char buf[32];
+    const struct plan_group *g = &plan.groups[bc.group];
+    uint64_t id;
+    int i;
+    for (id = 0; id < bc.n_dense && bc.counts; ++id) {
+        if (bc.counts[id] == 0) continue;
+        str.l = 0;
+        for (i = 0; i < g->n; ++i)
+            kputs(ss_name(g->segs[i].wl, id/bc.stride[i] % ss_size(g->segs[i].wl), buf), &str);
+        bc_push_pair(&a, &n, &m, &str, bc.counts[id]);
+    }
+    // merge shards of worker threads
+    struct bc_shard *sh, *sh0 = bc.shards;
+    khint_t k, k0;
+    int ret;
+    for (sh = sh0 ? sh0->next : NULL; sh; sh = sh->next) {
+        for (k = kh_begin(sh->packed); k != kh_end(sh->packed); ++k) {
+            if (!kh_exist(sh->packed, k)) continue;
+            k0 = kh_put(bc64, sh0->packed, kh_key(sh->packed, k), &ret);
+            if (ret) kh_val(sh0->packed, k0) = 0;
+            kh_val(sh0->packed, k0) += kh_val(sh->packed, k);
+        }
+        for (k = kh_begin(sh->str); k != kh_end(sh->str); ++k) {
+            if (!kh_exist(sh->str, k)) continue;
+            k0 = kh_put(str, sh0->str, (char*)kh_key(sh->str, k), &ret);
+            if (ret) kh_val(sh0->str, k0) = 0;
+            else free((char*)kh_key(sh->str, k));
+            kh_val(sh0->str, k0) += kh_val(sh->str, k);
+        }
+    }
+    if (sh0) {
+        for (k = kh_begin(sh0->packed); k != kh_end(sh0->packed); ++k) {
+            if (!kh_exist(sh0->packed, k)) continue;
+            bc_unpack(kh_key(sh0->packed, k), &str);
+            bc_push_pair(&a, &n, &m, &str, kh_val(sh0->packed, k));
+        }
+        for (k = kh_begin(sh0->str); k != kh_end(sh0->str); ++k) {
+            if (!kh_exist(sh0->str, k)) continue;
+            str.l = 0;
+            kputs(kh_key(sh0->str, k), &str);
+            bc_push_pair(&a, &n, &m, &str, kh_val(sh0->str, k));
+            free((char*)kh_key(sh0->str, k));
         }
-        free(args.names);
-        fclose(args.cbdis_fp);
     }
-    if (args.cbhash) kh_destroy(str,args.cbhash);
+    while (bc.shards) {
+        sh = bc.shards;
+        bc.shards = sh->next;
+        kh_destroy(bc64, sh->packed);
+        kh_destroy(str, sh->str);
+        free(sh);
+    }
+    if (bc.counts) free(bc.counts);
+    if (str.m) free(str.s);
+
+    qsort(a, n, sizeof(struct name_count_pair), cmpfunc);
+    for (i = 0; i < n; ++i) {
+        fprintf(args.cbdis_fp, "%s\t%u\n", a[i].name, a[i].count);
+        free(a[i].name);
+    }
+    if (a) free(a);
+    fclose(args.cbdis_fp);
 }
 void report_write()
 {
@@ -978,32 +1504,20 @@ void report_write()
 }
 void full_details()
 {
-    /*
-    if (args.barcode_dis_fp) {
-        LOG_print("Cell barcodes summary.");
-        int i, j, k;
-      
-        for (i = 1; i < args.n_thread; ++i) {
-            for (j = 0; j < args.hold[i]->n; ++j) {
-                struct segment *s0 = args.hold[0]->seg[j];
-                struct segment *s1 = args.hold[i]->seg[j];
-                for (k = 0; k < s1->n; ++k) {
-                    s0->counts[k].matched += s1->counts[k].matched;
-                    s0->counts[k].corrected += s1->counts[k].corrected;
-                }
-            }
-        }
-      
-        for (i = 0; i < config.n_cell_barcode; ++i) {
-            struct bcode_reg *br = &config.cell_barcodes[i];
-            struct segment *s0 = args.hold[0]->seg[i];
-            fprintf(args.barcode_dis_fp, "# Read %d, %d-%d\n", br->rd, br->start, br->end);
-            for (j = 0; j < br->n_wl; ++j)
-                fprintf(args.barcode_dis_fp, "%s\t%"PRIu64"\t%"PRIu64"\n", br->white_list[j], s0->counts[j].matched, s0->counts[j].corrected);
-        }
+    if (bc.dis == 0) return;
+    LOG_print("Cell barcodes summary.");
+    const struct plan_group *g = &plan.groups[bc.group];
+    char buf[32];
+    int i, j;
+    for (i = 0; i < g->n; ++i) {
+        const struct plan_seg *sg = &g->segs[i];
+        fprintf(args.barcode_dis_fp, "# Read %d, %d-%d\n", sg->rd+1, sg->start+1, sg->start+sg->len);
+        if (sg->wl == NULL) continue;
+        for (j = 0; j < ss_size(sg->wl); ++j)
+            fprintf(args.barcode_dis_fp, "%s\t%"PRIu64"\t%"PRIu64"\n", ss_name(sg->wl, j, buf), bc.matched[i][j], bc.corrected[i][j]);
+        free(bc.matched[i]);
+        free(bc.corrected[i]);
     }
-    */
-
 }
 static void memory_release()
 {
@@ -1022,6 +1536,8 @@ static int parse_args(int argc, char **argv)
     const char *thread = NULL;
     const char *chunk_size = NULL;    
     const char *qual_thres = NULL;
+    const char *n_bucket = NULL;
+    const char *bucket_mem = NULL;
     for (i = 1; i < argc;) {
         const char *a = argv[i++];
         const char **var = 0;
@@ -1031,11 +1547,16 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-2") == 0) var = &args.out2_fname;
         else if (strcmp(a, "-config") == 0) var = &args.config_fname;
         else if (strcmp(a, "-cbdis") == 0) var = &args.cbdis_fname;
-        else if (strcmp(a, "-t") == 0) var = &thread; // skip
-        else if (strcmp(a, "-r") == 0) var = &chunk_size; // skip
+        else if (strcmp(a, "-t") == 0) var = &thread;
+        else if (strcmp(a, "-r") == 0) var = &chunk_size;
         else if (strcmp(a, "-run") == 0) var = &args.run_code;
         else if (strcmp(a, "-report") == 0) var = &args.report_fname;
         else if (strcmp(a, "-dis") == 0) var = &args.dis_fname;
+        else if (strcmp(a, "-sheet") == 0) var = &args.sheet_fname;
+        else if (strcmp(a, "-outdir") == 0) var = &args.outdir;
+        else if (strcmp(a, "-bucket") == 0) var = &n_bucket;
+        else if (strcmp(a, "-bucket-prefix") == 0) var = &args.bucket_prefix;
+        else if (strcmp(a, "-m") == 0) var = &bucket_mem;
         else if (strcmp(a, "-q") == 0) var = &qual_thres;       
         else if (strcmp(a, "-f") == 0) {
             args.bgiseq_filter = 1;
@@ -1068,11 +1589,14 @@ static int parse_args(int argc, char **argv)
 
     if (args.config_fname == NULL) error("Option -config is required.");
     config_init(args.config_fname);
+    if (args.sheet_fname) sheet_load(args.sheet_fname);
+    plan_compile(args.run_code);
     LOG_print("Configure file inited.");
     
-    // if (thread) args.n_thread = str2int((char*)thread);
+    if (thread) args.n_thread = str2int((char*)thread);
     if (chunk_size) args.chunk_size = str2int((char*)chunk_size);
-    // assert(args.n_thread >= 1 && args.chunk_size >= 1);
+    if (args.n_thread < 1) args.n_thread = 1;
+    assert(args.chunk_size >= 1);
     if (qual_thres) {
         args.qual_thres = str2int((char*)qual_thres);
         LOG_print("Average quality below %d will be drop.", args.qual_thres);
@@ -1080,12 +1604,40 @@ static int parse_args(int argc, char **argv)
 
     if (args.r1_fname == NULL && (!isatty(fileno(stdin)))) args.r1_fname = "-";
     if (args.r1_fname == NULL) error("Fastq file(s) must be set.");
+
+    args.fastq = fastq_handler_init(args.r1_fname, args.r2_fname, args.smart_pair, args.chunk_size);
+    if (args.fastq == NULL) error("Failed to init input fastq.");
+
+    // Every input file of a lane is decompressed by a reader thread of its
+    // own, R1 and R2 always apart. Readers take up to half of -t, so several
+    // lanes are decoded at once; workers and compression share the rest.
+    int per_lane = args.r2_fname ? 2 : 1;
+    int n_lane = args.n_thread/(2*per_lane);
+    if (n_lane < 1) n_lane = 1;
+    if (n_lane > args.fastq->n_file) n_lane = args.fastq->n_file;
+    gpool_init(args.n_thread - n_lane*per_lane);
+    fastq_handler_threads(args.fastq, n_lane, 2, args.n_thread*2);
         
     if (args.report_fname) {
         args.report_fp = fopen(args.report_fname, "w");
         CHECK_EMPTY(args.report_fp, "%s : %s.", args.report_fname, strerror(errno));
     }
 
+    if (args.outdir) {
+        if (args.sheet_fname == NULL) error("Option -outdir works with -sheet.");
+        if (args.out1_fname || args.out2_fname) error("Option -outdir conflicts with -1 and -2.");
+        demux_open(args.outdir, config.read_2 != NULL || (config.read_1 == NULL && (args.r2_fname || args.smart_pair)));
+    }
+
+    if (n_bucket) {
+        args.n_bucket = str2int(n_bucket);
+        if (args.bucket_prefix == NULL) error("Option -bucket-prefix is required for -bucket.");
+        if (args.outdir || args.out1_fname || args.out2_fname) error("Option -bucket conflicts with -outdir, -1 and -2.");
+        if (config.cell_barcodes == NULL) error("Option -bucket needs cell barcode in configure file.");
+        if (bucket_mem) args.bucket_mem = human2int(bucket_mem);
+        args.buckets = fq_bucket_init(args.bucket_prefix, args.n_bucket, args.bucket_mem);
+    }
+
     if (args.out1_fname) {
         args.out1_fp = fopen(args.out1_fname, "w");
         if (args.out1_fp == NULL) error("%s: %s.", args.out1_fname, strerror(errno));
@@ -1094,15 +1646,11 @@ static int parse_args(int argc, char **argv)
             if (args.out2_fp == NULL) error("%s: %s.", args.out2_fname, strerror(errno));
         }
     }
-    
-    args.fastq = fastq_handler_init(args.r1_fname, args.r2_fname, args.smart_pair, args.chunk_size);
-    if (args.fastq == NULL) error("Failed to init input fastq.");
+
 
     if (args.cbdis_fname) {
         args.cbdis_fp = fopen(args.cbdis_fname, "w");
         if (args.cbdis_fp == NULL) error("%s : %s.", args.cbdis_fname, strerror(errno));
-        args.cbhash = kh_init(str);
-        args.bghash = kh_init(str);
     } 
         
     // if (args.run_code == NULL) args.run_code = strdup("1");
@@ -1111,12 +1659,26 @@ static int parse_args(int argc, char **argv)
         args.barcode_dis_fp = fopen(args.dis_fname, "w");
         CHECK_EMPTY(args.barcode_dis_fp, "%s : %s.", args.dis_fname, strerror(errno));
     }
+    bc_init(args.cbdis_fp != NULL, args.barcode_dis_fp != NULL);
     
     return 0;
 }
 
 extern int fastq_parse_usage();
 
+static void *parse_read(void *opts)
+{
+    return fastq_read(args.fastq, opts);
+}
+static void *parse_run(void *data, void *opts)
+{
+    return run_it(data, 0);
+}
+static void parse_write(void *data, void *opts)
+{
+    fastq_write_lanes(args.fastq, data, write_out);
+}
+
 int fastq_prase_barcodes(int argc, char **argv)
 {
     double t_real;
@@ -1124,20 +1686,25 @@ int fastq_prase_barcodes(int argc, char **argv)
     
     if (parse_args(argc, argv)) return fastq_parse_usage();
 
-    for (;;) {
-        struct bseq_pool *b = fastq_read(args.fastq, &args);
-        if (b == NULL) break;
-        b = run_it(b, 0);
-        write_out(b);
-    }
-    // todo: multi-threads parse
+    // report stats are summed by write_out in input order, barcodes are
+    // counted by the workers, see bc_count()
+    pipeline_run(args.n_thread*2, parse_read, parse_run, parse_write, &args);
     
     cell_barcode_count_pair_write();
 
     report_write();
     // todo: html report
     full_details();
-    
+
+    demux_close();
+    if (args.buckets) {
+        uint64_t n = fq_bucket_close(args.buckets, args.n_thread);
+        LOG_print("Write %"PRIu64" fragments into %d buckets.", n, args.n_bucket);
+    }
+    gpool_destroy();
+    if (args.outdir) demux_report(args.outdir);
+    demux_destroy();
+
     memory_release();
 
     config_destory();
@@ -6,6 +6,9 @@
 #include "read_tags.h"
 #include "htslib/thread_pool.h"
 #include "htslib/bgzf.h"
+#include "thread.h"
+#include "fqi.h"
+#include "stats.h"
 #include <zlib.h>
 #include <ctype.h>
 #include <sys/stat.h>
@@ -19,7 +22,7 @@ static struct args {
     const char *prefix;
     const char *report_fname;
     int dropN;    
-    int n_thread;
+    int n_thread; // size of global thread pool
     int dedup;
     const char *dup_tag;
     int paired;
@@ -115,9 +118,11 @@ static int parse_args(int argc, char **argv)
 
     free(s); free(str.s);
     
-    //if (thread) args.n_thread = str2int(thread);
-    if (file_thread) args.n_thread = str2int(file_thread);
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_thread;
+    if (thread) args.n_thread = str2int(thread);
     if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
     if (memory) args.mem_per_thread = human2int(memory);
 
     if (args.mem_per_thread < MIN_MEM_PER_THREAD) args.mem_per_thread = MIN_MEM_PER_THREAD;
@@ -143,6 +148,7 @@ struct record_offset {
 
 struct read_block {
     struct dict *dict;
+    char **names; // sorted names of dict
     int n, m;
     struct record_offset *idx;
     int max;
@@ -153,6 +159,7 @@ struct fastq_idx {
     int n;
     char **name;
     int *length;
+    int *count; // records of each name
 };
 
 void fastq_idx_destroy(struct fastq_idx *i)
@@ -162,6 +169,7 @@ void fastq_idx_destroy(struct fastq_idx *i)
     free(i->name);
     //free(i->offset);
     free(i->length);
+    free(i->count);
     free(i);
 }
     
@@ -260,6 +268,8 @@ struct read_block *read_block_file(BGZF *fp, int max, int paired)
     }
     r->data = (uint8_t*) str.s;
     r->max = str.l;
+    stats_records(record);
+    stats_input(args.input_fname, bgzf_tell(fp) >> 16);
 
     LOG_print("Read %d records", record);
     return r;
@@ -353,8 +363,10 @@ void read_block_sort_by_name(struct read_block *r, struct dict *tag)
         ++i; // skip \0
     }
     
-    char **names = dict_names(r->dict);
-    qsort(names, dict_size(r->dict), sizeof(char*), name_cmp);   
+    int n = dict_size(r->dict);
+    r->names = malloc(n*sizeof(char*));
+    for (i = 0; i < n; ++i) r->names[i] = dict_name(r->dict, i);
+    qsort(r->names, n, sizeof(char*), name_cmp);   
 }
 
 void read_block_destroy(struct read_block *r)
@@ -363,6 +375,7 @@ void read_block_destroy(struct read_block *r)
     for (i = 0; i < r->n; ++i)
         if (r->idx[i].m) free(r->idx[i].offsets);
     free(r->idx);
+    free(r->names);
     dict_destroy(r->dict);
     free(r->data);
     free(r);
@@ -373,20 +386,22 @@ struct fastq_idx *write_block_with_idx(const char *fn, struct read_block *r)
     if (dict_size(r->dict) == 0) return NULL;
     BGZF *fp = bgzf_open(fn, "w");   
     if (fp == NULL) error("%s : %s.", fn, strerror(errno));
-    bgzf_mt(fp, args.n_thread, 256);
+    gpool_attach_bgzf(fp, gpool_high);
     struct fastq_idx *idx = malloc(sizeof(*idx));
     memset(idx, 0, sizeof(*idx));
     idx->n = dict_size(r->dict);
     idx->name = malloc(idx->n*sizeof(char*));
     idx->length = malloc(idx->n*sizeof(int));
+    idx->count = malloc(idx->n*sizeof(int));
     
     kstring_t buf ={0,0,0};
     int i;
     for (i = 0; i < idx->n; ++i) {
         idx->length[i] = 0;
-        char *name = dict_name(r->dict, i);
+        char *name = r->names[i];
         int old_idx = dict_query(r->dict, name);
         struct record_offset *off = &r->idx[old_idx];
+        idx->count[i] = off->n;
         int j;        
         for (j = 0; j < off->n; ++j) {
             buf.l = 0;
@@ -412,7 +427,7 @@ static int merge_cmp(const void *a, const void *b)
 
     return strcmp(ia->name, ib->name);
 }
-int fastq_merge_core(struct fastq_node **node, int n_node, BGZF *fp)
+int fastq_merge_core(struct fastq_node **node, int n_node, BGZF *fp, int *count)
 {
     // int n = n_node;
     if (node[0]->name == NULL) return 0;
@@ -429,6 +444,7 @@ int fastq_merge_core(struct fastq_node **node, int n_node, BGZF *fp)
             int ret = bgzf_write(fp, d->buf, d->n);
             if (ret != d->n) error("Failed to write. %s", d->fn);
             length+=d->n;
+            *count += d->idx->count[d->i];
             // cache next record
             d->i ++;
             if (d->i >= d->idx->n) { // close handler
@@ -455,20 +471,23 @@ int fastq_merge_core(struct fastq_node **node, int n_node, BGZF *fp)
     free(name);
     return length;
 }
-struct fastq_idx *fastq_merge(struct fastq_node **node, int n_node, const char *fn)
+// Index groups of final output if fqi is set.
+struct fastq_idx *fastq_merge(struct fastq_node **node, int n_node, const char *fn, int fqi)
 {
     // init
     BGZF *fp = bgzf_open(fn, "w");
     if (fp == NULL) error("%s : %s.", fn, strerror(errno));
-    bgzf_mt(fp, args.n_thread, 64);
+    struct fqi_writer *w = fqi ? fqi_writer_init(fp) : NULL;
+    gpool_attach_bgzf(fp, gpool_high);
     
     int i;
     for (i = 0; i < n_node; ++i) {
         struct fastq_node *d = node[i];
         d->fp = bgzf_open(d->fn, "r");
-        bgzf_mt(d->fp, args.n_thread, 64);
         // debug_print("%s", d->fn);
         if (d->fp == NULL) error("%s : %s.", d->fn, strerror(errno));
+        // up to max_file_open spill files are read at once, keep read-ahead small
+        gpool_attach_bgzf(d->fp, gpool_low);
         d->name = d->idx->name[0];
         d->m = d->idx->length[0] + 1;
         d->buf = malloc(d->m);
@@ -494,27 +513,33 @@ struct fastq_idx *fastq_merge(struct fastq_node **node, int n_node, const char *
             m_idx = m_idx == 0 ? 1024 : m_idx*2;
             idx->name = realloc(idx->name, m_idx*sizeof(char*));
             idx->length = realloc(idx->length, m_idx*sizeof(int));
+            idx->count = realloc(idx->count, m_idx*sizeof(int));
         }
         idx->name[idx->n] = strdup(node[0]->name);
-        
-        int l = fastq_merge_core(node, n, fp);
+        idx->count[idx->n] = 0;
+        int l = fastq_merge_core(node, n, fp, &idx->count[idx->n]);
         idx->length[idx->n] = l;
+        if (w) {
+            fqi_writer_push(w, idx->name[idx->n], l, idx->count[idx->n]);
+            stats_output(l); // final output only
+        }
         idx->n++;
     }
     for (i = 0; i < n_node; ++i) free(node[i]);
+    if (w) fqi_writer_close(w, fp, fn);
     bgzf_close(fp);
     LOG_print("Create %s from %d files.", fn, n_node);
     return idx;
 }
 
-struct fastq_idx *merge_files(struct fastq_stream *fastqs, int n, const char *fn)
+struct fastq_idx *merge_files(struct fastq_stream *fastqs, int n, const char *fn, int fqi)
 {
     struct fastq_node **nodes = malloc(n*sizeof(struct fastq_node*));
     int i;
     for (i = 0; i < n; ++i) {
         nodes[i] = fastqs[i].n;
     }
-    struct fastq_idx *idx = fastq_merge(nodes, n, fn);
+    struct fastq_idx *idx = fastq_merge(nodes, n, fn, fqi);
     free(nodes);
     return idx;
 }
@@ -561,19 +586,132 @@ void fastq_dedup_pool_destroy(struct fastq_dedup_pool *p)
     free(p->buf);
     free(p);
 }
-static int check_similar_sequences(char *s1, char *s2, int m)
+// Near duplicates differ in at most DEDUP_MISMATCH bases. Sequences are cut
+// into DEDUP_MISMATCH+1 parts, two sequences within the limit share at least
+// one identical part, so only sequences sharing a part are compared.
+#define DEDUP_MISMATCH 3
+#define DEDUP_PARTS    (DEDUP_MISMATCH+1)
+
+// Mismatches of two ASCII sequences, compared 8 bytes per word. Stop counting
+// once above max.
+static int hamming_bounded(const char *a, const char *b, int l, int max)
 {
-    int l1 = strlen(s1);
-    int l2 = strlen(s2);
-    if (l1 != l2) error("Inconsitant read length");
-    int i;
-    int e = 0;
-    for (i = 0; i < l1; ++i) {
-        if (s1[i] != s2[i])  e++;
-        if (e > m) return 1;
+    const uint64_t m7 = 0x7f7f7f7f7f7f7f7fULL;
+    int i, e = 0;
+    for (i = 0; i + 8 <= l; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a+i, 8);
+        memcpy(&y, b+i, 8);
+        x ^= y;
+        if (x == 0) continue;
+        // high bit set for each differing byte, no carry across bytes
+        x = (((x & m7) + m7) | x) & ~m7;
+        e += __builtin_popcountll(x);
+        if (e > max) return e;
     }
-    return 0;
+    for (; i < l; ++i)
+        if (a[i] != b[i] && ++e > max) return e;
+    return e;
+}
+
+struct part_key {
+    uint64_t h; // hash of length, part and part sequence
+    int id;
+    int part;
+};
+
+static int part_key_cmp(const void *a, const void *b)
+{
+    const struct part_key *x = a, *y = b;
+    if (x->h != y->h) return x->h < y->h ? -1 : 1;
+    return x->id - y->id;
+}
+static int int_cmp(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+// Merge r2 into r1 or r1 into r2, return 1 if r1 merged.
+static int dedup_merge(struct read_info_pool *r1, struct read_info_pool *r2)
+{
+    if (r1->n > r2->n || (r1->n == r2->n && r1->qual > r2->qual)) {
+        r1->dup += r2->dup;
+        r2->dup = -1;
+        return 0;
+    }
+    r2->dup += r1->dup;
+    r1->dup = -1;
+    return 1;
+}
+
+// Sequences are visited in order of first appearance, and candidates of each
+// in ascending order, so merges happen exactly as comparing all pairs.
+static void dedup_similar(struct fastq_dedup_pool *p)
+{
+    int n = p->n;
+    if (n < 2) return;
+    int *len = malloc(n*sizeof(int));
+    struct part_key *keys = malloc((size_t)n*DEDUP_PARTS*sizeof(struct part_key));
+    int i, k;
+    for (i = 0; i < n; ++i) {
+        const char *s = dict_name(p->dict, i);
+        int l = strlen(s);
+        len[i] = l;
+        for (k = 0; k < DEDUP_PARTS; ++k) {
+            int st = l*k/DEDUP_PARTS, ed = l*(k+1)/DEDUP_PARTS;
+            uint64_t h = 14695981039346656037ULL; // FNV-1a
+            h = (h ^ (uint64_t)l) * 1099511628211ULL;
+            h = (h ^ (uint64_t)k) * 1099511628211ULL;
+            int j;
+            for (j = st; j < ed; ++j) h = (h ^ (uint8_t)s[j]) * 1099511628211ULL;
+            struct part_key *e = &keys[i*DEDUP_PARTS+k];
+            e->h = h;
+            e->id = i;
+            e->part = k;
+        }
+    }
+    qsort(keys, (size_t)n*DEDUP_PARTS, sizeof(struct part_key), part_key_cmp);
+    int *pos = malloc((size_t)n*DEDUP_PARTS*sizeof(int));
+    for (i = 0; i < n*DEDUP_PARTS; ++i) pos[keys[i].id*DEDUP_PARTS+keys[i].part] = i;
+
+    int *cand = NULL;
+    int m_cand = 0;
+    for (i = 0; i < n; ++i) {
+        struct read_info_pool *r1 = &p->reads[i];
+        if (r1->dup == -1) continue;
+        // ids sorted within a part, entries after i's own are all behind i
+        int n_cand = 0;
+        for (k = 0; k < DEDUP_PARTS; ++k) {
+            int q = pos[i*DEDUP_PARTS+k];
+            uint64_t h = keys[q].h;
+            for (++q; q < n*DEDUP_PARTS && keys[q].h == h; ++q) {
+                if (n_cand == m_cand) {
+                    m_cand = m_cand == 0 ? 64 : m_cand<<1;
+                    cand = realloc(cand, m_cand*sizeof(int));
+                }
+                cand[n_cand++] = keys[q].id;
+            }
+        }
+        if (n_cand == 0) continue;
+        qsort(cand, n_cand, sizeof(int), int_cmp);
+        const char *rd1 = dict_name(p->dict, i);
+        int j;
+        for (j = 0; j < n_cand; ++j) {
+            if (j > 0 && cand[j] == cand[j-1]) continue;
+            if (cand[j] == i) continue; // parts of i collide with each other
+            struct read_info_pool *r2 = &p->reads[cand[j]];
+            if (r2->dup == -1) continue;
+            if (len[cand[j]] != len[i]) continue; // hash collision
+            if (hamming_bounded(rd1, dict_name(p->dict, cand[j]), len[i], DEDUP_MISMATCH) > DEDUP_MISMATCH) continue;
+            if (dedup_merge(r1, r2)) break;
+        }
+    }
+    free(cand);
+    free(pos);
+    free(keys);
+    free(len);
 }
+
 static struct fastq_dedup_pool *dedup_it(struct fastq_dedup_pool *p)
 {
     kstring_t str = {0,0,0};
@@ -661,41 +799,8 @@ static struct fastq_dedup_pool *dedup_it(struct fastq_dedup_pool *p)
             }            
         }
     }
-    char **names = dict_names(p->dict);
-    for (i = 0; i < p->n; ++i) {
-        struct read_info_pool *r1 = &p->reads[i];
-        if (r1->dup == -1) continue;
-        char *rd1 = names[i];
-        int j;
-        for (j = i +1; j < p->n; ++j) {
-            struct read_info_pool *r2 = &p->reads[j];
-            if (r2->dup ==-1) continue;
-            char *rd2 = names[j];
-            if (check_similar_sequences(rd1, rd2, 3) == 0) {
-                if (r1->n > r2->n) {
-                    r1->dup += r2->dup;
-                    r2->dup = -1;
-                }
-                else if (r1->n == r2->n) {
-                    if (r1->qual > r2->qual) {
-                        r1->dup += r2->dup;
-                        r2->dup = -1;
-                    }
-                    else {
-                        r2->dup += r1->dup;
-                        r1->dup = -1;
-                    }
-                }
-                else {
-                    r2->dup += r1->dup;
-                    r1->dup =-1;
-                }
-            }
+    dedup_similar(p);
 
-            if (r1->dup == -1) break;
-        }
-    }
-    
     // kstring_t str={0,0,0};
     str.l = 0;
     for (i = 0; i < p->n; ++i) {
@@ -762,12 +867,79 @@ void dedup_write(struct fastq_dedup_pool *dp, BGZF *out)
 {
     int ret =bgzf_write(out, dp->buf, dp->l_buf);
     assert(ret == dp->l_buf);
+    stats_output(dp->l_buf);
     // fputs(dp->buf, out);
     args.read_counts += dp->read_counts;
     args.nondup += dp->nondup;
     fastq_dedup_pool_destroy(dp);
 }
 
+// Barcode groups of merged file are deduplicated by workers in chunks, and
+// written in order.
+#define DEDUP_CHUNK_SIZE 1000000
+
+struct dedup_chunk {
+    int start, n; // groups [start, start+n) of idx
+    void **data;  // raw group, then dedup pool
+};
+
+struct dedup_stream {
+    BGZF *fp;
+    struct fastq_idx *idx;
+    int i;
+    BGZF *out;
+    struct fqi_writer *w;
+};
+
+static void *dedup_read(void *opts)
+{
+    struct dedup_stream *d = opts;
+    if (d->i == d->idx->n) return NULL;
+    struct dedup_chunk *c = malloc(sizeof(*c));
+    c->start = d->i;
+    c->n = 0;
+    c->data = NULL;
+    int m = 0;
+    int64_t size = 0;
+    while (d->i < d->idx->n && size < DEDUP_CHUNK_SIZE) {
+        int l = d->idx->length[d->i];
+        char *buf = malloc(l+1);
+        int ret = bgzf_read(d->fp, buf, l);
+        if (ret != l) error("Failed to read merged file.");
+        buf[l] = '\0';
+        if (c->n == m) {
+            m = m == 0 ? 64 : m<<1;
+            c->data = realloc(c->data, m*sizeof(void*));
+        }
+        c->data[c->n++] = buf;
+        size += l;
+        d->i++;
+    }
+    return c;
+}
+
+static void *dedup_run(void *data, void *opts)
+{
+    struct dedup_chunk *c = data;
+    int i;
+    for (i = 0; i < c->n; ++i) c->data[i] = dedup_str(c->data[i]);
+    return c;
+}
+
+static void dedup_flush(void *data, void *opts)
+{
+    struct dedup_stream *d = opts;
+    struct dedup_chunk *c = data;
+    int i;
+    for (i = 0; i < c->n; ++i) {
+        struct fastq_dedup_pool *dp = c->data[i];
+        fqi_writer_push(d->w, d->idx->name[c->start+i], dp->l_buf, dp->nondup);
+        dedup_write(dp, d->out);
+    }
+    free(c->data);
+    free(c);
+}
+
 extern int fsort_usage();
 
 int fsort(int argc, char **argv)
@@ -781,7 +953,7 @@ int fsort(int argc, char **argv)
     if (fp == NULL) error("%s : %s.", args.input_fname, strerror(errno));
     int type = bgzf_compression(fp);
     if (type == 2) 
-        bgzf_mt(fp, args.n_thread, 256);
+        gpool_attach_bgzf(fp, gpool_normal);
     
     int n_file = 0;
     int i_name = 0;
@@ -794,7 +966,7 @@ int fsort(int argc, char **argv)
             sprintf(name, "%s.%.4d.bgz", args.prefix, i_name);
             i_name++;
             
-            struct fastq_idx *idx = merge_files(fastqs, n_file, name);
+            struct fastq_idx *idx = merge_files(fastqs, n_file, name, 0);
             memset(fastqs, 0, sizeof(struct fastq_stream)*max_file_open);
             fastqs[0].n = malloc(sizeof(struct fastq_node));
             memset(fastqs[0].n, 0, sizeof(struct fastq_node));
@@ -825,30 +997,30 @@ int fsort(int argc, char **argv)
     if (args.dedup) {
         char *name = calloc(strlen(args.prefix)+20,1);
         sprintf(name, "%s.all.bgz", args.prefix);
-        struct fastq_idx *idx = merge_files(fastqs, n_file, name);
+        struct fastq_idx *idx = merge_files(fastqs, n_file, name, 0);
         
         BGZF *fp = bgzf_open(name, "r");        
         if (fp == NULL)
             error("%s : %s.", name, strerror(errno));
-        bgzf_mt(fp, args.n_thread, 256);
+        gpool_attach_bgzf(fp, gpool_normal);
         
         BGZF *out = bgzf_open(args.output_fname, "w");
         if (out == NULL) error("%s : %s.", args.output_fname, strerror(errno));
-        bgzf_mt(out, args.n_thread, 256);
-        
-        int i;
-        for (i = 0; i < idx->n; ++i) {
-            int l = idx->length[i];
-            char *buf = malloc(l+1);
-            int ret = bgzf_read(fp, buf, l);
-            assert(ret == l);
-            buf[l] = '\0';
-            struct fastq_dedup_pool *dp = (struct fastq_dedup_pool*)dedup_str(buf);
-            dedup_write(dp, out);
-        }
+        struct dedup_stream d = {
+            .fp = fp,
+            .idx = idx,
+            .i = 0,
+            .out = out,
+            .w = fqi_writer_init(out),
+        };
+        gpool_attach_bgzf(out, gpool_high);
+
+        pipeline_run(args.n_thread*2, dedup_read, dedup_run, dedup_flush, &d);
+
         unlink(name);
         free(name);
         bgzf_close(fp);
+        fqi_writer_close(d.w, out, args.output_fname);
         bgzf_close(out);
         if (args.report_fname) {
             FILE *re = fopen(args.report_fname, "w");
@@ -863,12 +1035,14 @@ int fsort(int argc, char **argv)
     }
     else {
         char *name = strdup(args.output_fname);
-        struct fastq_idx *idx = merge_files(fastqs, n_file, name);
+        struct fastq_idx *idx = merge_files(fastqs, n_file, name, 1);
         free(name);
         fastq_idx_destroy(idx);
     }
 
     free(fastqs);
+    bgzf_close(fp);
+    gpool_destroy();
     LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
 
     return 0;
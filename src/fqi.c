@@ -0,0 +1,261 @@
+#include "utils.h"
+#include "fqi.h"
+#include "dict.h"
+#include "stats.h"
+#include "htslib/kstring.h"
+
+#define FQI_MAGIC "#PISA fqi 1"
+
+struct fqi_group {
+    uint64_t voff;
+    int64_t bytes;
+    int records;
+};
+
+struct fqi_writer {
+    struct dict *names;
+    int64_t *start; // uncompressed offset of group
+    int64_t *bytes;
+    int *records;
+    int n, m;
+    int64_t uaddr;
+};
+
+struct fqi {
+    struct dict *names;
+    struct fqi_group *g;
+};
+
+struct fqi_writer *fqi_writer_init(BGZF *fp)
+{
+    // multithreaded writer takes the index from first job, so index before
+    // the pool attached
+    if (bgzf_index_build_init(fp)) error("Failed to init block index.");
+    struct fqi_writer *w = calloc(1, sizeof(*w));
+    w->names = dict_init();
+    return w;
+}
+
+void fqi_writer_push(struct fqi_writer *w, const char *name, int64_t bytes, int records)
+{
+    if (w->n == w->m) {
+        w->m = w->m == 0 ? 1024 : w->m<<1;
+        w->start = realloc(w->start, w->m*sizeof(int64_t));
+        w->bytes = realloc(w->bytes, w->m*sizeof(int64_t));
+        w->records = realloc(w->records, w->m*sizeof(int));
+    }
+    // a second group of one name cannot be fetched, and would shift names
+    // against the offsets below
+    if (dict_query(w->names, name) != -1) error("Barcode %s is not grouped in one block.", name);
+    dict_push(w->names, name);
+    w->start[w->n] = w->uaddr;
+    w->bytes[w->n] = bytes;
+    w->records[w->n] = records;
+    w->n++;
+    w->uaddr += bytes;
+}
+
+static void writer_destroy(struct fqi_writer *w)
+{
+    dict_destroy(w->names);
+    free(w->start);
+    free(w->bytes);
+    free(w->records);
+    free(w);
+}
+
+// bgzf_index_dump layout: n, then n pairs of compressed and uncompressed
+// offsets of block starts, first block (0,0) is implicit.
+static uint64_t *read_gzi(const char *fn, int *n)
+{
+    FILE *fp = fopen(fn, "rb");
+    CHECK_EMPTY(fp, "%s : %s.", fn, strerror(errno));
+    uint64_t x;
+    if (fread(&x, sizeof(x), 1, fp) != 1) error("Truncated %s.", fn);
+    uint64_t *offs = malloc((x+1)*2*sizeof(uint64_t));
+    offs[0] = offs[1] = 0;
+    if (fread(offs+2, sizeof(uint64_t), x*2, fp) != x*2) error("Truncated %s.", fn);
+    fclose(fp);
+    *n = x+1;
+    return offs;
+}
+
+void fqi_writer_close(struct fqi_writer *w, BGZF *fp, const char *fq_fname)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.fqi.tmp", fq_fname);
+    if (bgzf_index_dump(fp, str.s, NULL)) error("Failed to dump block index.");
+    int n;
+    uint64_t *offs = read_gzi(str.s, &n);
+    unlink(str.s);
+
+    str.l = 0;
+    ksprintf(&str, "%s.fqi", fq_fname);
+    FILE *out = fopen(str.s, "w");
+    CHECK_EMPTY(out, "%s : %s.", str.s, strerror(errno));
+    fprintf(out, FQI_MAGIC "\n");
+    // groups are in file order, walk blocks along
+    int i, b = 0;
+    for (i = 0; i < w->n; ++i) {
+        uint64_t u = w->start[i];
+        while (b + 1 < n && offs[(b+1)*2+1] <= u) b++;
+        uint64_t voff = offs[b*2] << 16 | (u - offs[b*2+1]);
+        fprintf(out, "%s\t%" PRIu64 "\t%" PRId64 "\t%d\n", dict_name(w->names, i), voff, w->bytes[i], w->records[i]);
+    }
+    if (fclose(out)) error("%s : %s.", str.s, strerror(errno));
+    free(offs);
+    free(str.s);
+    writer_destroy(w);
+}
+
+struct fqi *fqi_load(const char *fq_fname)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.fqi", fq_fname);
+    FILE *fp = fopen(str.s, "r");
+    if (fp == NULL) {
+        free(str.s);
+        return NULL;
+    }
+    struct fqi *I = malloc(sizeof(*I));
+    I->names = dict_init();
+    I->g = NULL;
+    int m = 0;
+    char *line = NULL;
+    size_t m_line = 0;
+    ssize_t l;
+    int first = 1;
+    while ((l = getline(&line, &m_line, fp)) > 0) {
+        if (line[l-1] == '\n') line[--l] = '\0';
+        if (first) {
+            if (strcmp(line, FQI_MAGIC) != 0) error("%s is not a fqi index.", str.s);
+            first = 0;
+            continue;
+        }
+        char *p = strchr(line, '\t');
+        if (p == NULL) error("Malformed line in %s : %s", str.s, line);
+        *p++ = '\0';
+        struct fqi_group g;
+        if (sscanf(p, "%" SCNu64 "\t%" SCNd64 "\t%d", &g.voff, &g.bytes, &g.records) != 3)
+            error("Malformed line in %s : %s", str.s, p);
+        int idx = dict_push(I->names, line);
+        if (idx >= m) {
+            m = m == 0 ? 1024 : m<<1;
+            I->g = realloc(I->g, m*sizeof(struct fqi_group));
+        }
+        I->g[idx] = g;
+    }
+    if (first) error("Empty index %s.", str.s);
+    free(line);
+    fclose(fp);
+    free(str.s);
+    return I;
+}
+
+void fqi_destroy(struct fqi *I)
+{
+    dict_destroy(I->names);
+    free(I->g);
+    free(I);
+}
+
+int fqi_size(const struct fqi *I)
+{
+    return dict_size(I->names);
+}
+char *fqi_name(const struct fqi *I, int idx)
+{
+    return dict_name(I->names, idx);
+}
+int fqi_records(const struct fqi *I, int idx)
+{
+    return I->g[idx].records;
+}
+int fqi_query(const struct fqi *I, const char *name)
+{
+    return dict_query(I->names, name);
+}
+
+int fqi_fetch(const struct fqi *I, BGZF *fp, int idx, kstring_t *str)
+{
+    const struct fqi_group *g = &I->g[idx];
+    str->l = 0;
+    if (bgzf_seek(fp, g->voff, SEEK_SET) < 0) return -1;
+    if (ks_resize(str, g->bytes+1) < 0) return -1;
+    if (bgzf_read(fp, str->s, g->bytes) != g->bytes) return -1;
+    str->l = g->bytes;
+    str->s[str->l] = '\0';
+    return 0;
+}
+
+extern int fetch_usage();
+
+int fqi_fetch_main(int argc, char **argv)
+{
+    double t_real;
+    t_real = realtime();
+
+    const char *input_fname = NULL;
+    const char *output_fname = NULL;
+    const char *list_fname = NULL;
+    struct dict *barcodes = dict_init();
+    int i;
+    for (i = 1; i < argc;) {
+        const char *a = argv[i++];
+        const char **var = 0;
+        if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) return fetch_usage();
+        if (strcmp(a, "-o") == 0) var = &output_fname;
+        else if (strcmp(a, "-list") == 0) var = &list_fname;
+
+        if (var != 0) {
+            if (i == argc) error("Miss an argument after %s.", a);
+            *var = argv[i++];
+            continue;
+        }
+
+        if (a[0] == '-' && a[1]) error("Unknown parameter: %s", a);
+        if (input_fname == NULL) {
+            input_fname = a;
+            continue;
+        }
+        dict_push(barcodes, a);
+    }
+    if (input_fname == NULL) return fetch_usage();
+    if (list_fname) dict_read(barcodes, list_fname);
+    if (dict_size(barcodes) == 0) error("No barcode specified.");
+
+    struct fqi *I = fqi_load(input_fname);
+    if (I == NULL) error("%s.fqi : %s. Sort with `PISA fsort` first.", input_fname, strerror(errno));
+    BGZF *fp = bgzf_open(input_fname, "r");
+    if (fp == NULL) error("%s : %s.", input_fname, strerror(errno));
+
+    int gz = output_fname && strlen(output_fname) > 3 && strcmp(output_fname + strlen(output_fname) - 3, ".gz") == 0;
+    BGZF *out = output_fname ? bgzf_open(output_fname, gz ? "w" : "wu") : bgzf_dopen(fileno(stdout), "wu");
+    if (out == NULL) error("%s : %s.", output_fname ? output_fname : "-", strerror(errno));
+
+    kstring_t str = {0,0,0};
+    int n_miss = 0;
+    uint64_t n_rec = 0;
+    for (i = 0; i < dict_size(barcodes); ++i) {
+        int idx = fqi_query(I, dict_name(barcodes, i));
+        if (idx == -1) {
+            n_miss++;
+            continue;
+        }
+        if (fqi_fetch(I, fp, idx, &str) < 0) error("Failed to read %s.", input_fname);
+        if (bgzf_write(out, str.s, str.l) != str.l) error("Failed to write %s.", output_fname ? output_fname : "-");
+        n_rec += fqi_records(I, idx);
+        stats_records(fqi_records(I, idx));
+        stats_output(str.l);
+    }
+    if (n_miss) warnings("%d barcodes not found in %s.", n_miss, input_fname);
+    LOG_print("Fetch %" PRIu64 " records of %d barcodes.", n_rec, dict_size(barcodes) - n_miss);
+
+    if (str.m) free(str.s);
+    bgzf_close(out);
+    bgzf_close(fp);
+    fqi_destroy(I);
+    dict_destroy(barcodes);
+    LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
+    return 0;
+}
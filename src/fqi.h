@@ -0,0 +1,39 @@
+#ifndef FQI_H
+#define FQI_H
+
+#include <stdint.h>
+#include "htslib/bgzf.h"
+#include "htslib/kstring.h"
+
+// Sidecar index FQ.fqi of a bgzipped FASTQ grouped by barcode, written by
+// fsort and parse -bucket. One line per group in file order:
+//
+//   barcode  virtual_offset  bytes  records
+//
+// A group is fetched by one bgzf_seek and one bgzf_read.
+struct fqi;
+struct fqi_writer;
+
+// Call right after bgzf_open, before attaching a thread pool.
+struct fqi_writer *fqi_writer_init(BGZF *fp);
+// Groups are pushed in file order, bytes are uncompressed length. Each name
+// is pushed once, a repeated name is an error.
+void fqi_writer_push(struct fqi_writer *w, const char *name, int64_t bytes, int records);
+// Call before bgzf_close. Write fq_fname.fqi and free w.
+void fqi_writer_close(struct fqi_writer *w, BGZF *fp, const char *fq_fname);
+
+// Load fq_fname.fqi, NULL if not exists.
+struct fqi *fqi_load(const char *fq_fname);
+void fqi_destroy(struct fqi *I);
+
+int fqi_size(const struct fqi *I);
+char *fqi_name(const struct fqi *I, int idx);
+int fqi_records(const struct fqi *I, int idx);
+// Return index of barcode, -1 if not found.
+int fqi_query(const struct fqi *I, const char *name);
+
+// Read records of group idx into str, return 0 or -1 on error. Groups may
+// exceed 2G, the length is str->l.
+int fqi_fetch(const struct fqi *I, BGZF *fp, int idx, kstring_t *str);
+
+#endif
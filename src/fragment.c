@@ -9,6 +9,8 @@
 #include "region_index.h"
 #include "bed.h"
 #include "bam_region.h"
+#include "stats.h"
+#include "thread.h"
 
 // TN5 offsett
 // reads aligning to the + strand were offset by +4 bps, and reads aligning to the – strand were offset −5 bps
@@ -24,7 +26,7 @@ static struct args {
     const char *bed_fname;
     const char *black_region_fname;
     int isize;
-    int file_th;
+    int n_thread; // size of global thread pool
     int qual_thres;
     struct dict *cells;
     struct bam_region_itr *target;
@@ -45,7 +47,7 @@ static struct args {
     .bed_fname      = NULL,
     .black_region_fname = NULL,
     .isize          = 2000,
-    .file_th        = 4,
+    .n_thread       = 4,
     .qual_thres     = 20,
     .cells          = NULL,
     .target         = NULL,
@@ -64,6 +66,7 @@ static int parse_args(int argc, char **argv)
 
     int i;
     const char *file_th = NULL;
+    const char *thread  = NULL;
     const char *isize   = NULL;
     const char *qual    = NULL;
     for (i = 1; i < argc; ) {
@@ -73,6 +76,7 @@ static int parse_args(int argc, char **argv)
         if (strcmp(a, "-list") == 0) var = &args.barcode_list;
         else if (strcmp(a, "-tag") == 0) var = &args.tag;
         else if (strcmp(a, "-o") == 0) var = &args.output_fname;
+        else if (strcmp(a, "-t") == 0) var = &thread;
         else if (strcmp(a, "-@") == 0) var = &file_th;
         else if (strcmp(a, "-isize") == 0) var = &isize;
         else if (strcmp(a, "-bed") == 0) var = &args.bed_fname;
@@ -102,7 +106,11 @@ static int parse_args(int argc, char **argv)
         args.tag = "CB";
     }
     if (strlen(args.tag) != 2) error("Bad format of tag, %s", args.tag);
-    if (file_th) args.file_th = str2int(file_th);
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_th;
+    if (thread) args.n_thread = str2int(thread);
+    if (args.n_thread < 1) args.n_thread = 1;
+    gpool_init(args.n_thread);
     if (isize) args.isize = str2int(isize);
     if (args.isize < 0) args.isize = 2000;
     if (qual) args.qual_thres = str2int(qual);
@@ -118,12 +126,11 @@ static int parse_args(int argc, char **argv)
     args.hdr = sam_hdr_read(args.fp);
     CHECK_EMPTY(args.hdr, "Failed to open header.");
 
-    hts_set_threads(args.fp, args.file_th);
+    gpool_attach_hts(args.fp, gpool_normal);
 
     args.fp_out = bgzf_open(args.output_fname, "w");
     if (args.fp_out == NULL) error("%s : %s.", args.output_fname, strerror(errno));
-    
-    bgzf_mt(args.fp_out, args.file_th, 256);
+    gpool_attach_bgzf(args.fp_out, gpool_high);
     
     if (args.bed_fname) {
         struct bed_spec *bed = bed_read(args.bed_fname);
@@ -220,6 +227,7 @@ void fragment_flush_cache(struct dict *d, BGZF *out, bam_hdr_t *hdr)
 
     // write to disk
     kstring_t str = {0,0,0};
+    uint64_t bytes = 0;
     for (i = 0; i < sizes; ++i) {
         str.l = 0;
         struct frag *f = a[i];
@@ -229,8 +237,10 @@ void fragment_flush_cache(struct dict *d, BGZF *out, bam_hdr_t *hdr)
         kputs(dict_name(d, f->idx), &str); kputc('\t', &str);
         kputw(f->dup, &str);kputs("\n", &str);
         if (bgzf_write(out, str.s, str.l) < 0) error("Failed to write file.");
+        bytes += str.l;
     }
     free(str.s);
+    stats_output(bytes);
 
     // release cached
     for (i = 0; i < dict_size(d); ++i) {
@@ -394,6 +404,7 @@ static void memory_release()
     bgzf_close(args.fp_out);
     bam_hdr_destroy(args.hdr);
     hts_close(args.fp);
+    gpool_destroy();
     fragment_close(args.cells);
 }
 
@@ -407,11 +418,14 @@ int bam2frag(int argc, char **argv)
     bam1_t *b = bam_init1();
     int last_id = -1;
     int ret;
+    int n_rec = 0;
     while ((ret = read_bam(args.fp, args.hdr, b, args.target)) >=0) {
+        stats_read_hts(args.fp, &n_rec, 0);
         if (filter_bam(b, args.hdr, args.black_region)) continue;
         last_id = process_bam(args.fp, args.hdr, b, last_id, args.fp_out);
     }
     
+    stats_read_hts(args.fp, &n_rec, 1);
     fragment_flush_cache(args.cells, args.fp_out, args.hdr);
     
     export_sites_stat(args.cells,args.sites_fname);
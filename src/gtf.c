@@ -401,6 +401,98 @@ static void gtf_sort(struct gtf *gtf)
     }
 
 }
+// Junctions of a contig, hashed by donor<<32|acceptor to offset<<32|count of
+// their hits in a.
+KHASH_MAP_INIT_INT64(junc, uint64_t)
+
+struct gtf_junc_idx {
+    khash_t(junc) *h;
+    struct gtf_junc *a;
+};
+
+struct junc_rec {
+    uint64_t key;
+    struct gtf_junc j;
+};
+
+static int cmp_junc(const void *_a, const void *_b)
+{
+    const struct junc_rec *a = _a, *b = _b;
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+static struct gtf_junc_idx *ctg_build_junc(struct gtf_ctg *ctg)
+{
+    int n = 0, m = 0;
+    struct junc_rec *r = NULL;
+    int i, j, k;
+    for (i = 0; i < ctg->n_gtf; ++i) {
+        struct gtf *gene = ctg->gtf[i];
+        for (j = 0; j < gene->n_gtf; ++j) {
+            struct gtf *tx = gene->gtf[j];
+            if (tx->type != feature_transcript) continue;
+            struct gtf *last = NULL;
+            int exon = 0;
+            for (k = 0; k < tx->n_gtf; ++k) {
+                struct gtf *e = tx->gtf[k];
+                if (e->type != feature_exon) continue;
+                exon++;
+                if (last && last->end >= e->start) { // exons overlapped, leave contig to exon scan
+                    free(r);
+                    return NULL;
+                }
+                if (last) {
+                    if (n == m) {
+                        m = m == 0 ? 1024 : m<<1;
+                        r = realloc(r, m*sizeof(struct junc_rec));
+                    }
+                    r[n].key = (uint64_t)last->end<<32 | (uint32_t)e->start;
+                    r[n].j.tx = tx;
+                    r[n].j.exon = exon-1;
+                    r[n].j.start = last->start;
+                    r[n].j.end = e->end;
+                    n++;
+                }
+                last = e;
+            }
+        }
+    }
+    qsort(r, n, sizeof(struct junc_rec), cmp_junc);
+
+    struct gtf_junc_idx *J = malloc(sizeof(*J));
+    J->h = kh_init(junc);
+    J->a = malloc(n*sizeof(struct gtf_junc));
+    for (i = 0; i < n; ) {
+        for (j = i+1; j < n && r[j].key == r[i].key; ++j);
+        int ret;
+        khint_t p = kh_put(junc, J->h, r[i].key, &ret);
+        kh_val(J->h, p) = (uint64_t)i<<32 | (uint32_t)(j-i);
+        for (k = i; k < j; ++k) J->a[k] = r[k].j;
+        i = j;
+    }
+    free(r);
+    return J;
+}
+
+static void junc_destroy(struct gtf_junc_idx *J)
+{
+    if (J == NULL) return;
+    kh_destroy(junc, J->h);
+    free(J->a);
+    free(J);
+}
+
+const struct gtf_junc *gtf_query_junc(struct gtf_ctg const *ctg, int donor, int acceptor, int *n)
+{
+    *n = 0;
+    if (ctg->junc == NULL) return NULL;
+    khint_t k = kh_get(junc, ctg->junc->h, (uint64_t)donor<<32 | (uint32_t)acceptor);
+    if (k == kh_end(ctg->junc->h)) return NULL;
+    uint64_t v = kh_val(ctg->junc->h, k);
+    *n = (uint32_t)v;
+    return ctg->junc->a + (v>>32);
+}
+
 static struct region_index *ctg_build_idx(struct gtf_ctg *ctg)
 {
     struct region_index *idx = region_index_create();
@@ -422,6 +514,7 @@ static int gtf_build_index(struct gtf_spec *G)
             gtf_sort(ctg->gtf[j]); // sort gene
         }
         ctg->idx = ctg_build_idx(ctg);
+        ctg->junc = ctg_build_junc(ctg);
         total_gene+=ctg->n_gtf;
     }
     return total_gene;
@@ -495,6 +588,12 @@ struct gtf_spec *gtf_read_lite(const char *fname)
 {
     return gtf_read(fname, FILTER_ATTRS);
 }
+struct gtf_ctg *gtf_query_ctg(struct gtf_spec const *G, const char *name)
+{
+    int id = dict_query(G->name, name);
+    if (id == -1) return NULL;
+    return dict_query_value(G->name, id);
+}
 struct region_itr *gtf_query(struct gtf_spec const *G, char *name, int start, int end)
 {
     int id = dict_query(G->name, name);
@@ -527,6 +626,7 @@ void gtf_destroy(struct gtf_spec *G)
         struct gtf_ctg *ctg = dict_query_value(G->name, i);
         if (ctg->gene_idx) dict_destroy(ctg->gene_idx);
         region_index_destroy(ctg->idx);
+        junc_destroy(ctg->junc);
         
         int j;
         for (j = 0; j < ctg->n_gtf; ++j) {
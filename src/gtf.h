@@ -63,11 +63,23 @@ struct gtf {
 
 struct _ctg_idx;
 
+// Annotated splice junction of a transcript. Donor is the last base of an
+// exon, acceptor the first base of next exon.
+struct gtf_junc {
+    const struct gtf *tx;
+    int exon;  // exon number of donor in transcript, from 1
+    int start; // start of donor exon
+    int end;   // end of acceptor exon
+};
+
+struct gtf_junc_idx;
+
 struct gtf_ctg {
     struct dict *gene_idx;
     struct region_index *idx;    
     int n_gtf, m_gtf;
     struct gtf **gtf; 
+    struct gtf_junc_idx *junc; // NULL if any transcript has overlapped exons
 };
 struct gtf_spec {
     struct dict *name; // contig names
@@ -84,6 +96,9 @@ const char *get_feature_name(enum feature_type type);
 struct gtf_spec *gtf_read(const char *fname, int filter);
 struct gtf_spec *gtf_read_lite(const char *fname); // only read necessary info
 struct region_itr *gtf_query(struct gtf_spec const *G, char *name, int start, int end);
+struct gtf_ctg *gtf_query_ctg(struct gtf_spec const *G, const char *name);
+// Return transcripts sharing junction donor-acceptor, NULL if not annotated.
+const struct gtf_junc *gtf_query_junc(struct gtf_ctg const *ctg, int donor, int acceptor, int *n);
 void gtf_destroy(struct gtf_spec *G);
 
 #endif
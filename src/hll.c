@@ -0,0 +1,142 @@
+#include "utils.h"
+#include "hll.h"
+#include <math.h>
+
+struct hll {
+    int p;
+    int n, m;         // sparse hashes and table size, m is 0 once dense
+    uint32_t *sparse; // open addressing, 0 for empty slot
+    uint8_t *reg;
+};
+
+struct hll *hll_init(int p)
+{
+    if (p < 4 || p > 16) error("HyperLogLog precision should be in [4, 16].");
+    struct hll *h = malloc(sizeof(*h));
+    h->p = p;
+    h->n = 0;
+    h->m = 8;
+    h->sparse = calloc(h->m, sizeof(uint32_t));
+    h->reg = NULL;
+    return h;
+}
+
+void hll_destroy(struct hll *h)
+{
+    free(h->sparse);
+    free(h->reg);
+    free(h);
+}
+
+// Top p bits select register, rank is the position of first 1 in the rest.
+static inline void reg_add(struct hll *h, uint32_t x)
+{
+    uint32_t idx = x >> (32 - h->p);
+    uint32_t w = x << h->p;
+    uint8_t rank = w ? __builtin_clz(w) + 1 : 32 - h->p + 1;
+    if (h->reg[idx] < rank) h->reg[idx] = rank;
+}
+
+static void sparse_insert(uint32_t *t, int m, uint32_t x)
+{
+    uint32_t i = (x * 2654435761u) & (m - 1);
+    while (t[i] && t[i] != x) i = (i + 1) & (m - 1);
+    t[i] = x;
+}
+
+static int sparse_add(struct hll *h, uint32_t x)
+{
+    uint32_t i = (x * 2654435761u) & (h->m - 1);
+    while (h->sparse[i]) {
+        if (h->sparse[i] == x) return 0;
+        i = (i + 1) & (h->m - 1);
+    }
+    h->sparse[i] = x;
+    return 1;
+}
+
+static void to_dense(struct hll *h)
+{
+    h->reg = calloc(1 << h->p, 1);
+    int i;
+    for (i = 0; i < h->m; ++i)
+        if (h->sparse[i]) reg_add(h, h->sparse[i]);
+    free(h->sparse);
+    h->sparse = NULL;
+    h->m = 0;
+}
+
+static void hll_add32(struct hll *h, uint32_t x)
+{
+    if (h->m == 0) {
+        reg_add(h, x);
+        return;
+    }
+    if (x == 0) x = 1; // 0 marks empty slot
+    if (sparse_add(h, x) == 0) return;
+    h->n++;
+    if (h->n*2 <= h->m) return;
+    // table bytes over registers
+    if ((int64_t)h->m*2*sizeof(uint32_t) > (1 << h->p)) {
+        to_dense(h);
+        return;
+    }
+    int m = h->m*2, i;
+    uint32_t *t = calloc(m, sizeof(uint32_t));
+    for (i = 0; i < h->m; ++i)
+        if (h->sparse[i]) sparse_insert(t, m, h->sparse[i]);
+    free(h->sparse);
+    h->sparse = t;
+    h->m = m;
+}
+
+void hll_add(struct hll *h, uint64_t hash)
+{
+    hll_add32(h, hash >> 32);
+}
+
+// A dense sketch only comes from enough distinct values, so the union is dense
+// too and registers are merged by max; sparse hashes are added one by one.
+void hll_merge(struct hll *h, const struct hll *o)
+{
+    if (h->p != o->p) error("Merge HyperLogLog of different precisions.");
+    int i;
+    if (o->m) {
+        for (i = 0; i < o->m; ++i)
+            if (o->sparse[i]) hll_add32(h, o->sparse[i]);
+        return;
+    }
+    if (h->m) to_dense(h);
+    for (i = 0; i < 1 << h->p; ++i)
+        if (h->reg[i] < o->reg[i]) h->reg[i] = o->reg[i];
+}
+
+double hll_estimate(const struct hll *h)
+{
+    if (h->m) return h->n;
+    int m = 1 << h->p, i, zero = 0;
+    double sum = 0;
+    for (i = 0; i < m; ++i) {
+        sum += ldexp(1.0, -h->reg[i]);
+        if (h->reg[i] == 0) zero++;
+    }
+    double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213/(1 + 1.079/m);
+    double e = alpha * m * m / sum;
+    if (e <= 2.5 * m && zero) return m * log((double)m / zero); // linear counting
+    const double two32 = 4294967296.0;
+    if (e > two32/30) return -two32 * log(1 - e/two32);
+    return e;
+}
+
+uint64_t hll_hash(const char *s)
+{
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    for (; *s; ++s) h = (h ^ (uint8_t)*s) * 1099511628211ULL;
+    // murmur3 finalizer, FNV alone leaves high bits poorly mixed
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
@@ -0,0 +1,24 @@
+#ifndef HLL_H
+#define HLL_H
+
+#include <stdint.h>
+
+// HyperLogLog distinct counter with 2^p registers, standard error about
+// 1.04/sqrt(2^p). Small sets keep their 32-bit hashes in a sparse table and
+// are counted exactly; the table turns into registers once it takes more
+// memory than them, so millions of tiny sets stay cheap.
+struct hll;
+
+// p in [4, 16].
+struct hll *hll_init(int p);
+void hll_destroy(struct hll *h);
+
+// Add a value by its 64-bit hash, see hll_hash.
+void hll_add(struct hll *h, uint64_t hash);
+// Add all values of o into h, same as adding them to h directly.
+void hll_merge(struct hll *h, const struct hll *o);
+double hll_estimate(const struct hll *h);
+
+uint64_t hll_hash(const char *s);
+
+#endif
@@ -1,6 +1,7 @@
 #include "utils.h"
 #include "pisa_version.h"
 #include "version.h"
+#include "stats.h"
 #include <string.h>
 
 int usage()
@@ -12,6 +13,8 @@ int usage()
     fprintf(stderr, "\n--- Processing FASTQ\n");
     fprintf(stderr, "    parse      Parse barcodes from fastq reads.\n");
     fprintf(stderr, "    fsort      Sort fastq records by barcodes.\n");
+    fprintf(stderr, "    fetch      Fetch reads of barcodes from sorted fastq.\n");
+    fprintf(stderr, "    wlidx      Build binary index of barcode white list.\n");
     
     fprintf(stderr, "\n--- Processing BAM\n");
     fprintf(stderr, "    sam2bam    Parse FASTQ+ read name and convert SAM to BAM.\n");
@@ -24,15 +27,20 @@ int usage()
     fprintf(stderr, "    count      Count matrix.\n");
     fprintf(stderr, "    bam2fq     Convert BAM to FASTQ+ file with selected tags.\n");
     fprintf(stderr, "    bam2frag   Generate fragment file.\n");
+    fprintf(stderr, "\nGlobal options, accepted by all commands:\n");
+    fprintf(stderr, "    -stats     [FILE]  Write runtime statistics in JSON format.\n");
+    fprintf(stderr, "    -progress  [INT]   Print progress and ETA every INT seconds.\n");
     fprintf(stderr, "\n");
     return 1;
 }
-int main(int argc, char *argv[])
+static int run_command(int argc, char *argv[])
 {
     // process FQ
     extern int fastq_prase_barcodes(int argc, char *argv[]);
     //extern int fastq_trim_adaptors(int argc, char *argv[]);
     extern int fsort(int argc, char ** argv);
+    extern int wlidx_main(int argc, char **argv);
+    extern int fqi_fetch_main(int argc, char **argv);
 
     // process BAM
     extern int sam2bam(int argc, char *argv[]);
@@ -48,10 +56,11 @@ int main(int argc, char *argv[])
     extern int bam2frag(int argc, char **argv);
 
 
-    if (argc == 1) return usage();
-    else if (strcmp(argv[1], "parse") == 0) return fastq_prase_barcodes(argc-1, argv+1);
+    if (strcmp(argv[1], "parse") == 0) return fastq_prase_barcodes(argc-1, argv+1);
     //else if (strcmp(argv[1], "trim") == 0) return fastq_trim_adaptors(argc-1, argv+1);
     else if (strcmp(argv[1], "fsort") == 0) return fsort(argc-1, argv+1);
+    else if (strcmp(argv[1], "fetch") == 0) return fqi_fetch_main(argc-1, argv+1);
+    else if (strcmp(argv[1], "wlidx") == 0) return wlidx_main(argc-1, argv+1);
     else if (strcmp(argv[1], "sam2bam") == 0) return sam2bam(argc-1, argv+1);
     else if (strcmp(argv[1], "bam2fq") == 0) return bam2fq(argc-1, argv+1);
     else if (strcmp(argv[1], "rmdup") == 0) return bam_rmdup(argc-1, argv+1);
@@ -72,3 +81,13 @@ int main(int argc, char *argv[])
     else return usage();
     return 0;
 }
+int main(int argc, char *argv[])
+{
+    if (argc == 1) return usage();
+    argc = stats_parse_args(argc, argv);
+    if (argc < 2) return usage(); // only global options given
+    stats_start(argv[1]);
+    int ret = run_command(argc, argv);
+    stats_finish();
+    return ret;
+}
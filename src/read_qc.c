@@ -0,0 +1,216 @@
+#include "utils.h"
+#include "read_qc.h"
+
+#if defined(__x86_64__) && !defined(PISA_NO_SIMD)
+#define QC_X86
+#include <immintrin.h>
+#endif
+
+#if QC_HEAD > 16
+#error "QC_HEAD should fit in first vector."
+#endif
+
+// Bases from i to l.
+static inline void qc_scan(const char *seq, const char *qual, int i, int l, struct read_qc *qc)
+{
+    for (; i < l; ++i) {
+        if (seq[i] == 'N') qc->n++;
+        if (qual == NULL) continue;
+        int q = qual[i] - 33;
+        qc->qsum += q;
+        if (q >= QC_Q30) qc->q30++;
+        if (i < QC_HEAD && q < QC_LOW) qc->low++;
+    }
+}
+
+static void read_qc_scalar(const char *seq, const char *qual, int l, struct read_qc *qc)
+{
+    memset(qc, 0, sizeof(*qc));
+    qc_scan(seq, qual, 0, l, qc);
+}
+
+#ifdef QC_X86
+// Unsigned compares by min/max, qualities above 127 still count. Sum of
+// qualities by SAD against zero, offset removed at the end. The last partial
+// vector is copied to a zero padded buffer; zero is never N nor Q30 and adds
+// nothing to the sum, and the low quality mask is cut to the read length.
+static inline void qc_sse2_step(const char *seq, const char *qual, int i, int l, __m128i *sum, struct read_qc *qc)
+{
+    const __m128i cn   = _mm_set1_epi8('N');
+    const __m128i c30  = _mm_set1_epi8(33+QC_Q30);
+    const __m128i clow = _mm_set1_epi8(33+QC_LOW-1);
+    __m128i s = _mm_loadu_si128((const __m128i*)seq);
+    qc->n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(s, cn)));
+    if (qual == NULL) return;
+    __m128i q = _mm_loadu_si128((const __m128i*)qual);
+    qc->q30 += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(q, c30), q)));
+    *sum = _mm_add_epi64(*sum, _mm_sad_epu8(q, _mm_setzero_si128()));
+    if (i == 0) {
+        unsigned mask = (1u<<QC_HEAD)-1;
+        if (l < QC_HEAD) mask &= (1u<<l)-1;
+        qc->low = __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(q, clow), q)) & mask);
+    }
+}
+static void read_qc_sse2(const char *seq, const char *qual, int l, struct read_qc *qc)
+{
+    __m128i sum = _mm_setzero_si128();
+    int i = 0;
+    memset(qc, 0, sizeof(*qc));
+    for (; i + 16 <= l; i += 16)
+        qc_sse2_step(seq+i, qual ? qual+i : NULL, i, l, &sum, qc);
+    if (i < l) {
+        char sb[16] = {0}, qb[16] = {0};
+        memcpy(sb, seq+i, l-i);
+        if (qual) memcpy(qb, qual+i, l-i);
+        qc_sse2_step(sb, qual ? qb : NULL, i, l, &sum, qc);
+    }
+    if (qual) qc->qsum = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum)) - 33*l;
+}
+
+__attribute__((target("avx2")))
+static inline void qc_avx2_step(const char *seq, const char *qual, int i, int l, __m256i *sum, struct read_qc *qc)
+{
+    const __m256i cn   = _mm256_set1_epi8('N');
+    const __m256i c30  = _mm256_set1_epi8(33+QC_Q30);
+    const __m256i clow = _mm256_set1_epi8(33+QC_LOW-1);
+    __m256i s = _mm256_loadu_si256((const __m256i*)seq);
+    qc->n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, cn)));
+    if (qual == NULL) return;
+    __m256i q = _mm256_loadu_si256((const __m256i*)qual);
+    qc->q30 += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(q, c30), q)));
+    *sum = _mm256_add_epi64(*sum, _mm256_sad_epu8(q, _mm256_setzero_si256()));
+    if (i == 0) {
+        unsigned mask = (1u<<QC_HEAD)-1;
+        if (l < QC_HEAD) mask &= (1u<<l)-1;
+        qc->low = __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(q, clow), q)) & mask);
+    }
+}
+__attribute__((target("avx2")))
+static void read_qc_avx2(const char *seq, const char *qual, int l, struct read_qc *qc)
+{
+    __m256i sum = _mm256_setzero_si256();
+    int i = 0;
+    memset(qc, 0, sizeof(*qc));
+    for (; i + 32 <= l; i += 32)
+        qc_avx2_step(seq+i, qual ? qual+i : NULL, i, l, &sum, qc);
+    if (i < l) {
+        char sb[32] = {0}, qb[32] = {0};
+        memcpy(sb, seq+i, l-i);
+        if (qual) memcpy(qb, qual+i, l-i);
+        qc_avx2_step(sb, qual ? qb : NULL, i, l, &sum, qc);
+    }
+    if (qual) {
+        __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        qc->qsum = _mm_cvtsi128_si32(s) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(s, s)) - 33*l;
+    }
+}
+#endif
+
+typedef void (*read_qc_func)(const char *, const char *, int, struct read_qc *);
+
+static read_qc_func qc_func = NULL;
+static const char *qc_name = NULL;
+
+static read_qc_func qc_resolve()
+{
+    read_qc_func f = read_qc_scalar;
+    const char *name = "scalar";
+#ifdef QC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        f = read_qc_avx2;
+        name = "avx2";
+    }
+    else {
+        f = read_qc_sse2; // always present on x86-64
+        name = "sse2";
+    }
+#endif
+    // every thread resolves the same answer, no lock needed
+    __atomic_store_n(&qc_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&qc_func, f, __ATOMIC_RELEASE);
+    return f;
+}
+
+void read_qc(const char *seq, const char *qual, int l, struct read_qc *qc)
+{
+    read_qc_func f = __atomic_load_n(&qc_func, __ATOMIC_ACQUIRE);
+    if (f == NULL) f = qc_resolve();
+    f(seq, qual, l, qc);
+}
+
+const char *read_qc_impl()
+{
+    if (__atomic_load_n(&qc_func, __ATOMIC_ACQUIRE) == NULL) qc_resolve();
+    return __atomic_load_n(&qc_name, __ATOMIC_RELAXED);
+}
+
+#ifdef READ_QC_BENCH
+// make read_qc_bench; ./read_qc_bench [n_reads] [read_length]
+#include <time.h>
+
+// Three loops of parse before reads were summarised in one pass.
+static void read_qc_multipass(const char *seq, const char *qual, int l, struct read_qc *qc)
+{
+    memset(qc, 0, sizeof(*qc));
+    int i;
+    for (i = 0; i < l; ++i) {
+        if (qual[i]-33 >= QC_Q30) qc->q30++;
+        if (seq[i] == 'N') qc->n++;
+    }
+    for (i = 0; i < QC_HEAD && i < l; ++i)
+        if (qual[i]-33 < QC_LOW) qc->low++;
+    for (i = 0; i < l; ++i) qc->qsum += qual[i]-33;
+}
+
+static double bench_now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static void bench_run(const char *name, read_qc_func f, const char *seq, const char *qual, int n, int l, struct read_qc *ref)
+{
+    struct read_qc qc;
+    uint64_t check = 0;
+    int i, diff = 0;
+    double t0 = bench_now();
+    for (i = 0; i < n; ++i) {
+        f(seq + (uint64_t)i*l, qual + (uint64_t)i*l, l, &qc);
+        check += qc.q30 + qc.qsum + qc.low + qc.n;
+        if (ref && memcmp(&qc, &ref[i], sizeof(qc)) != 0) diff++;
+    }
+    double t = bench_now() - t0;
+    fprintf(stderr, "%-10s %8.2f ns/read %8.3f sec  checksum %" PRIu64 "  mismatch %d\n", name, t*1e9/n, t, check, diff);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int l = argc > 2 ? atoi(argv[2]) : 100;
+    if (n < 1 || l < 1) error("Usage: read_qc_bench [n_reads] [read_length]");
+    char *seq  = malloc((uint64_t)n*l + 32);
+    char *qual = malloc((uint64_t)n*l + 32);
+    struct read_qc *ref = malloc(n*sizeof(*ref));
+    uint64_t i;
+    srand(1);
+    for (i = 0; i < (uint64_t)n*l; ++i) {
+        seq[i]  = "ACGTACGTACGTACGN"[rand() & 15];
+        qual[i] = 33 + 2 + rand()%40;
+    }
+    for (i = 0; i < n; ++i) read_qc_scalar(seq + i*l, qual + i*l, l, &ref[i]);
+
+    fprintf(stderr, "%d reads, %d bp, read_qc() picks %s\n", n, l, read_qc_impl());
+    bench_run("multipass", read_qc_multipass, seq, qual, n, l, ref);
+    bench_run("scalar", read_qc_scalar, seq, qual, n, l, ref);
+#ifdef QC_X86
+    bench_run("sse2", read_qc_sse2, seq, qual, n, l, ref);
+    if (__builtin_cpu_supports("avx2")) bench_run("avx2", read_qc_avx2, seq, qual, n, l, ref);
+#endif
+    free(seq);
+    free(qual);
+    free(ref);
+    return 0;
+}
+#endif
@@ -0,0 +1,25 @@
+#ifndef READ_QC_H
+#define READ_QC_H
+
+// Per read quality summary, collected in one pass over sequence and quality.
+// Qualities are phred+33.
+#define QC_Q30   30  // count bases at or above this quality
+#define QC_LOW   10  // bases below this quality are bad ...
+#define QC_HEAD  15  // ... if they fall in the first QC_HEAD bases
+
+struct read_qc {
+    int q30;    // bases with quality >= QC_Q30
+    int qsum;   // sum of base qualities
+    int low;    // bases with quality < QC_LOW in the first QC_HEAD bases
+    int n;      // N bases
+};
+
+// qual may be NULL, then only N bases are counted. Picks SSE2 or AVX2 code
+// path at first call on x86-64, scalar elsewhere or if built with
+// -DPISA_NO_SIMD.
+void read_qc(const char *seq, const char *qual, int l, struct read_qc *qc);
+
+// Name of selected code path, "avx2", "sse2" or "scalar".
+const char *read_qc_impl();
+
+#endif
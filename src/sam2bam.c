@@ -8,7 +8,8 @@
 #include "htslib/khash.h"
 #include "htslib/kseq.h"
 #include "htslib/bgzf.h"
-#include "thread_pool_internal.h"
+#include "thread.h"
+#include "stats.h"
 #include <zlib.h>
 #include "gtf.h"
 #include "read_anno.h"
@@ -54,9 +55,8 @@ static struct args {
     int enable_corr;
     struct gtf_spec *G;
     
-    int n_thread;
+    int n_thread;     // size of global thread pool
     int buffer_size;  // buffered records in each chunk
-    int file_th;
     gzFile fp;        // input file handler
     kstream_t *ks;    // input streaming
     htsFile *fp_out;     // output file handler
@@ -84,7 +84,6 @@ static struct args {
     .G                 = NULL,
     .n_thread          = 1,
     .buffer_size       = 1000000, // 1M
-    .file_th           = 1,
     .fp                = NULL,
     .ks                = NULL,
     .fp_out            = NULL,
@@ -187,6 +186,10 @@ static struct sam_pool* sam_pool_read(kstream_t *s, int buffer_size)
     }
 
     free(str.s);
+    if (stats_on) {
+        stats_records(p->n);
+        stats_input(args.input_fname, gzoffset(args.fp));
+    }
     if (p->n == 0) {
         sam_pool_destroy(p);
         return NULL;
@@ -219,12 +222,15 @@ static bam_hdr_t *sam_parse_header(kstream_t *s, kstring_t *line)
     
     return NULL;
 }
-static void write_out(struct sam_pool *p)
+static void write_out(void *_p, void *_opts)
 {
+    struct sam_pool *p = (struct sam_pool*)_p;
     int i;
     struct args *opts = p->opts;    
+    uint64_t bytes = 0;
     for (i = 0; i < p->n; ++i) {
         if (p->bam[i] == NULL) continue;
+        bytes += p->bam[i]->l_data + 36;
 
         /* do NOT filter any records, edited 2020/04/04
         if (p->flag[i] == FLG_FLT) continue; // filter this alignment for low map quality
@@ -236,6 +242,7 @@ static void write_out(struct sam_pool *p)
         if (sam_write1(opts->fp_out, opts->hdr, p->bam[i]) == -1) error("Failed to write.");
     }
     sam_pool_destroy(p);
+    stats_output(bytes);
 }
 static void summary_report(struct args *opts)
 {
@@ -496,7 +503,7 @@ static int sam_safe_check(kstring_t *str)
     if (s < 11) return 1; // we need at least 11 columns for SAM
     return 0;
 }
-static void *sam_name_parse(void *_p)
+static void *sam_name_parse(void *_p, void *_opts)
 {
     struct sam_pool *p = (struct sam_pool*)_p;
     struct args *opts = p->opts;
@@ -545,16 +552,11 @@ static void *sam_name_parse(void *_p)
     free(s0);
     return p;
 }
-static int sam_name_parse_light()
+static void *sam_chunk_read(void *_opts)
 {
-    for (;;) {
-        struct sam_pool *p = sam_pool_read(args.ks, args.buffer_size);
-        if (p == NULL) break;
-        p->opts = &args;
-        p = sam_name_parse(p);
-        write_out(p);
-    }
-    return 0;
+    struct sam_pool *p = sam_pool_read(args.ks, args.buffer_size);
+    if (p) p->opts = &args;
+    return p;
 }
 
 extern int sam2bam_usage();
@@ -613,15 +615,18 @@ static int parse_args(int argc, char **argv)
     if (args.fp == NULL) error("%s : %s.", args.input_fname, strerror(errno));
     args.ks = ks_init(args.fp);
 
+    // -@ is kept as an alias of -t, all threads come from one global pool
+    if (thread == NULL) thread = file_th;
+    if (thread) {
+        args.n_thread = str2int((char*)thread);
+        if (args.n_thread < 1) args.n_thread = 1;
+    }
+    gpool_init(args.n_thread);
+    
     // init output    
     args.fp_out = hts_open(args.output_fname, "bw");
     if (args.fp_out == NULL) error("%s : %s.", args.output_fname, strerror(errno));
-
-    if (file_th) {
-        args.file_th = str2int((char*)file_th);
-        if (args.file_th <1) args.file_th = 1;
-        hts_set_threads(args.fp_out, args.file_th);
-    }
+    gpool_attach_hts(args.fp_out, gpool_high);
 
     if (args.enable_corr) {
         if (args.gtf_fname == NULL) error("-gtf is required if mapping quality correction enabled.");
@@ -638,11 +643,7 @@ static int parse_args(int argc, char **argv)
     if (args.mito_fname) {
         args.fp_mito = bgzf_open(args.mito_fname, "w");
         if (args.fp_mito == NULL) error("%s : %s.", args.mito_fname, strerror(errno));
-    }
-
-    if (thread) {
-        args.n_thread = str2int((char*)thread);
-        assert(args.n_thread > 0);
+        gpool_attach_bgzf(args.fp_mito, gpool_high);
     }
 
     if (buffer_size) {
@@ -687,6 +688,7 @@ static void memory_release()
     if (args.fp_mito) bgzf_close(args.fp_mito);
     if (args.fp_report != stdout) fclose(args.fp_report);
     if (args.enable_corr) gtf_destroy(args.G);
+    gpool_destroy();
 }
 
 int sam2bam(int argc, char **argv)
@@ -696,49 +698,7 @@ int sam2bam(int argc, char **argv)
     
     if (parse_args(argc, argv)) return 1;
 
-    if (args.n_thread == 1)
-        sam_name_parse_light();
-    
-    else {
-
-        int nt = args.n_thread;
-
-        hts_tpool *p = hts_tpool_init(nt);
-        hts_tpool_process *q = hts_tpool_process_init(p, nt*2, 0);
-        hts_tpool_result *r;
-
-        for (;;) {
-
-            struct sam_pool *b = sam_pool_read(args.ks, args.buffer_size);
-            if (b == NULL) break;
-            b->opts = &args;
-
-            int block;
-
-            do {
-
-                block = hts_tpool_dispatch2(p, q, sam_name_parse, b, 0);
-
-                if ((r = hts_tpool_next_result(q))) {
-                    struct sam_pool *d = (struct sam_pool*)r->data;
-                    write_out(d);
-                }
-                //hts_tpool_delete_result(r, 1);
-            }
-            while (block == -1);
-        }
-        
-        hts_tpool_process_flush(q);
-
-        while ((r = hts_tpool_next_result(q))) {
-            struct sam_pool *d = (struct sam_pool *)r->data;
-            write_out(d);
-        }
-
-        hts_tpool_process_destroy(q);
-        hts_tpool_destroy(p);
-
-    }
+    pipeline_run(args.n_thread*2, sam_chunk_read, sam_name_parse, write_out, &args);
 
     summary_report(&args);
     
@@ -31,6 +31,8 @@ struct similarity_search_aux {
     hash32_t *d1; 
     uint64_t *cs; // compact sequence    
     int n, m;
+    enum ss_metric metric;
+    uint32_t *peq; // levenshtein only, match masks of A/C/G/T per sequence
 };
 
 uint8_t encode_base(char c)
@@ -60,9 +62,7 @@ uint8_t encode_base(char c)
 // not safe for Ns
 uint32_t enc32(char *s, int l)
 {
-    int len = strlen(s);
-    if (len < l) error("Try to encode a truncated sequence ?");
-    if (len > 16) error("Only support to encode sequence shorter than 16nt.");
+    if (l > 10) error("Only support to encode sequence not longer than 10nt.");
     uint64_t q = 0;
     int i;
     for (i = 0; i < l; ++i)
@@ -74,8 +74,8 @@ uint32_t enc32(char *s, int l)
 uint64_t enc64(char *s)
 {
     int l = strlen(s);
-    if (l > 32) error("Only support to encode sequence not longer than 32nt.");
-    uint32_t q = 0;
+    if (l > kmer_max) error("Only support to encode sequence not longer than %dnt.", kmer_max);
+    uint64_t q = 0;
     int i;
     for (i = 0; i < l; ++i)
         q = q<<3 | (encode_base(s[i]) & 0x7);
@@ -180,9 +180,28 @@ void ss_destroy(ss_t *S)
     }
     kh_destroy(ss32, S->d1);
     free(S->cs);
+    if (S->peq) free(S->peq);
     free(S);
 }
 
+// Bit i is set if base i, counted from the first one, is A/C/G/T.
+static void build_peq(uint64_t q, uint32_t *peq)
+{
+    int l = 0, i;
+    for (; q>>(3*l); ++l);
+    memset(peq, 0, 4*sizeof(uint32_t));
+    for (i = l-1; i >= 0; --i, q >>= 3)
+        peq[(q & 0x7) - BASE_A] |= 1u << i;
+}
+void ss_set_metric(ss_t *S, enum ss_metric metric)
+{
+    S->metric = metric;
+    if (metric != ss_levenshtein || S->peq) return;
+    S->peq = malloc((S->m > 0 ? S->m : 1)*4*sizeof(uint32_t));
+    int i;
+    for (i = 0; i < S->n; ++i) build_peq(S->cs[i], S->peq + i*4);
+}
+
 static void build_kmers(ss_t *S, uint64_t q, int idx)
 {
     int offset = 3 *kmer_size;
@@ -222,8 +241,10 @@ int ss_push(ss_t *S, char *seq)
     if (S->n == S->m) {
         S->m = S->m == 0 ? 1024 : S->m<<1;
         S->cs = realloc(S->cs, S->m*sizeof(uint64_t));
+        if (S->peq) S->peq = realloc(S->peq, S->m*4*sizeof(uint32_t));
     }
     S->cs[S->n] = q;
+    if (S->peq) build_peq(q, S->peq + S->n*4);
     int ret;
     k = kh_put(ss64, S->d0, S->cs[S->n], &ret);
     kh_val(S->d0, k) = S->n;
@@ -233,105 +254,35 @@ int ss_push(ss_t *S, char *seq)
     return 0;
 }
 
-struct element {
-    int ele;
-    int cnt;
-};
-typedef struct set {
-    struct element *ele;
-    int n, m;
-} set_t;
+#define SS_LOW3 0x1249249249249249ULL // lowest bit of every 3-bit base
 
-set_t *set_init()
-{
-    set_t *set = malloc(sizeof(*set));
-    memset(set, 0, sizeof(*set));
-    return set;
-}
-void set_destory(set_t *set)
+// Bases differ where any bit of the 3-bit codes differs. Both sequences should
+// be in the same length.
+static inline int hamming_dist_calc(uint64_t a, uint64_t b)
 {
-    if (set->m) free(set->ele);
-    free(set);
+    uint64_t x = a ^ b;
+    return __builtin_popcountll((x | x>>1 | x>>2) & SS_LOW3);
 }
-static void set_push_core(int ele, set_t *set)
-{
-    int i;
-    for (i = 0; i < set->n; ++i)
-        if (set->ele[i].ele == ele) {
-            set->ele[i].cnt++;
-            return;
-        }
 
-    if (set->n == set->m) {
-        set->m = set->m == 0 ? 2 : set->m<<1;
-        set->ele = realloc(set->ele, sizeof(struct element)*set->m);
-    }
-    
-    set->ele[set->n].ele = ele;
-    set->ele[set->n].cnt = 1;
-    set->n++;
-}
-void set_push(int *ele, int n, set_t *set)
-{
-    assert(n > 0);
+extern int levenshtein_bp(const uint64_t *peq, int m, const uint8_t *text, int n, int max);
 
-    int i;
-    for (i = 0; i < n; ++i) set_push_core(ele[i], set);    
-}
-int cmpfunc (const void * a, const void * b)
+// Query is the text, white list sequence is the pattern. N in query matches nothing.
+static inline int levnshn_dist_calc(const ss_t *S, int idx, const uint8_t *text, int n, int e)
 {
-    return (*(struct element*)b).cnt - (*(struct element*)a).cnt;
+    const uint32_t *p = S->peq + idx*4;
+    uint64_t peq[5] = { p[0], p[1], p[2], p[3], 0 };
+    int m = (64 - __builtin_clzll(S->cs[idx]) + 2)/3;
+    return levenshtein_bp(peq, m, text, n, e);
 }
 
-int set_top_2(set_t *set)
+static int ss_dist(const ss_t *S, int idx, uint64_t q, const uint8_t *text, int n, int e)
 {
-    if (set->n <= 2) return set->n;
-
-    qsort(set->ele, set->n,  sizeof(struct element),  cmpfunc);
-
-    int max = set->ele[1].cnt;
-    int i;
-    for (i = 2; max <= set->ele[i].cnt && i < set->n; ++i) {}
-    return i;
+    if (S->metric == ss_levenshtein) return levnshn_dist_calc(S, idx, text, n, e);
+    if (S->cs[idx]>>(3*n) || S->cs[idx]>>(3*(n-1)) == 0) return e+1; // length mismatch
+    return hamming_dist_calc(S->cs[idx], q);
 }
 
-int hamming_dist_calc(uint64_t a, uint64_t b)
-{
-    char *s1 = decode64(a);
-    char *s2 = decode64(b);
-    int l = strlen(s1);
-    int i;
-    int d = 0;
-    for (i = 0; i < l; ++i)
-        if (s1[i] != s2[i]) d++;
-    free(s1); free(s2);
-    return d;
-}
-
-extern size_t levenshtein_n(const char *a, const size_t length, const char *b, const size_t bLength);
-
-int levnshn_dist_calc(uint64_t a, uint64_t b)
-{
-    char *s1 = decode64(a);
-    char *s2 = decode64(b);
-    int l = strlen(s1);
-    int dist = levenshtein_n(s1, l, s2, l);
-    free(s1);
-    free(s2);
-    return dist;
-}
-
-static int use_levenshtein_distance = 0;
-
-void set_levenshtein()
-{
-    use_levenshtein_distance = 1;    
-}
-void set_hamming()
-{
-    use_levenshtein_distance = 0;
-}
-char *ss_query(ss_t *S, char *seq, int e, int *exact)
+int ss_query_idx(ss_t *S, char *seq, int e, int *exact)
 {
     *exact = 1; // exactly match
     int l = strlen(seq);
@@ -339,12 +290,28 @@ char *ss_query(ss_t *S, char *seq, int e, int *exact)
     uint64_t q = enc64(seq);
     khint_t k = kh_get(ss64, S->d0, q);
     
-    if (k != kh_end(S->d0)) return decode64(q);
+    if (k != kh_end(S->d0)) return kh_val(S->d0, k);
 
     *exact = 0;
     int i;
-    set_t *set = set_init();
-    
+    uint8_t text[32];
+    for (i = 0; i < l; ++i) text[i] = (q >> 3*(l-i-1) & 0x7) - BASE_A;
+
+    // no k-mer in short sequence, white list of such length is small anyway
+    if (l < kmer_size) {
+        int hit = -1;
+        for (i = 0; i < S->n; ++i) {
+            if (ss_dist(S, i, q, text, l, e) > e) continue;
+            if (hit != -1) return -1;
+            hit = i;
+        }
+        return hit;
+    }
+
+    // Every sequence sharing a k-mer is a candidate, even if it shares only one,
+    // so errors in the middle of query are still corrected. A candidate may be
+    // listed by several k-mers, only different hits are multi hits.
+    int hit = -1;
     for (i = 0; i < l - kmer_size+1; ++i) {
         int j = check_Ns(seq+i, kmer_size);
         if (j) {
@@ -352,41 +319,39 @@ char *ss_query(ss_t *S, char *seq, int e, int *exact)
             continue;
         }
         uint32_t q0 = enc32(seq+i, kmer_size);
-         k = kh_get(ss32, S->d1, q0);        
+        k = kh_get(ss32, S->d1, q0);
         if (k == kh_end(S->d1)) continue;
         
-        struct ss_idx *idx = &kh_val(S->d1, k);        
-        set_push(idx->idx, idx->n, set);        
-    }
-
-
-    /*
-      Previous we use kmer frequency to identify the similar of two sequence and calculate the lenvenstain distance
-      for top 2 candidates. However, in some cases, when a sequence error happens at the middle of query sequence, leading
-      to low frequency of kmers, will be ignored at this step. So we now will count all candidates. 
-
-      // int n = set_top_2(set);      
-
-      */
-
-    
-    int hit = -1;
-    for (i = 0; i < set->n; ++i) {
-        int dist = use_levenshtein_distance == 1 ?  levnshn_dist_calc(S->cs[set->ele[i].ele], q) : hamming_dist_calc(S->cs[set->ele[i].ele], q);
-        if (dist <= e) {
-            if (hit != -1) goto multi_hits;
-            hit = set->ele[i].ele;
+        struct ss_idx *idx = &kh_val(S->d1, k);
+        for (j = 0; j < idx->n; ++j) {
+            int c = idx->idx[j];
+            if (c == hit) continue;
+            if (ss_dist(S, c, q, text, l, e) > e) continue;
+            if (hit != -1) return -1;
+            hit = c;
         }
     }
-    
-    set_destory(set);
-
-    if (hit == -1) return NULL;
-    return decode64(S->cs[hit]);
-
-  multi_hits:
-    set_destory(set);
-    return NULL;
+    return hit;
+}
+char *ss_query(ss_t *S, char *seq, int e, int *exact)
+{
+    int idx = ss_query_idx(S, seq, e, exact);
+    if (idx == -1) return NULL;
+    return decode64(S->cs[idx]);
+}
+int ss_size(ss_t *S)
+{
+    return S->n;
+}
+char *ss_name(ss_t *S, int idx, char *buf)
+{
+    uint64_t q = S->cs[idx];
+    int i, l = 0;
+    for (; q>>(3*l); ++l);
+    for (i = l-1; i >= 0; --i, q >>= 3)
+        buf[i] = "\0ACGTN"[q & 0x7];
+    buf[l] = '\0';
+    return buf;
 }
 
 #ifdef SS_MAIN
@@ -7,11 +7,21 @@ typedef uint32_t  base32_t;
 
 typedef struct similarity_search_aux ss_t;
 
-extern void set_levenshtein();
-extern void set_hamming();
+enum ss_metric {
+    ss_hamming,     // default
+    ss_levenshtein, // Myers' bit-parallel edit distance, for indel prone platforms
+};
 
 extern ss_t *ss_init();
+// Set distance of query per index, so segments can differ. Queries do not
+// touch shared state and can run from several threads after pushing done.
+extern void ss_set_metric(ss_t *S, enum ss_metric metric);
 extern char *ss_query(ss_t *S, char *seq, int e, int *i);
+// Return index of hit in push order, -1 for unfound or multi hits.
+extern int ss_query_idx(ss_t *S, char *seq, int e, int *i);
+extern int ss_size(ss_t *S);
+// Write barcode to buf, at least 22 bytes.
+extern char *ss_name(ss_t *S, int idx, char *buf);
 extern int ss_push(ss_t *S, char *seq);
 extern void ss_destroy(ss_t *);
 
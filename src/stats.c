@@ -0,0 +1,258 @@
+#include "utils.h"
+#include "stats.h"
+#include "number.h"
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+int stats_on = 0;
+
+#define MAX_INPUT 64
+
+struct stage {
+    uint64_t busy, wait; // nanoseconds
+    int n_thread;
+};
+
+struct input {
+    char *fn;
+    int64_t size;
+    int64_t offset;
+};
+
+static struct {
+    const char *json;
+    int progress;
+    const char *cmd;
+    double t_start;
+
+    uint64_t records;
+    uint64_t bytes_out;
+    uint64_t allocs;
+    uint64_t reuses;
+    struct stage stages[stats_stage_max];
+
+    uint64_t queue_sum;
+    uint64_t queue_n;
+    int queue_max;
+
+    int n_input;
+    struct input inputs[MAX_INPUT];
+    pthread_mutex_t lock;
+
+    pthread_t progress_thread;
+    pthread_cond_t  progress_cond;
+    int quit;
+} st = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .progress_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *stage_names[] = { "reader", "worker", "writer" };
+
+int stats_parse_args(int argc, char **argv)
+{
+    int i, n = 1;
+    for (i = 1; i < argc; ++i) {
+        if (i + 1 < argc && strcmp(argv[i], "-stats") == 0) st.json = argv[++i];
+        else if (i + 1 < argc && strcmp(argv[i], "-progress") == 0) st.progress = str2int(argv[++i]);
+        else argv[n++] = argv[i];
+    }
+    if (n < argc) argv[n] = NULL;
+    if (st.progress < 0) error("-progress must be a positive interval in seconds.");
+    stats_on = st.json != NULL || st.progress > 0;
+    return n;
+}
+
+double stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void stats_stage_add(enum stats_stage s, double busy, double wait)
+{
+    if (!stats_on) return;
+    __atomic_add_fetch(&st.stages[s].busy, (uint64_t)(busy*1e9), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st.stages[s].wait, (uint64_t)(wait*1e9), __ATOMIC_RELAXED);
+}
+void stats_stage_threads(enum stats_stage s, int n)
+{
+    if (!stats_on) return;
+    if (st.stages[s].n_thread < n) st.stages[s].n_thread = n;
+}
+void stats_queue(int depth)
+{
+    if (!stats_on) return;
+    __atomic_add_fetch(&st.queue_sum, depth, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st.queue_n, 1, __ATOMIC_RELAXED);
+    if (depth > st.queue_max) st.queue_max = depth; // sampled by reader only
+}
+void stats_records(uint64_t n)
+{
+    if (!stats_on) return;
+    __atomic_add_fetch(&st.records, n, __ATOMIC_RELAXED);
+}
+void stats_alloc(int n)
+{
+    if (!stats_on) return;
+    __atomic_add_fetch(&st.allocs, n, __ATOMIC_RELAXED);
+}
+void stats_reuse(int n)
+{
+    if (!stats_on) return;
+    __atomic_add_fetch(&st.reuses, n, __ATOMIC_RELAXED);
+}
+void stats_output(uint64_t bytes)
+{
+    if (!stats_on) return;
+    __atomic_add_fetch(&st.bytes_out, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_input(const char *fn, int64_t offset)
+{
+    if (!stats_on || fn == NULL) return;
+    pthread_mutex_lock(&st.lock);
+    int i;
+    for (i = 0; i < st.n_input; ++i)
+        if (strcmp(st.inputs[i].fn, fn) == 0) break;
+    if (i == st.n_input) {
+        if (st.n_input == MAX_INPUT) {
+            pthread_mutex_unlock(&st.lock);
+            return;
+        }
+        struct stat s;
+        st.inputs[i].fn = strdup(fn);
+        // stdin and pipes have no size, no ETA for them
+        st.inputs[i].size = stat(fn, &s) == 0 && S_ISREG(s.st_mode) ? s.st_size : 0;
+        st.n_input++;
+    }
+    if (offset > st.inputs[i].offset) st.inputs[i].offset = offset;
+    pthread_mutex_unlock(&st.lock);
+}
+void stats_input_hts(htsFile *fp)
+{
+    if (!stats_on) return;
+    int64_t offset;
+    if (fp->is_bgzf) offset = bgzf_tell(fp->fp.bgzf) >> 16;
+    else if (fp->is_cram) return;
+    else offset = htell(fp->fp.hfile);
+    stats_input(fp->fn, offset);
+}
+
+static void input_offset(int64_t *offset, int64_t *size)
+{
+    int i;
+    *offset = *size = 0;
+    pthread_mutex_lock(&st.lock);
+    for (i = 0; i < st.n_input; ++i) {
+        if (st.inputs[i].size == 0) continue;
+        *offset += st.inputs[i].offset;
+        *size += st.inputs[i].size;
+    }
+    pthread_mutex_unlock(&st.lock);
+}
+
+static void print_progress(double now)
+{
+    double t = now - st.t_start;
+    uint64_t records = __atomic_load_n(&st.records, __ATOMIC_RELAXED);
+    int64_t offset, size;
+    input_offset(&offset, &size);
+    if (size == 0 || offset == 0) {
+        LOG_print("Processed %"PRIu64" records, %.0f records/sec.", records, records/t);
+        return;
+    }
+    double frac = (double)offset/size;
+    if (frac > 1) frac = 1;
+    int eta = (int)(t/frac - t);
+    LOG_print("Processed %"PRIu64" records, %.0f records/sec, %.1f%% of input, ETA %02d:%02d:%02d.",
+              records, records/t, frac*100, eta/3600, eta%3600/60, eta%60);
+}
+
+static void *progress_run(void *_d)
+{
+    pthread_mutex_lock(&st.lock);
+    for (;;) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += st.progress;
+        while (!st.quit)
+            if (pthread_cond_timedwait(&st.progress_cond, &st.lock, &ts)) break;
+        if (st.quit) break;
+        pthread_mutex_unlock(&st.lock);
+        print_progress(stats_now());
+        pthread_mutex_lock(&st.lock);
+    }
+    pthread_mutex_unlock(&st.lock);
+    return NULL;
+}
+
+void stats_start(const char *cmd)
+{
+    if (!stats_on) return;
+    st.cmd = cmd;
+    st.t_start = stats_now();
+    if (st.progress > 0 && pthread_create(&st.progress_thread, NULL, progress_run, NULL))
+        error("Failed to create thread.");
+}
+
+static void write_json(double t)
+{
+    FILE *fp = fopen(st.json, "w");
+    if (fp == NULL) {
+        warnings("%s : %s.", st.json, strerror(errno));
+        return;
+    }
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+
+    int64_t offset, size;
+    input_offset(&offset, &size);
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"command\": \"%s\",\n", st.cmd);
+    fprintf(fp, "  \"real_time\": %.3f,\n", t);
+    fprintf(fp, "  \"cpu_time\": %.3f,\n", cputime());
+    fprintf(fp, "  \"records\": %"PRIu64",\n", st.records);
+    fprintf(fp, "  \"records_per_sec\": %.1f,\n", t > 0 ? st.records/t : 0);
+    fprintf(fp, "  \"bytes_in\": %"PRId64",\n", offset);
+    fprintf(fp, "  \"bytes_out\": %"PRIu64",\n", st.bytes_out);
+    fprintf(fp, "  \"stages\": {\n");
+    int i;
+    for (i = 0; i < stats_stage_max; ++i) {
+        struct stage *s = &st.stages[i];
+        double busy = s->busy*1e-9;
+        int n = s->n_thread ? s->n_thread : 1;
+        fprintf(fp, "    \"%s\": { \"threads\": %d, \"busy\": %.3f, \"wait\": %.3f, \"utilization\": %.3f }%s\n",
+                stage_names[i], n, busy, s->wait*1e-9, t > 0 ? busy/(n*t) : 0, i+1 < stats_stage_max ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"queue_depth\": { \"mean\": %.2f, \"max\": %d },\n",
+            st.queue_n ? (double)st.queue_sum/st.queue_n : 0, st.queue_max);
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n", r.ru_maxrss);
+    fprintf(fp, "  \"allocs\": %"PRIu64",\n", st.allocs);
+    fprintf(fp, "  \"reuses\": %"PRIu64"\n", st.reuses);
+    fprintf(fp, "}\n");
+    fclose(fp);
+}
+
+void stats_finish()
+{
+    if (!stats_on) return;
+    if (st.progress > 0) {
+        pthread_mutex_lock(&st.lock);
+        st.quit = 1;
+        pthread_cond_signal(&st.progress_cond);
+        pthread_mutex_unlock(&st.lock);
+        pthread_join(st.progress_thread, NULL);
+    }
+    double t = stats_now() - st.t_start;
+    if (st.json) write_json(t);
+    int i;
+    for (i = 0; i < st.n_input; ++i) free(st.inputs[i].fn);
+    st.n_input = 0;
+    stats_on = 0;
+}
@@ -0,0 +1,62 @@
+#ifndef PISA_STATS_H
+#define PISA_STATS_H
+
+#include <stdint.h>
+#include "htslib/hts.h"
+
+// Runtime statistics of one subcommand, enabled by global options
+//
+//    -stats FILE     Write JSON stats to FILE at exit.
+//    -progress INT   Print a progress line every INT seconds.
+//
+// Both are stripped from argv by stats_parse_args before the subcommand sees
+// them. All hooks return at once if stats are off, and are called per chunk
+// instead of per record, so the cost is a branch in the hot path.
+extern int stats_on;
+
+enum stats_stage {
+    stats_reader = 0,
+    stats_worker,
+    stats_writer,
+    stats_stage_max,
+};
+
+// Strip global options, return new argc.
+int stats_parse_args(int argc, char **argv);
+void stats_start(const char *cmd);
+// Stop progress thread and write JSON.
+void stats_finish();
+
+// Monotonic clock in seconds.
+double stats_now();
+
+void stats_stage_add(enum stats_stage s, double busy, double wait);
+void stats_stage_threads(enum stats_stage s, int n);
+// Sample items in flight between reader and writer.
+void stats_queue(int depth);
+void stats_records(uint64_t n);
+void stats_alloc(int n);
+void stats_reuse(int n);
+
+// Current position of input file, progress and ETA estimated against file size.
+void stats_input(const char *fn, int64_t offset);
+// Compressed offset of htsFile, BGZF block address for compressed files.
+void stats_input_hts(htsFile *fp);
+// Uncompressed bytes handed to output, compressed size is unknown until
+// the threaded BGZF writer flushes. Summary tables written at exit, like the
+// matrices of count and attrcnt, are not counted.
+void stats_output(uint64_t bytes);
+
+// For loops reading one record at a time. Count a record in *n and report
+// every STATS_STEP records, or the rest if end is set.
+#define STATS_STEP 65536
+static inline void stats_read_hts(htsFile *fp, int *n, int end)
+{
+    if (!stats_on) return;
+    if (!end && ++*n < STATS_STEP) return;
+    stats_records(*n);
+    stats_input_hts(fp);
+    *n = 0;
+}
+
+#endif
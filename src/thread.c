@@ -1,115 +1,146 @@
 #include "thread.h"
 #include "utils.h"
+#include "stats.h"
 
 
-void tpool_thread(void *_p)
-{
-    struct tpool_work *w;
-    struct tpool *p = _p;
-    for (;;) {
-        pthread_mutex_lock(&p->lock);
-        while (p->n == 0 && !p->shutdown)
-            pthread_cond_wait(&p->not_empty, &p->lock);
-        if (p->shutdown) {
-            pthread_mutex_unlock(&p->lock);
-            pthread_exit(NULL);
-        }
-        w = p->head;
-        p->n--;
-        if (p->n == 0)
-            p->head = p->tail = NULL;
-        else
-            p->head = w->next;
-
-        if (!p->do_not_block && p->n == (p->m-1))
-            pthread_cond_broadcast(&p->not_full);
-        
-        if (p->n == 0)
-            pthread_cond_signal(&p->empty);
+struct pl_job {
+    pipeline_work_func work;
+    void *data;
+    void *opts;
+};
 
-        pthread_mutex_unlock(&p->lock);
-        
-        (*(w->routine))(w->arg);
-        free(w);
-    }
+static void *pl_job_run(void *_j)
+{
+    struct pl_job *j = _j;
+    double t0 = stats_on ? stats_now() : 0;
+    void *data = j->work(j->data, j->opts);
+    if (stats_on) stats_stage_add(stats_worker, stats_now() - t0, 0);
+    free(j);
+    return data;
 }
-struct tpool *tpool_init(int n_thread, int max_size, int do_not_block)
+static void pl_write(hts_tpool_result *r, pipeline_write_func write, void *opts)
 {
-    struct tpool *p = malloc(sizeof(*p));
-    memset(p, 0, sizeof(*p));
-    p->n_thread = n_thread;
-    p->m = max_size;
-    p->do_not_block = do_not_block;
-    p->threads = malloc(sizeof(pthread_t)*n_thread);
-    pthread_mutex_init(&p->lock, NULL);
-    pthread_cond_init(&p->not_empty, NULL);
-    pthread_cond_init(&p->not_full, NULL);
-    pthread_cond_init(&p->empty, NULL);
-    int i;
-    for (i = 0; i < n_thread; ++i)
-        pthread_create(&p->threads[i], NULL, tpool_thread, p);
-
-    return p;
+    double t0 = stats_on ? stats_now() : 0;
+    if (write) write(hts_tpool_result_data(r), opts);
+    hts_tpool_delete_result(r, 0);
+    if (stats_on) stats_stage_add(stats_writer, stats_now() - t0, 0);
 }
 
-int tpool_add_work(struct tpool *p, void *routine, void *arg)
+uint64_t pipeline_run(int qsize, pipeline_read_func read, pipeline_work_func work, pipeline_write_func write, void *opts)
 {
-    struct tpool_work *w;
-    pthread_mutex_lock(&p->lock);
-    if (p->n == p->m && p->do_not_block) {
-        pthread_mutex_unlock(&p->lock);
-        return -1;
-    }
+    void *data;
+    uint64_t n = 0;
+    double t0 = 0, t1 = 0;
 
-    while (p->n == p->m && !p->shutdown)
-        pthread_cond_wait(&p->not_full, &p->lock);
-
-    if (p->shutdown) {
-        pthread_mutex_unlock(&p->lock);
-        return -1;
+    hts_tpool *p = gpool_get();
+    if (p == NULL) {
+        double t[3] = {0,0,0};
+        for (;;) {
+            if (stats_on) t0 = stats_now();
+            data = read(opts);
+            if (stats_on) t[0] += (t1 = stats_now()) - t0;
+            if (data == NULL) break;
+            data = work(data, opts);
+            if (stats_on) t[1] += (t0 = stats_now()) - t1;
+            if (write) write(data, opts);
+            if (stats_on) t[2] += stats_now() - t0;
+            n++;
+        }
+        stats_stage_add(stats_reader, t[0], 0);
+        stats_stage_add(stats_worker, t[1], 0);
+        stats_stage_add(stats_writer, t[2], 0);
+        return n;
     }
+    stats_stage_threads(stats_worker, gpool_size());
 
-    w = malloc(sizeof(*w));
-    w->routine = routine;
-    w->arg = arg;
-    w->next = NULL;
+    if (qsize < gpool_size()*2) qsize = gpool_size()*2;
+    hts_tpool_process *q = hts_tpool_process_init(p, qsize, 0);
+    if (q == NULL) error("Failed to init thread pool process.");
+    hts_tpool_result *r;
+    uint64_t n_out = 0;
+    for (;;) {
+        if (stats_on) t0 = stats_now();
+        data = read(opts);
+        if (stats_on) stats_stage_add(stats_reader, stats_now() - t0, 0);
+        if (data == NULL) break;
 
-    if (p->n == 0) {
-        p->tail = p->head = w;
-        pthread_cond_broadcast(&p->not_empty);
+        struct pl_job *j = malloc(sizeof(*j));
+        j->work = work;
+        j->data = data;
+        j->opts = opts;
+        if (stats_on) stats_queue(n - n_out);
+        // at most qsize items in flight, wait for the oldest one
+        if (n - n_out == qsize) {
+            if (stats_on) t1 = stats_now();
+            r = hts_tpool_next_result_wait(q);
+            if (stats_on) stats_stage_add(stats_reader, 0, stats_now() - t1);
+            pl_write(r, write, opts);
+            n_out++;
+        }
+        // never blocks, queued jobs are fewer than qsize
+        if (hts_tpool_dispatch2(p, q, pl_job_run, j, 0) < 0) error("Failed to dispatch job.");
+        n++;
+        while ((r = hts_tpool_next_result(q))) {
+            pl_write(r, write, opts);
+            n_out++;
+        }
     }
-    else {
-        p->tail->next = w;
-        p->tail = w;
+    while (n_out < n) {
+        if (stats_on) t0 = stats_now();
+        r = hts_tpool_next_result_wait(q);
+        if (stats_on) stats_stage_add(stats_writer, 0, stats_now() - t0);
+        pl_write(r, write, opts);
+        n_out++;
     }
-    p->n++;
-    pthread_mutex_unlock(&p->lock);
-    return 1;
+    hts_tpool_process_destroy(q);
+    return n;
 }
 
-void tpool_destroy(struct tpool *p)
-{
-    pthread_mutex_unlock(&p->lock);
-
-    if (p->shutdown) {
-        pthread_mutex_unlock(&p->lock);
-        return;
-    }
+static struct {
+    hts_tpool *p;
+    int n_thread;
+} gpool = { NULL, 1 };
 
-    while (p->n != 0) 
-        pthread_cond_wait(&p->empty, &p->lock);
-        
-    p->shutdown = 1;
-
-    pthread_mutex_unlock(&p->lock);
-    pthread_cond_broadcast(&p->not_empty);
-    pthread_cond_broadcast(&p->not_full);
-
-    int i;
-    for (i = 0; i < p->n_thread; i++)
-        pthread_join(p->threads[i], NULL);
-    
-    free(p->threads);
-    free(p);
-    return;
+int gpool_init(int n_thread)
+{
+    if (gpool.p) error("Global thread pool has already been inited.");
+    gpool.n_thread = n_thread < 1 ? 1 : n_thread;
+    if (gpool.n_thread < 2) return 0;
+    gpool.p = hts_tpool_init(gpool.n_thread);
+    if (gpool.p == NULL) error("Failed to init thread pool with %d threads.", gpool.n_thread);
+    return 0;
+}
+hts_tpool *gpool_get()
+{
+    return gpool.p;
+}
+int gpool_size()
+{
+    return gpool.n_thread;
+}
+hts_tpool_process *gpool_process_init(enum gpool_priority prio)
+{
+    if (gpool.p == NULL) return NULL;
+    return hts_tpool_process_init(gpool.p, gpool.n_thread*prio, 0);
+}
+int gpool_attach_hts(htsFile *fp, enum gpool_priority prio)
+{
+    if (gpool.p == NULL) return 0;
+    // multithreaded SAM parser of htslib 1.10 hangs at EOF on a shared pool,
+    // text input is parsed by the reading thread
+    if (fp->format.format == sam) return 0;
+    htsThreadPool tp = { gpool.p, gpool.n_thread*prio };
+    return hts_set_thread_pool(fp, &tp);
+}
+int gpool_attach_bgzf(BGZF *fp, enum gpool_priority prio)
+{
+    if (gpool.p == NULL) return 0;
+    return bgzf_thread_pool(fp, gpool.p, gpool.n_thread*prio);
+}
+void gpool_destroy()
+{
+    if (gpool.p == NULL) return;
+    hts_tpool_destroy(gpool.p);
+    gpool.p = NULL;
+    gpool.n_thread = 1;
 }
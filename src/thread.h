@@ -3,29 +3,61 @@
 
 #include<stdio.h>
 #include<pthread.h>
+#include "htslib/hts.h"
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 
-struct tpool_work {
-    void (*routine)();
-    void *arg;
-    struct tpool_work *next;
-};
+// Ordered pipeline on the global pool. The caller thread reads input items,
+// dispatches them as jobs to the pool below, and consumes results in input
+// order between reads.
+//
+//  - Workers are the pool threads, so the pipeline never adds threads of its
+//    own, and work jobs share the pool with BGZF compression of the same
+//    command. Idle pool threads take the next queued job, so one slow chunk
+//    never stalls the others.
+//  - Items in flight are bounded by qsize (at least twice the pool size),
+//    the reader waits for the oldest result once qsize items are out, so
+//    memory never grows unbounded.
+//  - If write is NULL, results are dropped, which makes the pipeline a plain
+//    task scheduler.
+//  - Without a pool, all stages run in caller thread.
+//
+// read  : return next item, NULL at end of input
+// work  : transform item, return result passed to write
+// write : consume result in input order, free it if necessary
+typedef void *(*pipeline_read_func)(void *opts);
+typedef void *(*pipeline_work_func)(void *data, void *opts);
+typedef void (*pipeline_write_func)(void *data, void *opts);
+
+// Return items processed.
+uint64_t pipeline_run(int qsize, pipeline_read_func read, pipeline_work_func work, pipeline_write_func write, void *opts);
 
-struct tpool {
-    int                n_thread;
-    int                m, n; // queue size
-    int                do_not_block;
-    pthread_t         *threads;
-    struct tpool_work *head;
-    struct tpool_work *tail;
-    pthread_mutex_t    lock;
-    pthread_cond_t     not_empty;
-    pthread_cond_t     not_full;
-    pthread_cond_t     empty;
-    int                shutdown;
+// Process-wide thread pool, shared by all BGZF readers/writers and worker
+// stages of one subcommand. Sized once by -t, so attaching more handles never
+// adds threads.
+//
+// hts_tpool has no explicit priorities; a worker only picks jobs from a process
+// whose output queue has more free slots than busy threads. We express priority
+// as queue headroom, so high priority processes (output compression) can still
+// be scheduled while compute stages are saturated.
+enum gpool_priority {
+    gpool_low = 1,
+    gpool_normal = 2,
+    gpool_high = 4,
 };
 
-struct tpool *tpool_init(int n_thread, int max_size, int do_not_block);
-int tpool_add_work(struct tpool *p, void *routine, void *arg);
-void tpool_destroy(struct tpool *p);
+// Init global pool with n_thread workers, n_thread < 2 means no pool and
+// every attach below becomes a no-op.
+int gpool_init(int n_thread);
+// Return NULL if pool not inited.
+hts_tpool *gpool_get();
+int gpool_size();
+// Create a worker process on the global pool, queue size scaled by priority.
+hts_tpool_process *gpool_process_init(enum gpool_priority prio);
+// Attach htsFile/BGZF to global pool.
+int gpool_attach_hts(htsFile *fp, enum gpool_priority prio);
+int gpool_attach_bgzf(BGZF *fp, enum gpool_priority prio);
+// Should be called after all attached handles closed.
+void gpool_destroy();
 
 #endif
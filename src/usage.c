@@ -8,13 +8,13 @@ int fragment_usage()
     fprintf(stderr, "\nOptions:\n");
     fprintf(stderr, " -o       [FILE]    Output file. This file will be bgzipped and indexed.\n");
     fprintf(stderr, " -tag     [TAG]     Cell barcode tag.\n");
-    fprintf(stderr, " -list    [FILE]    Cell barcode white list.\n");
+    fprintf(stderr, " -list    [FILE]    Cell barcode white list, plain text or index built by wlidx.\n");
     fprintf(stderr, " -q       [20]      Mapping quality score to filter reads.\n");
     fprintf(stderr, " -isize   [2000]    Skip if insert size greater than this. [2KB]\n");
     fprintf(stderr, " -bed     [BED]     Only convert fragments overlapped with target regions.\n");
     fprintf(stderr, " -black-region [BED] Skip convert fragments overlapped with black regions.\n");
     fprintf(stderr, " -stat    [FILE]    Transposition events per cell.\n");   
-    fprintf(stderr, " -@       [4]       Thread to unpack and pack files.[4]\n");
+    fprintf(stderr, " -t       [INT]     Threads to unpack and pack files. -@ is an alias. [4]\n");
     fprintf(stderr, " -disable-tn5       Disable Tn5 offset for each fragment.\n");
     return 1;
 }
@@ -29,11 +29,34 @@ int fastq_parse_usage()
     fprintf(stderr, " -config  [json]    Configure file in JSON format. Required.\n");
     fprintf(stderr, " -run     [string]  Run code, used for different library.\n");
     fprintf(stderr, " -cbdis   [file]    Read count per cell barcode.\n");
+    fprintf(stderr, " -dis     [file]    Exactly matched and corrected reads per white list barcode, by segment.\n");
+    fprintf(stderr, " -sheet   [file]    Sample sheet, sample name and sample barcode per line.\n");
+    fprintf(stderr, " -outdir  [dir]     Demultiplex reads into DIR/SAMPLE_[12].fq.gz, work with -sheet.\n");
+    fprintf(stderr, " -bucket  [INT]     Write reads into INT bgzipped buckets partitioned by cell barcode.\n");
+    fprintf(stderr, " -bucket-prefix [str] Buckets are named PREFIX.NNNN.fq.gz.\n");
+    fprintf(stderr, " -m       [mem]     Memory to buffer buckets, spilled to disk if exceeded, 64K per bucket at least. [1G]\n");
     fprintf(stderr, " -p                 Read 1 and read 2 interleaved in the input file.\n");
     //fprintf(stderr, " -f                 Filter reads on DNBSEQ standard (2 bases < q10 at first 15 bases).\n");
     fprintf(stderr, " -q       [INT]     Drop reads if average sequencing quality below this value.\n");
     fprintf(stderr, " -dropN             Drop reads if N base in sequence or barcode.\n");
     fprintf(stderr, " -report  [csv]     Summary report.\n");
+    fprintf(stderr, " -t       [INT]     Threads, up to half decompress R1/R2 of lanes in parallel.\n");
+    fprintf(stderr, " -r       [10000]   Records per chunk.\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " Outputs keep the input order, lane by lane, whatever -t is set.\n");
+    fprintf(stderr, " Segments with variable offset, like DNBelab C4 beads, can be located by a linker:\n");
+    fprintf(stderr, "   {\"location\":\"R1:17-26\", \"anchor\":\"TCGGAT\", \"anchor location\":\"R1:11-16\",\n");
+    fprintf(stderr, "    \"anchor shift\":\"2\", \"anchor distance\":\"1\"}\n");
+    fprintf(stderr, "   The segment moves with the linker found in 2 bases around its location with at most\n");
+    fprintf(stderr, "   1 mismatch. Reads without the linker are counted as failed barcodes.\n");
+    fprintf(stderr, " Reads in each bucket are grouped by cell barcode like `fsort -tag CB`, so fsort is not\n");
+    fprintf(stderr, "   needed after -bucket. Each barcode falls in exactly one bucket, and is indexed in\n");
+    fprintf(stderr, "   PREFIX.NNNN.fq.gz.fqi for `PISA fetch`.\n");
+    fprintf(stderr, " Barcodes are corrected by hamming distance, set \"correction\":\"levenshtein\" in a segment\n");
+    fprintf(stderr, "   to allow indels within \"distance\" edits.\n");
+    fprintf(stderr, " Sample barcodes in -sheet are corrected with \"distance\" of \"sample barcode\" segments,\n");
+    fprintf(stderr, "   segments of dual index are joined by '+', like \"S1 ACGTACGT+TTGCAGTC\". Reads of\n");
+    fprintf(stderr, "   unknown sample barcodes are dropped. Per sample summary in DIR/sample_report.csv.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -45,13 +68,30 @@ int fsort_usage()
     fprintf(stderr, " -tag     [TAGS]     Tags, such as CB,UR. Order of these tags is sensitive.\n");
     fprintf(stderr, " -dedup              Remove dna copies with same tags. Only keep reads have the best quality.\n");
     fprintf(stderr, " -dup-tag [TAG]      Tag name of duplication counts. Use with -dedup only. [DU]\n");
-    fprintf(stderr, " -list    [file]     White list for first tag, usually for cell barcodes.\n");
-    fprintf(stderr, " -@       [INT]      Threads to compress file.\n");
+    fprintf(stderr, " -list    [file]     White list for first tag, usually for cell barcodes. Plain text or index built by wlidx.\n");
+    fprintf(stderr, " -t       [INT]      Threads shared by compression and decompression. -@ is an alias.\n");
     fprintf(stderr, " -o       [fq.gz]    bgzipped output fastq file.\n");
     fprintf(stderr, " -m       [mem]      Memory per thread. [1G]\n");
     fprintf(stderr, " -p                  Input fastq is smart pairing.\n");
     fprintf(stderr, " -T       [prefix]   Write temporary files to PREFIX.nnnn.tmp\n");
     fprintf(stderr, " -report  [csv]      Summapry report.\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " Offset and record count of each barcode are indexed in OUTPUT.fqi, reads of a barcode\n");
+    fprintf(stderr, " can be fetched by `PISA fetch` without decompressing the whole file.\n");
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+int fetch_usage()
+{
+    fprintf(stderr, "* Fetch reads of barcodes from fastq sorted by fsort or parse -bucket.\n");
+    fprintf(stderr, "fetch [options] sorted.fq.gz [BARCODE ...]\n");
+    fprintf(stderr, "\nOptions :\n");
+    fprintf(stderr, " -list    [file]     Barcodes to fetch, one per line.\n");
+    fprintf(stderr, " -o       [fq]       Output fastq, bgzipped if ends with .gz. [stdout]\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " Index sorted.fq.gz.fqi is required. Barcodes are the values of -tag of fsort, values of\n");
+    fprintf(stderr, " several tags are concatenated in order.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -96,7 +136,8 @@ int sam2bam_usage()
     fprintf(stderr, " -o       [BAM]       Output file [stdout].\n");
     fprintf(stderr, " -mito    [string]    Mitochondria name. Used to stat ratio of mitochondria reads.\n");
     fprintf(stderr, " -maln    [BAM]       Export mitochondria reads into this file instead of standard output file.\n");
-    fprintf(stderr, " -@       [INT]       Threads to compress bam file.\n");
+    fprintf(stderr, " -t       [INT]       Threads shared by parsing and compression. -@ is an alias.\n");
+    fprintf(stderr, " -r       [1000000]   Records per chunk.\n");
     fprintf(stderr, " -report  [csv]       Alignment report.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Note :\n");
@@ -118,7 +159,7 @@ int rmdup_usage()
     fprintf(stderr, "bam_rmdup [options] in.bam\n");
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, "   -tag   [TAGS]       Barcode tags to group reads.\n");
-    fprintf(stderr, "   -@     [INT]        Threads to unpack BAM.\n");
+    fprintf(stderr, "   -t     [INT]        Threads to unpack and pack BAM. -@ is an alias.\n");
     fprintf(stderr, "   -o     [BAM]        Output bam.\n");
     fprintf(stderr, "   -S                  Treat PE reads as SE.\n");
     fprintf(stderr, "   -k                  Keep duplicates, make flag instead of remove them.\n");
@@ -131,10 +172,18 @@ int pick_usage()
     fprintf(stderr, "* Pick alignment records within barcode list.\n");
     fprintf(stderr, "PickBam [options] in.bam\n");
     fprintf(stderr, "\nOptions :\n");
-    fprintf(stderr, " -list    [file]       Barcode white list.\n");
+    fprintf(stderr, " -list    [file]       Barcode white list, plain text or index built by wlidx.\n");
     fprintf(stderr, " -tag     [TAG]        Barcode tag.\n");
     fprintf(stderr, " -o       [BAM]        Output file.\n");
-    fprintf(stderr, " -@       [INT]        Threads to unpack BAM.\n");
+    fprintf(stderr, " -t       [INT]        Threads to filter, unpack and pack BAM. -@ is an alias.\n");
+    fprintf(stderr, " -split   [DIR]        Split records into DIR/BARCODE.bam, one file per barcode, in one pass.\n");
+    fprintf(stderr, " -map     [file]       Barcode and group name per line, split records into DIR/GROUP.bam.\n");
+    fprintf(stderr, " -max-open [INT]       Files open at the same time in split mode. [256]\n");
+    fprintf(stderr, " -m       [mem]        Memory to buffer compressed records in split mode. [1G]\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " Records without tag, not in -list or -map, or flagged QC failed are dropped. In split mode,\n");
+    fprintf(stderr, " records of a file keep their input order, files beyond -max-open are closed and appended\n");
+    fprintf(stderr, " later.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -146,9 +195,8 @@ int anno_usage()
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, " -o        [BAM]       Output bam file.\n");
     fprintf(stderr, " -report   [csv]       Summary report.\n");
-    fprintf(stderr, " -@        [INT]       Threads to compress bam file.\n");
     fprintf(stderr, " -q        [0]         Map Quality Score cutoff. MapQ smaller and equal to this value will not be annotated.\n");
-    fprintf(stderr, " -t        [INT]       Threads to annotate.\n");
+    fprintf(stderr, " -t        [INT]       Threads shared by annotation and BAM (de)compression. -@ is an alias.\n");
     fprintf(stderr, " -chunk    [INT]       Chunk size per thread.\n");
     fprintf(stderr, " -anno-only            Export annotated reads only.\n");
 
@@ -166,10 +214,15 @@ int anno_usage()
     fprintf(stderr, " -ignore-strand        Ignore strand of transcript in GTF. Reads mapped to antisense transcripts will also be annotated.\n");
     fprintf(stderr, " -splice               Reads covered exon-intron edge will also be annotated.\n");
     fprintf(stderr, " -intron               Reads covered intron regions will be annotated.\n");
+    fprintf(stderr, " -no-cache             Annotate every read from scratch instead of reusing results of reads with identical alignment.\n");
 
     fprintf(stderr, "\nOptions for VCF file :\n");
     fprintf(stderr, " -vcf      [VCF/BCF]   Varaints.\n");
     fprintf(stderr, " -vtag     [TAG]       Tag name. Set with -vcf.\n");
+    fprintf(stderr, " -vcf-outdir [DIR]     Write cell x variant allele count matrices to this directory. Set with -vcf.\n");
+    fprintf(stderr, " -cb       [TAG]       Cell barcode tag. Required by -vcf-outdir.\n");
+    fprintf(stderr, " -umi      [TAG]       UMI tag. Count each UMI once instead of each read.\n");
+    fprintf(stderr, " -list     [file]      Cell barcode white list. Other cells are not counted.\n");
     
     fprintf(stderr, "\nNotice :\n");
     fprintf(stderr, " * For GTF mode, this program will set tags in default, you could also reset them by -tags.\n");
@@ -178,6 +231,8 @@ int anno_usage()
     fprintf(stderr, "   GN : Gene name.\n");
     fprintf(stderr, "   GX : Gene ID.\n");
     fprintf(stderr, "   RE : Region type, E (Exon), N (Intron), C (Exon and Intron), S (junction reads cover isoforms properly), V (ambiguous reads), I (Intergenic), A (Anitisense)\n");
+    fprintf(stderr, " * -vcf-outdir exports barcodes.tsv.gz, features.tsv.gz (chr,pos,ref,alt) and alt.mtx.gz, ref.mtx.gz, other.mtx.gz in MEX format.\n");
+    fprintf(stderr, "   With -umi, a UMI is counted as its majority allele, ties as other. Coordinate sorted input keeps memory low.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -193,7 +248,7 @@ int bam_corr_usage()
     fprintf(stderr, " -tags-block  [TAGS]   Tags to define read group. For example, if set to GN (gene), reads in the same gene will be grouped together.\n");
     fprintf(stderr, " -cr                   Enable CellRanger like UMI correction method.\n");
     fprintf(stderr, " -e                    Maximal hamming distance to define similar barcode, default is 1.\n");
-    fprintf(stderr, " -@        [INT]       Thread to compress BAM file.\n");
+    fprintf(stderr, " -t        [5]         Threads shared by correction and BAM (de)compression. -@ is an alias.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Demo : \n");
     fprintf(stderr, " // Two groups of reads have same cell barcode (CB) and gene (GN) but their UMIs (UY) differ by only one base. The UMI of less supported\n");
@@ -212,16 +267,20 @@ int bam_attr_usage()
     fprintf(stderr, "PISA count in.bam\n");
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, " -cb       [TAG]      Cell Barcode, or other tag used for each individual.\n");
-    fprintf(stderr, " -list     [file]     Cell barcode white list.\n");
+    fprintf(stderr, " -list     [file]     Cell barcode white list, plain text or index built by wlidx.\n");
     fprintf(stderr, " -tags     [TAGS]     Tags to count.\n");
     fprintf(stderr, " -dedup               Deduplicate the atrributes in each tag.\n");
+    fprintf(stderr, " -hll      [INT]      Estimate deduplicated counts by HyperLogLog with 2^INT registers, 4 to 16.\n");
     fprintf(stderr, " -all-tags            Only records with all tags be count.\n");
     fprintf(stderr, " -group    [TAG]      Group tag, count all tags for each group seperately.\n");
     fprintf(stderr, " -o        [file]     Output count table.\n");
     fprintf(stderr, " -q        [INT]      Map Quality to filter bam.\n");
     fprintf(stderr, " -no-header           Ignore header in the output.\n");
-    fprintf(stderr, " -@        [INT]      Thread to unpack bam.\n");
-    
+    fprintf(stderr, " -t        [INT]      Threads to unpack and count. -@ is an alias.\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " Deduplicated values of A/C/G/T shorter than 32 bases, such as UMIs, are counted as packed\n");
+    fprintf(stderr, " integers. For tags with too many values, -hll keeps memory bounded per cell, counts below\n");
+    fprintf(stderr, " 2^INT/8 are still exact, larger counts have a standard error of 1.04/sqrt(2^INT).\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -232,8 +291,15 @@ int bam_extract_usage()
     fprintf(stderr, "bam_extract_tags[options] in.bam\n");
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, " -tags     [TAGS]     Tags to be extracted.\n");
-    fprintf(stderr, " -o        [file]     Output file. tsv format\n");
+    fprintf(stderr, " -o        [file]     Output file. tsv format, compressed if end with .gz\n");
+    fprintf(stderr, " -bin      [file]     Output columnar binary file instead of tsv.\n");
     fprintf(stderr, " -n                   Print read name.\n");
+    fprintf(stderr, " -t        [INT]      Threads. [4]\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " * Records without any of the tags are skipped.\n");
+    fprintf(stderr, " * -bin writes one fixed width column of dictionary codes per tag, 0 for missing tag. The\n");
+    fprintf(stderr, "   header and layout are described in src/bam_extract_tags.c, and each column can be\n");
+    fprintf(stderr, "   mapped directly, e.g. numpy.memmap.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -245,14 +311,14 @@ int bam_count_usage()
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, " -tag      [TAG]      Cell barcode tag.\n");
     fprintf(stderr, " -anno-tag [TAG]      Annotation tag, gene or peak.\n");
-    fprintf(stderr, " -list     [file]     Barcode white list, used as column names at matrix. If not set, all barcodes will be count.\n");
+    fprintf(stderr, " -list     [file]     Barcode white list, used as column names at matrix. If not set, all barcodes will be count. Plain text or index built by wlidx.\n");
     //fprintf(stderr, " -o        [file]     Output matrix.\n");
     fprintf(stderr, " -outdir   [DIR]      Output matrix in MEX format into this fold.\n");
     fprintf(stderr, " -umi      [TAG]      UMI tag. Count once if more than one record has same UMI in one gene or peak.\n");
     fprintf(stderr, " -one-hit             Skip if a read hits more than 1 gene or peak.\n");
     fprintf(stderr, " -corr                Enable correct UMIs. Similar UMIs defined as amming distance <= 1.\n");
     fprintf(stderr, " -q        [INT]      Minimal map quality to filter. Default is 20.\n");
-    fprintf(stderr, " -@        [INT]      Threads to unpack BAM.\n");
+    fprintf(stderr, " -t        [INT]      Threads to unpack BAM and pack matrix. -@ is an alias. [5]\n");
     fprintf(stderr,"\n");
     return 1;
 }
@@ -262,11 +328,19 @@ int bam2fq_usage()
     fprintf(stderr, "* Convert BAM into fastq.\n");
     fprintf(stderr, "bam2fq in.bam\n");
     fprintf(stderr, "\nOptions :\n");
-    fprintf(stderr, " -i        [TAGS]     Export tags in read name.\n");        
-    fprintf(stderr, " -f                   Filter this record if `-i` specified tags not existed.\n");
+    fprintf(stderr, " -tag      [TAGS]     Export tags in read name.\n");
+    fprintf(stderr, " -filter              Filter this record if `-tag` specified tags not existed.\n");
     fprintf(stderr, " -fa                  Output fasta instead of fastq.\n");
-    fprintf(stderr, " -o        [fastq]    Output file.\n");
-    fprintf(stderr, " -@        [INT]      Threads to unpack BAM.\n");
+    fprintf(stderr, " -o        [fastq]    Output file. Compressed if end with .gz.\n");
+    fprintf(stderr, " -1        [fastq]    Read 1 output of paired reads.\n");
+    fprintf(stderr, " -2        [fastq]    Read 2 output of paired reads.\n");
+    fprintf(stderr, " -t        [INT]      Threads. [5]\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " * With -1 and -2, secondary and supplementary alignments are skipped, reads are restored to\n");
+    fprintf(stderr, "   sequenced orientation, and mates are written in pairs. Unpaired reads and reads whose mate\n");
+    fprintf(stderr, "   is missing go to -o, or are dropped if -o not set. If -filter removes one mate, the pair is\n");
+    fprintf(stderr, "   removed.\n");
+    fprintf(stderr, " * Mates are buffered until both seen, so name sorted or unsorted input keeps memory small.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "* Following options are experimental. \n");
     fprintf(stderr, "* Merge overlapped reads from same molecular.\n");
@@ -291,3 +365,16 @@ int bam_impute_usage()
     return 1;
 }
 */
+int wlidx_usage()
+{
+    fprintf(stderr, "* Build a binary index of barcode white list.\n");
+    fprintf(stderr, "wlidx -o whitelist.idx whitelist.txt[.gz]\n");
+    fprintf(stderr, "\nOptions :\n");
+    fprintf(stderr, " -o       [file]       Output index.\n");
+    fprintf(stderr, "\nNotes :\n");
+    fprintf(stderr, " The index is memory mapped, so jobs running on one node share its pages. It can be used\n");
+    fprintf(stderr, " in place of the plain list by -list of pick, count, attrcnt, fsort and bam2frag, and as\n");
+    fprintf(stderr, " \"white list\":\"whitelist.idx\" in the config of parse.\n");
+    fprintf(stderr, "\n");
+    return 1;
+}
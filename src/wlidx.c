@@ -0,0 +1,295 @@
+#include "utils.h"
+#include "wlidx.h"
+#include "stats.h"
+#include "htslib/kstring.h"
+#include "htslib/kseq.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+KSTREAM_INIT(gzFile, gzread, 8193)
+
+#define WLIDX_MAGIC    "PISAWL\1"
+#define WLIDX_VERSION  1
+
+struct wlidx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t len;     // barcode length
+    uint64_t n;       // barcodes
+    uint64_t names;   // offsets from beginning of file
+    uint64_t eyt;
+    uint64_t rank;
+    uint64_t size;    // file size
+};
+
+struct wlidx {
+    void *map;
+    size_t size;
+    int n;
+    int len;
+    int stride;
+    const char *names;
+    const uint64_t *eyt;
+    const uint32_t *rank;
+};
+
+static inline int enc2bit(char c)
+{
+    switch (c) {
+        case 'A': case 'a': return 0;
+        case 'C': case 'c': return 1;
+        case 'G': case 'g': return 2;
+        case 'T': case 't': return 3;
+        default: return -1;
+    }
+}
+// Return 0 on success, 1 on non-ACGT base or length mismatch.
+static inline int encode_barcode(const char *s, int len, uint64_t *code)
+{
+    uint64_t x = 0;
+    int i;
+    for (i = 0; i < len; ++i) {
+        int c = enc2bit(s[i]);
+        if (c < 0) return 1;
+        x = x<<2 | c;
+    }
+    if (s[len] != '\0') return 1;
+    *code = x;
+    return 0;
+}
+
+struct wl_pair {
+    uint64_t code;
+    uint32_t idx;
+};
+static int cmp_pair(const void *a, const void *b)
+{
+    const struct wl_pair *x = a, *y = b;
+    if (x->code != y->code) return x->code < y->code ? -1 : 1;
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+// In-order walk of the implicit tree fills slots in sorted order.
+static uint64_t eyt_fill(uint64_t *eyt, uint32_t *rank, const struct wl_pair *a, uint64_t i, uint64_t k, uint64_t n)
+{
+    if (k > n) return i;
+    i = eyt_fill(eyt, rank, a, i, 2*k, n);
+    eyt[k] = a[i].code;
+    rank[k] = a[i].idx;
+    i++;
+    return eyt_fill(eyt, rank, a, i, 2*k+1, n);
+}
+static size_t align8(size_t l)
+{
+    return (l + 7) & ~(size_t)7;
+}
+
+int wlidx_build(const char *in, const char *out)
+{
+    gzFile fp = gzopen(in, "r");
+    CHECK_EMPTY(fp, "%s : %s.", in, strerror(errno));
+    kstream_t *ks = ks_init(fp);
+    kstring_t str = {0,0,0};
+    kstring_t names = {0,0,0};
+    int ret;
+    int len = -1;
+    uint64_t n = 0, m = 0;
+    struct wl_pair *a = NULL;
+    while (ks_getuntil(ks, 2, &str, &ret) >= 0) {
+        if (str.l == 0) continue;
+        if (str.s[0] == '#') continue;
+        if (strcmp(str.s, "Barcode") == 0) continue; // emit header
+        char *p = str.s;
+        char *e = str.s + str.l;
+        while (p < e && !isspace(*p)) p++;
+        *p = '\0';
+        int l = p - str.s;
+        if (len == -1) {
+            len = l;
+            if (len > 32) error("Only support barcodes not longer than 32nt. %s", str.s);
+        }
+        if (l != len) error("Inconsistance barcode length. %d vs %d, %s", len, l, str.s);
+        if (n == m) {
+            m = m == 0 ? 1024 : m<<1;
+            a = realloc(a, m*sizeof(struct wl_pair));
+            CHECK_EMPTY(a, "Failed to allocate memory.");
+        }
+        if (encode_barcode(str.s, len, &a[n].code)) error("Only A/C/G/T allowed in barcodes. %s", str.s);
+        a[n].idx = n;
+        kputsn(str.s, len+1, &names); // keep the terminating NUL
+        n++;
+    }
+    if (str.m) free(str.s);
+    ks_destroy(ks);
+    gzclose(fp);
+    if (n == 0) error("Barcode list is empty. %s", in);
+    if (n >= INT32_MAX) error("Too many barcodes. %s", in);
+
+    qsort(a, n, sizeof(struct wl_pair), cmp_pair);
+
+    // drop duplicates, keep the first one in input order
+    uint8_t *dup = calloc(n, 1);
+    uint64_t i, j;
+    for (i = 1, j = 0; i < n; ++i) {
+        if (a[i].code == a[j].code) dup[a[i].idx] = 1;
+        else a[++j] = a[i];
+    }
+    uint64_t n_uniq = j + 1;
+    if (n_uniq < n) warnings("%"PRIu64" duplicated barcodes in %s, skip them.", n - n_uniq, in);
+
+    // renumber in input order, skip duplicates
+    uint32_t *new_idx = malloc(n*sizeof(uint32_t));
+    int stride = len + 1;
+    for (i = 0, j = 0; i < n; ++i) {
+        new_idx[i] = j;
+        if (dup[i]) continue;
+        if (j != i) memmove(names.s + j*stride, names.s + i*stride, stride);
+        j++;
+    }
+    for (i = 0; i < n_uniq; ++i) a[i].idx = new_idx[a[i].idx];
+    free(new_idx);
+    free(dup);
+
+    struct wlidx_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, WLIDX_MAGIC, 8);
+    h.version = WLIDX_VERSION;
+    h.len = len;
+    h.n = n_uniq;
+    h.names = align8(sizeof(h));
+    h.eyt = h.names + align8(n_uniq*stride);
+    h.rank = h.eyt + (n_uniq+1)*sizeof(uint64_t);
+    h.size = h.rank + align8((n_uniq+1)*sizeof(uint32_t));
+
+    uint64_t *eyt = calloc(n_uniq+1, sizeof(uint64_t));
+    uint32_t *rank = calloc(n_uniq+1, sizeof(uint32_t));
+    eyt_fill(eyt, rank, a, 0, 1, n_uniq);
+    free(a);
+
+    FILE *fo = fopen(out, "wb");
+    CHECK_EMPTY(fo, "%s : %s.", out, strerror(errno));
+    static const char pad[8] = {0};
+    size_t l = align8(n_uniq*stride) - n_uniq*stride;
+    if (fwrite(&h, sizeof(h), 1, fo) != 1 ||
+        fwrite(pad, 1, h.names - sizeof(h), fo) != h.names - sizeof(h) ||
+        fwrite(names.s, stride, n_uniq, fo) != n_uniq ||
+        fwrite(pad, 1, l, fo) != l ||
+        fwrite(eyt, sizeof(uint64_t), n_uniq+1, fo) != n_uniq+1 ||
+        fwrite(rank, sizeof(uint32_t), n_uniq+1, fo) != n_uniq+1 ||
+        fwrite(pad, 1, h.size - h.rank - (n_uniq+1)*sizeof(uint32_t), fo) != h.size - h.rank - (n_uniq+1)*sizeof(uint32_t))
+        error("Failed to write %s.", out);
+    if (fclose(fo)) error("%s : %s.", out, strerror(errno));
+
+    free(eyt);
+    free(rank);
+    free(names.s);
+    return (int)n_uniq;
+}
+
+int wlidx_check(const char *fname)
+{
+    char magic[8];
+    FILE *fp = fopen(fname, "rb");
+    if (fp == NULL) return 0;
+    int ret = fread(magic, 1, 8, fp) == 8 && memcmp(magic, WLIDX_MAGIC, 8) == 0;
+    fclose(fp);
+    return ret;
+}
+
+struct wlidx *wlidx_load(const char *fname)
+{
+    if (!wlidx_check(fname)) return NULL;
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) error("%s : %s.", fname, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st)) error("%s : %s.", fname, strerror(errno));
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) error("Failed to map %s : %s.", fname, strerror(errno));
+
+    const struct wlidx_header *h = map;
+    if (h->version != WLIDX_VERSION) error("Unsupported whitelist index version %u, rebuild it with `PISA wlidx`.", h->version);
+    if (h->size != (uint64_t)st.st_size) error("Truncated whitelist index? %s", fname);
+
+    struct wlidx *W = malloc(sizeof(*W));
+    W->map = map;
+    W->size = st.st_size;
+    W->n = h->n;
+    W->len = h->len;
+    W->stride = h->len + 1;
+    W->names = (const char*)map + h->names;
+    W->eyt = (const uint64_t*)((const char*)map + h->eyt);
+    W->rank = (const uint32_t*)((const char*)map + h->rank);
+    return W;
+}
+void wlidx_destroy(struct wlidx *W)
+{
+    munmap(W->map, W->size);
+    free(W);
+}
+int wlidx_size(const struct wlidx *W)
+{
+    return W->n;
+}
+int wlidx_length(const struct wlidx *W)
+{
+    return W->len;
+}
+int wlidx_query(const struct wlidx *W, const char *s)
+{
+    uint64_t x;
+    if (encode_barcode(s, W->len, &x)) return -1;
+    uint64_t k = 1, n = W->n;
+    while (k <= n) {
+        __builtin_prefetch(W->eyt + k*8); // 8 levels below fit one cache line
+        k = 2*k + (W->eyt[k] < x);
+    }
+    k >>= __builtin_ffsll(~k);
+    if (k == 0 || W->eyt[k] != x) return -1;
+    return W->rank[k];
+}
+char *wlidx_name(const struct wlidx *W, int idx)
+{
+    assert(idx >= 0 && idx < W->n);
+    return (char*)W->names + (size_t)idx*W->stride;
+}
+
+extern int wlidx_usage();
+
+int wlidx_main(int argc, char **argv)
+{
+    double t_real;
+    t_real = realtime();
+
+    const char *input_fname = NULL;
+    const char *output_fname = NULL;
+    int i;
+    for (i = 1; i < argc;) {
+        const char *a = argv[i++];
+        const char **var = 0;
+        if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) return wlidx_usage();
+        if (strcmp(a, "-o") == 0) var = &output_fname;
+
+        if (var != 0) {
+            if (i == argc) error("Miss an argument after %s.", a);
+            *var = argv[i++];
+            continue;
+        }
+
+        if (a[0] == '-' && a[1]) error("Unknown parameter: %s", a);
+        if (input_fname == NULL) {
+            input_fname = a;
+            continue;
+        }
+        error("Unknown argument: %s.", a);
+    }
+    if (input_fname == NULL) return wlidx_usage();
+    if (output_fname == NULL) error("No output index specified.");
+
+    int n = wlidx_build(input_fname, output_fname);
+    stats_records(n);
+    LOG_print("Index %d barcodes.", n);
+    LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
+    return 0;
+}
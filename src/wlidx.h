@@ -0,0 +1,37 @@
+#ifndef WLIDX_H
+#define WLIDX_H
+
+#include <stdint.h>
+
+// Binary whitelist index, built once by `PISA wlidx` and mmap'ed read-only by
+// every consumer, so concurrent jobs on one node share the pages through the
+// page cache instead of each hashing its own copy.
+//
+// Layout, all offsets 8-byte aligned:
+//   header   magic, barcode length, number of barcodes
+//   names    fixed width NUL-terminated barcodes, in input order
+//   eyt      2-bit packed barcodes in Eytzinger (BFS) order, 1-based
+//   rank     input order index of each eyt slot
+//
+// Barcodes are indexed from 0 in input order, duplicates are dropped.
+struct wlidx;
+
+// Build index from a plain text barcode list. Return number of barcodes.
+int wlidx_build(const char *in, const char *out);
+
+// Return 1 if fname looks like a binary whitelist index.
+int wlidx_check(const char *fname);
+
+// Map index file, NULL if not an index.
+struct wlidx *wlidx_load(const char *fname);
+void wlidx_destroy(struct wlidx *W);
+
+int wlidx_size(const struct wlidx *W);
+int wlidx_length(const struct wlidx *W);
+
+// Return index of barcode, -1 if not found.
+int wlidx_query(const struct wlidx *W, const char *s);
+// Point to mapped string, valid until wlidx_destroy.
+char *wlidx_name(const struct wlidx *W, int idx);
+
+#endif